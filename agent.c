@@ -0,0 +1,1190 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "agent.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+#ifdef SLH_AGENT_HAVE_URING
+#include "uring.h"
+#endif
+
+/*!
+ * Handle frames arriving on the TAP interface.
+ */
+static void slh_agent_tap_event(struct slh_agent_event* const ev,
+		uint32_t events);
+
+/*!
+ * Handle frames handed over by a TAP queue worker.
+ */
+static void slh_agent_worker_event(struct slh_agent_event* const ev,
+		uint32_t events);
+
+/*!
+ * Send or queue an Ethernet frame read from the TAP interface elsewhere.
+ */
+static void slh_agent_tap_frame(struct slh_agent* const agent,
+		const uint8_t* frame, uint16_t len);
+
+/*!
+ * Send an Ethernet frame from a window slot, its headers compressed if
+ * the parent has agreed to it.
+ */
+static void slh_agent_send_frame(struct slh_agent* const agent,
+		uint8_t* payload, uint16_t len);
+
+/*!
+ * Start a worker for each TAP queue after the first.
+ */
+static int slh_agent_start_workers(struct slh_agent* const agent);
+
+/*!
+ * Stop the first `count` workers.
+ */
+static void slh_agent_stop_workers(struct slh_agent* const agent,
+		uint16_t count);
+
+/*!
+ * Handle frames arriving from the parent.
+ */
+static void slh_agent_ctl_event(struct slh_agent_event* const ev,
+		uint32_t events);
+
+/*!
+ * Handle the frames from the parent waiting to be read, until there is no
+ * room for what they need sent.
+ */
+static void slh_agent_ctl_read(struct slh_agent* const agent);
+
+/*!
+ * Write the counters to stderr on SIGUSR1.
+ */
+static void slh_agent_sig_event(struct slh_agent_event* const ev,
+		uint32_t events);
+
+/*!
+ * Send output the parent was not ready for earlier.
+ */
+static void slh_agent_tx_event(struct slh_agent_event* const ev,
+		uint32_t events);
+
+/*!
+ * Return true if there is room to send the parent a full-size frame,
+ * flushing output if need be.
+ */
+static _Bool slh_agent_tx_room(struct slh_agent* const agent);
+
+/*!
+ * Return true if there is room for whatever the next frame from the
+ * parent needs sent, either way.
+ */
+static _Bool slh_agent_ctl_room(struct slh_agent* const agent);
+
+/*!
+ * Send everything written to the parent this turn.
+ */
+static void slh_agent_flush(struct slh_agent* const agent);
+
+/*!
+ * Retransmit frames the parent has not acknowledged in time.
+ */
+static void slh_agent_retx_event(struct slh_agent_event_timer* const timer,
+		uint64_t now);
+
+/*!
+ * Handle one frame received from the parent.
+ */
+static void slh_agent_handle_frame(struct slh_agent* const agent,
+		uint16_t len);
+
+/*!
+ * Answer a frame from the parent, once written to the TAP interface or
+ * not.
+ */
+static void slh_agent_tap_written(struct slh_agent* const agent, int res,
+		uint8_t seq, const uint8_t* frame, uint16_t len);
+
+/*!
+ * Send queued frames as the window opens up.
+ */
+static void slh_agent_send_queued(struct slh_agent* const agent);
+
+/*!
+ * Arm the retransmission timer for the oldest frame in flight.
+ */
+static void slh_agent_arm_retx(struct slh_agent* const agent);
+
+/*!
+ * Stop the event loop.
+ */
+static void slh_agent_stop(struct slh_agent* const agent, int res);
+
+/*!
+ * Start the io_uring engine.
+ *
+ * @retval	0		Success
+ * @retval	-EOPNOTSUPP	Not built in, or not usable with the backend
+ */
+static int slh_agent_ring_start(struct slh_agent* const agent);
+
+/*!
+ * Run one turn of the loop through the io_uring engine.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+static int slh_agent_ring_run_once(struct slh_agent* const agent);
+
+/*!
+ * Queue an Ethernet frame from the parent for the io_uring engine to
+ * write to the TAP interface.  The parent is answered once it is written.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+static int slh_agent_ring_write(struct slh_agent* const agent,
+		const uint8_t* hdr, const uint8_t* frame, uint16_t len,
+		uint8_t seq);
+
+/*!
+ * Return true if the io_uring engine, if any, can take a TAP write.
+ */
+static _Bool slh_agent_ring_can_write(const struct slh_agent* const agent);
+
+/*!
+ * Take the control channel back from the io_uring engine, if it has it.
+ */
+static void slh_agent_ring_stop(struct slh_agent* const agent);
+
+/*!
+ * Stop the io_uring engine, if started.
+ */
+static void slh_agent_ring_free(struct slh_agent* const agent);
+
+int slh_agent_init(struct slh_agent* const agent) {
+	sigset_t sigs;
+	int res;
+
+	agent->negotiated = false;
+	agent->tx_blocked = false;
+	agent->retx_blocked = false;
+	agent->iphc = false;
+	agent->offload = 0;
+	agent->ring = NULL;
+	agent->res = 0;
+	memset(&agent->stats, 0, sizeof(agent->stats));
+
+	/*
+	 * Prepare the transmit window and queue, big enough for a frame as
+	 * read from the interface, offload header and all
+	 */
+	res = slh_agent_window_init(&agent->win, agent->window,
+			slh_agent_tap_buf_sz(&agent->tap), agent->timeout);
+	if (res < 0)
+		return res;
+
+	res = slh_agent_queue_init(&agent->queue, agent->depth,
+			slh_agent_tap_buf_sz(&agent->tap), agent->policy);
+	if (res < 0)
+		goto freewin;
+
+	/* Receive buffer: frame type, sequence number and payload */
+	agent->rx_sz = slh_agent_tap_buf_sz(&agent->tap) + 2;
+	agent->rx.raw = malloc(agent->rx_sz);
+	if (!agent->rx.raw) {
+		res = -ENOMEM;
+		goto freequeue;
+	}
+
+	/* Decompression buffer: an Ethernet frame, as FS would carry */
+	agent->iphc_buf = malloc(agent->tap.mtu);
+	if (!agent->iphc_buf) {
+		res = -ENOMEM;
+		goto freerx;
+	}
+
+	res = slh_agent_event_init(&agent->loop);
+	if (res < 0)
+		goto freeiphc;
+
+	res = slh_agent_event_nonblock(agent->tap.fd);
+	if (res < 0)
+		goto freeloop;
+
+	res = slh_agent_event_nonblock(agent->ctl.rx_fd);
+	if (res < 0)
+		goto freeloop;
+
+	if (agent->ctl.tx_fd != agent->ctl.rx_fd) {
+		res = slh_agent_event_nonblock(agent->ctl.tx_fd);
+		if (res < 0)
+			goto freeloop;
+	}
+
+	if (agent->uring) {
+		/* Takes the TAP interface, and the control channel if able */
+		res = slh_agent_ring_start(agent);
+		if (res < 0)
+			goto freeloop;
+	}
+
+	agent->tap_ev.cb = slh_agent_tap_event;
+	agent->tap_ev.data = agent;
+	agent->tap_ev.fd = agent->tap.fd;
+	if (!agent->ring) {
+		res = slh_agent_event_add(&agent->loop, &agent->tap_ev,
+				EPOLLIN);
+		if (res < 0)
+			goto freering;
+	}
+
+	agent->ctl_ev.cb = slh_agent_ctl_event;
+	agent->ctl_ev.data = agent;
+	agent->ctl_ev.fd = agent->ctl.rx_fd;
+	agent->tx_ev.cb = slh_agent_tx_event;
+	agent->tx_ev.data = agent;
+	agent->tx_ev.fd = agent->ctl.tx_fd;
+	if (agent->ctl.tx_async) {
+		/* The io_uring engine has it */
+	} else if (agent->ctl.tx_fd == agent->ctl.rx_fd) {
+		/* One socket both ways: ctl_ev passes EPOLLOUT on to tx_ev */
+		res = slh_agent_event_add(&agent->loop, &agent->ctl_ev,
+				EPOLLIN | EPOLLOUT);
+		if (res < 0)
+			goto freering;
+	} else {
+		res = slh_agent_event_add(&agent->loop, &agent->ctl_ev,
+				EPOLLIN);
+		if (res < 0)
+			goto freering;
+
+		/* In shared memory mode, the parent signals an eventfd */
+		res = slh_agent_event_add(&agent->loop, &agent->tx_ev,
+				slh_agent_frame_is_shm(&agent->ctl)
+					? EPOLLIN : EPOLLOUT);
+		if (res < 0)
+			goto freering;
+	}
+
+	agent->retx.cb = slh_agent_retx_event;
+	agent->retx.data = agent;
+	agent->retx.armed = false;
+
+	/*
+	 * Take SIGUSR1 through the event loop; blocked before the workers
+	 * start, so they inherit the mask and leave it to us.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	res = -pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	if (res < 0)
+		goto freering;
+
+	agent->sig_ev.cb = slh_agent_sig_event;
+	agent->sig_ev.data = agent;
+	agent->sig_ev.fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (agent->sig_ev.fd < 0) {
+		res = -errno;
+		goto freering;
+	}
+
+	res = slh_agent_event_add(&agent->loop, &agent->sig_ev, EPOLLIN);
+	if (res < 0)
+		goto closesig;
+
+	res = slh_agent_start_workers(agent);
+	if (res < 0)
+		goto closesig;
+	return 0;
+
+closesig:
+	close(agent->sig_ev.fd);
+	agent->sig_ev.fd = -1;
+freering:
+	slh_agent_ring_free(agent);
+freeloop:
+	slh_agent_event_free(&agent->loop);
+freeiphc:
+	free(agent->iphc_buf);
+	agent->iphc_buf = NULL;
+freerx:
+	free(agent->rx.raw);
+	agent->rx.raw = NULL;
+freequeue:
+	slh_agent_queue_free(&agent->queue);
+freewin:
+	slh_agent_window_free(&agent->win);
+	return res;
+}
+
+int slh_agent_run(struct slh_agent* const agent) {
+	const struct slh_agent_frame* soh;
+	uint8_t opts[12];
+	uint8_t opts_sz = 0;
+	uint16_t soh_sz;
+	uint8_t* payload;
+	int res;
+
+	if (agent->window > 1) {
+		/* Offer a window */
+		opts[opts_sz++] = SLH_OPT_WINDOW;
+		opts[opts_sz++] = 1;
+		opts[opts_sz++] = agent->window;
+	}
+
+	/* Say how we're talking to the parent, and what else we could do */
+	opts[opts_sz++] = SLH_OPT_FRAMING;
+	if (agent->ctl.framing == SLH_FRAMING_STUFFED) {
+		opts[opts_sz++] = 2;
+		opts[opts_sz++] = SLH_FRAMING_STUFFED;
+		opts[opts_sz++] = SLH_FRAMING_COBS;
+	} else {
+		opts[opts_sz++] = 1;
+		opts[opts_sz++] = agent->ctl.framing;
+	}
+
+	/* Offer to compress IPv6 headers */
+	opts[opts_sz++] = SLH_OPT_IPHC;
+	opts[opts_sz++] = 0;
+
+	if (agent->tap.offload) {
+		/* Offer the interface's offloads */
+		opts[opts_sz++] = SLH_OPT_OFFLOAD;
+		opts[opts_sz++] = 1;
+		opts[opts_sz++] = agent->tap.offload;
+	}
+
+	/* Send the frame info, held in the window until ACKed */
+	payload = slh_agent_window_payload(&agent->win, &soh_sz);
+	res = slh_agent_device_detail(payload, soh_sz, &agent->tap,
+			opts, opts_sz);
+	if (res < 0)
+		return res;
+
+	soh = slh_agent_window_commit(&agent->win, SOH, res,
+			agent->loop.now, &soh_sz);
+	res = slh_agent_write_frame(&agent->ctl, soh, soh_sz);
+	if (res < 0)
+		return res;
+	slh_agent_arm_retx(agent);
+
+	while (!agent->loop.stop) {
+		/* Send everything from the last turn in one go */
+		slh_agent_flush(agent);
+		if (agent->loop.stop)
+			break;
+
+		res = agent->ring
+			? slh_agent_ring_run_once(agent)
+			: slh_agent_event_run_once(&agent->loop, -1);
+		if (res < 0)
+			return res;
+
+		slh_agent_send_queued(agent);
+		slh_agent_arm_retx(agent);
+	}
+
+	/* Last replies, if the parent is still listening */
+	slh_agent_ring_stop(agent);
+	slh_agent_frame_flush(&agent->ctl);
+	return agent->res;
+}
+
+void slh_agent_free(struct slh_agent* const agent) {
+	if (agent->workers)
+		slh_agent_stop_workers(agent, agent->tap.queues - 1);
+	slh_agent_ring_free(agent);
+	slh_agent_event_free(&agent->loop);
+	close(agent->sig_ev.fd);
+	agent->sig_ev.fd = -1;
+	free(agent->iphc_buf);
+	agent->iphc_buf = NULL;
+	free(agent->rx.raw);
+	agent->rx.raw = NULL;
+	slh_agent_queue_free(&agent->queue);
+	slh_agent_window_free(&agent->win);
+}
+
+void slh_agent_get_stats(const struct slh_agent* const agent,
+		struct slh_agent_stats* const stats) {
+	uint16_t i;
+
+	*stats = agent->stats;
+	stats->up_queue_drop_head = agent->queue.dropped_head;
+	stats->up_queue_drop_tail = agent->queue.dropped_tail;
+	stats->up_queue_depth = agent->queue.count;
+	stats->up_queue_peak = agent->queue.peak;
+	if (agent->capture)
+		stats->capture_dropped = agent->capture->dropped;
+
+	for (i = 0; agent->workers && (i < (agent->tap.queues - 1)); i++)
+		stats->up_truncated += atomic_load_explicit(
+				&agent->workers[i].truncated,
+				memory_order_relaxed);
+}
+
+static void slh_agent_tap_event(struct slh_agent_event* const ev,
+		uint32_t events) {
+	struct slh_agent* const agent = ev->data;
+	uint16_t count = 0;
+
+	(void)events;
+	while (1) {
+		/*
+		 * If nothing is waiting ahead of it, the frame can go
+		 * straight into the window, otherwise it joins the back
+		 * of the queue.
+		 */
+		_Bool direct = agent->negotiated
+			&& !agent->queue.count
+			&& slh_agent_window_has_space(&agent->win)
+			&& slh_agent_tx_room(agent);
+		uint8_t* payload;
+		uint8_t* frame;
+		uint16_t payload_sz;
+		uint8_t action;
+		int len;
+
+		if (agent->batch && (count == agent->batch)) {
+			/* Read the rest on the next turn */
+			slh_agent_event_again(&agent->loop, ev, EPOLLIN);
+			break;
+		}
+
+		if (direct)
+			payload = slh_agent_window_payload(&agent->win,
+					&payload_sz);
+		else
+			payload = slh_agent_queue_tail(&agent->queue,
+					&payload_sz);
+
+		if (agent->tap.offload) {
+			/* Offload header goes in front, where RS has it */
+			frame = payload + SLH_TAP_OFFLOAD_HDR_SZ;
+			len = slh_agent_tap_read_offload(&agent->tap, payload,
+					frame,
+					payload_sz - SLH_TAP_OFFLOAD_HDR_SZ);
+		} else {
+			frame = payload;
+			len = slh_agent_tap_read(&agent->tap, payload,
+					payload_sz);
+		}
+		if (len == -EAGAIN) {
+			/* All caught up */
+			break;
+		} else if (len == -EMSGSIZE) {
+			agent->stats.up_truncated++;
+			continue;
+		} else if (len < 0) {
+			slh_agent_stop(agent, len);
+			break;
+		}
+		count++;
+		agent->stats.up_frames++;
+		agent->stats.up_bytes += len;
+		if (agent->capture)
+			slh_agent_capture_frame(agent->capture,
+					SLH_AGENT_CAPTURE_UP, frame, len);
+
+		action = slh_agent_rules_eval(&agent->rules, frame, len);
+		len += frame - payload;
+		if (action == SLH_AGENT_RULES_DROP) {
+			agent->stats.up_filtered++;
+			continue;
+		} else if (direct) {
+			slh_agent_send_frame(agent, payload, len);
+		} else {
+			slh_agent_queue_push(&agent->queue, len, action);
+		}
+	}
+}
+
+static void slh_agent_worker_event(struct slh_agent_event* const ev,
+		uint32_t events) {
+	struct slh_agent* const agent = ev->data;
+	struct slh_agent_worker* const worker = (struct slh_agent_worker*)
+		((uint8_t*)ev - offsetof(struct slh_agent_worker, ev));
+	uint16_t count = 0;
+	int res;
+
+	(void)events;
+	do {
+		const uint8_t* frame;
+		uint16_t len;
+
+		while ((frame = slh_agent_worker_head(worker, &len))) {
+			if (agent->batch && (count == agent->batch)) {
+				/*
+				 * Take the rest on the next turn; the worker
+				 * won't signal again until we sleep.
+				 */
+				slh_agent_event_again(&agent->loop, ev,
+						EPOLLIN);
+				return;
+			}
+
+			slh_agent_tap_frame(agent, frame, len);
+			slh_agent_worker_pop(worker);
+			count++;
+		}
+	} while (!slh_agent_worker_sleep(worker));
+
+	/* Stored before the worker signalled, so seen by now */
+	res = atomic_load(&worker->res);
+	if (res < 0)
+		/* Without its queue, the interface is of no use */
+		slh_agent_stop(agent, res);
+}
+
+static void slh_agent_tap_frame(struct slh_agent* const agent,
+		const uint8_t* frame, uint16_t len) {
+	/* Skip any offload header to get at the Ethernet frame */
+	const uint16_t hdr_sz = agent->tap.offload
+		? SLH_TAP_OFFLOAD_HDR_SZ : 0;
+	const uint8_t action = slh_agent_rules_eval(&agent->rules,
+			frame + hdr_sz, len - hdr_sz);
+	uint8_t* payload;
+	uint16_t payload_sz;
+
+	agent->stats.up_frames++;
+	agent->stats.up_bytes += len - hdr_sz;
+	if (agent->capture)
+		slh_agent_capture_frame(agent->capture, SLH_AGENT_CAPTURE_UP,
+				frame + hdr_sz, len - hdr_sz);
+	if (action == SLH_AGENT_RULES_DROP) {
+		agent->stats.up_filtered++;
+		return;
+	} else if (agent->negotiated
+			&& !agent->queue.count
+			&& slh_agent_window_has_space(&agent->win)
+			&& slh_agent_tx_room(agent)) {
+		payload = slh_agent_window_payload(&agent->win, &payload_sz);
+		memcpy(payload, frame, len);
+		slh_agent_send_frame(agent, payload, len);
+	} else {
+		payload = slh_agent_queue_tail(&agent->queue, &payload_sz);
+		memcpy(payload, frame, len);
+		slh_agent_queue_push(&agent->queue, len, action);
+	}
+}
+
+static void slh_agent_send_frame(struct slh_agent* const agent,
+		uint8_t* payload, uint16_t len) {
+	const uint32_t wire = agent->ctl.tx_write_ptr;
+	const struct slh_agent_frame* out;
+	uint16_t out_sz;
+	uint8_t type = FS;
+
+	if (agent->tap.offload) {
+		if (agent->offload && ((payload[0]
+					& SLH_TAP_OFFLOAD_F_NEEDS_CSUM)
+				|| (payload[1] != SLH_TAP_GSO_NONE))) {
+			/* Leave the parent the rest of the work */
+			type = RS;
+			agent->stats.up_offloaded++;
+		} else {
+			/* Nothing left to do, send it as any other */
+			len -= SLH_TAP_OFFLOAD_HDR_SZ;
+			memmove(payload, payload + SLH_TAP_OFFLOAD_HDR_SZ,
+					len);
+		}
+	}
+
+	if (agent->iphc && (type == FS)) {
+		int res = slh_agent_iphc_compress(payload, len,
+				agent->tap.mac);
+		if (res > 0) {
+			type = GS;
+			len = res;
+			agent->stats.up_compressed++;
+		}
+	}
+
+	out = slh_agent_window_commit(&agent->win, type, len,
+			agent->loop.now, &out_sz);
+	slh_agent_write_frame(&agent->ctl, out, out_sz);
+
+	agent->stats.up_sent++;
+	agent->stats.up_sent_bytes += out_sz;
+	agent->stats.up_wire_bytes += agent->ctl.tx_write_ptr - wire;
+}
+
+static int slh_agent_start_workers(struct slh_agent* const agent) {
+	uint16_t count = (agent->tap.queues > 1)
+		? (agent->tap.queues - 1) : 0;
+	uint16_t i;
+	int res;
+
+	agent->workers = NULL;
+	if (!count)
+		return 0;
+
+	agent->workers = calloc(count, sizeof(struct slh_agent_worker));
+	if (!agent->workers)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		struct slh_agent_worker* const worker = &(agent->workers[i]);
+
+		worker->ev.cb = slh_agent_worker_event;
+		worker->ev.data = agent;
+		res = slh_agent_worker_start(worker, &agent->tap);
+		if (res < 0)
+			goto stop;
+
+		res = slh_agent_event_add(&agent->loop, &worker->ev, EPOLLIN);
+		if (res < 0) {
+			i++;
+			goto stop;
+		}
+	}
+	return 0;
+
+stop:
+	slh_agent_stop_workers(agent, i);
+	return res;
+}
+
+static void slh_agent_stop_workers(struct slh_agent* const agent,
+		uint16_t count) {
+	while (count--)
+		slh_agent_worker_stop(&agent->workers[count]);
+	free(agent->workers);
+	agent->workers = NULL;
+}
+
+static void slh_agent_ctl_event(struct slh_agent_event* const ev,
+		uint32_t events) {
+	struct slh_agent* const agent = ev->data;
+
+	if (events & EPOLLOUT)
+		/* Sharing a socket with the transmit side */
+		slh_agent_tx_event(&agent->tx_ev, EPOLLOUT);
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		/* Nothing to read */
+		return;
+
+	agent->ctl.rx_ready = true;
+	slh_agent_ctl_read(agent);
+}
+
+static void slh_agent_ctl_read(struct slh_agent* const agent) {
+	int len;
+
+	while (!agent->loop.stop) {
+		if (!slh_agent_ctl_room(agent)) {
+			/* No room for replies or frames yet */
+			agent->tx_blocked = true;
+			break;
+		}
+
+		len = slh_agent_read_frame(&agent->ctl, agent->rx.header,
+				agent->rx_sz);
+		if (!len) {
+			/* All caught up */
+			break;
+		} else if (len == -EPIPE) {
+			/* Parent has gone away */
+			slh_agent_stop(agent, 0);
+		} else if (len == -EBADMSG) {
+			agent->stats.down_bad++;
+			slh_agent_drop_frame(&agent->ctl);
+		} else if (len == -EMSGSIZE) {
+			agent->stats.down_oversize++;
+			slh_agent_drop_frame(&agent->ctl);
+		} else if (len < 0) {
+			slh_agent_stop(agent, len);
+		} else {
+			slh_agent_handle_frame(agent, len);
+		}
+	}
+}
+
+static void slh_agent_sig_event(struct slh_agent_event* const ev,
+		uint32_t events) {
+	struct slh_agent* const agent = ev->data;
+	struct signalfd_siginfo info;
+	struct slh_agent_stats stats;
+	uint16_t count = 0;
+
+	(void)events;
+
+	/* Any number of signals may have arrived, one dump will do */
+	while (read(ev->fd, &info, sizeof(info)) == sizeof(info))
+		count++;
+	if (!count)
+		return;
+
+	slh_agent_get_stats(agent, &stats);
+	slh_agent_stats_dump(stderr, agent->tap.name, &stats);
+}
+
+static void slh_agent_tx_event(struct slh_agent_event* const ev,
+		uint32_t events) {
+	struct slh_agent* const agent = ev->data;
+
+	(void)events;
+	slh_agent_flush(agent);
+	if (agent->tx_blocked && slh_agent_ctl_room(agent)) {
+		/* Pick up where the control channel left off */
+		agent->tx_blocked = false;
+		slh_agent_event_again(&agent->loop, &agent->ctl_ev, EPOLLIN);
+	}
+}
+
+static _Bool slh_agent_tx_room(struct slh_agent* const agent) {
+	const uint32_t need = slh_agent_frame_encoded_max(agent->rx_sz);
+
+	if (slh_agent_frame_tx_space(&agent->ctl) >= need)
+		return true;
+
+	slh_agent_flush(agent);
+	return slh_agent_frame_tx_space(&agent->ctl) >= need;
+}
+
+static _Bool slh_agent_ctl_room(struct slh_agent* const agent) {
+	return slh_agent_tx_room(agent) && slh_agent_ring_can_write(agent);
+}
+
+static void slh_agent_flush(struct slh_agent* const agent) {
+	int res = slh_agent_frame_flush(&agent->ctl);
+
+	/* -EAGAIN: the rest goes when the parent is ready for it */
+	if ((res < 0) && (res != -EAGAIN))
+		slh_agent_stop(agent, res);
+}
+
+static void slh_agent_retx_event(struct slh_agent_event_timer* const timer,
+		uint64_t now) {
+	struct slh_agent* const agent = timer->data;
+	const struct slh_agent_frame* out;
+	uint16_t out_sz;
+
+	while ((out = slh_agent_window_due(&agent->win, now, &out_sz))) {
+		if (slh_agent_write_frame(&agent->ctl, out, out_sz) < 0) {
+			/* No room: try again once the parent takes some */
+			slh_agent_window_undue(&agent->win, now);
+			agent->retx_blocked = true;
+			break;
+		}
+		agent->stats.up_retransmits++;
+	}
+
+	if (!agent->negotiated && !slh_agent_window_inflight(&agent->win))
+		/* Gave up on the SOH, carry on with stop-and-wait */
+		agent->negotiated = true;
+}
+
+static void slh_agent_handle_frame(struct slh_agent* const agent,
+		uint16_t len) {
+	struct slh_agent_frame* const frame = agent->rx.header;
+	uint8_t* payload = frame->payload;
+	uint16_t payload_sz = len - sizeof(struct slh_agent_frame);
+	const uint8_t* hdr = NULL;
+	uint8_t seq = 0;
+	int res;
+
+	switch (frame->type) {
+	case EOT:
+		slh_agent_stop(agent, 0);
+		break;
+	case ENQ:
+		{
+			/* Parent wants the counters */
+			struct slh_agent_stats stats;
+			uint8_t reply[1 + SLH_AGENT_STATS_SZ] = { ENQ };
+
+			slh_agent_get_stats(agent, &stats);
+			res = slh_agent_stats_encode(&reply[1],
+					SLH_AGENT_STATS_SZ, &stats);
+			slh_agent_write_frame(&agent->ctl,
+					(const struct slh_agent_frame*)reply,
+					1 + res);
+		}
+		break;
+	case FS:
+	case GS:
+	case RS:
+		/*
+		 * Payload is an Ethernet frame, maybe compressed, maybe with
+		 * an offload header
+		 */
+		agent->stats.down_frames++;
+		agent->stats.down_bytes += len;
+		if (agent->win.seq) {
+			if (!payload_sz) {
+				slh_agent_write_frame_nopayload(&agent->ctl,
+						NAK);
+				agent->stats.down_naks++;
+				break;
+			}
+			seq = payload[0];
+			payload++;
+			payload_sz--;
+
+			if (slh_agent_window_rx_dup(&agent->win, seq)) {
+				/* Our ACK got lost */
+				slh_agent_write_reply(&agent->ctl, ACK,
+						true, seq);
+				agent->stats.down_duplicates++;
+				break;
+			}
+		}
+
+		if (frame->type == GS) {
+			res = agent->iphc
+				? slh_agent_iphc_decompress(agent->iphc_buf,
+					agent->tap.mtu, payload, payload_sz,
+					agent->tap.mac)
+				: -EBADMSG;
+			if (res < 0) {
+				slh_agent_write_reply(&agent->ctl, NAK,
+						agent->win.seq, seq);
+				agent->stats.down_undecodable++;
+				agent->stats.down_naks++;
+				break;
+			}
+			payload = agent->iphc_buf;
+			payload_sz = res;
+		} else if (frame->type == RS) {
+			if (!agent->offload
+					|| (payload_sz < SLH_TAP_OFFLOAD_HDR_SZ)) {
+				slh_agent_write_reply(&agent->ctl, NAK,
+						agent->win.seq, seq);
+				agent->stats.down_undecodable++;
+				agent->stats.down_naks++;
+				break;
+			}
+			hdr = payload;
+			payload += SLH_TAP_OFFLOAD_HDR_SZ;
+			payload_sz -= SLH_TAP_OFFLOAD_HDR_SZ;
+			agent->stats.down_offloaded++;
+		}
+
+		if (slh_agent_rules_eval(&agent->rules, payload, payload_sz)
+				== SLH_AGENT_RULES_DROP) {
+			slh_agent_write_reply(&agent->ctl, NAK,
+					agent->win.seq, seq);
+			agent->stats.down_filtered++;
+			agent->stats.down_naks++;
+			break;
+		}
+
+		if (agent->ring) {
+			res = slh_agent_ring_write(agent, hdr, payload,
+					payload_sz, seq);
+			if (!res)
+				/* Answered once written */
+				break;
+		} else if (hdr) {
+			res = slh_agent_tap_write_offload(&agent->tap, hdr,
+					payload, payload_sz);
+		} else {
+			res = slh_agent_tap_write(&agent->tap, payload,
+					payload_sz);
+		}
+		slh_agent_tap_written(agent, res, seq, payload, payload_sz);
+		break;
+	case SYN:
+		slh_agent_write_frame_nopayload(&agent->ctl, ACK);
+		break;
+	case ACK:
+		slh_agent_window_ack(&agent->win, payload, payload_sz);
+		if (!agent->negotiated) {
+			/* Reply to our SOH */
+			const uint8_t* opt;
+			uint8_t opt_len;
+
+			opt = slh_agent_find_option(payload, payload_sz,
+					SLH_OPT_WINDOW, &opt_len);
+			if (opt && opt_len)
+				slh_agent_window_set_size(&agent->win, *opt);
+
+			opt = slh_agent_find_option(payload, payload_sz,
+					SLH_OPT_FRAMING, &opt_len);
+			if (opt && opt_len && (*opt != agent->ctl.framing))
+				/* Anything we didn't offer is ignored */
+				slh_agent_frame_set_framing(&agent->ctl,
+						*opt);
+
+			if (slh_agent_find_option(payload, payload_sz,
+						SLH_OPT_IPHC, &opt_len))
+				agent->iphc = true;
+
+			opt = slh_agent_find_option(payload, payload_sz,
+					SLH_OPT_OFFLOAD, &opt_len);
+			if (opt && opt_len && agent->tap.offload) {
+				/* Segmentation needs checksums too */
+				uint8_t offload = *opt & agent->tap.offload;
+
+				if (!(offload & SLH_TAP_OFFLOAD_CSUM))
+					offload = 0;
+				if (offload && !slh_agent_tap_set_offload(
+							&agent->tap, offload))
+					agent->offload = offload;
+			}
+			agent->negotiated = true;
+		}
+		break;
+	case NAK:
+		slh_agent_window_nak(&agent->win, payload, payload_sz);
+		agent->negotiated = true;
+		agent->stats.up_naks++;
+		break;
+	default:
+		slh_agent_write_frame_nopayload(&agent->ctl, NAK);
+		agent->stats.down_naks++;
+	}
+}
+
+static void slh_agent_tap_written(struct slh_agent* const agent, int res,
+		uint8_t seq, const uint8_t* frame, uint16_t len) {
+	slh_agent_write_reply(&agent->ctl, (res < 0) ? NAK : ACK,
+			agent->win.seq, seq);
+	if (res < 0) {
+		agent->stats.down_write_errors++;
+		agent->stats.down_naks++;
+	} else {
+		if (agent->win.seq)
+			/* A retransmission from here on just gets an ACK */
+			slh_agent_window_rx_done(&agent->win, seq);
+		agent->stats.down_written++;
+		if (agent->capture)
+			slh_agent_capture_frame(agent->capture,
+					SLH_AGENT_CAPTURE_DOWN, frame, len);
+	}
+}
+
+static void slh_agent_send_queued(struct slh_agent* const agent) {
+	while (agent->negotiated && slh_agent_window_has_space(&agent->win)
+			&& slh_agent_tx_room(agent)) {
+		const uint8_t* queued;
+		uint8_t* payload;
+		uint16_t payload_sz;
+		uint16_t len;
+
+		queued = slh_agent_queue_head(&agent->queue, &len);
+		if (!queued)
+			break;
+
+		payload = slh_agent_window_payload(&agent->win, &payload_sz);
+		memcpy(payload, queued, len);
+		slh_agent_queue_pop(&agent->queue);
+		slh_agent_send_frame(agent, payload, len);
+	}
+}
+
+static void slh_agent_arm_retx(struct slh_agent* const agent) {
+	int timeout;
+
+	if (agent->retx_blocked) {
+		if (!slh_agent_tx_room(agent)) {
+			/* Wait for the parent rather than the clock */
+			slh_agent_event_timer_clear(&agent->loop,
+					&agent->retx);
+			return;
+		}
+		agent->retx_blocked = false;
+	}
+
+	timeout = slh_agent_window_next_timeout(&agent->win,
+			agent->loop.now);
+	if (timeout < 0)
+		slh_agent_event_timer_clear(&agent->loop, &agent->retx);
+	else
+		slh_agent_event_timer_set(&agent->loop, &agent->retx,
+				agent->loop.now + timeout);
+}
+
+static void slh_agent_stop(struct slh_agent* const agent, int res) {
+	agent->res = res;
+	agent->loop.stop = true;
+}
+
+#ifdef SLH_AGENT_HAVE_URING
+/*!
+ * Handle a completion from the io_uring engine.
+ */
+static void slh_agent_ring_event(struct slh_agent_uring* const uring,
+		uint8_t op, uint16_t buf, int res) {
+	struct slh_agent* const agent = uring->data;
+	const uint16_t hdr_sz = agent->tap.offload
+		? SLH_TAP_OFFLOAD_HDR_SZ : 0;
+	uint8_t* const raw = slh_agent_uring_buf_data(uring, buf);
+	uint8_t* const frame = raw + agent->tap.ops->raw_hdr_sz;
+
+	switch (op) {
+	case SLH_AGENT_URING_TAP_READ:
+		if (res >= 0)
+			res = slh_agent_tap_raw_unwrap(&agent->tap, raw, res);
+		if (res == -EMSGSIZE)
+			agent->stats.up_truncated++;
+		else if (res < 0)
+			slh_agent_stop(agent, res);
+		else
+			/* As from a worker: copied to the window or queue */
+			slh_agent_tap_frame(agent, frame, res);
+		break;
+	case SLH_AGENT_URING_TAP_WRITE:
+		slh_agent_tap_written(agent, res, uring->buf[buf].tag,
+				frame + hdr_sz, uring->buf[buf].len
+					- agent->tap.ops->raw_hdr_sz
+					- hdr_sz);
+		break;
+	case SLH_AGENT_URING_CTL_READ:
+		if (res < 0)
+			slh_agent_stop(agent, res);
+		else if (!agent->tx_blocked)
+			slh_agent_ctl_read(agent);
+		break;
+	case SLH_AGENT_URING_CTL_WRITE:
+		if (res < 0)
+			slh_agent_stop(agent, res);
+		break;
+	case SLH_AGENT_URING_POLL:
+		/* Something the event loop watches is ready */
+		res = slh_agent_event_run_once(&agent->loop, 0);
+		if (res < 0)
+			slh_agent_stop(agent, res);
+		break;
+	}
+}
+
+static int slh_agent_ring_start(struct slh_agent* const agent) {
+	/* Only a byte stream can be read and written in bulk */
+	const _Bool stream = (agent->ctl.framing == SLH_FRAMING_STUFFED)
+		|| (agent->ctl.framing == SLH_FRAMING_COBS);
+	int res;
+
+	agent->ring = malloc(sizeof(struct slh_agent_uring));
+	if (!agent->ring)
+		return -ENOMEM;
+
+	agent->ring->cb = slh_agent_ring_event;
+	agent->ring->data = agent;
+	res = slh_agent_uring_init(agent->ring, &agent->tap,
+			stream ? &agent->ctl : NULL, agent->loop.epfd);
+	if (res < 0) {
+		free(agent->ring);
+		agent->ring = NULL;
+	}
+	return res;
+}
+
+static int slh_agent_ring_run_once(struct slh_agent* const agent) {
+	int res = slh_agent_uring_submit(agent->ring,
+			slh_agent_event_wait_time(&agent->loop, -1));
+	if (res < 0)
+		return res;
+
+	agent->loop.now = slh_agent_now();
+	slh_agent_uring_complete(agent->ring);
+
+	if (agent->tx_blocked && !agent->loop.stop
+			&& slh_agent_ctl_room(agent)) {
+		/* Pick up where the control channel left off */
+		agent->tx_blocked = false;
+		if (agent->ctl.tx_async)
+			slh_agent_ctl_read(agent);
+		else
+			slh_agent_event_again(&agent->loop, &agent->ctl_ev,
+					EPOLLIN);
+	}
+
+	if (agent->loop.stop)
+		return 0;
+	if (agent->loop.again)
+		return slh_agent_event_run_once(&agent->loop, 0);
+	slh_agent_event_run_timers(&agent->loop);
+	return 0;
+}
+
+static int slh_agent_ring_write(struct slh_agent* const agent,
+		const uint8_t* hdr, const uint8_t* frame, uint16_t len,
+		uint8_t seq) {
+	struct slh_agent_uring* const ring = agent->ring;
+	const uint16_t hdr_sz = agent->tap.offload
+		? SLH_TAP_OFFLOAD_HDR_SZ : 0;
+	uint8_t* raw;
+	int buf;
+
+	if (((uint32_t)hdr_sz + len)
+			> (ring->buf_sz - agent->tap.ops->raw_hdr_sz))
+		return -EMSGSIZE;
+
+	buf = slh_agent_uring_get_buf(ring);
+	if (buf < 0)
+		return buf;
+
+	raw = slh_agent_uring_buf_data(ring, buf)
+		+ agent->tap.ops->raw_hdr_sz;
+	if (hdr)
+		memcpy(raw, hdr, hdr_sz);
+	else
+		/* Asks for nothing */
+		memset(raw, 0, hdr_sz);
+	memcpy(raw + hdr_sz, frame, len);
+
+	ring->buf[buf].tag = seq;
+	return slh_agent_uring_tap_write(ring, buf, hdr_sz + len);
+}
+
+static _Bool slh_agent_ring_can_write(const struct slh_agent* const agent) {
+	return !agent->ring || slh_agent_uring_can_write(agent->ring);
+}
+
+static void slh_agent_ring_stop(struct slh_agent* const agent) {
+	if (agent->ring)
+		slh_agent_uring_stop(agent->ring);
+}
+
+static void slh_agent_ring_free(struct slh_agent* const agent) {
+	if (!agent->ring)
+		return;
+
+	slh_agent_uring_free(agent->ring);
+	free(agent->ring);
+	agent->ring = NULL;
+}
+#else
+static int slh_agent_ring_start(struct slh_agent* const agent) {
+	(void)agent;
+	return -EOPNOTSUPP;
+}
+
+static int slh_agent_ring_run_once(struct slh_agent* const agent) {
+	(void)agent;
+	return -EOPNOTSUPP;
+}
+
+static int slh_agent_ring_write(struct slh_agent* const agent,
+		const uint8_t* hdr, const uint8_t* frame, uint16_t len,
+		uint8_t seq) {
+	(void)agent;
+	(void)hdr;
+	(void)frame;
+	(void)len;
+	(void)seq;
+	return -EOPNOTSUPP;
+}
+
+static _Bool slh_agent_ring_can_write(const struct slh_agent* const agent) {
+	(void)agent;
+	return true;
+}
+
+static void slh_agent_ring_stop(struct slh_agent* const agent) {
+	(void)agent;
+}
+
+static void slh_agent_ring_free(struct slh_agent* const agent) {
+	(void)agent;
+}
+#endif
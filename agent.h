@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_AGENT_H
+#define _6LH_AGENT_AGENT_H
+
+#include "tap.h"
+#include "frame.h"
+#include "window.h"
+#include "queue.h"
+#include "event.h"
+#include "worker.h"
+#include "iphc.h"
+#include "rules.h"
+#include "stats.h"
+#include "capture.h"
+
+struct slh_agent_uring;
+
+#ifndef SLH_AGENT_DEFAULT_BATCH
+/*! Default number of TAP frames read per wakeup */
+#define SLH_AGENT_DEFAULT_BATCH	(64)
+#endif
+
+/*!
+ * Agent context: ties the TAP interface to the control channel.
+ */
+struct slh_agent {
+	/*! TAP interface, opened by the caller */
+	struct slh_agent_tap_ctx tap;
+	/*! Control channel, initialised by the caller */
+	struct slh_agent_frame_ctx ctl;
+	/*! Transmit window */
+	struct slh_agent_window win;
+	/*! Frames waiting for space in the transmit window */
+	struct slh_agent_queue queue;
+	/*! Event loop */
+	struct slh_agent_event_loop loop;
+	/*! TAP interface events */
+	struct slh_agent_event tap_ev;
+	/*! Control channel events */
+	struct slh_agent_event ctl_ev;
+	/*! Control channel output events */
+	struct slh_agent_event tx_ev;
+	/*! Retransmission timer */
+	struct slh_agent_event_timer retx;
+	/*! SIGUSR1 events, through a signalfd */
+	struct slh_agent_event sig_ev;
+	/*! Workers serving the extra TAP queues (`tap.queues - 1`) */
+	struct slh_agent_worker* workers;
+	/*! Rules applied to frames both ways, compiled by the caller */
+	struct slh_agent_rules rules;
+	/*!
+	 * Counters kept by the main thread; see slh_agent_get_stats for
+	 * the full set
+	 */
+	struct slh_agent_stats stats;
+	/*! Capture of the frames crossing the interface, or NULL */
+	struct slh_agent_capture* capture;
+	/*! io_uring engine (see uring.h), or NULL to use the event loop */
+	struct slh_agent_uring* ring;
+
+	/*! Buffer for frames received from the parent */
+	union {
+		uint8_t* raw;
+		struct slh_agent_frame* header;
+	} rx;
+	/*! Size of the receive buffer */
+	uint16_t rx_sz;
+	/*! Buffer for Ethernet frames rebuilt from GS frames, MTU-sized */
+	uint8_t* iphc_buf;
+
+	/*! Largest window offered to the parent */
+	uint8_t window;
+	/*! Whether the parent has answered our SOH frame */
+	uint8_t negotiated;
+	/*!
+	 * Reading from the parent is paused until it takes our output, or
+	 * the io_uring engine has finished some TAP writes
+	 */
+	uint8_t tx_blocked;
+	/*!
+	 * Retransmissions are due but wait until the parent takes our
+	 * output
+	 */
+	uint8_t retx_blocked;
+	/*! The parent has accepted IPv6 header compression */
+	uint8_t iphc;
+	/*!
+	 * Offloads the parent has agreed to take on, SLH_TAP_OFFLOAD_
+	 * flags, if the interface was opened with any
+	 */
+	uint8_t offload;
+	/*! Transmit queue overflow policy */
+	uint8_t policy;
+	/*! Transmit queue depth */
+	uint16_t depth;
+	/*!
+	 * Most frames taken from a TAP queue before other events get a
+	 * look in (0: no limit)
+	 */
+	uint16_t batch;
+	/*! Retransmission timeout in milliseconds */
+	uint32_t timeout;
+	/*! Do the TAP and control channel I/O through io_uring */
+	uint8_t uring;
+	/*! Reason the event loop was stopped */
+	int res;
+};
+
+/*!
+ * Prepare the agent once the TAP interface and control channel are open.
+ * The `window`, `timeout`, `depth`, `policy`, `batch`, `rules`,
+ * `capture` and `uring` fields must be set.  If the TAP interface has more
+ * than one queue, a worker thread is started for each queue after the
+ * first, which the main thread serves itself.
+ *
+ * With `uring` set, the main thread's TAP queue and, if it is a byte
+ * stream, the control channel are read and written through the io_uring
+ * engine, which fails with -EOPNOTSUPP if not built in or if the TAP
+ * backend cannot do without its own reads and writes.
+ *
+ * SIGUSR1 is blocked, for the agent to pick up while it runs: each one
+ * has the counters written to stderr.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_init(struct slh_agent* const agent);
+
+/*!
+ * Send the SOH frame, then pass traffic until the parent sends EOT or the
+ * control channel is closed.
+ *
+ * @retval	0	Parent asked us to exit
+ * @retval	<0	errno.h error
+ */
+int slh_agent_run(struct slh_agent* const agent);
+
+/*!
+ * Take a snapshot of the counters, including those kept by the transmit
+ * queue and the TAP queue workers.
+ *
+ * @param[in]		agent	Agent context
+ * @param[out]		stats	Counters
+ */
+void slh_agent_get_stats(const struct slh_agent* const agent,
+		struct slh_agent_stats* const stats);
+
+/*!
+ * Release the resources held by the agent.  The TAP interface is left open.
+ */
+void slh_agent_free(struct slh_agent* const agent);
+
+#endif
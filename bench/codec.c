@@ -0,0 +1,435 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Framing codec sweep: time slh_agent_write_frame, slh_agent_read_frame and
+ * slh_agent_drop_frame over a socket pair, byte-stuffed and COBS-framed,
+ * for frames from 64 bytes to 9 KiB with 0% to 100% of their bytes needing
+ * escape, and with the encoded stream arriving in pieces of various sizes.
+ * Each case reports ns/frame, MB/s of frame data and the system calls the
+ * frame code made per frame.
+ *
+ * Only the frame code is timed: draining what the writer sent, and feeding
+ * the reader, happen with the clock stopped.  Give one of `write`, `read`,
+ * `split` or `drop` to run just those cases.
+ */
+
+#include "frame.h"
+#include "codec.h"
+#include "syscount.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*! Transmit and receive buffer size */
+#define BENCH_BUF_SZ	(262144)
+/*! Frame data pushed through per case */
+#define BENCH_BYTES	(8 * 1048576)
+/*! Fewest frames per case */
+#define BENCH_MIN_FRAMES	(4096)
+/*! Frames written between flushes, as the agent does once per loop turn */
+#define BENCH_BATCH	(32)
+/*! Frame size the `drop` cases read with: too small for every frame */
+#define BENCH_DROP_SZ	(32)
+/*! Escape density used when sweeping the other parameters */
+#define BENCH_DEFAULT_ESCAPE	(1)
+/*! Largest payload, a 9 KiB jumbo frame */
+#define BENCH_SIZE_MAX	(9216)
+
+/*! Payload sizes */
+static const uint16_t bench_sizes[] = { 64, 256, 1280, 1500, 4096,
+	BENCH_SIZE_MAX };
+/*! Percentage of bytes needing escape */
+static const uint8_t bench_escapes[] = { 0, 1, 10, 50, 100 };
+/*! Size of the pieces the encoded stream arrives in */
+static const uint32_t bench_splits[] = { 64, 1500, 65536 };
+
+#define BENCH_COUNT(a)	(sizeof(a) / sizeof((a)[0]))
+
+/*!
+ * Framing under test, and the bytes it has to treat specially.
+ */
+struct bench_framing {
+	const char* name;
+	uint8_t framing;
+	const uint8_t* special;
+	uint8_t special_sz;
+};
+
+static const uint8_t bench_special_dle[] = { STX, ETX, DLE };
+static const uint8_t bench_special_cobs[] = { 0 };
+
+static const struct bench_framing bench_framings[] = {
+	{
+		.name = "dle",
+		.framing = SLH_FRAMING_STUFFED,
+		.special = bench_special_dle,
+		.special_sz = sizeof(bench_special_dle),
+	},
+	{
+		.name = "cobs",
+		.framing = SLH_FRAMING_COBS,
+		.special = bench_special_cobs,
+		.special_sz = sizeof(bench_special_cobs),
+	},
+};
+
+/*!
+ * Result of a case.
+ */
+struct bench_result {
+	uint64_t elapsed;
+	uint64_t syscalls;
+	uint32_t frames;
+};
+
+/*!
+ * Return the monotonic clock in nanoseconds.
+ */
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*!
+ * Return the number of frames to push through for a payload size.
+ */
+static uint32_t bench_frames(uint16_t size) {
+	uint32_t frames = BENCH_BYTES / size;
+	return (frames < BENCH_MIN_FRAMES) ? BENCH_MIN_FRAMES : frames;
+}
+
+/*!
+ * Fill a frame with pseudo-random bytes, `escape` percent of them special
+ * to the framing.
+ */
+static void bench_fill(uint8_t* frame, uint16_t sz, uint8_t escape,
+		const struct bench_framing* const bf) {
+	uint32_t state = 0x6c68;
+	uint16_t i;
+
+	for (i = 0; i < sz; i++) {
+		state = (state * 1103515245) + 12345;
+		if (((state >> 8) % 100) < escape) {
+			frame[i] = bf->special[(state >> 16)
+				% bf->special_sz];
+		} else {
+			/* Any byte that needs no escaping either way */
+			frame[i] = 0x20 + ((state >> 16) % 0xc0);
+		}
+	}
+	frame[0] = FS;
+}
+
+/*!
+ * Open a socket pair, the reading end non-blocking as the agent has it.
+ */
+static int bench_socketpair(int* fds) {
+	const int sz = 1048576;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+
+	/* Room for the largest piece fed at once */
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+/*!
+ * Throw away everything waiting on a descriptor.
+ */
+static void bench_drain(int fd) {
+	static uint8_t scratch[65536];
+
+	while (bench_raw_read(fd, scratch, sizeof(scratch)) > 0)
+		;
+}
+
+/*!
+ * Time writing frames into a socket, flushing every BENCH_BATCH frames.
+ */
+static int bench_write(struct bench_result* const res,
+		const uint8_t* frame, uint16_t frame_sz, uint8_t framing) {
+	struct slh_agent_frame_ctx tx;
+	uint64_t start;
+	uint64_t sys;
+	uint32_t i;
+	int fds[2];
+	int ret = -1;
+
+	if (bench_socketpair(fds) < 0)
+		return -1;
+
+	if (slh_agent_frame_init(&tx, -1, fds[0], 4096, BENCH_BUF_SZ)
+			|| slh_agent_frame_set_framing(&tx, framing)) {
+		fprintf(stderr, "cannot set up writer\n");
+		goto close;
+	}
+
+	res->elapsed = 0;
+	res->syscalls = 0;
+	res->frames = bench_frames(frame_sz - 1);
+
+	sys = bench_syscalls();
+	start = bench_now();
+	for (i = 0; i < res->frames; i++) {
+		int wr;
+
+		while ((wr = slh_agent_write_frame(&tx,
+					(const struct slh_agent_frame*)frame,
+					frame_sz)) == -EAGAIN) {
+			/* The reader is behind: catch it up off the clock */
+			res->elapsed += bench_now() - start;
+			bench_drain(fds[1]);
+			start = bench_now();
+		}
+		if (wr < 0)
+			goto fail;
+
+		if (((i + 1) % BENCH_BATCH) && ((i + 1) < res->frames))
+			continue;
+
+		while ((wr = slh_agent_frame_flush(&tx)) == -EAGAIN) {
+			res->elapsed += bench_now() - start;
+			bench_drain(fds[1]);
+			start = bench_now();
+		}
+		if (wr < 0)
+			goto fail;
+	}
+	res->elapsed += bench_now() - start;
+	res->syscalls = bench_syscalls() - sys;
+	ret = 0;
+
+fail:
+	if (ret)
+		fprintf(stderr, "write failed\n");
+	slh_agent_frame_free(&tx);
+close:
+	close(fds[0]);
+	close(fds[1]);
+	return ret;
+}
+
+/*!
+ * Encode frames into `out`, as many as fit in `out_sz` bytes.
+ *
+ * @returns	Number of bytes encoded, or 0 on error.
+ */
+static size_t bench_encode(uint8_t* out, size_t out_sz,
+		const uint8_t* frame, uint16_t frame_sz, uint8_t framing,
+		uint32_t* frames) {
+	struct slh_agent_frame_ctx tx;
+	size_t len;
+
+	if (slh_agent_frame_init(&tx, -1, -1, 4096, out_sz)
+			|| slh_agent_frame_set_framing(&tx, framing))
+		return 0;
+
+	/* COBS framing starts with a zero byte; leave it out */
+	tx.tx_read_ptr = tx.tx_write_ptr;
+
+	*frames = 0;
+	while ((slh_agent_frame_tx_space(&tx)
+				>= slh_agent_frame_encoded_max(frame_sz))
+			&& !slh_agent_write_frame(&tx,
+				(const struct slh_agent_frame*)frame,
+				frame_sz))
+		(*frames)++;
+
+	len = slh_agent_frame_tx_pending(&tx);
+	memcpy(out, &tx.tx_buffer[tx.tx_read_ptr & (tx.tx_buffer_sz - 1)],
+			len);
+	slh_agent_frame_free(&tx);
+	return len;
+}
+
+/*!
+ * Time reading frames from a socket, the encoded stream arriving `split`
+ * bytes at a time.  With `max_sz` smaller than the frames, each is
+ * refused and dropped instead.
+ */
+static int bench_read(struct bench_result* const res,
+		const uint8_t* frame, uint16_t frame_sz, uint8_t framing,
+		uint32_t split, uint16_t max_sz) {
+	static uint8_t stream[BENCH_BUF_SZ / 2];
+	static uint8_t decoded[BENCH_SIZE_MAX + 1];
+	struct slh_agent_frame_ctx rx;
+	uint32_t per_stream;
+	size_t stream_sz;
+	int fds[2];
+	int ret = -1;
+
+	stream_sz = bench_encode(stream, sizeof(stream), frame, frame_sz,
+			framing, &per_stream);
+	if (!stream_sz) {
+		fprintf(stderr, "cannot encode\n");
+		return -1;
+	}
+
+	if (bench_socketpair(fds) < 0)
+		return -1;
+
+	if (slh_agent_frame_init(&rx, fds[1], -1, BENCH_BUF_SZ, 4096)
+			|| slh_agent_frame_set_framing(&rx, framing)) {
+		fprintf(stderr, "cannot set up reader\n");
+		goto close;
+	}
+
+	res->elapsed = 0;
+	res->syscalls = 0;
+	res->frames = 0;
+
+	while (res->frames < bench_frames(frame_sz - 1)) {
+		size_t off;
+
+		for (off = 0; off < stream_sz; off += split) {
+			size_t len = stream_sz - off;
+			uint64_t start;
+			uint64_t sys;
+			int rd;
+
+			if (len > split)
+				len = split;
+			if (bench_raw_write(fds[0], stream + off, len)
+					!= (ssize_t)len) {
+				perror("write");
+				goto fail;
+			}
+
+			rx.rx_ready = 1;
+			sys = bench_syscalls();
+			start = bench_now();
+			while ((rd = slh_agent_read_frame(&rx,
+						(struct slh_agent_frame*)
+						decoded, max_sz))) {
+				if (rd == -EMSGSIZE) {
+					slh_agent_drop_frame(&rx);
+				} else if (rd != frame_sz) {
+					break;
+				}
+				res->frames++;
+			}
+			res->elapsed += bench_now() - start;
+			res->syscalls += bench_syscalls() - sys;
+
+			if (rd) {
+				fprintf(stderr, "read returned %d\n", rd);
+				goto fail;
+			}
+		}
+	}
+
+	if ((max_sz >= frame_sz) && memcmp(decoded, frame, frame_sz)) {
+		fprintf(stderr, "frame mismatch\n");
+		goto fail;
+	}
+	ret = 0;
+
+fail:
+	slh_agent_frame_free(&rx);
+close:
+	close(fds[0]);
+	close(fds[1]);
+	return ret;
+}
+
+/*!
+ * Print the result of a case.
+ */
+static void bench_report(const char* op, const struct bench_framing* bf,
+		uint16_t size, uint8_t escape, uint32_t split,
+		const struct bench_result* const res) {
+	char split_str[24] = "";
+
+	if (split)
+		snprintf(split_str, sizeof(split_str), "split %5u", split);
+
+	printf("codec %-6s %-5s %-4s %5u B esc %3u%% %-11s "
+			"%9.1f ns/frame %8.1f MB/s %6.3f syscalls/frame\n",
+			slh_agent_codec_impl(), op, bf->name, size, escape,
+			split_str,
+			(double)res->elapsed / res->frames,
+			((double)res->frames * size * 1000.0) / res->elapsed,
+			(double)res->syscalls / res->frames);
+}
+
+int main(int argc, char* argv[]) {
+	static uint8_t frame[BENCH_SIZE_MAX + 1];
+	const char* only = (argc > 1) ? argv[1] : NULL;
+	struct bench_result res;
+	unsigned int f, s, e, p;
+
+	for (f = 0; f < BENCH_COUNT(bench_framings); f++) {
+		const struct bench_framing* const bf = &bench_framings[f];
+
+		for (s = 0; s < BENCH_COUNT(bench_sizes); s++) {
+			const uint16_t size = bench_sizes[s];
+			const uint16_t frame_sz = size + 1;
+
+			for (e = 0; e < BENCH_COUNT(bench_escapes); e++) {
+				const uint8_t escape = bench_escapes[e];
+
+				bench_fill(frame, frame_sz, escape, bf);
+
+				if (!only || !strcmp(only, "write")) {
+					if (bench_write(&res, frame, frame_sz,
+								bf->framing))
+						return 1;
+					bench_report("write", bf, size,
+							escape, 0, &res);
+				}
+
+				if (!only || !strcmp(only, "read")) {
+					if (bench_read(&res, frame, frame_sz,
+								bf->framing,
+								BENCH_BUF_SZ
+								/ 2,
+								frame_sz))
+						return 1;
+					bench_report("read", bf, size,
+							escape, 0, &res);
+				}
+			}
+
+			bench_fill(frame, frame_sz, BENCH_DEFAULT_ESCAPE, bf);
+
+			for (p = 0; p < BENCH_COUNT(bench_splits); p++) {
+				if (only && strcmp(only, "split"))
+					break;
+				if (bench_read(&res, frame, frame_sz,
+							bf->framing,
+							bench_splits[p],
+							frame_sz))
+					return 1;
+				bench_report("read", bf, size,
+						BENCH_DEFAULT_ESCAPE,
+						bench_splits[p], &res);
+			}
+
+			if (!only || !strcmp(only, "drop")) {
+				if (bench_read(&res, frame, frame_sz,
+							bf->framing,
+							BENCH_BUF_SZ / 2,
+							BENCH_DROP_SZ))
+					return 1;
+				bench_report("drop", bf, size,
+						BENCH_DEFAULT_ESCAPE, 0, &res);
+			}
+		}
+	}
+
+	return 0;
+}
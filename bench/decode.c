@@ -0,0 +1,314 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Decoder microbenchmark: time slh_agent_read_frame on full-size frames
+ * with no, few and many bytes needing escape, byte-stuffed and COBS-framed.
+ * Frames are fed through a pipe a receive buffer's worth at a time; only
+ * the decoding is timed.  Before timing, each batch is decoded with every
+ * scanning function the CPU supports, which must agree with the portable
+ * code byte for byte.
+ */
+
+#include "frame.h"
+#include "codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! Decoded frame size, type byte plus a 1280-byte MTU payload */
+#define BENCH_FRAME_SZ	(1281)
+/*! Receive buffer size */
+#define BENCH_BUF_SZ	(65536)
+/*! Frames decoded per case */
+#define BENCH_FRAMES	(200000)
+
+/*!
+ * Benchmark case: one frame in `escape_in` needs escaping on average.
+ */
+struct bench_case {
+	const char* name;
+	uint32_t escape_in;
+};
+
+static const struct bench_case bench_cases[] = {
+	{ .name = "none",	.escape_in = 0 },
+	{ .name = "few",	.escape_in = 256 },
+	{ .name = "many",	.escape_in = 4 },
+};
+
+/*!
+ * Framing under test, and the bytes it has to treat specially.
+ */
+struct bench_framing {
+	const char* name;
+	uint8_t framing;
+	const uint8_t* special;
+	uint8_t special_sz;
+};
+
+#define BENCH_CASES	(sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+static const uint8_t bench_special_dle[] = { STX, ETX, DLE };
+static const uint8_t bench_special_cobs[] = { 0 };
+
+static const struct bench_framing bench_framings[] = {
+	{
+		.name = "dle",
+		.framing = SLH_FRAMING_STUFFED,
+		.special = bench_special_dle,
+		.special_sz = sizeof(bench_special_dle),
+	},
+	{
+		.name = "cobs",
+		.framing = SLH_FRAMING_COBS,
+		.special = bench_special_cobs,
+		.special_sz = sizeof(bench_special_cobs),
+	},
+};
+
+#define BENCH_FRAMINGS	(sizeof(bench_framings) / sizeof(bench_framings[0]))
+
+/*! Scanning functions checked, the portable code first */
+static const char* const bench_check_impls[] = { "scalar", "avx2", "sse2" };
+
+#define BENCH_CHECK_IMPLS	\
+	(sizeof(bench_check_impls) / sizeof(bench_check_impls[0]))
+
+/*!
+ * Return the monotonic clock in nanoseconds.
+ */
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*!
+ * Fill a frame with pseudo-random bytes, one in `escape_in` of them
+ * special to the framing.
+ */
+static void bench_fill(uint8_t* frame, uint16_t sz, uint32_t escape_in,
+		const struct bench_framing* const bf) {
+	uint32_t state = 0x6c68;
+	uint16_t i;
+
+	for (i = 0; i < sz; i++) {
+		state = (state * 1103515245) + 12345;
+		if (escape_in && !((state >> 8) % escape_in)) {
+			frame[i] = bf->special[(state >> 16)
+				% bf->special_sz];
+		} else {
+			/* Any byte that does not need escaping */
+			frame[i] = 0x20 + ((state >> 16) % 0xc0);
+		}
+	}
+	frame[0] = FS;
+}
+
+/*!
+ * Encode `frame` as many times as fits in the receive buffer.
+ *
+ * @returns	Number of frames encoded into `out`.
+ */
+static int bench_encode(uint8_t* out, size_t* out_sz,
+		const uint8_t* frame, uint16_t sz,
+		const struct bench_framing* const bf) {
+	int count = 0;
+	size_t len = 0;
+
+	while (1) {
+		uint8_t enc[(2 * BENCH_FRAME_SZ) + 2];
+		size_t consumed;
+		size_t enc_sz;
+
+		if (bf->framing == SLH_FRAMING_COBS) {
+			enc_sz = slh_agent_codec_cobs_encode(enc, frame, sz);
+			enc[enc_sz++] = 0;
+		} else {
+			enc[0] = STX;
+			enc_sz = 1 + slh_agent_codec_escape(&enc[1],
+					sizeof(enc) - 2, frame, sz,
+					&consumed);
+			enc[enc_sz++] = ETX;
+		}
+
+		if ((len + enc_sz) > BENCH_BUF_SZ)
+			break;
+
+		memcpy(out + len, enc, enc_sz);
+		len += enc_sz;
+		count++;
+	}
+
+	*out_sz = len;
+	return count;
+}
+
+/*!
+ * Write a batch of encoded frames into the pipe.
+ *
+ * @retval	0	Success
+ * @retval	-1	Error, reported on stderr
+ */
+static int bench_feed(struct slh_agent_frame_ctx* const ctx, int fd,
+		const uint8_t* batch, size_t batch_sz) {
+	size_t off = 0;
+
+	/* The pipe holds 64 KiB by default */
+	while (off < batch_sz) {
+		ssize_t wr = write(fd, batch + off, batch_sz - off);
+		if (wr < 0) {
+			perror("write");
+			return -1;
+		}
+		off += wr;
+	}
+	ctx->rx_ready = 1;
+	return 0;
+}
+
+/*!
+ * Decode a batch with each scanning function the CPU supports, checking
+ * each gives the same bytes as the portable code.
+ *
+ * @retval	0	Success
+ * @retval	-1	Mismatch, reported on stderr
+ */
+static int bench_check(struct slh_agent_frame_ctx* const ctx, int fd,
+		const uint8_t* batch, size_t batch_sz, int per_batch,
+		const char* what) {
+	/* Decoded frames are never bigger than encoded ones */
+	static uint8_t expect[BENCH_BUF_SZ];
+	static uint8_t decoded[BENCH_FRAME_SZ];
+	unsigned int i;
+	int res = 0;
+
+	for (i = 0; !res && (i < BENCH_CHECK_IMPLS); i++) {
+		size_t off = 0;
+		int n;
+
+		if (slh_agent_codec_use(bench_check_impls[i]))
+			/* Not here to check */
+			continue;
+
+		if (bench_feed(ctx, fd, batch, batch_sz)) {
+			res = -1;
+			break;
+		}
+
+		for (n = 0; n < per_batch; n++) {
+			int len = slh_agent_read_frame(ctx,
+					(struct slh_agent_frame*)decoded,
+					sizeof(decoded));
+			if (len < 0) {
+				fprintf(stderr, "%s: %s read returned "
+						"%d\n", what,
+						bench_check_impls[i], len);
+				res = -1;
+				break;
+			}
+
+			if (!i) {
+				memcpy(expect + off, decoded, len);
+			} else if (memcmp(expect + off, decoded, len)) {
+				fprintf(stderr, "%s: %s decoding differs "
+						"from scalar\n", what,
+						bench_check_impls[i]);
+				res = -1;
+				break;
+			}
+			off += len;
+		}
+	}
+
+	slh_agent_codec_use(NULL);
+	return res;
+}
+
+int main(void) {
+	static uint8_t frame[BENCH_FRAME_SZ];
+	static uint8_t decoded[BENCH_FRAME_SZ];
+	static uint8_t batch[BENCH_BUF_SZ];
+	struct slh_agent_frame_ctx ctx;
+	unsigned int i;
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return 1;
+	}
+
+	if (slh_agent_frame_init(&ctx, fds[0], -1, BENCH_BUF_SZ,
+				4096)) {
+		perror("slh_agent_frame_init");
+		return 1;
+	}
+
+	for (i = 0; i < (BENCH_FRAMINGS * BENCH_CASES); i++) {
+		const struct bench_case* const bc =
+			&bench_cases[i % BENCH_CASES];
+		const struct bench_framing* const bf =
+			&bench_framings[i / BENCH_CASES];
+		uint64_t elapsed = 0;
+		size_t batch_sz;
+		char what[32];
+		int per_batch;
+		int done = 0;
+
+		if (slh_agent_frame_set_framing(&ctx, bf->framing)) {
+			fprintf(stderr, "%s: cannot switch\n", bf->name);
+			return 1;
+		}
+
+		bench_fill(frame, sizeof(frame), bc->escape_in, bf);
+		per_batch = bench_encode(batch, &batch_sz,
+				frame, sizeof(frame), bf);
+		snprintf(what, sizeof(what), "%s %s", bf->name, bc->name);
+		if (bench_check(&ctx, fds[1], batch, batch_sz, per_batch,
+					what))
+			return 1;
+
+		while (done < BENCH_FRAMES) {
+			uint64_t start;
+			int n;
+
+			if (bench_feed(&ctx, fds[1], batch, batch_sz))
+				return 1;
+
+			start = bench_now();
+			for (n = 0; n < per_batch; n++) {
+				int len = slh_agent_read_frame(&ctx,
+						(struct slh_agent_frame*)
+						decoded, sizeof(decoded));
+				if (len != sizeof(frame)) {
+					fprintf(stderr, "%s: read returned %d\n",
+							bc->name, len);
+					return 1;
+				}
+			}
+			elapsed += bench_now() - start;
+			done += per_batch;
+		}
+
+		if (memcmp(decoded, frame, sizeof(frame))) {
+			fprintf(stderr, "%s: frame mismatch\n", bc->name);
+			return 1;
+		}
+
+		printf("decode %-6s %-4s escapes %-5s %8.1f ns/frame "
+				"%8.1f MB/s %6.2f%% overhead\n",
+				slh_agent_codec_impl(), bf->name, bc->name,
+				(double)elapsed / done,
+				((double)done * sizeof(frame) * 1000.0)
+					/ elapsed,
+				(((double)batch_sz / per_batch)
+					- sizeof(frame)) * 100.0
+					/ sizeof(frame));
+	}
+
+	return 0;
+}
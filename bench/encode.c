@@ -0,0 +1,322 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Encoder microbenchmark: time slh_agent_write_frame on full-size frames
+ * with no, few and many bytes needing escape, byte-stuffed and COBS-framed,
+ * and report how much bigger the encoded frames are.  Nothing is sent: the
+ * transmit buffer is emptied whenever it fills.
+ *
+ * First, frames of assorted sizes and escape densities are encoded with
+ * each scanning function the CPU supports, and must come out byte for byte
+ * as the portable code has them, and decode back to what went in.
+ */
+
+#include "frame.h"
+#include "codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*! Frame size, type byte plus a 1280-byte MTU payload */
+#define BENCH_FRAME_SZ	(1281)
+/*! Transmit buffer size */
+#define BENCH_BUF_SZ	(65536)
+/*! Frames encoded per case */
+#define BENCH_FRAMES	(200000)
+
+/*!
+ * Benchmark case: one frame in `escape_in` needs escaping on average.
+ */
+struct bench_case {
+	const char* name;
+	uint32_t escape_in;
+};
+
+static const struct bench_case bench_cases[] = {
+	{ .name = "none",	.escape_in = 0 },
+	{ .name = "few",	.escape_in = 256 },
+	{ .name = "many",	.escape_in = 4 },
+};
+
+#define BENCH_CASES	(sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+/*!
+ * Framing under test, and the bytes it has to treat specially.
+ */
+struct bench_framing {
+	const char* name;
+	uint8_t framing;
+	const uint8_t* special;
+	uint8_t special_sz;
+};
+
+static const uint8_t bench_special_dle[] = { STX, ETX, DLE };
+static const uint8_t bench_special_cobs[] = { 0 };
+
+static const struct bench_framing bench_framings[] = {
+	{
+		.name = "dle",
+		.framing = SLH_FRAMING_STUFFED,
+		.special = bench_special_dle,
+		.special_sz = sizeof(bench_special_dle),
+	},
+	{
+		.name = "cobs",
+		.framing = SLH_FRAMING_COBS,
+		.special = bench_special_cobs,
+		.special_sz = sizeof(bench_special_cobs),
+	},
+};
+
+#define BENCH_FRAMINGS	(sizeof(bench_framings) / sizeof(bench_framings[0]))
+
+/*! Frame sizes checked, either side of the lookaheads and vector sizes */
+static const uint16_t bench_check_sizes[] = { 1, 2, 8, 9, 16, 17, 32, 33,
+	40, 41, 64, 65, 100, BENCH_FRAME_SZ };
+/*! One byte in this many needing escape, in the frames checked */
+static const uint32_t bench_check_escapes[] = { 0, 256, 32, 8, 4, 2, 1 };
+/*! Frames of each size and density checked */
+#define BENCH_CHECK_SEEDS	(16)
+/*! Scanning functions checked against the portable code */
+static const char* const bench_check_impls[] = { "avx2", "sse2" };
+
+#define BENCH_COUNT(a)	(sizeof(a) / sizeof((a)[0]))
+
+/*!
+ * Return the monotonic clock in nanoseconds.
+ */
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*!
+ * Fill a frame with pseudo-random bytes, one in `escape_in` of them
+ * special to the framing.
+ */
+static void bench_fill(uint8_t* frame, uint16_t sz, uint32_t escape_in,
+		const struct bench_framing* const bf, uint32_t state) {
+	uint16_t i;
+
+	for (i = 0; i < sz; i++) {
+		state = (state * 1103515245) + 12345;
+		if (escape_in && !((state >> 8) % escape_in)) {
+			frame[i] = bf->special[(state >> 16)
+				% bf->special_sz];
+		} else {
+			/* Any byte that needs no escaping either way */
+			frame[i] = 0x20 + ((state >> 16) % 0xc0);
+		}
+	}
+	frame[0] = FS;
+}
+
+/*!
+ * Encode one frame on its own.
+ *
+ * @returns	The encoded frame, `*enc_sz` bytes of it, or NULL on error.
+ */
+static const uint8_t* bench_encode_one(struct slh_agent_frame_ctx* const ctx,
+		const uint8_t* frame, uint16_t sz, uint32_t* enc_sz) {
+	ctx->tx_read_ptr = ctx->tx_write_ptr;
+	if (slh_agent_write_frame(ctx, (const struct slh_agent_frame*)frame,
+				sz))
+		return NULL;
+	return slh_agent_frame_tx_data(ctx, enc_sz);
+}
+
+/*!
+ * Check a frame encodes the same with every scanning function, and
+ * decodes back to itself.
+ *
+ * @retval	0	Success
+ * @retval	-1	Mismatch, reported on stderr
+ */
+static int bench_check_frame(struct slh_agent_frame_ctx* const tx,
+		struct slh_agent_frame_ctx* const rx,
+		const uint8_t* frame, uint16_t sz, const char* what) {
+	static uint8_t expect[(2 * BENCH_FRAME_SZ) + 2];
+	static uint8_t decoded[BENCH_FRAME_SZ];
+	const uint8_t* enc;
+	uint8_t* space;
+	uint32_t expect_sz;
+	uint32_t enc_sz;
+	uint32_t space_sz;
+	unsigned int i;
+	int len;
+
+	slh_agent_codec_use("scalar");
+	enc = bench_encode_one(tx, frame, sz, &expect_sz);
+	if (!enc) {
+		fprintf(stderr, "%s: scalar encode failed\n", what);
+		return -1;
+	}
+	memcpy(expect, enc, expect_sz);
+
+	for (i = 0; i < BENCH_COUNT(bench_check_impls); i++) {
+		if (slh_agent_codec_use(bench_check_impls[i]))
+			/* Not here to check */
+			continue;
+
+		enc = bench_encode_one(tx, frame, sz, &enc_sz);
+		if (!enc || (enc_sz != expect_sz)
+				|| memcmp(enc, expect, expect_sz)) {
+			fprintf(stderr, "%s: %s encoding differs from "
+					"scalar\n", what,
+					bench_check_impls[i]);
+			return -1;
+		}
+	}
+
+	/* Hand the encoded frame straight to the decoder */
+	space = slh_agent_frame_rx_space(rx, &space_sz);
+	memcpy(space, expect, expect_sz);
+	slh_agent_frame_rx_commit(rx, expect_sz);
+	len = slh_agent_read_frame(rx, (struct slh_agent_frame*)decoded,
+			sizeof(decoded));
+	if ((len != sz) || memcmp(decoded, frame, sz)) {
+		fprintf(stderr, "%s: decodes to %d bytes, not what went in\n",
+				what, len);
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Check every scanning function against the portable code.
+ *
+ * @retval	0	Success
+ * @retval	-1	Mismatch, reported on stderr
+ */
+static int bench_check(void) {
+	static uint8_t frame[BENCH_FRAME_SZ];
+	struct slh_agent_frame_ctx tx;
+	struct slh_agent_frame_ctx rx;
+	unsigned int f, i;
+	int res = -1;
+
+	if (slh_agent_frame_init(&tx, -1, -1, 4096, BENCH_BUF_SZ)) {
+		perror("slh_agent_frame_init");
+		return -1;
+	}
+	if (slh_agent_frame_init(&rx, -1, -1, BENCH_BUF_SZ, 4096)) {
+		perror("slh_agent_frame_init");
+		goto freetx;
+	}
+	/* Nothing to read: the decoder gets what was encoded */
+	rx.rx_ready = 0;
+
+	for (f = 0; f < BENCH_FRAMINGS; f++) {
+		const struct bench_framing* const bf = &bench_framings[f];
+
+		if (slh_agent_frame_set_framing(&tx, bf->framing)
+				|| slh_agent_frame_set_framing(&rx,
+					bf->framing)) {
+			fprintf(stderr, "%s: cannot switch\n", bf->name);
+			goto freerx;
+		}
+
+		for (i = 0; i < (BENCH_COUNT(bench_check_sizes)
+					* BENCH_COUNT(bench_check_escapes)
+					* BENCH_CHECK_SEEDS); i++) {
+			const uint16_t sz = bench_check_sizes[i
+				% BENCH_COUNT(bench_check_sizes)];
+			const uint32_t escape_in = bench_check_escapes[
+				(i / BENCH_COUNT(bench_check_sizes))
+				% BENCH_COUNT(bench_check_escapes)];
+			const uint32_t seed = 1 + (i
+					/ (BENCH_COUNT(bench_check_sizes)
+					* BENCH_COUNT(bench_check_escapes)));
+			char what[64];
+
+			snprintf(what, sizeof(what),
+					"check %s %u B, 1 in %u, seed %u",
+					bf->name, sz, escape_in, seed);
+			bench_fill(frame, sz, escape_in, bf, seed);
+			if (bench_check_frame(&tx, &rx, frame, sz, what))
+				goto freerx;
+		}
+	}
+	res = 0;
+
+freerx:
+	slh_agent_frame_free(&rx);
+freetx:
+	slh_agent_frame_free(&tx);
+	slh_agent_codec_use(NULL);
+	return res;
+}
+
+int main(void) {
+	static uint8_t frame[BENCH_FRAME_SZ];
+	struct slh_agent_frame_ctx ctx;
+	unsigned int i;
+
+	if (bench_check())
+		return 1;
+
+	if (slh_agent_frame_init(&ctx, -1, -1, 4096, BENCH_BUF_SZ)) {
+		perror("slh_agent_frame_init");
+		return 1;
+	}
+
+	for (i = 0; i < (BENCH_FRAMINGS * BENCH_CASES); i++) {
+		const struct bench_case* const bc =
+			&bench_cases[i % BENCH_CASES];
+		const struct bench_framing* const bf =
+			&bench_framings[i / BENCH_CASES];
+		uint64_t elapsed = 0;
+		uint64_t encoded = 0;
+		uint64_t start;
+		int done = 0;
+
+		if (slh_agent_frame_set_framing(&ctx, bf->framing)) {
+			fprintf(stderr, "%s: cannot switch\n", bf->name);
+			return 1;
+		}
+
+		bench_fill(frame, sizeof(frame), bc->escape_in, bf, 0x6c68);
+
+		while (done < BENCH_FRAMES) {
+			/* Throw away what was encoded last time */
+			encoded += slh_agent_frame_tx_pending(&ctx);
+			ctx.tx_read_ptr = ctx.tx_write_ptr;
+
+			start = bench_now();
+			while ((done < BENCH_FRAMES)
+					&& (slh_agent_frame_tx_space(&ctx)
+						>= slh_agent_frame_encoded_max(
+							sizeof(frame)))) {
+				if (slh_agent_write_frame(&ctx,
+							(const struct
+							 slh_agent_frame*)
+							frame,
+							sizeof(frame))) {
+					fprintf(stderr, "%s: write failed\n",
+							bc->name);
+					return 1;
+				}
+				done++;
+			}
+			elapsed += bench_now() - start;
+		}
+		encoded += slh_agent_frame_tx_pending(&ctx);
+		ctx.tx_read_ptr = ctx.tx_write_ptr;
+
+		printf("encode %-6s %-4s escapes %-5s %8.1f ns/frame "
+				"%8.1f MB/s %6.2f%% overhead\n",
+				slh_agent_codec_impl(), bf->name, bc->name,
+				(double)elapsed / done,
+				((double)done * sizeof(frame) * 1000.0)
+					/ elapsed,
+				(((double)encoded / done) - sizeof(frame))
+					* 100.0 / sizeof(frame));
+	}
+
+	slh_agent_frame_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,463 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * End-to-end benchmark: run the agent's main loop in a thread, with the
+ * socket backend's SOCK_SEQPACKET socket pair or the mock backend standing
+ * in for the TAP interface and pipes for the control channel, and play the
+ * parent from the main thread.
+ * Frames are pushed through each way, stop-and-wait and windowed, and each
+ * case reports ns/frame, MB/s and the system calls the agent made per
+ * frame.  Needs no privileges.
+ */
+
+#include "agent.h"
+#include "codec.h"
+#include "syscount.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*! Frames sent per case */
+#define BENCH_FRAMES	(100000)
+/*! Ethernet frame size */
+#define BENCH_FRAME_SZ	(1280)
+/*! Control channel buffer sizes */
+#define BENCH_BUF_SZ	(65536)
+/*! Longest wait for the agent, in milliseconds */
+#define BENCH_TIMEOUT	(5000)
+
+/*!
+ * Benchmark case.
+ */
+struct bench_case {
+	const char* name;
+	/*! Frames go from the parent to the interface */
+	_Bool down;
+	/*! Window offered and accepted */
+	uint8_t window;
+	/*! Interface held in memory, not a socket */
+	_Bool mock;
+};
+
+static const struct bench_case bench_cases[] = {
+	{ .name = "up",		.down = false,	.window = 1 },
+	{ .name = "up",		.down = false,	.window = 32 },
+	{ .name = "down",	.down = true,	.window = 1 },
+	{ .name = "down",	.down = true,	.window = 32 },
+	{ .name = "up",		.down = false,	.window = 32,	.mock = true },
+	{ .name = "down",	.down = true,	.window = 32,	.mock = true },
+};
+
+#define BENCH_CASES	(sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+/*!
+ * Agent under test, and the parent's end of everything.
+ */
+struct bench_loop {
+	struct slh_agent agent;
+	pthread_t thread;
+	/*! Parent's end of the control channel */
+	struct slh_agent_frame_ctx ctl;
+	/*! Far end of the stand-in TAP interface, or -1 if a mock one */
+	int wire_fd;
+	/*! Agent's end, as the socket backend's argument */
+	char tap_arg[12];
+	/*! Result of slh_agent_run */
+	int res;
+	/*! System calls made by the agent thread */
+	unsigned long syscalls;
+	/*! Frames injected into, or drained from, the interface */
+	unsigned long wire_frames;
+	/*! Frames the parent has taken from the agent */
+	_Atomic unsigned long delivered;
+	/*! Frames taken from a mock interface so far */
+	_Atomic unsigned long taken;
+	/*! The parent has had all its frames acknowledged */
+	_Atomic _Bool done;
+	/*! Ethernet frame sent each way */
+	uint8_t frame[BENCH_FRAME_SZ];
+};
+
+/*!
+ * Return the monotonic clock in nanoseconds.
+ */
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*!
+ * Agent thread.
+ */
+static void* bench_agent_main(void* arg) {
+	struct bench_loop* const bl = arg;
+
+	bl->res = slh_agent_run(&bl->agent);
+	bl->syscalls = bench_syscalls();
+	return NULL;
+}
+
+/*!
+ * Read a frame from the agent, waiting for one if need be.
+ *
+ * @returns	Size of the frame, or <0 on error or timeout.
+ */
+static int bench_read(struct bench_loop* const bl, uint8_t* buf,
+		uint16_t buf_sz) {
+	while (1) {
+		struct pollfd pfd = { .fd = bl->ctl.rx_fd, .events = POLLIN };
+		int len = slh_agent_read_frame(&bl->ctl,
+				(struct slh_agent_frame*)buf, buf_sz);
+
+		if (len)
+			return len;
+
+		/* Send our replies before waiting for more */
+		while (slh_agent_frame_flush(&bl->ctl) == -EAGAIN) {
+			struct pollfd out = {
+				.fd = bl->ctl.tx_fd,
+				.events = POLLOUT
+			};
+			poll(&out, 1, BENCH_TIMEOUT);
+		}
+
+		if (poll(&pfd, 1, BENCH_TIMEOUT) <= 0) {
+			fprintf(stderr, "agent went quiet\n");
+			return -ETIMEDOUT;
+		}
+		bl->ctl.rx_ready = true;
+	}
+}
+
+/*!
+ * Write a frame to the agent, flushing as needed to make room.
+ */
+static void bench_write(struct bench_loop* const bl, const uint8_t* frame,
+		uint16_t len) {
+	while (slh_agent_write_frame(&bl->ctl,
+				(const struct slh_agent_frame*)frame, len)
+			== -EAGAIN) {
+		struct pollfd out = { .fd = bl->ctl.tx_fd, .events = POLLOUT };
+		poll(&out, 1, BENCH_TIMEOUT);
+		slh_agent_frame_flush(&bl->ctl);
+	}
+}
+
+/*!
+ * Injector thread: send BENCH_FRAMES frames into the interface, never
+ * getting more than half the agent's queue ahead of the parent so none
+ * are dropped.
+ */
+static void* bench_inject_main(void* arg) {
+	struct bench_loop* const bl = arg;
+	const unsigned long ahead = bl->agent.depth / 2;
+
+	for (bl->wire_frames = 0; bl->wire_frames < BENCH_FRAMES;
+			bl->wire_frames++) {
+		while ((bl->wire_frames - atomic_load_explicit(
+					&bl->delivered,
+					memory_order_relaxed)) >= ahead)
+			sched_yield();
+		if (bl->wire_fd < 0) {
+			if (slh_agent_mocktap_inject(&bl->agent.tap,
+						bl->frame,
+						sizeof(bl->frame)) < 0)
+				break;
+		} else if (send(bl->wire_fd, bl->frame, sizeof(bl->frame),
+					0) < 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * Drain thread: take frames the agent writes to the interface until the
+ * socket is shut down, or the parent is done with a mock interface.
+ */
+static void* bench_drain_main(void* arg) {
+	struct bench_loop* const bl = arg;
+	uint8_t buf[BENCH_FRAME_SZ];
+
+	bl->wire_frames = 0;
+	if (bl->wire_fd >= 0) {
+		while (recv(bl->wire_fd, buf, sizeof(buf), 0) > 0)
+			bl->wire_frames++;
+		return NULL;
+	}
+
+	while (1) {
+		/* Checked first: all frames are written before it is set */
+		const _Bool done = atomic_load(&bl->done);
+
+		if (slh_agent_mocktap_take(&bl->agent.tap, buf,
+					sizeof(buf)) >= 0)
+			atomic_store(&bl->taken, ++bl->wire_frames);
+		else if (done)
+			break;
+		else
+			sched_yield();
+	}
+	return NULL;
+}
+
+/*!
+ * Start an agent, with a window of `window` frames, and answer its SOH.
+ */
+static int bench_start(struct bench_loop* const bl, uint8_t window,
+		_Bool mock) {
+	uint8_t ack[] = { ACK, SLH_OPT_WINDOW, 1, window };
+	uint8_t buf[BENCH_FRAME_SZ + 2];
+	int tap[2], down[2], up[2];
+	int len;
+
+	if ((pipe(down) < 0) || (pipe(up) < 0)) {
+		perror("pipe");
+		return -1;
+	}
+
+	memset(&bl->agent, 0, sizeof(bl->agent));
+	if (mock) {
+		bl->agent.tap.ops = &slh_agent_mocktap_ops;
+		bl->wire_fd = -1;
+	} else {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tap) < 0) {
+			perror("socketpair");
+			return -1;
+		}
+		snprintf(bl->tap_arg, sizeof(bl->tap_arg), "%d", tap[0]);
+		bl->agent.tap.ops = &slh_agent_socktap_ops;
+		bl->agent.tap.arg = bl->tap_arg;
+		bl->wire_fd = tap[1];
+	}
+	bl->agent.tap.mtu = BENCH_FRAME_SZ;
+	bl->agent.tap.queues = 1;
+	atomic_store(&bl->done, false);
+	if (slh_agent_tap_open(&bl->agent.tap) < 0) {
+		fprintf(stderr, "cannot open %s backend\n",
+				bl->agent.tap.ops->name);
+		return -1;
+	}
+
+	if (slh_agent_frame_init(&bl->agent.ctl, down[0], up[1],
+				BENCH_BUF_SZ, BENCH_BUF_SZ)
+			|| slh_agent_frame_init(&bl->ctl, up[0], down[1],
+				BENCH_BUF_SZ, BENCH_BUF_SZ)
+			|| slh_agent_event_nonblock(up[0])
+			|| slh_agent_event_nonblock(down[1])) {
+		fprintf(stderr, "cannot set up control channel\n");
+		return -1;
+	}
+
+	bl->agent.window = window;
+	bl->agent.timeout = SLH_AGENT_WINDOW_DEFAULT_TIMEOUT;
+	bl->agent.depth = SLH_AGENT_QUEUE_DEFAULT_DEPTH;
+	bl->agent.policy = SLH_AGENT_QUEUE_DROP_TAIL;
+	bl->agent.batch = SLH_AGENT_DEFAULT_BATCH;
+	if ((slh_agent_rules_init(&bl->agent.rules) < 0)
+			|| (slh_agent_init(&bl->agent) < 0)) {
+		fprintf(stderr, "cannot set up agent\n");
+		return -1;
+	}
+
+	if (pthread_create(&bl->thread, NULL, bench_agent_main, bl)) {
+		fprintf(stderr, "cannot start agent\n");
+		return -1;
+	}
+
+	len = bench_read(bl, buf, sizeof(buf));
+	if ((len < 1) || (buf[0] != SOH)) {
+		fprintf(stderr, "no SOH\n");
+		return -1;
+	}
+	bench_write(bl, ack, (window > 1) ? sizeof(ack) : 1);
+	slh_agent_frame_flush(&bl->ctl);
+	return 0;
+}
+
+/*!
+ * Tell the agent to exit, and clean up.
+ */
+static int bench_stop(struct bench_loop* const bl) {
+	bench_write(bl, &(const uint8_t){ EOT }, 1);
+	slh_agent_frame_flush(&bl->ctl);
+	pthread_join(bl->thread, NULL);
+
+	if (bl->wire_fd < 0) {
+		const uint64_t dropped = slh_agent_mocktap_dropped(
+				&bl->agent.tap);
+		if (dropped)
+			fprintf(stderr, "mock interface dropped %" PRIu64
+					" frames\n", dropped);
+	}
+
+	slh_agent_free(&bl->agent);
+	slh_agent_rules_free(&bl->agent.rules);
+	slh_agent_frame_free(&bl->agent.ctl);
+	slh_agent_tap_close(&bl->agent.tap);
+	if (bl->wire_fd >= 0)
+		close(bl->wire_fd);
+	slh_agent_frame_free(&bl->ctl);
+	close(bl->agent.ctl.rx_fd);
+	close(bl->agent.ctl.tx_fd);
+	close(bl->ctl.rx_fd);
+	close(bl->ctl.tx_fd);
+	return bl->res;
+}
+
+/*!
+ * Take BENCH_FRAMES frames from the interface, acknowledging each batch
+ * as it arrives.
+ */
+static int bench_up(struct bench_loop* const bl, uint8_t window) {
+	uint8_t buf[BENCH_FRAME_SZ + 2];
+	unsigned long got = 0;
+	pthread_t thread;
+	int res = 0;
+
+	atomic_store(&bl->delivered, 0);
+	if (pthread_create(&thread, NULL, bench_inject_main, bl))
+		return -1;
+
+	while (got < BENCH_FRAMES) {
+		int len = bench_read(bl, buf, sizeof(buf));
+
+		if (len < 0) {
+			res = len;
+			break;
+		}
+		if ((buf[0] != FS) || ((len - 1 - (window > 1))
+					!= BENCH_FRAME_SZ))
+			continue;
+
+		/* Replies go out together when we next wait */
+		got++;
+		atomic_store_explicit(&bl->delivered, got,
+				memory_order_relaxed);
+		bench_write(bl, (const uint8_t[]){ ACK, buf[1] },
+				(window > 1) ? 2 : 1);
+	}
+
+	pthread_join(thread, NULL);
+	return res;
+}
+
+/*!
+ * Return true if the agent could not write another frame to a mock
+ * interface without one being dropped.
+ */
+static _Bool bench_wire_full(struct bench_loop* const bl,
+		unsigned long sent) {
+	return (bl->wire_fd < 0) && ((sent - atomic_load(&bl->taken))
+			>= SLH_AGENT_MOCKTAP_SLOTS);
+}
+
+/*!
+ * Send BENCH_FRAMES frames to the interface, keeping up to `window` in
+ * flight, and no more than a mock interface can hold.
+ */
+static int bench_down(struct bench_loop* const bl, uint8_t window) {
+	uint8_t out[BENCH_FRAME_SZ + 2] = { FS };
+	uint8_t buf[BENCH_FRAME_SZ + 2];
+	const uint8_t hdr = (window > 1) ? 2 : 1;
+	unsigned long sent = 0;
+	unsigned long acked = 0;
+	pthread_t thread;
+	int res = 0;
+
+	memcpy(out + hdr, bl->frame, sizeof(bl->frame));
+	atomic_store(&bl->taken, 0);
+	if (pthread_create(&thread, NULL, bench_drain_main, bl))
+		return -1;
+
+	while (acked < BENCH_FRAMES) {
+		int len;
+
+		while ((sent < BENCH_FRAMES) && ((sent - acked) < window)
+				&& !bench_wire_full(bl, sent)) {
+			out[1] = (hdr > 1) ? (uint8_t)sent : out[1];
+			bench_write(bl, out, hdr + sizeof(bl->frame));
+			sent++;
+		}
+
+		if (sent == acked) {
+			/* Nothing in flight: wait for the interface */
+			sched_yield();
+			continue;
+		}
+
+		len = bench_read(bl, buf, sizeof(buf));
+		if (len < 0) {
+			res = len;
+			break;
+		}
+		if ((buf[0] == ACK) || (buf[0] == NAK))
+			acked++;
+	}
+
+	if (bl->wire_fd < 0)
+		atomic_store(&bl->done, true);
+	else
+		shutdown(bl->agent.tap.fd, SHUT_WR);
+	pthread_join(thread, NULL);
+	return res;
+}
+
+int main(void) {
+	static struct bench_loop bl;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(bl.frame); i++)
+		/* Mostly ordinary bytes, with the odd one needing escape */
+		bl.frame[i] = (i % 97) ? (0x20 + (i % 0xc0)) : DLE;
+	/* Not IPv6, so never compressed */
+	bl.frame[12] = 0x88;
+	bl.frame[13] = 0xb5;
+
+	for (i = 0; i < BENCH_CASES; i++) {
+		const struct bench_case* const bc = &bench_cases[i];
+		uint64_t elapsed;
+		int res;
+
+		if (bench_start(&bl, bc->window, bc->mock))
+			return 1;
+
+		elapsed = bench_now();
+		res = bc->down ? bench_down(&bl, bc->window)
+			: bench_up(&bl, bc->window);
+		elapsed = bench_now() - elapsed;
+
+		if ((bench_stop(&bl) < 0) || (res < 0))
+			return 1;
+		if (bl.wire_frames != BENCH_FRAMES)
+			fprintf(stderr, "%s: %lu of %u frames made it\n",
+					bc->name, bl.wire_frames,
+					BENCH_FRAMES);
+
+		printf("loop %-6s %-6s %-4s window %3u %5u bytes "
+				"%8.1f ns/frame %8.1f MB/s "
+				"%6.3f syscalls/frame\n",
+				slh_agent_codec_impl(),
+				bl.agent.tap.ops->name, bc->name, bc->window,
+				BENCH_FRAME_SZ,
+				(double)elapsed / BENCH_FRAMES,
+				((double)BENCH_FRAMES * BENCH_FRAME_SZ * 1000.0)
+					/ elapsed,
+				(double)bl.syscalls / BENCH_FRAMES);
+	}
+
+	return 0;
+}
@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Rule engine microbenchmark: time slh_agent_rules_eval on an IPv6/UDP
+ * frame with no rules, with BENCH_RULES rules it matches none of (so the
+ * whole table is checked), and with the same rules when it matches the
+ * first.
+ */
+
+#include "rules.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*! Frame size: Ethernet, IPv6 and UDP headers plus a small payload */
+#define BENCH_FRAME_SZ	(128)
+/*! Rules in the full table */
+#define BENCH_RULES	(128)
+/*! Frames checked per case */
+#define BENCH_FRAMES	(2000000)
+
+/*!
+ * Return the monotonic clock in nanoseconds.
+ */
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*!
+ * Build an IPv6/UDP frame to the given UDP port.
+ */
+static void bench_fill(uint8_t* frame, uint16_t dport) {
+	static const uint8_t dst[6] = { 0x33, 0x33, 0x00, 0x00, 0x00, 0x01 };
+	static const uint8_t src[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+	const uint16_t plen = BENCH_FRAME_SZ - 14 - 40;
+
+	memset(frame, 0, BENCH_FRAME_SZ);
+	memcpy(&frame[0], dst, sizeof(dst));
+	memcpy(&frame[6], src, sizeof(src));
+	frame[12] = 0x86;
+	frame[13] = 0xdd;
+	frame[14] = 0x60;
+	frame[18] = plen >> 8;
+	frame[19] = plen & 0xff;
+	frame[20] = 17;
+	frame[21] = 64;
+	frame[54] = 0xc0;
+	frame[55] = 0x00;
+	frame[56] = dport >> 8;
+	frame[57] = dport & 0xff;
+	frame[58] = plen >> 8;
+	frame[59] = plen & 0xff;
+}
+
+/*!
+ * Time `BENCH_FRAMES` checks of a frame and print the result.
+ */
+static int bench_run(const char* name,
+		const struct slh_agent_rules* const rules,
+		const uint8_t* frame, uint8_t expect) {
+	volatile uint8_t sink = 0;
+	uint64_t start;
+	uint64_t elapsed;
+	unsigned int i;
+
+	if (slh_agent_rules_eval(rules, frame, BENCH_FRAME_SZ) != expect) {
+		fprintf(stderr, "%s: wrong action\n", name);
+		return -1;
+	}
+
+	start = bench_now();
+	for (i = 0; i < BENCH_FRAMES; i++)
+		sink += slh_agent_rules_eval(rules, frame, BENCH_FRAME_SZ);
+	elapsed = bench_now() - start;
+	(void)sink;
+
+	printf("rules %-6s %4u rows %8.1f ns/frame %8.2f Mframes/s\n",
+			name, rules->rows, (double)elapsed / BENCH_FRAMES,
+			((double)BENCH_FRAMES * 1000.0) / elapsed);
+	return 0;
+}
+
+int main(void) {
+	static uint8_t frame[BENCH_FRAME_SZ];
+	static char text[BENCH_RULES * 64];
+	struct slh_agent_rules rules;
+	unsigned int line = 0;
+	size_t off = 0;
+	unsigned int i;
+	int res = 1;
+
+	if (slh_agent_rules_init(&rules)) {
+		perror("slh_agent_rules_init");
+		return 1;
+	}
+
+	bench_fill(frame, 5683);
+	if (bench_run("none", &rules, frame, 0))
+		goto exit;
+
+	/*
+	 * A mix of rules, the first sending CoAP traffic ahead, the rest
+	 * matching nothing this frame carries.
+	 */
+	off += snprintf(&text[off], sizeof(text) - off,
+			"prio 3 type ipv6 nh 17 port 5683\n");
+	for (i = 1; i < BENCH_RULES; i++) {
+		switch (i % 4) {
+		case 0:
+			off += snprintf(&text[off], sizeof(text) - off,
+					"drop type 0x%04x\n", 0x9000 + i);
+			break;
+		case 1:
+			off += snprintf(&text[off], sizeof(text) - off,
+					"drop type ipv6 nh 6 dport %u\n",
+					1000 + i);
+			break;
+		case 2:
+			off += snprintf(&text[off], sizeof(text) - off,
+					"prio 1 dst 02:00:00:00:%02x:%02x\n",
+					i >> 8, i & 0xff);
+			break;
+		default:
+			off += snprintf(&text[off], sizeof(text) - off,
+					"drop type ipv6 tc 0x%02x/0xfc\n",
+					(i & 0x3f) << 2);
+			break;
+		}
+	}
+
+	if (slh_agent_rules_parse(&rules, text, &line)) {
+		fprintf(stderr, "bad rule at line %u\n", line);
+		goto exit;
+	}
+
+	if (bench_run("first", &rules, frame, 3))
+		goto exit;
+
+	bench_fill(frame, 5684);
+	if (bench_run("miss", &rules, frame, 0))
+		goto exit;
+
+	res = 0;
+
+exit:
+	slh_agent_rules_free(&rules);
+	return res;
+}
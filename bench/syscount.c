@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/* For syscall */
+#define _GNU_SOURCE
+
+#include "syscount.h"
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/*! System calls made by this thread */
+static _Thread_local unsigned long bench_syscall_count;
+
+unsigned long bench_syscalls(void) {
+	return bench_syscall_count;
+}
+
+ssize_t bench_raw_write(int fd, const void* buf, size_t len) {
+	return syscall(SYS_write, fd, buf, len);
+}
+
+ssize_t bench_raw_read(int fd, void* buf, size_t len) {
+	return syscall(SYS_read, fd, buf, len);
+}
+
+ssize_t read(int fd, void* buf, size_t len) {
+	bench_syscall_count++;
+	return syscall(SYS_read, fd, buf, len);
+}
+
+ssize_t write(int fd, const void* buf, size_t len) {
+	bench_syscall_count++;
+	return syscall(SYS_write, fd, buf, len);
+}
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) {
+	bench_syscall_count++;
+	return syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+}
+
+ssize_t send(int fd, const void* buf, size_t len, int flags) {
+	bench_syscall_count++;
+	return syscall(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+int epoll_wait(int epfd, struct epoll_event* events, int max,
+		int timeout) {
+	bench_syscall_count++;
+	/* Not every architecture has epoll_wait, all have epoll_pwait */
+	return syscall(SYS_epoll_pwait, epfd, events, max, timeout, NULL,
+			_NSIG / 8);
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_BENCH_SYSCOUNT_H
+#define _6LH_AGENT_BENCH_SYSCOUNT_H
+
+#include <sys/types.h>
+
+/*
+ * System call counting for the benchmarks.
+ *
+ * Linking syscount.c into a benchmark replaces the C library's read,
+ * write, recv, send and epoll_wait with versions that count each call
+ * made by the calling thread, then make the system call directly.  Only
+ * calls from our own code are counted, not those the C library makes
+ * internally (e.g. for stdio).
+ */
+
+/*!
+ * Return the number of system calls made by this thread so far.
+ */
+unsigned long bench_syscalls(void);
+
+/*!
+ * Write to a descriptor without counting the call, for benchmarks feeding
+ * data to the code under test.
+ */
+ssize_t bench_raw_write(int fd, const void* buf, size_t len);
+
+/*!
+ * Read from a descriptor without counting the call.
+ */
+ssize_t bench_raw_read(int fd, void* buf, size_t len);
+
+#endif
@@ -0,0 +1,610 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Bulk TCP benchmark: two agents, each with a real TAP interface in a
+ * network namespace of its own, with this program as the parent of both,
+ * passing each one's frames to the other.  A TCP connection is made from
+ * one namespace to the other across them, and BENCH_BYTES are sent down
+ * it, with and without offloads.  Each case reports MB/s, and the frames
+ * crossing each way and their average size.
+ *
+ * Needs CAP_NET_ADMIN and CAP_SYS_ADMIN; without them it says so and
+ * exits, so `make bench` carries on.
+ */
+
+#define _GNU_SOURCE
+#include "agent.h"
+#include "codec.h"
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+/*! Bytes sent down the connection per case */
+#define BENCH_BYTES	(128UL << 20)
+/*! Size of each write, and of each read */
+#define BENCH_CHUNK	(65536)
+/*! Agent MTU: the agent's counts the Ethernet header, the kernel's not */
+#define BENCH_MTU	(1514)
+/*! Window offered and accepted */
+#define BENCH_WINDOW	(32)
+/*! TCP port the receiver listens on */
+#define BENCH_PORT	(5001)
+/*! Longest wait for an agent, in milliseconds */
+#define BENCH_TIMEOUT	(5000)
+/*! Largest frame to or from an agent: type, sequence and payload */
+#define BENCH_FRAME_SZ	(2 + SLH_TAP_OFFLOAD_HDR_SZ + SLH_TAP_OFFLOAD_FRAME_MAX)
+/*! Frames held for an agent whose window is full */
+#define BENCH_PENDING	(4 * BENCH_WINDOW)
+
+/*!
+ * Benchmark case.
+ */
+struct bench_case {
+	const char* name;
+	/*! Offloads offered and accepted */
+	uint8_t offload;
+};
+
+static const struct bench_case bench_cases[] = {
+	{ .name = "plain",	.offload = 0 },
+	{ .name = "offload",	.offload = SLH_TAP_OFFLOAD_ALL },
+};
+
+#define BENCH_CASES	(sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+/*!
+ * One agent, its interface and its end of the connection, and the
+ * parent's dealings with it.
+ */
+struct bench_side {
+	struct slh_agent agent;
+	pthread_t thread;
+	/*! Parent's end of the control channel */
+	struct slh_agent_frame_ctx ctl;
+	/*! Interface name */
+	const char* name;
+	/*! Interface address */
+	const char* addr;
+	/*! Runs in a network namespace of its own */
+	_Bool isolate;
+	/*! Receives, rather than sends, the bytes */
+	_Bool receiver;
+	/*! Interface is up and its end of the connection is ready */
+	_Atomic uint8_t ready;
+	/*! Result of setting up and running the agent */
+	int res;
+	/*! Listening socket, on the receiving side */
+	int listen_fd;
+	/*! Thread at the connection's end */
+	pthread_t tcp_thread;
+	/*! Whether `tcp_thread` was started */
+	_Bool receiving;
+	/*! Whether the parent has answered the agent's SOH */
+	_Bool negotiated;
+	/*! Sequence number of the next frame we send the agent */
+	uint8_t next;
+	/*! Sequence number of the oldest frame the agent has not answered */
+	uint8_t base;
+	/*! Frames for the agent, waiting for room in its window */
+	uint8_t* pending;
+	/*! Size of each of those frames */
+	uint16_t pending_len[BENCH_PENDING];
+	/*! Slot of the oldest of them, and how many there are */
+	uint16_t pending_head;
+	uint16_t pending_count;
+	/*! Frames taken from the agent, and of those, RS frames */
+	unsigned long frames;
+	unsigned long offloaded;
+	/*! Size of those frames' payloads */
+	unsigned long long bytes;
+	/*! Frames we could not pass on, the other side not being ready */
+	unsigned long dropped;
+};
+
+/*! Set when the receiver has read everything, or given up */
+static _Atomic uint8_t bench_done;
+/*! When the sender connected, and the receiver finished, in ns */
+static uint64_t bench_started;
+static uint64_t bench_finished;
+/*! Bytes the receiver read */
+static unsigned long bench_received;
+
+/*!
+ * Return the monotonic clock in nanoseconds.
+ */
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*!
+ * Give an interface an IPv4 address on a /24, and the MTU the kernel
+ * should know it by.
+ */
+static int bench_configure(const char* name, const char* addr,
+		uint16_t mtu) {
+	struct ifreq ifr;
+	struct sockaddr_in* const sin = (struct sockaddr_in*)&ifr.ifr_addr;
+	int res = -1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	ifr.ifr_mtu = mtu;
+	if (ioctl(fd, SIOCSIFMTU, &ifr) < 0)
+		goto exit;
+
+	sin->sin_family = AF_INET;
+	inet_pton(AF_INET, addr, &sin->sin_addr);
+	if (ioctl(fd, SIOCSIFADDR, &ifr) < 0)
+		goto exit;
+
+	inet_pton(AF_INET, "255.255.255.0", &sin->sin_addr);
+	if (ioctl(fd, SIOCSIFNETMASK, &ifr) < 0)
+		goto exit;
+	res = 0;
+
+exit:
+	if (res < 0)
+		perror(name);
+	close(fd);
+	return res;
+}
+
+/*!
+ * Receiver thread: read from the first connection until it is closed.
+ */
+static void* bench_receive_main(void* arg) {
+	struct bench_side* const side = arg;
+	static uint8_t buf[BENCH_CHUNK];
+	ssize_t len;
+	int fd;
+
+	fd = accept(side->listen_fd, NULL, NULL);
+	if (fd >= 0) {
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+			bench_received += len;
+		close(fd);
+	}
+
+	bench_finished = bench_now();
+	atomic_store(&bench_done, true);
+	return NULL;
+}
+
+/*!
+ * Sender thread: connect to `arg`, and send BENCH_BYTES.
+ */
+static void* bench_send_main(void* arg) {
+	static uint8_t buf[BENCH_CHUNK];
+	struct sockaddr_in sin;
+	unsigned long sent = 0;
+	int fd;
+
+	memset(buf, 0x5a, sizeof(buf));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(BENCH_PORT);
+	inet_pton(AF_INET, arg, &sin.sin_addr);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	bench_started = bench_now();
+	if (connect(fd, (const struct sockaddr*)&sin, sizeof(sin)) < 0) {
+		perror("connect");
+	} else {
+		while (sent < BENCH_BYTES) {
+			ssize_t len = write(fd, buf, sizeof(buf));
+
+			if (len < 0) {
+				perror("write");
+				break;
+			}
+			sent += len;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+/*!
+ * Agent thread: move to a namespace of its own if asked, open the
+ * interface, set it up, and run the agent.  The receiving side also
+ * starts listening and a thread to take the bytes, inheriting the
+ * namespace.
+ */
+static void* bench_agent_main(void* arg) {
+	struct bench_side* const side = arg;
+	struct slh_agent* const agent = &side->agent;
+
+	if (side->isolate && (unshare(CLONE_NEWNET) < 0)) {
+		side->res = -errno;
+		goto exit;
+	}
+
+	side->res = slh_agent_tap_open(&agent->tap);
+	if (side->res < 0)
+		goto exit;
+
+	if (bench_configure(agent->tap.name, side->addr,
+				BENCH_MTU - 14) < 0) {
+		side->res = -EIO;
+		goto close;
+	}
+
+	if (side->receiver) {
+		struct sockaddr_in sin;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(BENCH_PORT);
+		side->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC,
+				0);
+		if ((side->listen_fd < 0)
+				|| (bind(side->listen_fd,
+						(const struct sockaddr*)&sin,
+						sizeof(sin)) < 0)
+				|| (listen(side->listen_fd, 1) < 0)) {
+			side->res = -EIO;
+			goto close;
+		}
+
+		if (pthread_create(&side->tcp_thread, NULL,
+					bench_receive_main, side)) {
+			side->res = -EIO;
+			goto close;
+		}
+		side->receiving = true;
+	}
+
+	side->res = slh_agent_init(agent);
+	if (side->res < 0)
+		goto close;
+
+	atomic_store(&side->ready, true);
+	side->res = slh_agent_run(agent);
+	slh_agent_free(agent);
+
+close:
+	if (side->receiving) {
+		/* Wake the receiver, if it never got a connection */
+		shutdown(side->listen_fd, SHUT_RDWR);
+		if (atomic_load(&bench_done))
+			pthread_join(side->tcp_thread, NULL);
+		else
+			/* Stuck on a connection going nowhere */
+			pthread_detach(side->tcp_thread);
+	}
+	if (side->listen_fd >= 0)
+		close(side->listen_fd);
+	slh_agent_tap_close(&agent->tap);
+exit:
+	if (side->res < 0)
+		atomic_store(&bench_done, true);
+	return NULL;
+}
+
+/*!
+ * Write a frame to an agent, flushing as needed to make room.
+ */
+static void bench_write(struct bench_side* const side, const uint8_t* frame,
+		uint16_t len) {
+	while (slh_agent_write_frame(&side->ctl,
+				(const struct slh_agent_frame*)frame, len)
+			== -EAGAIN) {
+		struct pollfd out = {
+			.fd = side->ctl.tx_fd,
+			.events = POLLOUT
+		};
+		poll(&out, 1, BENCH_TIMEOUT);
+		slh_agent_frame_flush(&side->ctl);
+	}
+}
+
+/*!
+ * Return true if the parent may send the agent another frame.
+ */
+static _Bool bench_has_space(const struct bench_side* const side) {
+	return (uint8_t)(side->next - side->base) < BENCH_WINDOW;
+}
+
+/*!
+ * Send an agent the frames held for it, as far as its window allows.
+ */
+static void bench_send_pending(struct bench_side* const side) {
+	while (side->pending_count && bench_has_space(side)) {
+		uint8_t* const frame = &side->pending[
+			(size_t)side->pending_head * BENCH_FRAME_SZ];
+
+		frame[1] = side->next++;
+		bench_write(side, frame,
+				side->pending_len[side->pending_head]);
+		side->pending_head = (side->pending_head + 1) % BENCH_PENDING;
+		side->pending_count--;
+	}
+}
+
+/*!
+ * Deal with a frame from one agent, passing Ethernet frames to the other.
+ * Frames are held until the other has room for them; if too many are
+ * held already, they are refused, as a busy link would lose them.
+ */
+static void bench_handle(struct bench_side* const from,
+		struct bench_side* const to, const uint8_t* frame, int len,
+		uint8_t offload) {
+	uint16_t slot;
+
+	uint8_t ack[] = {
+		ACK,
+		SLH_OPT_WINDOW, 1, BENCH_WINDOW,
+		SLH_OPT_OFFLOAD, 1, offload
+	};
+
+	switch (frame[0]) {
+	case SOH:
+		/* Take the window, and the offloads if asked to */
+		bench_write(from, ack, offload ? 7 : 4);
+		from->negotiated = true;
+		break;
+	case FS:
+	case RS:
+		if (len < 2)
+			break;
+		from->frames++;
+		from->bytes += len - 2;
+		if (frame[0] == RS)
+			from->offloaded++;
+
+		if (!to->negotiated || (to->pending_count == BENCH_PENDING)) {
+			bench_write(from, (const uint8_t[]){ NAK, frame[1] },
+					2);
+			from->dropped++;
+			break;
+		}
+		bench_write(from, (const uint8_t[]){ ACK, frame[1] }, 2);
+
+		slot = (to->pending_head + to->pending_count) % BENCH_PENDING;
+		memcpy(&to->pending[(size_t)slot * BENCH_FRAME_SZ], frame,
+				len);
+		to->pending_len[slot] = len;
+		to->pending_count++;
+		bench_send_pending(to);
+		break;
+	case ACK:
+	case NAK:
+		/* Each frame is answered in turn, so either moves us on */
+		if ((len > 1) && ((uint8_t)(frame[1] - from->base)
+					< (uint8_t)(from->next - from->base)))
+			from->base = frame[1] + 1;
+		bench_send_pending(from);
+		break;
+	}
+}
+
+/*!
+ * Set up one side's agent and control channel, and start its thread.
+ */
+static int bench_start(struct bench_side* const side, uint8_t offload) {
+	int ctl[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+
+	memset(&side->agent, 0, sizeof(side->agent));
+	strncpy(side->agent.tap.name, side->name, SLH_TAP_NAME_SZ - 1);
+	side->agent.tap.ops = &slh_agent_linuxtap_ops;
+	side->agent.tap.mtu = BENCH_MTU;
+	side->agent.tap.queues = 1;
+	side->agent.tap.offload = offload;
+	side->agent.window = BENCH_WINDOW;
+	side->agent.timeout = SLH_AGENT_WINDOW_DEFAULT_TIMEOUT;
+	side->agent.depth = SLH_AGENT_QUEUE_DEFAULT_DEPTH;
+	side->agent.policy = SLH_AGENT_QUEUE_DROP_TAIL;
+	side->agent.batch = SLH_AGENT_DEFAULT_BATCH;
+
+	if ((slh_agent_frame_init_packet(&side->agent.ctl, ctl[0],
+					4 * BENCH_FRAME_SZ) < 0)
+			|| (slh_agent_frame_init_packet(&side->ctl, ctl[1],
+					4 * BENCH_FRAME_SZ) < 0)
+			|| slh_agent_event_nonblock(ctl[1])
+			|| (slh_agent_rules_init(&side->agent.rules) < 0)) {
+		fprintf(stderr, "cannot set up control channel\n");
+		return -1;
+	}
+
+	atomic_store(&side->ready, false);
+	side->res = 0;
+	side->listen_fd = -1;
+	side->receiving = false;
+	side->negotiated = false;
+	side->next = 0;
+	side->base = 0;
+	side->pending_head = 0;
+	side->pending_count = 0;
+	side->frames = 0;
+	side->offloaded = 0;
+	side->bytes = 0;
+	side->dropped = 0;
+
+	if (pthread_create(&side->thread, NULL, bench_agent_main, side)) {
+		fprintf(stderr, "cannot start agent\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Tell an agent to exit, and clean up.
+ */
+static int bench_stop(struct bench_side* const side) {
+	bench_write(side, &(const uint8_t){ EOT }, 1);
+	slh_agent_frame_flush(&side->ctl);
+	pthread_join(side->thread, NULL);
+
+	slh_agent_rules_free(&side->agent.rules);
+	slh_agent_frame_free(&side->agent.ctl);
+	close(side->agent.ctl.rx_fd);
+	slh_agent_frame_free(&side->ctl);
+	close(side->ctl.rx_fd);
+	return side->res;
+}
+
+/*!
+ * Pass frames between the two agents until the receiver is done.
+ */
+static int bench_forward(struct bench_side* const sides, uint8_t offload) {
+	static uint8_t frame[BENCH_FRAME_SZ];
+	_Bool sending = false;
+	pthread_t sender;
+	unsigned int i;
+	int res = 0;
+
+	while (!atomic_load(&bench_done)) {
+		struct pollfd pfd[2];
+
+		if (!sending && atomic_load(&sides[0].ready)
+				&& atomic_load(&sides[1].ready)
+				&& sides[0].negotiated
+				&& sides[1].negotiated) {
+			if (pthread_create(&sender, NULL, bench_send_main,
+						(void*)sides[1].addr))
+				return -1;
+			sending = true;
+		}
+
+		for (i = 0; i < 2; i++) {
+			int len;
+
+			while ((len = slh_agent_read_frame(&sides[i].ctl,
+						(struct slh_agent_frame*)frame,
+						sizeof(frame))) > 0)
+				bench_handle(&sides[i], &sides[!i], frame,
+						len, offload);
+		}
+
+		/* Both may have been written to: send it all */
+		for (i = 0; i < 2; i++) {
+			while (slh_agent_frame_flush(&sides[i].ctl)
+					== -EAGAIN) {
+				struct pollfd out = {
+					.fd = sides[i].ctl.tx_fd,
+					.events = POLLOUT
+				};
+				poll(&out, 1, BENCH_TIMEOUT);
+			}
+
+			pfd[i].fd = sides[i].ctl.rx_fd;
+			pfd[i].events = POLLIN;
+		}
+
+		res = poll(pfd, 2, BENCH_TIMEOUT);
+		if (res <= 0) {
+			fprintf(stderr, "agents went quiet\n");
+			res = -ETIMEDOUT;
+			break;
+		}
+		res = 0;
+		for (i = 0; i < 2; i++)
+			if (pfd[i].revents)
+				sides[i].ctl.rx_ready = true;
+	}
+
+	if (sending)
+		pthread_join(sender, NULL);
+	return res;
+}
+
+int main(void) {
+	static struct bench_side sides[2] = {
+		{ .name = "slhbench0", .addr = "10.99.0.1" },
+		{ .name = "slhbench1", .addr = "10.99.0.2", .isolate = true,
+			.receiver = true },
+	};
+	unsigned int i;
+
+	/* Keep the host's network out of it */
+	if (unshare(CLONE_NEWNET) < 0) {
+		perror("bench/tcp: skipped, cannot make network namespaces");
+		return 0;
+	}
+
+	for (i = 0; i < 2; i++) {
+		sides[i].pending = malloc((size_t)BENCH_PENDING
+				* BENCH_FRAME_SZ);
+		if (!sides[i].pending) {
+			perror("malloc");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < BENCH_CASES; i++) {
+		const struct bench_case* const bc = &bench_cases[i];
+		uint64_t elapsed;
+		unsigned int s;
+		int res;
+
+		atomic_store(&bench_done, false);
+		bench_received = 0;
+		if (bench_start(&sides[0], bc->offload)
+				|| bench_start(&sides[1], bc->offload))
+			return 1;
+
+		res = bench_forward(sides, bc->offload);
+		for (s = 0; s < 2; s++) {
+			if (bench_stop(&sides[s]) < 0) {
+				fprintf(stderr, "%s: %s\n", sides[s].name,
+						strerror(-sides[s].res));
+				res = -1;
+			}
+		}
+		if (res < 0)
+			return 1;
+		if (bench_received != BENCH_BYTES)
+			fprintf(stderr, "%s: %lu of %lu bytes made it\n",
+					bc->name, bench_received, BENCH_BYTES);
+
+		elapsed = bench_finished - bench_started;
+		printf("tcp  %-6s %-7s %8.1f MB/s  there %7lu frames "
+				"%7.1f bytes/frame (%lu RS)  back %7lu frames "
+				"%7.1f bytes/frame (%lu RS)\n",
+				slh_agent_codec_impl(), bc->name,
+				((double)bench_received * 1000.0) / elapsed,
+				sides[0].frames,
+				(double)sides[0].bytes
+					/ (sides[0].frames ? sides[0].frames : 1),
+				sides[0].offloaded,
+				sides[1].frames,
+				(double)sides[1].bytes
+					/ (sides[1].frames ? sides[1].frames : 1),
+				sides[1].offloaded);
+		if (sides[0].dropped || sides[1].dropped)
+			fprintf(stderr, "%s: %lu frames dropped by the "
+					"parent\n", bc->name,
+					sides[0].dropped + sides[1].dropped);
+	}
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Transport benchmark: push frames from one thread to another through the
+ * frame API, once over a pipe (byte-stuffed) and once over a shared memory
+ * channel, and time how long it takes for all of them to arrive.
+ */
+
+/* For pipe2 */
+#define _GNU_SOURCE
+
+#include "frame.h"
+#include "codec.h"
+#include "shm.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! Frames sent per case */
+#define BENCH_FRAMES	(200000)
+/*! Frames written between flushes, as the agent does once per loop turn */
+#define BENCH_BATCH	(32)
+/*! Receive buffer, transmit buffer and ring size */
+#define BENCH_BUF_SZ	(65536)
+
+/*!
+ * Benchmark case: frame size in bytes.
+ */
+static const uint16_t bench_sizes[] = { 64, 1281 };
+
+/*!
+ * Writer thread arguments.
+ */
+struct bench_writer {
+	struct slh_agent_frame_ctx* ctx;
+	const uint8_t* frame;
+	uint16_t frame_sz;
+	/*! Events meaning "room to write" on ctx->tx_fd */
+	short tx_events;
+};
+
+/*!
+ * Return the monotonic clock in nanoseconds.
+ */
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*!
+ * Wait for an event on a descriptor.
+ */
+static void bench_wait(int fd, short events) {
+	struct pollfd pfd = { .fd = fd, .events = events };
+	poll(&pfd, 1, 100);
+}
+
+/*!
+ * Flush, waiting for the reader to take the data if need be: all of it,
+ * or enough to make room for another frame.
+ */
+static void bench_flush(struct bench_writer* const wr, _Bool all) {
+	int res;
+
+	while ((res = slh_agent_frame_flush(wr->ctx)) == -EAGAIN) {
+		if (!all && (slh_agent_frame_tx_space(wr->ctx)
+					>= slh_agent_frame_encoded_max(
+						wr->frame_sz)))
+			return;
+		bench_wait(wr->ctx->tx_fd, wr->tx_events);
+	}
+
+	if (res < 0) {
+		fprintf(stderr, "flush: %s\n", strerror(-res));
+		exit(1);
+	}
+}
+
+/*!
+ * Writer thread: send BENCH_FRAMES frames.
+ */
+static void* bench_writer_main(void* arg) {
+	struct bench_writer* const wr = arg;
+	unsigned int i;
+
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		while (slh_agent_write_frame(wr->ctx,
+					(const struct slh_agent_frame*)
+					wr->frame, wr->frame_sz) == -EAGAIN)
+			bench_flush(wr, false);
+
+		if (!((i + 1) % BENCH_BATCH))
+			bench_flush(wr, false);
+	}
+
+	bench_flush(wr, true);
+	return NULL;
+}
+
+/*!
+ * Receive BENCH_FRAMES frames on `rx` while a thread sends them on `tx`.
+ *
+ * @returns	Elapsed time in nanoseconds, or 0 on error.
+ */
+static uint64_t bench_run(struct slh_agent_frame_ctx* const rx,
+		struct bench_writer* const wr) {
+	static uint8_t decoded[UINT16_MAX];
+	pthread_t thread;
+	uint64_t start = bench_now();
+	unsigned int got = 0;
+
+	if (pthread_create(&thread, NULL, bench_writer_main, wr))
+		return 0;
+
+	while (got < BENCH_FRAMES) {
+		int len = slh_agent_read_frame(rx,
+				(struct slh_agent_frame*)decoded,
+				sizeof(decoded));
+		if (len == 0) {
+			bench_wait(rx->rx_fd, POLLIN);
+			rx->rx_ready = true;
+		} else if (len != wr->frame_sz) {
+			fprintf(stderr, "read returned %d\n", len);
+			exit(1);
+		} else {
+			got++;
+		}
+	}
+
+	pthread_join(thread, NULL);
+	if (memcmp(decoded, wr->frame, wr->frame_sz)) {
+		fprintf(stderr, "frame mismatch\n");
+		exit(1);
+	}
+	return bench_now() - start;
+}
+
+/*!
+ * Print the result of a case.
+ */
+static void bench_report(const char* name, uint16_t frame_sz,
+		uint64_t elapsed) {
+	printf("transport %-4s %5u bytes %8.1f ns/frame %8.1f MB/s\n",
+			name, frame_sz, (double)elapsed / BENCH_FRAMES,
+			((double)BENCH_FRAMES * frame_sz * 1000.0)
+				/ elapsed);
+}
+
+/*!
+ * Time a case over a pipe.
+ */
+static int bench_pipe(struct bench_writer* const wr) {
+	struct slh_agent_frame_ctx rx, tx;
+	uint64_t elapsed;
+	int fds[2];
+
+	if (pipe2(fds, O_NONBLOCK) < 0) {
+		perror("pipe2");
+		return -1;
+	}
+
+	if (slh_agent_frame_init(&rx, fds[0], -1, BENCH_BUF_SZ, 4096)
+			|| slh_agent_frame_init(&tx, -1, fds[1], 4096,
+				BENCH_BUF_SZ)) {
+		perror("slh_agent_frame_init");
+		return -1;
+	}
+
+	wr->ctx = &tx;
+	wr->tx_events = POLLOUT;
+	elapsed = bench_run(&rx, wr);
+	if (elapsed)
+		bench_report("pipe", wr->frame_sz, elapsed);
+
+	slh_agent_frame_free(&tx);
+	slh_agent_frame_free(&rx);
+	close(fds[0]);
+	close(fds[1]);
+	return elapsed ? 0 : -1;
+}
+
+/*!
+ * Time a case over shared memory.
+ */
+static int bench_shm(struct bench_writer* const wr) {
+	struct slh_agent_frame_ctx rx, tx;
+	struct slh_agent_shm_fds fds;
+	uint64_t elapsed;
+	int res;
+
+	res = slh_agent_shm_create(&fds, BENCH_BUF_SZ);
+	if (res < 0) {
+		fprintf(stderr, "slh_agent_shm_create: %s\n",
+				strerror(-res));
+		return -1;
+	}
+
+	if (slh_agent_frame_init_shm(&rx, &fds, false)
+			|| slh_agent_frame_init_shm(&tx, &fds, true)) {
+		fprintf(stderr, "slh_agent_frame_init_shm failed\n");
+		return -1;
+	}
+
+	wr->ctx = &tx;
+	wr->tx_events = POLLIN;
+	elapsed = bench_run(&rx, wr);
+	if (elapsed)
+		bench_report("shm", wr->frame_sz, elapsed);
+
+	slh_agent_frame_free(&tx);
+	slh_agent_frame_free(&rx);
+	slh_agent_shm_close(&fds);
+	return elapsed ? 0 : -1;
+}
+
+int main(void) {
+	static uint8_t frame[UINT16_MAX];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(frame); i++)
+		/* Mostly ordinary bytes, with the odd one needing escape */
+		frame[i] = (i % 97) ? (0x20 + (i % 0xc0)) : DLE;
+	frame[0] = FS;
+
+	for (i = 0; i < (sizeof(bench_sizes) / sizeof(bench_sizes[0]));
+			i++) {
+		struct bench_writer wr = {
+			.frame = frame,
+			.frame_sz = bench_sizes[i],
+		};
+
+		if (bench_pipe(&wr) || bench_shm(&wr))
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,356 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* pcapng block types */
+#define SLH_AGENT_PCAPNG_SHB		(0x0a0d0d0a)
+#define SLH_AGENT_PCAPNG_IDB		(0x00000001)
+#define SLH_AGENT_PCAPNG_ISB		(0x00000005)
+#define SLH_AGENT_PCAPNG_EPB		(0x00000006)
+
+/* pcapng options */
+#define SLH_AGENT_PCAPNG_OPT_END	(0)
+#define SLH_AGENT_PCAPNG_IF_NAME	(2)
+#define SLH_AGENT_PCAPNG_IF_TSRESOL	(9)
+#define SLH_AGENT_PCAPNG_EPB_FLAGS	(2)
+#define SLH_AGENT_PCAPNG_ISB_OSDROP	(7)
+
+/*! Byte order magic: read back swapped if the reader's order differs */
+#define SLH_AGENT_PCAPNG_MAGIC		(0x1a2b3c4d)
+/*! Ethernet link type */
+#define SLH_AGENT_PCAPNG_ETHERNET	(1)
+
+/*! Round up to the 32-bit boundary pcapng pads everything to */
+#define SLH_AGENT_PCAPNG_PAD(len)	(((len) + 3) & ~3U)
+
+/*! Size of an EPB block with `len` bytes of frame and the flags option */
+#define SLH_AGENT_PCAPNG_EPB_SZ(len)	(44 + SLH_AGENT_PCAPNG_PAD(len))
+/*! Size of an ISB block with the drop count option */
+#define SLH_AGENT_PCAPNG_ISB_SZ		(40)
+
+/*!
+ * Add bytes to the writer's output buffer, which must have room.
+ */
+static void slh_agent_capture_put(struct slh_agent_capture* const cap,
+		const void* data, uint32_t len) {
+	memcpy(cap->out + cap->out_len, data, len);
+	cap->out_len += len;
+}
+
+/*!
+ * Add a 32-bit value to the writer's output buffer.
+ */
+static void slh_agent_capture_put32(struct slh_agent_capture* const cap,
+		uint32_t value) {
+	slh_agent_capture_put(cap, &value, sizeof(value));
+}
+
+/*!
+ * Add an option, padded, to the writer's output buffer.
+ */
+static void slh_agent_capture_put_opt(struct slh_agent_capture* const cap,
+		uint16_t code, const void* value, uint16_t len) {
+	const uint16_t hdr[2] = { code, len };
+	const uint32_t zero = 0;
+
+	slh_agent_capture_put(cap, hdr, sizeof(hdr));
+	slh_agent_capture_put(cap, value, len);
+	slh_agent_capture_put(cap, &zero, SLH_AGENT_PCAPNG_PAD(len) - len);
+}
+
+/*!
+ * Write out the writer's output buffer.  After an error, output is
+ * discarded.
+ */
+static void slh_agent_capture_flush(struct slh_agent_capture* const cap) {
+	uint32_t off = 0;
+
+	while (!cap->res && (off < cap->out_len)) {
+		ssize_t len = write(cap->fd, cap->out + off,
+				cap->out_len - off);
+		if (len < 0) {
+			if (errno != EINTR)
+				cap->res = -errno;
+			continue;
+		}
+		off += len;
+	}
+	cap->out_len = 0;
+}
+
+/*!
+ * Make room for `len` bytes in the writer's output buffer.
+ */
+static void slh_agent_capture_reserve(struct slh_agent_capture* const cap,
+		uint32_t len) {
+	if ((cap->out_len + len) > SLH_AGENT_CAPTURE_BUF_SZ)
+		slh_agent_capture_flush(cap);
+}
+
+/*!
+ * Add the section header and interface description.
+ */
+static void slh_agent_capture_put_header(struct slh_agent_capture* const cap,
+		const struct slh_agent_tap_ctx* const tap) {
+	const uint16_t name_len = strnlen(tap->name, SLH_TAP_NAME_SZ);
+	const uint8_t tsresol = 9;
+	const uint64_t section_len = UINT64_MAX;
+	const uint16_t version[2] = { 1, 0 };
+	const uint16_t link[2] = { SLH_AGENT_PCAPNG_ETHERNET, 0 };
+	const uint32_t idb_sz = 20 + (4 + SLH_AGENT_PCAPNG_PAD(name_len))
+		+ (4 + 4) + 4;
+
+	/* Section header, length unknown */
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_SHB);
+	slh_agent_capture_put32(cap, 28);
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_MAGIC);
+	slh_agent_capture_put(cap, version, sizeof(version));
+	slh_agent_capture_put(cap, &section_len, sizeof(section_len));
+	slh_agent_capture_put32(cap, 28);
+
+	/* The interface, with nanosecond timestamps */
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_IDB);
+	slh_agent_capture_put32(cap, idb_sz);
+	slh_agent_capture_put(cap, link, sizeof(link));
+	slh_agent_capture_put32(cap, cap->slot_sz);
+	slh_agent_capture_put_opt(cap, SLH_AGENT_PCAPNG_IF_NAME,
+			tap->name, name_len);
+	slh_agent_capture_put_opt(cap, SLH_AGENT_PCAPNG_IF_TSRESOL,
+			&tsresol, sizeof(tsresol));
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_OPT_END);
+	slh_agent_capture_put32(cap, idb_sz);
+}
+
+/*!
+ * Add a packet block for the frame in `slot`.
+ */
+static void slh_agent_capture_put_frame(struct slh_agent_capture* const cap,
+		uint32_t slot) {
+	const struct slh_agent_capture_rec* const rec = &cap->rec[slot];
+	const uint16_t caplen = (rec->len > cap->slot_sz)
+		? cap->slot_sz : rec->len;
+	const uint32_t sz = SLH_AGENT_PCAPNG_EPB_SZ(caplen);
+	const uint32_t flags = rec->dir;
+	const uint32_t zero = 0;
+
+	slh_agent_capture_reserve(cap, sz);
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_EPB);
+	slh_agent_capture_put32(cap, sz);
+	slh_agent_capture_put32(cap, 0);
+	slh_agent_capture_put32(cap, rec->ts >> 32);
+	slh_agent_capture_put32(cap, rec->ts);
+	slh_agent_capture_put32(cap, caplen);
+	slh_agent_capture_put32(cap, rec->len);
+	slh_agent_capture_put(cap, &cap->buffer[(size_t)slot * cap->slot_sz],
+			caplen);
+	slh_agent_capture_put(cap, &zero,
+			SLH_AGENT_PCAPNG_PAD(caplen) - caplen);
+	slh_agent_capture_put_opt(cap, SLH_AGENT_PCAPNG_EPB_FLAGS,
+			&flags, sizeof(flags));
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_OPT_END);
+	slh_agent_capture_put32(cap, sz);
+}
+
+/*!
+ * Add the interface statistics: the frames dropped with the ring full.
+ */
+static void slh_agent_capture_put_stats(struct slh_agent_capture* const cap,
+		uint64_t now) {
+	slh_agent_capture_reserve(cap, SLH_AGENT_PCAPNG_ISB_SZ);
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_ISB);
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_ISB_SZ);
+	slh_agent_capture_put32(cap, 0);
+	slh_agent_capture_put32(cap, now >> 32);
+	slh_agent_capture_put32(cap, now);
+	slh_agent_capture_put_opt(cap, SLH_AGENT_PCAPNG_ISB_OSDROP,
+			&cap->dropped, sizeof(cap->dropped));
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_OPT_END);
+	slh_agent_capture_put32(cap, SLH_AGENT_PCAPNG_ISB_SZ);
+}
+
+/*!
+ * Return the time of day in nanoseconds.
+ */
+static uint64_t slh_agent_capture_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*!
+ * Writer thread: write out frames until told to stop.
+ */
+static void* slh_agent_capture_main(void* arg) {
+	struct slh_agent_capture* const cap = arg;
+	uint32_t tail = atomic_load(&cap->tail);
+
+	while (1) {
+		uint64_t count;
+
+		if (tail != atomic_load(&cap->head)) {
+			slh_agent_capture_put_frame(cap,
+					tail % SLH_AGENT_CAPTURE_SLOTS);
+			atomic_store(&cap->tail, ++tail);
+			continue;
+		}
+
+		/* Caught up: write out what we have, then wait for more */
+		slh_agent_capture_flush(cap);
+		if (atomic_load(&cap->stop))
+			break;
+
+		/*
+		 * Announce we're going to sleep, then check nothing slipped
+		 * in before the main thread could see the announcement.
+		 */
+		atomic_store(&cap->waiting, true);
+		if (tail != atomic_load(&cap->head)) {
+			atomic_store(&cap->waiting, false);
+			continue;
+		}
+
+		if (read(cap->wake_fd, &count, sizeof(count)) < 0) {
+			/* Woken all the same */
+		}
+	}
+
+	return NULL;
+}
+
+int slh_agent_capture_open(struct slh_agent_capture* const cap,
+		const char* path, const struct slh_agent_tap_ctx* const tap) {
+	sigset_t all, old;
+	int res;
+
+	cap->slot_sz = tap->mtu;
+	cap->dropped = 0;
+	cap->res = 0;
+	cap->out_len = 0;
+	atomic_init(&cap->head, 0);
+	atomic_init(&cap->tail, 0);
+	atomic_init(&cap->waiting, false);
+	atomic_init(&cap->stop, false);
+
+	cap->buffer = malloc((size_t)SLH_AGENT_CAPTURE_SLOTS * cap->slot_sz);
+	if (!cap->buffer)
+		return -ENOMEM;
+
+	cap->rec = calloc(SLH_AGENT_CAPTURE_SLOTS, sizeof(*cap->rec));
+	if (!cap->rec) {
+		res = -ENOMEM;
+		goto freebuf;
+	}
+
+	cap->out = malloc(SLH_AGENT_CAPTURE_BUF_SZ);
+	if (!cap->out) {
+		res = -ENOMEM;
+		goto freerec;
+	}
+
+	/* The writer blocks on this one */
+	cap->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (cap->wake_fd < 0) {
+		res = -errno;
+		goto freeout;
+	}
+
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (cap->fd < 0) {
+		res = -errno;
+		goto closewake;
+	}
+
+	slh_agent_capture_put_header(cap, tap);
+	slh_agent_capture_flush(cap);
+	res = cap->res;
+	if (res < 0)
+		goto closefile;
+
+	/* Signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	res = -pthread_create(&cap->thread, NULL,
+			slh_agent_capture_main, cap);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (res < 0)
+		goto closefile;
+
+	return 0;
+
+closefile:
+	close(cap->fd);
+closewake:
+	close(cap->wake_fd);
+freeout:
+	free(cap->out);
+freerec:
+	free(cap->rec);
+freebuf:
+	free(cap->buffer);
+	return res;
+}
+
+void slh_agent_capture_frame(struct slh_agent_capture* const cap,
+		uint8_t dir, const uint8_t* frame, uint16_t len) {
+	/* Sole writer of head, so no need for ordering on our own load */
+	const uint32_t head = atomic_load_explicit(&cap->head,
+			memory_order_relaxed);
+	const uint32_t slot = head % SLH_AGENT_CAPTURE_SLOTS;
+	struct slh_agent_capture_rec* const rec = &cap->rec[slot];
+
+	if ((head - atomic_load(&cap->tail)) >= SLH_AGENT_CAPTURE_SLOTS) {
+		/* The writer is behind: lose this one rather than wait */
+		cap->dropped++;
+		return;
+	}
+
+	rec->ts = slh_agent_capture_now();
+	rec->len = len;
+	rec->dir = dir;
+	memcpy(&cap->buffer[(size_t)slot * cap->slot_sz], frame,
+			(len > cap->slot_sz) ? cap->slot_sz : len);
+	atomic_store(&cap->head, head + 1);
+
+	/* Wake the writer if it's asleep */
+	if (atomic_exchange(&cap->waiting, false)) {
+		const uint64_t one = 1;
+		if (write(cap->wake_fd, &one, sizeof(one)) < 0) {
+			/* The writer will catch up when next woken */
+		}
+	}
+}
+
+int slh_agent_capture_close(struct slh_agent_capture* const cap) {
+	const uint64_t one = 1;
+	int res;
+
+	atomic_store(&cap->stop, true);
+	if (write(cap->wake_fd, &one, sizeof(one)) < 0) {
+		/* It can't be asleep for long: the eventfd never fills */
+	}
+	pthread_join(cap->thread, NULL);
+
+	/* Writer gone, the rest is ours */
+	slh_agent_capture_put_stats(cap, slh_agent_capture_now());
+	slh_agent_capture_flush(cap);
+	res = cap->res;
+
+	if ((close(cap->fd) < 0) && !res)
+		res = -errno;
+	close(cap->wake_fd);
+	free(cap->out);
+	free(cap->rec);
+	free(cap->buffer);
+	return res;
+}
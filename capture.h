@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_CAPTURE_H
+#define _6LH_AGENT_CAPTURE_H
+
+#include "tap.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Frame capture.
+ *
+ * Every Ethernet frame read from or written to the interface can be
+ * written to a pcapng file, timestamped to the nanosecond and flagged with
+ * its direction.  The main thread only copies each frame into a
+ * single-producer, single-consumer ring; a writer thread formats them and
+ * writes the file in chunks of up to SLH_AGENT_CAPTURE_BUF_SZ bytes.  As
+ * with the TAP queue workers, the main thread only signals the writer's
+ * eventfd when the writer has said it is about to sleep.  When the ring is
+ * full, frames are dropped and counted rather than waited for.
+ */
+
+#ifndef SLH_AGENT_CAPTURE_SLOTS
+/*! Number of frames buffered between the main thread and the writer */
+#define SLH_AGENT_CAPTURE_SLOTS		(1024)
+#endif
+
+#ifndef SLH_AGENT_CAPTURE_BUF_SZ
+/*! Most the writer writes to the file at once */
+#define SLH_AGENT_CAPTURE_BUF_SZ	(262144)
+#endif
+
+/*
+ * Direction of a captured frame.  As pcapng's epb_flags has it, seen from
+ * the host: frames the agent reads from the interface were sent by the
+ * host, those it writes are received.
+ */
+/*! Read from the interface, on its way to the parent */
+#define SLH_AGENT_CAPTURE_UP		(2)
+/*! From the parent, written to the interface */
+#define SLH_AGENT_CAPTURE_DOWN		(1)
+
+/*!
+ * Frame waiting in the ring.
+ */
+struct slh_agent_capture_rec {
+	/*! Time the frame was seen, in nanoseconds since the epoch */
+	uint64_t ts;
+	/*! Size of the frame */
+	uint16_t len;
+	/*! SLH_AGENT_CAPTURE_UP or SLH_AGENT_CAPTURE_DOWN */
+	uint8_t dir;
+};
+
+/*!
+ * Capture context
+ */
+struct slh_agent_capture {
+	/*! Capture file */
+	int fd;
+	/*! Writer thread */
+	pthread_t thread;
+	/*! eventfd the writer sleeps on */
+	int wake_fd;
+	/*! Frame storage, SLH_AGENT_CAPTURE_SLOTS slots of `slot_sz` bytes */
+	uint8_t* buffer;
+	/*! Details of the frame in each slot */
+	struct slh_agent_capture_rec* rec;
+	/*! Size of each slot; longer frames are cut short */
+	uint16_t slot_sz;
+	/*! Next slot to be filled, written by the main thread */
+	_Atomic uint32_t head;
+	/*! Next slot to be written out, written by the writer */
+	_Atomic uint32_t tail;
+	/*! Writer is waiting to be woken */
+	_Atomic uint8_t waiting;
+	/*! Writer should exit once the ring is empty */
+	_Atomic uint8_t stop;
+	/*! Frames dropped with the ring full; main thread only */
+	uint64_t dropped;
+	/*! First error writing the file; nothing more is written after it */
+	int res;
+	/*! Output buffer of the writer */
+	uint8_t* out;
+	/*! Bytes waiting in `out` */
+	uint32_t out_len;
+};
+
+/*!
+ * Create a capture file, write its header describing the interface, and
+ * start the writer thread.
+ *
+ * @param[out]		cap	Capture context
+ * @param[in]		path	File to create, replacing any already there
+ * @param[in]		tap	Interface, already open
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_capture_open(struct slh_agent_capture* const cap,
+		const char* path, const struct slh_agent_tap_ctx* const tap);
+
+/*!
+ * Hand a frame to the writer.  Called from the main thread only; never
+ * blocks.
+ *
+ * @param[inout]	cap	Capture context
+ * @param[in]		dir	SLH_AGENT_CAPTURE_UP or SLH_AGENT_CAPTURE_DOWN
+ * @param[in]		frame	Ethernet frame
+ * @param[in]		len	Size of the frame
+ */
+void slh_agent_capture_frame(struct slh_agent_capture* const cap,
+		uint8_t dir, const uint8_t* frame, uint16_t len);
+
+/*!
+ * Write out the frames still in the ring and the count of those dropped,
+ * stop the writer and close the file.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error writing the file
+ */
+int slh_agent_capture_close(struct slh_agent_capture* const cap);
+
+#endif
@@ -0,0 +1,329 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "codec.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+
+#if !defined(SLH_AGENT_CODEC_NO_SIMD) && defined(__GNUC__) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#define SLH_AGENT_CODEC_X86
+#include <immintrin.h>
+#endif
+
+/*!
+ * Scanning function: returns the offset of the first byte needing escape.
+ */
+typedef size_t (*slh_agent_codec_span_fn)(const uint8_t* buf, size_t len);
+
+/*!
+ * Scanning function in use, chosen on first use.
+ */
+static slh_agent_codec_span_fn slh_agent_codec_span_impl = NULL;
+
+/*!
+ * Name of the scanning function in use.
+ */
+static const char* slh_agent_codec_span_name = NULL;
+
+/*!
+ * Return the byte sent after DLE in place of a special byte.
+ */
+static inline uint8_t slh_agent_codec_escaped(uint8_t byte) {
+	switch (byte) {
+	case STX:
+		return E_STX;
+	case ETX:
+		return E_ETX;
+	default:
+		return E_DLE;
+	}
+}
+
+/*!
+ * Portable scanning function, one byte at a time.
+ */
+static size_t slh_agent_codec_span_scalar(const uint8_t* buf, size_t len) {
+	size_t off;
+
+	for (off = 0; off < len; off++) {
+		if (slh_agent_codec_special(buf[off]))
+			break;
+	}
+	return off;
+}
+
+#ifdef SLH_AGENT_CODEC_X86
+/*!
+ * SSE2 scanning function, 16 bytes at a time.
+ */
+__attribute__((target("sse2")))
+static size_t slh_agent_codec_span_sse2(const uint8_t* buf, size_t len) {
+	const __m128i stx = _mm_set1_epi8(STX);
+	const __m128i etx = _mm_set1_epi8(ETX);
+	const __m128i dle = _mm_set1_epi8(DLE);
+	size_t off = 0;
+
+	while ((len - off) >= sizeof(__m128i)) {
+		const __m128i v = _mm_loadu_si128(
+				(const __m128i*)(buf + off));
+		const __m128i hit = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, stx),
+					_mm_cmpeq_epi8(v, etx)),
+				_mm_cmpeq_epi8(v, dle));
+		const unsigned int mask = _mm_movemask_epi8(hit);
+
+		if (mask)
+			return off + __builtin_ctz(mask);
+		off += sizeof(__m128i);
+	}
+
+	return off + slh_agent_codec_span_scalar(buf + off, len - off);
+}
+
+/*!
+ * AVX2 scanning function, 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static size_t slh_agent_codec_span_avx2(const uint8_t* buf, size_t len) {
+	const __m256i stx = _mm256_set1_epi8(STX);
+	const __m256i etx = _mm256_set1_epi8(ETX);
+	const __m256i dle = _mm256_set1_epi8(DLE);
+	size_t off = 0;
+
+	while ((len - off) >= sizeof(__m256i)) {
+		const __m256i v = _mm256_loadu_si256(
+				(const __m256i*)(buf + off));
+		const __m256i hit = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, stx),
+					_mm256_cmpeq_epi8(v, etx)),
+				_mm256_cmpeq_epi8(v, dle));
+		const unsigned int mask = _mm256_movemask_epi8(hit);
+
+		if (mask)
+			return off + __builtin_ctz(mask);
+		off += sizeof(__m256i);
+	}
+
+	/*
+	 * Finish off the last partial vector 16 bytes at a time here rather
+	 * than calling the SSE2 code: mixing legacy SSE instructions with
+	 * live 256-bit state is very slow on some CPUs.
+	 */
+	if ((len - off) >= sizeof(__m128i)) {
+		const __m128i v = _mm_loadu_si128(
+				(const __m128i*)(buf + off));
+		const __m128i hit = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v,
+						_mm256_castsi256_si128(stx)),
+					_mm_cmpeq_epi8(v,
+						_mm256_castsi256_si128(etx))),
+				_mm_cmpeq_epi8(v,
+					_mm256_castsi256_si128(dle)));
+		const unsigned int mask = _mm_movemask_epi8(hit);
+
+		if (mask)
+			return off + __builtin_ctz(mask);
+		off += sizeof(__m128i);
+	}
+
+	_mm256_zeroupper();
+	return off + slh_agent_codec_span_scalar(buf + off, len - off);
+}
+#endif
+
+/*!
+ * Choose the fastest scanning function this CPU supports.
+ */
+static void slh_agent_codec_select(void) {
+#ifdef SLH_AGENT_CODEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		slh_agent_codec_span_name = "avx2";
+		slh_agent_codec_span_impl = slh_agent_codec_span_avx2;
+		return;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		slh_agent_codec_span_name = "sse2";
+		slh_agent_codec_span_impl = slh_agent_codec_span_sse2;
+		return;
+	}
+#endif
+	slh_agent_codec_span_name = "scalar";
+	slh_agent_codec_span_impl = slh_agent_codec_span_scalar;
+}
+
+/*!
+ * Check up to `lookahead` bytes one at a time, then scan the rest a vector
+ * at a time.  `*scanned` is set to the length found by the vector scan, or
+ * left alone if there was none.
+ */
+static inline size_t slh_agent_codec_span_from(const uint8_t* buf,
+		size_t len, size_t lookahead, size_t* const scanned) {
+	size_t off;
+
+	for (off = 0; off < len; off++) {
+		if (off == lookahead) {
+			if (!slh_agent_codec_span_impl)
+				slh_agent_codec_select();
+			*scanned = slh_agent_codec_span_impl(buf + off,
+					len - off);
+			return off + *scanned;
+		}
+		if (slh_agent_codec_special(buf[off]))
+			break;
+	}
+	return off;
+}
+
+size_t slh_agent_codec_span(const uint8_t* buf, size_t len) {
+	size_t scanned;
+
+	/*
+	 * Special bytes tend to come in clusters, where short runs are
+	 * cheaper to check one byte at a time than to start a vector scan
+	 * for.
+	 */
+	return slh_agent_codec_span_from(buf, len,
+			SLH_AGENT_CODEC_LOOKAHEAD, &scanned);
+}
+
+size_t slh_agent_codec_span_next(struct slh_agent_codec_scan* const scan,
+		const uint8_t* buf, size_t len) {
+	const size_t lookahead =
+		(scan->short_spans < SLH_AGENT_CODEC_SHORT_SPANS)
+		? SLH_AGENT_CODEC_LOOKAHEAD : SLH_AGENT_CODEC_DENSE_LOOKAHEAD;
+	size_t scanned = len;
+	size_t run = slh_agent_codec_span_from(buf, len, lookahead,
+			&scanned);
+
+	if (scanned == len) {
+		/* No vector scan, nothing learned */
+	} else if (scanned < SLH_AGENT_CODEC_LOOKAHEAD) {
+		/* Stopped short: one more and the scan goes by hand */
+		if (scan->short_spans < SLH_AGENT_CODEC_SHORT_SPANS)
+			scan->short_spans++;
+	} else {
+		/* A run worth scanning for, back to vectors */
+		scan->short_spans = 0;
+	}
+	return run;
+}
+
+size_t slh_agent_codec_escape(uint8_t* dst, size_t dst_sz,
+		const uint8_t* src, size_t src_sz, size_t* consumed) {
+	struct slh_agent_codec_scan scan = SLH_AGENT_CODEC_SCAN_INIT;
+	size_t in = 0;
+	size_t out = 0;
+
+	while (in < src_sz) {
+		/* Copy the run of ordinary bytes, as much as will fit */
+		size_t run = src_sz - in;
+		if (run > (dst_sz - out))
+			run = dst_sz - out;
+
+		run = slh_agent_codec_span_next(&scan, src + in, run);
+		memcpy(dst + out, src + in, run);
+		in += run;
+		out += run;
+
+		/* Stop if done, or no room for an escape sequence */
+		if ((in == src_sz) || ((dst_sz - out) < 2))
+			break;
+
+		/* Escape the special byte that ended the run */
+		dst[out] = DLE;
+		dst[out + 1] = slh_agent_codec_escaped(src[in]);
+		out += 2;
+		in++;
+	}
+
+	*consumed = in;
+	return out;
+}
+
+size_t slh_agent_codec_cobs_encode(uint8_t* dst,
+		const uint8_t* src, size_t src_sz) {
+	size_t out = 0;
+
+	while (1) {
+		/* Take bytes up to the next zero, or a full block */
+		size_t limit = src_sz;
+		size_t code = out;
+		size_t run;
+
+		if (limit > SLH_AGENT_CODEC_COBS_BLOCK)
+			limit = SLH_AGENT_CODEC_COBS_BLOCK;
+		out++;
+
+		/* As with escapes, short runs are cheaper checked by hand */
+		for (run = 0; run < limit; run++) {
+			if (run == SLH_AGENT_CODEC_LOOKAHEAD) {
+				const uint8_t* zero = memchr(src + run, 0,
+						limit - run);
+				size_t rest = (zero ? (size_t)(zero - src)
+						: limit) - run;
+
+				memcpy(dst + out, src + run, rest);
+				out += rest;
+				run += rest;
+				break;
+			}
+			if (!src[run])
+				break;
+			dst[out] = src[run];
+			out++;
+		}
+
+		dst[code] = run + 1;
+		src += run;
+		src_sz -= run;
+
+		if (run < SLH_AGENT_CODEC_COBS_BLOCK) {
+			/* Stopped at a zero, or the end which stands for one */
+			if (!src_sz)
+				break;
+			src++;
+			src_sz--;
+		} else if (!src_sz) {
+			/* Ended on a full block, nothing left out */
+			break;
+		}
+	}
+
+	return out;
+}
+
+const char* slh_agent_codec_impl(void) {
+	if (!slh_agent_codec_span_impl)
+		slh_agent_codec_select();
+	return slh_agent_codec_span_name;
+}
+
+int slh_agent_codec_use(const char* name) {
+	if (!name) {
+		slh_agent_codec_select();
+		return 0;
+	}
+	if (!strcmp(name, "scalar")) {
+		slh_agent_codec_span_name = "scalar";
+		slh_agent_codec_span_impl = slh_agent_codec_span_scalar;
+		return 0;
+	}
+#ifdef SLH_AGENT_CODEC_X86
+	__builtin_cpu_init();
+	if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+		slh_agent_codec_span_name = "avx2";
+		slh_agent_codec_span_impl = slh_agent_codec_span_avx2;
+		return 0;
+	}
+	if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+		slh_agent_codec_span_name = "sse2";
+		slh_agent_codec_span_impl = slh_agent_codec_span_sse2;
+		return 0;
+	}
+#endif
+	return -ENOTSUP;
+}
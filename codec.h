@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_CODEC_H
+#define _6LH_AGENT_CODEC_H
+
+#include "frame.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte-stuffing primitives.
+ *
+ * Frame payloads are mostly runs of bytes which pass through unchanged,
+ * broken up by the occasional STX, ETX or DLE which must be escaped.  The
+ * codec finds the next such byte a whole vector at a time (using SSE2 or
+ * AVX2 where the CPU has it, chosen at run time) so that the runs between
+ * them can be copied in bulk.  Define SLH_AGENT_CODEC_NO_SIMD to build the
+ * portable code only.
+ */
+
+#ifndef SLH_AGENT_CODEC_LOOKAHEAD
+/*! Bytes checked one at a time before scanning a vector at a time */
+#define SLH_AGENT_CODEC_LOOKAHEAD	(8)
+#endif
+
+#ifndef SLH_AGENT_CODEC_SHORT_SPANS
+/*! Short vector scans in a row after which data counts as dense */
+#define SLH_AGENT_CODEC_SHORT_SPANS	(4)
+#endif
+
+#ifndef SLH_AGENT_CODEC_DENSE_LOOKAHEAD
+/*! Bytes checked one at a time where special bytes are dense */
+#define SLH_AGENT_CODEC_DENSE_LOOKAHEAD	(32)
+#endif
+
+/*!
+ * Scanning state, carried from one span to the next through a frame.
+ *
+ * Where special bytes are dense, a vector scan mostly stops within a few
+ * bytes, and costs more to start than it saves.  After
+ * SLH_AGENT_CODEC_SHORT_SPANS such scans in a row, the lookahead is
+ * stretched to SLH_AGENT_CODEC_DENSE_LOOKAHEAD bytes, until a run long
+ * enough to be worth a vector scan turns up again.
+ */
+struct slh_agent_codec_scan {
+	/*! Vector scans in a row which stopped short */
+	uint8_t short_spans;
+};
+
+/*! Initial scanning state */
+#define SLH_AGENT_CODEC_SCAN_INIT	{ .short_spans = 0 }
+
+/*!
+ * Return true if the byte must be escaped.
+ */
+static inline _Bool slh_agent_codec_special(uint8_t byte) {
+	return (byte == STX) || (byte == ETX) || (byte == DLE);
+}
+
+/*!
+ * Return the number of bytes at the start of `buf` which pass through
+ * unescaped, that is, the offset of the first STX, ETX or DLE byte, or
+ * `len` if there is none.
+ *
+ * @param[in]		buf	Bytes to scan
+ * @param[in]		len	Number of bytes to scan
+ */
+size_t slh_agent_codec_span(const uint8_t* buf, size_t len);
+
+/*!
+ * As slh_agent_codec_span, for the next of a series of spans through the
+ * same data, falling back to checking one byte at a time where special
+ * bytes turn out to be dense.
+ *
+ * @param[inout]	scan	Scanning state, initially
+ *				SLH_AGENT_CODEC_SCAN_INIT
+ * @param[in]		buf	Bytes to scan
+ * @param[in]		len	Number of bytes to scan
+ */
+size_t slh_agent_codec_span_next(struct slh_agent_codec_scan* const scan,
+		const uint8_t* buf, size_t len);
+
+/*!
+ * Byte-stuff as much of `src` into `dst` as will fit.  An escape sequence
+ * is never split: if only one byte of space remains for it, encoding stops
+ * there.
+ *
+ * @param[out]		dst		Output buffer
+ * @param[in]		dst_sz		Size of the output buffer
+ * @param[in]		src		Bytes to encode
+ * @param[in]		src_sz		Number of bytes to encode
+ * @param[out]		consumed	Number of bytes of `src` encoded
+ *
+ * @returns		Number of bytes written to `dst`
+ */
+size_t slh_agent_codec_escape(uint8_t* dst, size_t dst_sz,
+		const uint8_t* src, size_t src_sz, size_t* consumed);
+
+/*
+ * Consistent overhead byte stuffing (COBS).
+ *
+ * The frame is cut at each zero byte, and into blocks of at most
+ * SLH_AGENT_CODEC_COBS_BLOCK bytes.  Each block is sent as a code byte,
+ * one more than its length, followed by its bytes; a code below 0xff means
+ * the block was followed by a zero, which is left out.  The encoded frame
+ * holds no zeros, so a zero byte can mark its end.
+ */
+
+/*! Largest block of non-zero bytes behind one COBS code byte */
+#define SLH_AGENT_CODEC_COBS_BLOCK	(254)
+
+/*!
+ * Return the largest size of a COBS-encoded frame, not counting the zero
+ * byte which ends it: one code byte per started block.
+ */
+static inline size_t slh_agent_codec_cobs_max(size_t len) {
+	return len + (len / SLH_AGENT_CODEC_COBS_BLOCK) + 1;
+}
+
+/*!
+ * COBS-encode `src` into `dst`, which must have room for
+ * slh_agent_codec_cobs_max(src_sz) bytes.
+ *
+ * @param[out]		dst		Output buffer
+ * @param[in]		src		Bytes to encode
+ * @param[in]		src_sz		Number of bytes to encode
+ *
+ * @returns		Number of bytes written to `dst`
+ */
+size_t slh_agent_codec_cobs_encode(uint8_t* dst,
+		const uint8_t* src, size_t src_sz);
+
+/*!
+ * Return the name of the scanning code in use ("avx2", "sse2" or
+ * "scalar").
+ */
+const char* slh_agent_codec_impl(void);
+
+/*!
+ * Use the named scanning code in place of the fastest, so that tests and
+ * benchmarks can check one against another.
+ *
+ * @param[in]		name	"avx2", "sse2" or "scalar", or NULL to go
+ *				back to the fastest
+ *
+ * @retval	0		Success
+ * @retval	-ENOTSUP	Not built in, or not supported by this CPU
+ */
+int slh_agent_codec_use(const char* name);
+
+#endif
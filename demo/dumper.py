@@ -77,7 +77,8 @@ class SixLowHAMAgentProtocol(asyncio.SubprocessProtocol):
             self._mac = [mac0, mac1, mac2, mac3, mac4, mac5]
             self._mtu = mtu
             self._ifidx = ifidx
-            self._name = framedata[-name_len:].decode()
+            name_start = self.SOH_STRUCT.size
+            self._name = framedata[name_start:name_start+name_len].decode()
             print ('Interface: MAC=%s MTU=%s IDX=%s NAME=%s' % (
                 self._mac, self._mtu, self._ifidx, self._name))
         elif frametype == self.FS:
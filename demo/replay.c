@@ -0,0 +1,943 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Load generator: starts the agent given on the command line with the
+ * socket backend standing in for its interface, plays the parent, and
+ * replays the Ethernet frames in a pcap or pcapng file through it.
+ *
+ * Frames go either to the interface, sent by us as FS frames as the parent
+ * would (`-t tap`, the default), or to the parent, fed in at the interface
+ * for the agent to pass on (`-t ctl`).  They are sent at the times the file
+ * gives, scaled (`-x 2` for twice as fast) or as fast as the agent will
+ * take them (`-f`).  When all have been sent, it reports the rate achieved,
+ * the latency percentiles (FS to ACK for `tap`, interface to FS for `ctl`),
+ * and any of the agent's counters which are not zero.
+ *
+ * Usage: replay [-t tap|ctl] [-x SCALE|-f] [-l LOOPS] FILE
+ *		AGENT [AGENT ARGS...]
+ *
+ * Add `-w WINDOW` to the agent's arguments to replay with a window.
+ */
+
+#include "frame.h"
+#include "stats.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*! Longest we wait for the agent before giving up, in milliseconds */
+#define REPLAY_TIMEOUT		(5000)
+/*! How long we wait for stragglers once all is sent, in milliseconds */
+#define REPLAY_LINGER		(1000)
+/*! Most interfaces described in a pcapng file */
+#define REPLAY_IFACES		(16)
+/*! Ethernet link type, in pcap and pcapng */
+#define REPLAY_ETHERNET		(1)
+
+/*!
+ * A frame from the file.
+ */
+struct replay_frame {
+	/*! Time it was captured, in nanoseconds */
+	uint64_t ts;
+	/*! Frame, within the file contents */
+	const uint8_t* data;
+	/*! Size of the frame as captured */
+	uint16_t len;
+};
+
+/*!
+ * Frames sent to the agent, waiting for an ACK.
+ */
+struct replay_inflight {
+	/*! Time it was sent */
+	uint64_t sent;
+	/*! Sequence number it was sent with */
+	uint8_t seq;
+	/*! ACKed or NAKed, out of turn */
+	_Bool done;
+};
+
+/*!
+ * Load generator state.
+ */
+struct replay {
+	/*! Our end of the control channel */
+	struct slh_agent_frame_ctx ctl;
+	/*! Our end of the agent's interface */
+	int wire_fd;
+	/*! Agent process */
+	pid_t pid;
+	/*! Interface MTU, from the SOH */
+	uint16_t mtu;
+	/*! Window agreed with the agent */
+	uint8_t window;
+
+	/*! Frames to replay */
+	struct replay_frame* frame;
+	/*! Number of frames */
+	size_t frames;
+	/*! Times the frames are replayed */
+	unsigned long loops;
+	/*! Speed-up over the times in the file, or 0 for flat out */
+	double scale;
+
+	/*! Latency of each frame delivered, in nanoseconds */
+	uint64_t* latency;
+	/*! Number of latencies */
+	unsigned long samples;
+	/*! Frames sent, to the agent or the interface */
+	uint64_t sent;
+	/*! Frames which came out the other side */
+	uint64_t delivered;
+	/*! Bytes in those frames */
+	uint64_t bytes;
+	/*! Frames the agent NAKed */
+	uint64_t naks;
+	/*! Frames bigger than the MTU, not sent */
+	uint64_t skipped;
+	/*! Frames sent to the parent which were not in the file */
+	uint64_t unknown;
+	/*! Time the first frame was due */
+	uint64_t start;
+	/*! Time the last frame came out */
+	uint64_t end;
+
+	/*! Counters from the agent, and how many it sent */
+	struct slh_agent_stats stats;
+	uint16_t stats_count;
+};
+
+/*! Frame buffer, big enough for anything the agent sends */
+static uint8_t replay_buffer[UINT16_MAX];
+
+/*!
+ * Return the monotonic clock in nanoseconds.
+ */
+static uint64_t replay_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static uint16_t replay_u16(const uint8_t* p, _Bool swap) {
+	uint16_t value;
+	memcpy(&value, p, sizeof(value));
+	return swap ? __builtin_bswap16(value) : value;
+}
+
+static uint32_t replay_u32(const uint8_t* p, _Bool swap) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return swap ? __builtin_bswap32(value) : value;
+}
+
+/*!
+ * Add a frame from the file, if it is one we can send.
+ */
+static int replay_add(struct replay* const r, size_t* cap, uint64_t ts,
+		const uint8_t* data, uint32_t len) {
+	if (len > UINT16_MAX)
+		return 0;
+
+	if (r->frames == *cap) {
+		struct replay_frame* frame;
+
+		*cap = *cap ? (*cap * 2) : 1024;
+		frame = realloc(r->frame, *cap * sizeof(*frame));
+		if (!frame)
+			return -ENOMEM;
+		r->frame = frame;
+	}
+
+	r->frame[r->frames].ts = ts;
+	r->frame[r->frames].data = data;
+	r->frame[r->frames].len = len;
+	r->frames++;
+	return 0;
+}
+
+/*!
+ * Read the frames from a classic pcap file.
+ */
+static int replay_parse_pcap(struct replay* const r, const uint8_t* buf,
+		size_t sz) {
+	const uint32_t magic = (sz >= 4) ? replay_u32(buf, false) : 0;
+	const _Bool swap = (magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1);
+	const _Bool nsec = (magic == 0xa1b23c4d) || (magic == 0x4d3cb2a1);
+	size_t off = 24;
+	size_t cap = 0;
+
+	if ((sz < 24) || ((magic != 0xa1b2c3d4) && (magic != 0xa1b23c4d)
+				&& !swap))
+		return -EINVAL;
+	if ((replay_u32(buf + 20, swap) & 0xffff) != REPLAY_ETHERNET)
+		return -EPROTONOSUPPORT;
+
+	while ((off + 16) <= sz) {
+		const uint64_t ts = ((uint64_t)replay_u32(buf + off, swap)
+				* 1000000000ULL)
+			+ ((uint64_t)replay_u32(buf + off + 4, swap)
+				* (nsec ? 1 : 1000));
+		const uint32_t len = replay_u32(buf + off + 8, swap);
+		int res;
+
+		if ((off + 16 + len) > sz)
+			/* Cut short */
+			break;
+
+		res = replay_add(r, &cap, ts, buf + off + 16, len);
+		if (res < 0)
+			return res;
+		off += 16 + len;
+	}
+
+	return 0;
+}
+
+/*!
+ * Read the frames from a pcapng file: the Ethernet frames in its enhanced
+ * and simple packet blocks.
+ */
+static int replay_parse_pcapng(struct replay* const r, const uint8_t* buf,
+		size_t sz) {
+	/* Units of each interface's timestamps, in nanoseconds (0: skip) */
+	uint64_t unit[REPLAY_IFACES];
+	uint8_t ifaces = 0;
+	uint64_t ts = 0;
+	_Bool swap = false;
+	size_t off = 0;
+	size_t cap = 0;
+
+	while ((off + 12) <= sz) {
+		uint32_t type = replay_u32(buf + off, swap);
+		uint32_t len;
+		int res = 0;
+
+		if (type == 0x0a0d0d0a) {
+			/* New section, maybe in the other byte order */
+			swap = (replay_u32(buf + off + 8, false)
+					!= 0x1a2b3c4d);
+			ifaces = 0;
+		}
+
+		len = replay_u32(buf + off + 4, swap);
+		if ((len < 12) || ((off + len) > sz))
+			break;
+
+		if ((type == 1) && (len >= 20) && (ifaces < REPLAY_IFACES)) {
+			/* Interface: note its link type and time units */
+			const uint8_t* opt = buf + off + 16;
+			const uint8_t* end = buf + off + len - 4;
+
+			unit[ifaces] = (replay_u16(buf + off + 8, swap)
+					== REPLAY_ETHERNET) ? 1000 : 0;
+			while (unit[ifaces] && ((opt + 4) <= end)) {
+				uint16_t code = replay_u16(opt, swap);
+				uint16_t opt_len = replay_u16(opt + 2, swap);
+
+				if (!code)
+					break;
+				if ((code == 9) && (opt_len == 1)) {
+					/* if_tsresol: powers of ten only */
+					uint8_t exp = opt[4];
+					unit[ifaces] = 1;
+					for (; exp < 9; exp++)
+						unit[ifaces] *= 10;
+				}
+				opt += 4 + ((opt_len + 3) & ~3U);
+			}
+			ifaces++;
+		} else if ((type == 6) && (len >= 32)) {
+			/* Enhanced packet */
+			uint32_t iface = replay_u32(buf + off + 8, swap);
+			uint32_t caplen = replay_u32(buf + off + 20, swap);
+
+			if ((iface < ifaces) && unit[iface]
+					&& ((28 + caplen) <= len)) {
+				ts = (((uint64_t)replay_u32(buf + off + 12,
+							swap) << 32)
+					| replay_u32(buf + off + 16, swap))
+					* unit[iface];
+				res = replay_add(r, &cap, ts, buf + off + 28,
+						caplen);
+			}
+		} else if ((type == 3) && (len >= 16)) {
+			/* Simple packet: no time, so straight after the last */
+			uint32_t caplen = len - 16;
+
+			if (ifaces && unit[0])
+				res = replay_add(r, &cap, ts, buf + off + 12,
+						caplen);
+		}
+
+		if (res < 0)
+			return res;
+		off += len;
+	}
+
+	return 0;
+}
+
+/*!
+ * Read the file into memory and find the frames in it.  The contents are
+ * kept for as long as the frames are needed.
+ */
+static int replay_load(struct replay* const r, const char* path) {
+	struct stat st;
+	uint8_t* buf;
+	size_t off = 0;
+	int res;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		res = -errno;
+		goto close;
+	}
+
+	buf = malloc(st.st_size + 1);
+	if (!buf) {
+		res = -ENOMEM;
+		goto close;
+	}
+
+	while (off < (size_t)st.st_size) {
+		ssize_t len = read(fd, buf + off, st.st_size - off);
+		if (len <= 0) {
+			res = len ? -errno : -EIO;
+			goto close;
+		}
+		off += len;
+	}
+
+	if ((off >= 12) && (replay_u32(buf, false) == 0x0a0d0d0a))
+		res = replay_parse_pcapng(r, buf, off);
+	else
+		res = replay_parse_pcap(r, buf, off);
+	if (!res && !r->frames)
+		res = -ENODATA;
+	if (res < 0)
+		free(buf);
+
+close:
+	close(fd);
+	return res;
+}
+
+/*!
+ * Time frame `idx` of the replay is due, relative to the start.
+ */
+static uint64_t replay_due(const struct replay* const r, uint64_t idx) {
+	const uint64_t first = r->frame[0].ts;
+	const uint64_t span = r->frame[r->frames - 1].ts - first;
+	const struct replay_frame* const frame = &r->frame[idx % r->frames];
+
+	return (((idx / r->frames) * span) + (frame->ts - first)) / r->scale;
+}
+
+/*!
+ * Milliseconds to wait before frame `idx` is due, rounded up.
+ */
+static int replay_wait(const struct replay* const r, uint64_t idx,
+		uint64_t now) {
+	const uint64_t due = r->start + replay_due(r, idx);
+
+	if (due <= now)
+		return 0;
+	if ((due - now) >= (REPLAY_TIMEOUT * 1000000ULL))
+		return REPLAY_TIMEOUT;
+	return ((due - now) + 999999) / 1000000;
+}
+
+/*!
+ * Start the agent, passing it our ends of the control channel and the
+ * interface.
+ *
+ * @returns	0, or -1 on error.
+ */
+static int replay_spawn(struct replay* const r, int argc, char* argv[]) {
+	char ctl_arg[16];
+	char tap_arg[32];
+	char** args;
+	int ctl[2], wire[2];
+	int i;
+
+	if ((socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) < 0)
+			|| (socketpair(AF_UNIX,
+					SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+					wire) < 0))
+		return -1;
+
+	snprintf(ctl_arg, sizeof(ctl_arg), "%d", ctl[1]);
+	snprintf(tap_arg, sizeof(tap_arg), "socket:%d", wire[1]);
+
+	args = calloc(argc + 5, sizeof(char*));
+	if (!args)
+		return -1;
+
+	for (i = 0; i < argc; i++)
+		args[i] = argv[i];
+	args[argc] = "-c";
+	args[argc + 1] = ctl_arg;
+	args[argc + 2] = "-T";
+	args[argc + 3] = tap_arg;
+
+	r->pid = fork();
+	if (r->pid == 0) {
+		fcntl(ctl[1], F_SETFD, 0);
+		fcntl(wire[1], F_SETFD, 0);
+		execvp(args[0], args);
+		perror(args[0]);
+		_exit(127);
+	}
+
+	free(args);
+	close(ctl[1]);
+	close(wire[1]);
+	if (r->pid < 0)
+		return -1;
+
+	r->wire_fd = wire[0];
+	if (fcntl(ctl[0], F_SETFL, O_NONBLOCK) < 0)
+		return -1;
+	return slh_agent_frame_init_packet(&r->ctl, ctl[0], 4 * UINT16_MAX);
+}
+
+/*!
+ * Queue a frame for the agent, flushing as needed to make room.
+ */
+static void replay_write(struct replay* const r, const uint8_t* frame,
+		uint16_t len) {
+	while (slh_agent_write_frame(&r->ctl,
+				(const struct slh_agent_frame*)frame, len)
+			== -EAGAIN) {
+		struct pollfd out = { .fd = r->ctl.tx_fd, .events = POLLOUT };
+		poll(&out, 1, REPLAY_TIMEOUT);
+		slh_agent_frame_flush(&r->ctl);
+	}
+}
+
+/*!
+ * Read a frame from the agent, waiting up to `timeout` milliseconds.
+ *
+ * @returns	Size of the frame, 0 on timeout, or <0 on error.
+ */
+static int replay_read(struct replay* const r, int timeout) {
+	while (1) {
+		struct pollfd pfd = { .fd = r->ctl.rx_fd, .events = POLLIN };
+		int len = slh_agent_read_frame(&r->ctl,
+				(struct slh_agent_frame*)replay_buffer,
+				sizeof(replay_buffer));
+
+		if (len)
+			return len;
+
+		slh_agent_frame_flush(&r->ctl);
+		if (poll(&pfd, 1, timeout) <= 0)
+			return 0;
+		r->ctl.rx_ready = true;
+	}
+}
+
+/*!
+ * Wait for the agent's SOH, and accept any window it offers.
+ */
+static int replay_connect(struct replay* const r) {
+	const uint8_t* p = &replay_buffer[1];
+	const uint8_t* win;
+	uint8_t win_len;
+	uint16_t mtu;
+	uint16_t opts;
+	int len;
+
+	len = replay_read(r, REPLAY_TIMEOUT);
+	if ((len < (1 + SLH_TAP_MAC_SZ + 7)) || (replay_buffer[0] != SOH))
+		return -EPROTO;
+	if (len < (1 + SLH_TAP_MAC_SZ + 7 + p[SLH_TAP_MAC_SZ + 6]))
+		return -EPROTO;
+
+	memcpy(&mtu, p + SLH_TAP_MAC_SZ, sizeof(mtu));
+	r->mtu = ntohs(mtu);
+
+	opts = SLH_TAP_MAC_SZ + 7 + p[SLH_TAP_MAC_SZ + 6];
+	win = slh_agent_find_option(p + opts, len - 1 - opts,
+			SLH_OPT_WINDOW, &win_len);
+	r->window = (win && (win_len == 1) && (win[0] > 1)) ? win[0] : 1;
+
+	if (r->window > 1) {
+		const uint8_t ack[] = { ACK, SLH_OPT_WINDOW, 1, r->window };
+		replay_write(r, ack, sizeof(ack));
+	} else {
+		replay_write(r, &(const uint8_t){ ACK }, 1);
+	}
+	slh_agent_frame_flush(&r->ctl);
+	return 0;
+}
+
+/*!
+ * Answer an FS frame from the agent.
+ */
+static void replay_ack(struct replay* const r) {
+	const uint8_t ack[] = { ACK, replay_buffer[1] };
+	replay_write(r, ack, (r->window > 1) ? 2 : 1);
+}
+
+/*!
+ * Take any frames the agent has written to the interface.
+ */
+static void replay_drain(struct replay* const r) {
+	ssize_t len;
+
+	while ((len = recv(r->wire_fd, replay_buffer, sizeof(replay_buffer),
+					MSG_DONTWAIT)) > 0) {
+		r->delivered++;
+		r->bytes += len;
+		r->end = replay_now();
+	}
+}
+
+/*!
+ * Note replies to the frames in flight.  An ACK settles the frame with the
+ * first sequence number and those sent before it, and any others listed;
+ * a NAK those listed.
+ */
+static void replay_settle(struct replay* const r,
+		struct replay_inflight* fl, uint32_t head, uint32_t* tail,
+		uint64_t now, int len) {
+	const _Bool ack = (replay_buffer[0] == ACK);
+	uint32_t i;
+	int s;
+
+	if (r->window == 1) {
+		/* Stop-and-wait: the one in flight */
+		if (*tail == head)
+			return;
+		fl[*tail % 256].done = true;
+		if (ack)
+			r->latency[r->samples++] = now
+				- fl[*tail % 256].sent;
+		else
+			r->naks++;
+		(*tail)++;
+		return;
+	}
+
+	for (s = 1; s < len; s++) {
+		for (i = *tail; i != head; i++) {
+			struct replay_inflight* const f = &fl[i % 256];
+
+			if (f->seq != replay_buffer[s])
+				continue;
+
+			if (!ack) {
+				r->naks += !f->done;
+				f->done = true;
+				break;
+			}
+
+			/* The first also settles everything before it */
+			for (i = (s == 1) ? *tail : i; ; i++) {
+				struct replay_inflight* const g = &fl[i % 256];
+				if (!g->done)
+					r->latency[r->samples++] = now
+						- g->sent;
+				g->done = true;
+				if (g == f)
+					break;
+			}
+			break;
+		}
+	}
+
+	while ((*tail != head) && fl[*tail % 256].done)
+		(*tail)++;
+}
+
+/*!
+ * Replay the frames to the interface, through the agent.
+ */
+static int replay_to_tap(struct replay* const r) {
+	static struct replay_inflight fl[256];
+	static uint8_t out[2 + UINT16_MAX];
+	const uint8_t hdr = (r->window > 1) ? 2 : 1;
+	const uint64_t total = (uint64_t)r->frames * r->loops;
+	uint64_t idx = 0;
+	uint64_t quiet = 0;
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	uint8_t seq = 0;
+
+	r->start = replay_now();
+	while (1) {
+		struct pollfd pfd = { .fd = r->ctl.rx_fd, .events = POLLIN };
+		uint64_t now = replay_now();
+		int timeout = REPLAY_TIMEOUT;
+		int len;
+
+		while ((idx < total) && ((head - tail) < r->window)
+				&& (!r->scale || !replay_wait(r, idx, now))) {
+			const struct replay_frame* const f =
+				&r->frame[idx++ % r->frames];
+
+			if (f->len > r->mtu) {
+				r->skipped++;
+				continue;
+			}
+
+			out[0] = FS;
+			out[1] = seq;
+			memcpy(out + hdr, f->data, f->len);
+			replay_write(r, out, hdr + f->len);
+
+			fl[head % 256].sent = now;
+			fl[head % 256].seq = seq++;
+			fl[head % 256].done = false;
+			head++;
+			r->sent++;
+		}
+		slh_agent_frame_flush(&r->ctl);
+		replay_drain(r);
+
+		if ((idx == total) && (head == tail))
+			break;
+		if ((idx < total) && ((head - tail) < r->window) && r->scale)
+			timeout = replay_wait(r, idx, now);
+
+		if (poll(&pfd, 1, timeout) > 0) {
+			r->ctl.rx_ready = true;
+			quiet = 0;
+		} else if (head != tail) {
+			if (quiet && ((replay_now() - quiet)
+					> (REPLAY_TIMEOUT * 1000000ULL))) {
+				fprintf(stderr, "Agent went quiet\n");
+				return -ETIMEDOUT;
+			}
+			if (!quiet)
+				quiet = replay_now();
+		}
+
+		now = replay_now();
+		while ((len = slh_agent_read_frame(&r->ctl,
+					(struct slh_agent_frame*)replay_buffer,
+					sizeof(replay_buffer))) > 0) {
+			if ((replay_buffer[0] == ACK)
+					|| (replay_buffer[0] == NAK))
+				replay_settle(r, fl, head, &tail, now, len);
+			else if (replay_buffer[0] == FS)
+				replay_ack(r);
+		}
+		if (len < 0)
+			return len;
+	}
+
+	/* Wait for the last frames to come out of the interface */
+	while (r->delivered < (r->sent - r->naks)) {
+		struct pollfd pfd = { .fd = r->wire_fd, .events = POLLIN };
+		if (poll(&pfd, 1, REPLAY_LINGER) <= 0)
+			break;
+		replay_drain(r);
+	}
+	return 0;
+}
+
+/*!
+ * Replay the frames to the parent (us), through the agent.
+ */
+static int replay_to_ctl(struct replay* const r) {
+	const uint64_t total = (uint64_t)r->frames * r->loops;
+	uint64_t* injected;
+	uint8_t seen[32];
+	uint64_t idx = 0;
+	uint64_t match = 0;
+	uint64_t last = 0;
+	_Bool blocked = false;
+
+	injected = calloc(total, sizeof(*injected));
+	if (!injected)
+		return -ENOMEM;
+	memset(seen, 0, sizeof(seen));
+
+	r->start = replay_now();
+	while (1) {
+		struct pollfd pfd[2] = {
+			{ .fd = r->ctl.rx_fd, .events = POLLIN },
+			{ .fd = r->wire_fd, .events = POLLOUT },
+		};
+		uint64_t now = replay_now();
+		int timeout = REPLAY_LINGER;
+		int len;
+
+		while (!blocked && (idx < total)
+				&& (!r->scale || !replay_wait(r, idx, now))) {
+			const struct replay_frame* const f =
+				&r->frame[idx % r->frames];
+
+			if (f->len > r->mtu) {
+				r->skipped++;
+				idx++;
+				continue;
+			}
+
+			if (send(r->wire_fd, f->data, f->len,
+						MSG_DONTWAIT) < 0) {
+				/* Try again when the agent has caught up */
+				blocked = true;
+				break;
+			}
+			injected[idx++] = now;
+			r->sent++;
+		}
+		slh_agent_frame_flush(&r->ctl);
+
+		if ((idx < total) && !blocked && r->scale)
+			timeout = replay_wait(r, idx, now);
+		else if ((idx == total) && (match == idx))
+			break;
+
+		if (poll(pfd, blocked ? 2 : 1, timeout) <= 0) {
+			if ((idx == total) && ((replay_now() - last)
+					> (REPLAY_LINGER * 1000000ULL)))
+				/* The rest aren't coming */
+				break;
+		}
+		if (pfd[1].revents & POLLOUT)
+			blocked = false;
+		r->ctl.rx_ready = true;
+
+		now = replay_now();
+		while ((len = slh_agent_read_frame(&r->ctl,
+					(struct slh_agent_frame*)replay_buffer,
+					sizeof(replay_buffer))) > 0) {
+			const uint8_t hdr = (r->window > 1) ? 2 : 1;
+			const uint8_t* data = replay_buffer + hdr;
+			const uint16_t data_len = len - hdr;
+			uint64_t i;
+
+			if ((replay_buffer[0] != FS) || (len < hdr))
+				continue;
+			replay_ack(r);
+
+			if (r->window > 1) {
+				/* Resent, our ACK being too slow? */
+				const uint8_t s = replay_buffer[1];
+				const uint8_t old = s + 128;
+
+				if (seen[s >> 3] & (1 << (s & 7)))
+					continue;
+				seen[s >> 3] |= 1 << (s & 7);
+				seen[old >> 3] &= ~(1 << (old & 7));
+			}
+
+			/* Frames come out in order, less any dropped */
+			for (i = match; i < idx; i++) {
+				const struct replay_frame* const f =
+					&r->frame[i % r->frames];
+
+				if (injected[i] && (f->len == data_len)
+						&& !memcmp(f->data, data,
+							data_len))
+					break;
+			}
+
+			if (i == idx) {
+				r->unknown++;
+				continue;
+			}
+
+			r->latency[r->samples++] = now - injected[i];
+			r->delivered++;
+			r->bytes += data_len;
+			r->end = last = now;
+			match = i + 1;
+		}
+		if (len < 0) {
+			free(injected);
+			return len;
+		}
+	}
+
+	free(injected);
+	return 0;
+}
+
+/*!
+ * Ask the agent for its counters.
+ */
+static void replay_stats(struct replay* const r) {
+	uint64_t until = replay_now() + (REPLAY_TIMEOUT * 1000000ULL);
+	int len;
+
+	replay_write(r, &(const uint8_t){ ENQ }, 1);
+	while (replay_now() < until) {
+		len = replay_read(r, REPLAY_TIMEOUT);
+		if (len <= 0)
+			return;
+		if (replay_buffer[0] == FS) {
+			replay_ack(r);
+		} else if (replay_buffer[0] == ENQ) {
+			uint64_t* const field = (uint64_t*)&r->stats;
+			uint16_t i;
+
+			for (i = 0; (i < SLH_AGENT_STATS_COUNT)
+					&& ((1 + ((i + 1) * 8)) <= len); i++) {
+				uint8_t b;
+
+				field[i] = 0;
+				for (b = 0; b < 8; b++)
+					field[i] = (field[i] << 8)
+						| replay_buffer[1 + (i * 8)
+							+ b];
+			}
+			r->stats_count = i;
+			return;
+		}
+	}
+}
+
+static int replay_cmp(const void* a, const void* b) {
+	const uint64_t x = *(const uint64_t*)a;
+	const uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/*!
+ * Print what was achieved.
+ */
+static void replay_report(struct replay* const r) {
+	static const double pct[] = { 50, 90, 99, 99.9, 100 };
+	const double elapsed = (double)(r->end - r->start) / 1e9;
+	const uint64_t* const field = (const uint64_t*)&r->stats;
+	unsigned int i;
+
+	printf("%" PRIu64 " frames sent, %" PRIu64 " delivered, %" PRIu64
+			" NAKed, %" PRIu64 " too big",
+			r->sent, r->delivered, r->naks, r->skipped);
+	if (r->unknown)
+		printf(", %" PRIu64 " unknown", r->unknown);
+	printf("\n");
+
+	if (r->delivered && (elapsed > 0))
+		printf("%.3f s, %.0f frames/s, %.2f MB/s\n", elapsed,
+				r->delivered / elapsed,
+				r->bytes / elapsed / 1e6);
+
+	if (r->samples) {
+		qsort(r->latency, r->samples, sizeof(*r->latency),
+				replay_cmp);
+		printf("latency (us):");
+		for (i = 0; i < (sizeof(pct) / sizeof(pct[0])); i++)
+			printf(" p%g %.1f", pct[i], r->latency[(size_t)(
+						(pct[i] / 100)
+						* (r->samples - 1))] / 1e3);
+		printf("\n");
+	}
+
+	for (i = 0; i < r->stats_count; i++)
+		if (field[i])
+			printf("%s: %" PRIu64 "\n", slh_agent_stats_names[i],
+					field[i]);
+}
+
+int main(int argc, char* argv[]) {
+	static struct replay r;
+	_Bool to_ctl = false;
+	int status;
+	int res;
+
+	r.loops = 1;
+	r.scale = 1;
+	while ((res = getopt(argc, argv, "+fl:t:x:")) != -1) {
+		switch (res) {
+		case 'f':
+			r.scale = 0;
+			break;
+		case 'l':
+			r.loops = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			if (!strcmp(optarg, "ctl")) {
+				to_ctl = true;
+			} else if (strcmp(optarg, "tap")) {
+				fprintf(stderr, "Invalid target: %s\n",
+						optarg);
+				return 1;
+			}
+			break;
+		case 'x':
+			r.scale = strtod(optarg, NULL);
+			if (r.scale <= 0) {
+				fprintf(stderr, "Invalid scale: %s\n",
+						optarg);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t tap|ctl] [-x SCALE|-f] "
+					"[-l LOOPS] FILE AGENT "
+					"[AGENT ARGS...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if ((optind + 2) > argc) {
+		fprintf(stderr, "No file or agent given\n");
+		return 1;
+	}
+
+	res = replay_load(&r, argv[optind]);
+	if (res < 0) {
+		fprintf(stderr, "Failed to load %s: %s\n", argv[optind],
+				strerror(-res));
+		return 1;
+	}
+
+	r.latency = calloc((size_t)r.frames * (r.loops ? r.loops : 1),
+			sizeof(*r.latency));
+	if (!r.latency || !r.loops) {
+		fprintf(stderr, "Invalid loop count\n");
+		return 1;
+	}
+
+	if (replay_spawn(&r, argc - optind - 1, argv + optind + 1) < 0) {
+		perror("spawn");
+		return 1;
+	}
+
+	res = replay_connect(&r);
+	if (res < 0) {
+		fprintf(stderr, "No SOH from the agent: %s\n", strerror(-res));
+		goto exit;
+	}
+
+	res = to_ctl ? replay_to_ctl(&r) : replay_to_tap(&r);
+	if (res < 0)
+		fprintf(stderr, "Replay stopped: %s\n", strerror(-res));
+
+	replay_stats(&r);
+	replay_report(&r);
+
+exit:
+	/* Tell the agent to shut down */
+	replay_write(&r, &(const uint8_t){ EOT }, 1);
+	slh_agent_frame_flush(&r.ctl);
+	waitpid(r.pid, &status, 0);
+	slh_agent_frame_free(&r.ctl);
+	close(r.wire_fd);
+	return (res < 0) ? 1 : 0;
+}
@@ -0,0 +1,238 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Reference parent for the shared memory control channel: starts the agent
+ * given on the command line with a new channel, acknowledges its device
+ * detail, then prints a line for each Ethernet frame it passes on until
+ * interrupted (or after a given number of frames), and shuts it down.
+ *
+ * Usage: shmclient [-c COUNT] [-r RING_SZ] AGENT [AGENT ARGS...]
+ */
+
+#include "frame.h"
+#include "shm.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*! Default size of each ring */
+#define SHMCLIENT_RING_SZ	(65536)
+
+/*! Set by SIGINT/SIGTERM */
+static volatile sig_atomic_t shmclient_stop = 0;
+
+static void shmclient_signal(int sig) {
+	(void)sig;
+	shmclient_stop = 1;
+}
+
+/*!
+ * Start the agent, passing it our end of the channel.
+ *
+ * @returns	Process ID of the agent, or -1 on error.
+ */
+static pid_t shmclient_spawn(const struct slh_agent_shm_fds* const fds,
+		int argc, char* argv[]) {
+	char fds_arg[64];
+	char** args;
+	pid_t pid;
+	int i;
+
+	snprintf(fds_arg, sizeof(fds_arg), "%d,%d,%d,%d,%d",
+			fds->mem_fd, fds->agent_rx_fd, fds->agent_tx_fd,
+			fds->parent_rx_fd, fds->parent_tx_fd);
+
+	args = calloc(argc + 3, sizeof(char*));
+	if (!args)
+		return -1;
+
+	for (i = 0; i < argc; i++)
+		args[i] = argv[i];
+	args[argc] = "-s";
+	args[argc + 1] = fds_arg;
+
+	pid = fork();
+	if (pid == 0) {
+		/* The agent needs all five descriptors */
+		const int keep[] = {
+			fds->mem_fd, fds->agent_rx_fd, fds->agent_tx_fd,
+			fds->parent_rx_fd, fds->parent_tx_fd
+		};
+		for (i = 0; i < 5; i++)
+			fcntl(keep[i], F_SETFD, 0);
+
+		execvp(args[0], args);
+		perror(args[0]);
+		_exit(127);
+	}
+
+	free(args);
+	return pid;
+}
+
+/*!
+ * Print the device detail from a SOH frame.
+ */
+static void shmclient_print_soh(const struct slh_agent_frame* const frame,
+		int len) {
+	const uint8_t* p = frame->payload;
+	uint16_t mtu;
+	uint32_t ifindex;
+
+	if (len < (1 + SLH_TAP_MAC_SZ + 7)) {
+		printf("SOH: too short\n");
+		return;
+	}
+
+	memcpy(&mtu, p + SLH_TAP_MAC_SZ, sizeof(mtu));
+	memcpy(&ifindex, p + SLH_TAP_MAC_SZ + 2, sizeof(ifindex));
+	printf("SOH: %.*s (index %u) MAC "
+			"%02x:%02x:%02x:%02x:%02x:%02x MTU %u\n",
+			p[SLH_TAP_MAC_SZ + 6],
+			(const char*)(p + SLH_TAP_MAC_SZ + 7),
+			ntohl(ifindex), p[0], p[1], p[2], p[3], p[4], p[5],
+			ntohs(mtu));
+}
+
+/*!
+ * Print a summary of an Ethernet frame.
+ */
+static void shmclient_print_fs(const struct slh_agent_frame* const frame,
+		int len) {
+	const uint8_t* p = frame->payload;
+
+	if (len < (1 + 14)) {
+		printf("FS: %d bytes\n", len - 1);
+		return;
+	}
+
+	printf("FS: %d bytes %02x:%02x:%02x:%02x:%02x:%02x -> "
+			"%02x:%02x:%02x:%02x:%02x:%02x type %04x\n",
+			len - 1, p[6], p[7], p[8], p[9], p[10], p[11],
+			p[0], p[1], p[2], p[3], p[4], p[5],
+			(p[12] << 8) | p[13]);
+}
+
+int main(int argc, char* argv[]) {
+	static uint8_t buffer[UINT16_MAX];
+	struct slh_agent_frame* const frame = (struct slh_agent_frame*)buffer;
+	struct slh_agent_frame_ctx ctx;
+	struct slh_agent_shm_fds fds;
+	uint32_t ring_sz = SHMCLIENT_RING_SZ;
+	unsigned long count = 0;
+	unsigned long seen = 0;
+	_Bool tx_blocked = false;
+	pid_t pid;
+	int status;
+	int res;
+
+	while ((res = getopt(argc, argv, "+c:r:")) != -1) {
+		switch (res) {
+		case 'c':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			ring_sz = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c COUNT] [-r RING_SZ] "
+					"AGENT [AGENT ARGS...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "No agent given\n");
+		return 1;
+	}
+
+	res = slh_agent_shm_create(&fds, ring_sz);
+	if (res < 0) {
+		fprintf(stderr, "Failed to create channel: %s\n",
+				strerror(-res));
+		return 1;
+	}
+
+	res = slh_agent_frame_init_shm(&ctx, &fds, true);
+	if (res < 0) {
+		fprintf(stderr, "Failed to map channel: %s\n",
+				strerror(-res));
+		return 1;
+	}
+
+	signal(SIGINT, shmclient_signal);
+	signal(SIGTERM, shmclient_signal);
+
+	pid = shmclient_spawn(&fds, argc - optind, argv + optind);
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+
+	while (!shmclient_stop) {
+		struct pollfd pfd[2] = {
+			{ .fd = ctx.rx_fd, .events = POLLIN },
+			{ .fd = ctx.tx_fd, .events = POLLIN },
+		};
+		int len;
+
+		len = slh_agent_read_frame(&ctx, frame, sizeof(buffer));
+		if (len == -EPIPE) {
+			/* Agent has gone away */
+			break;
+		} else if (len < 0) {
+			fprintf(stderr, "Bad frame: %s\n", strerror(-len));
+			slh_agent_drop_frame(&ctx);
+			continue;
+		} else if (len > 0) {
+			switch (frame->type) {
+			case SOH:
+				shmclient_print_soh(frame, len);
+				/* Accept the defaults: no options */
+				slh_agent_write_frame_nopayload(&ctx, ACK);
+				break;
+			case FS:
+				shmclient_print_fs(frame, len);
+				slh_agent_write_frame_nopayload(&ctx, ACK);
+				seen++;
+				break;
+			case SYN:
+				slh_agent_write_frame_nopayload(&ctx, ACK);
+				break;
+			default:
+				break;
+			}
+
+			if (count && (seen >= count))
+				break;
+			continue;
+		}
+
+		/* Nothing waiting: hand over our replies and sleep */
+		tx_blocked = (slh_agent_frame_flush(&ctx) == -EAGAIN);
+		res = poll(pfd, tx_blocked ? 2 : 1, 1000);
+		if (res > 0)
+			ctx.rx_ready = true;
+		else if (!res && (waitpid(pid, &status, WNOHANG) == pid))
+			/* Agent died without closing the channel */
+			goto exited;
+	}
+
+	/* Tell the agent to shut down */
+	slh_agent_write_frame_nopayload(&ctx, EOT);
+	slh_agent_frame_flush(&ctx);
+	waitpid(pid, &status, 0);
+
+exited:
+	slh_agent_frame_free(&ctx);
+	slh_agent_shm_close(&fds);
+	printf("%lu frames\n", seen);
+	return 0;
+}
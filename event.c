@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "event.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+
+/*!
+ * Return the number of milliseconds until the nearest timer expires, or
+ * `max_wait` if that is sooner.
+ */
+static int slh_agent_event_timeout(
+		const struct slh_agent_event_loop* const loop,
+		uint64_t now, int max_wait);
+
+/*!
+ * Call the handlers of all expired timers.
+ */
+static void slh_agent_event_fire_timers(
+		struct slh_agent_event_loop* const loop);
+
+int slh_agent_event_init(struct slh_agent_event_loop* const loop) {
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0)
+		return -errno;
+
+	loop->stop = false;
+	loop->now = slh_agent_now();
+	loop->again = NULL;
+	loop->timers = NULL;
+	return 0;
+}
+
+void slh_agent_event_free(struct slh_agent_event_loop* const loop) {
+	if (loop->epfd >= 0)
+		close(loop->epfd);
+	loop->epfd = -1;
+}
+
+int slh_agent_event_nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -errno;
+
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -errno;
+	return 0;
+}
+
+int slh_agent_event_add(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event* const ev, uint32_t events) {
+	struct epoll_event epev = {
+		.events = events | EPOLLET,
+		.data = {
+			.ptr = ev
+		}
+	};
+
+	ev->again = 0;
+	ev->next_again = NULL;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ev->fd, &epev) < 0)
+		return -errno;
+	return 0;
+}
+
+int slh_agent_event_mod(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event* const ev, uint32_t events) {
+	struct epoll_event epev = {
+		.events = events | EPOLLET,
+		.data = {
+			.ptr = ev
+		}
+	};
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, ev->fd, &epev) < 0)
+		return -errno;
+	return 0;
+}
+
+void slh_agent_event_again(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event* const ev, uint32_t events) {
+	if (!ev->again) {
+		/* Not already waiting for a turn */
+		ev->next_again = loop->again;
+		loop->again = ev;
+	}
+	ev->again |= events;
+}
+
+void slh_agent_event_timer_set(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event_timer* const timer,
+		uint64_t deadline) {
+	if (!timer->armed) {
+		timer->next = loop->timers;
+		loop->timers = timer;
+		timer->armed = true;
+	}
+	timer->deadline = deadline;
+}
+
+void slh_agent_event_timer_clear(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event_timer* const timer) {
+	struct slh_agent_event_timer** ptr = &(loop->timers);
+
+	while (*ptr) {
+		if (*ptr == timer) {
+			*ptr = timer->next;
+			break;
+		}
+		ptr = &((*ptr)->next);
+	}
+
+	timer->next = NULL;
+	timer->armed = false;
+}
+
+int slh_agent_event_run_once(struct slh_agent_event_loop* const loop,
+		int max_wait) {
+	struct epoll_event events[SLH_AGENT_EVENT_MAX];
+	struct slh_agent_event* ready;
+	int res, i;
+
+	res = epoll_wait(loop->epfd, events, SLH_AGENT_EVENT_MAX,
+			slh_agent_event_wait_time(loop, max_wait));
+	if (res < 0) {
+		if (errno != EINTR)
+			return -errno;
+		res = 0;
+	}
+	loop->now = slh_agent_now();
+
+	/* Merge the new events into those left over from last turn */
+	ready = loop->again;
+	loop->again = NULL;
+	for (i = 0; i < res; i++) {
+		struct slh_agent_event* ev = events[i].data.ptr;
+		if (!ev->again) {
+			ev->next_again = ready;
+			ready = ev;
+		}
+		ev->again |= events[i].events;
+	}
+
+	while (ready && !loop->stop) {
+		struct slh_agent_event* ev = ready;
+		uint32_t ev_events = ev->again;
+
+		ready = ev->next_again;
+		ev->next_again = NULL;
+		ev->again = 0;
+		ev->cb(ev, ev_events);
+	}
+
+	if (!loop->stop)
+		slh_agent_event_fire_timers(loop);
+	return 0;
+}
+
+int slh_agent_event_wait_time(const struct slh_agent_event_loop* const loop,
+		int max_wait) {
+	/* Don't sleep if a handler still has work to do */
+	if (loop->again)
+		return 0;
+	return slh_agent_event_timeout(loop, slh_agent_now(), max_wait);
+}
+
+void slh_agent_event_run_timers(struct slh_agent_event_loop* const loop) {
+	loop->now = slh_agent_now();
+	slh_agent_event_fire_timers(loop);
+}
+
+static int slh_agent_event_timeout(
+		const struct slh_agent_event_loop* const loop,
+		uint64_t now, int max_wait) {
+	const struct slh_agent_event_timer* timer = loop->timers;
+	int timeout = max_wait;
+
+	while (timer) {
+		int remain = (timer->deadline > now)
+			? (int)(timer->deadline - now) : 0;
+		if ((timeout < 0) || (remain < timeout))
+			timeout = remain;
+		timer = timer->next;
+	}
+
+	return timeout;
+}
+
+static void slh_agent_event_fire_timers(
+		struct slh_agent_event_loop* const loop) {
+	struct slh_agent_event_timer* timer = loop->timers;
+
+	while (timer) {
+		if (timer->deadline > loop->now) {
+			timer = timer->next;
+			continue;
+		}
+
+		/* Expired, the handler may re-arm it */
+		slh_agent_event_timer_clear(loop, timer);
+		timer->cb(timer, loop->now);
+
+		/* The list may have changed, start again */
+		timer = loop->timers;
+	}
+}
@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_EVENT_H
+#define _6LH_AGENT_EVENT_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+/*
+ * Event loop.
+ *
+ * File descriptors are registered edge-triggered and must be non-blocking:
+ * a handler is called once when the descriptor becomes ready and must then
+ * read (or write) until it sees EAGAIN.  A handler that has to stop early,
+ * e.g. because a buffer is full, calls slh_agent_event_again so it is called
+ * again on the next turn of the loop without waiting.
+ *
+ * Timers are one-shot and are checked on every turn; the nearest deadline
+ * decides how long the loop sleeps.
+ */
+
+#ifndef SLH_AGENT_EVENT_MAX
+/*! Largest number of events reported per turn of the loop */
+#define SLH_AGENT_EVENT_MAX	(16)
+#endif
+
+struct slh_agent_event;
+struct slh_agent_event_timer;
+
+/*!
+ * File descriptor event handler.
+ *
+ * @param[inout]	ev	The event registration
+ * @param[in]		events	epoll events seen (EPOLLIN, EPOLLOUT, …)
+ */
+typedef void (*slh_agent_event_cb)(struct slh_agent_event* const ev,
+		uint32_t events);
+
+/*!
+ * Timer expiry handler.
+ *
+ * @param[inout]	timer	The timer that expired
+ * @param[in]		now	Current time (milliseconds)
+ */
+typedef void (*slh_agent_event_timer_cb)(
+		struct slh_agent_event_timer* const timer,
+		uint64_t now);
+
+/*!
+ * File descriptor registration
+ */
+struct slh_agent_event {
+	/*! Handler to call */
+	slh_agent_event_cb cb;
+	/*! Handler data */
+	void* data;
+	/*! File descriptor watched */
+	int fd;
+	/*! Events to be handled again on the next turn */
+	uint32_t again;
+	/*! Next event needing another turn */
+	struct slh_agent_event* next_again;
+};
+
+/*!
+ * One-shot timer
+ */
+struct slh_agent_event_timer {
+	/*! Handler to call */
+	slh_agent_event_timer_cb cb;
+	/*! Handler data */
+	void* data;
+	/*! Time at which the timer fires (milliseconds) */
+	uint64_t deadline;
+	/*! Next armed timer */
+	struct slh_agent_event_timer* next;
+	/*! Whether the timer is armed */
+	uint8_t armed;
+};
+
+/*!
+ * Event loop context
+ */
+struct slh_agent_event_loop {
+	/*! epoll instance */
+	int epfd;
+	/*! Set to stop the loop */
+	uint8_t stop;
+	/*! Time at the start of this turn of the loop (milliseconds) */
+	uint64_t now;
+	/*! Events needing another turn */
+	struct slh_agent_event* again;
+	/*! Armed timers */
+	struct slh_agent_event_timer* timers;
+};
+
+/*!
+ * Return the current monotonic time in milliseconds.
+ */
+static inline uint64_t slh_agent_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/*!
+ * Initialise an event loop.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_event_init(struct slh_agent_event_loop* const loop);
+
+/*!
+ * Release the resources held by an event loop.
+ */
+void slh_agent_event_free(struct slh_agent_event_loop* const loop);
+
+/*!
+ * Put a file descriptor into non-blocking mode.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_event_nonblock(int fd);
+
+/*!
+ * Watch a file descriptor.  `ev->cb`, `ev->data` and `ev->fd` must be set
+ * by the caller.
+ *
+ * @param[inout]	loop	Event loop
+ * @param[inout]	ev	Event registration
+ * @param[in]		events	epoll events of interest
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_event_add(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event* const ev, uint32_t events);
+
+/*!
+ * Change the events of interest on a watched file descriptor.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_event_mod(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event* const ev, uint32_t events);
+
+/*!
+ * Ask for the handler to be called again on the next turn of the loop,
+ * because it stopped before draining its file descriptor.
+ */
+void slh_agent_event_again(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event* const ev, uint32_t events);
+
+/*!
+ * Arm (or re-arm) a timer.  `timer->cb` and `timer->data` must be set by
+ * the caller.
+ */
+void slh_agent_event_timer_set(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event_timer* const timer,
+		uint64_t deadline);
+
+/*!
+ * Disarm a timer.
+ */
+void slh_agent_event_timer_clear(struct slh_agent_event_loop* const loop,
+		struct slh_agent_event_timer* const timer);
+
+/*!
+ * Return how long the loop may sleep: not at all if a handler asked for
+ * another turn, otherwise until the nearest timer expires or for
+ * `max_wait` milliseconds, whichever is sooner (-1: no limit).
+ *
+ * For callers which sleep on something else, watching the epoll instance
+ * for readability alongside it, and calling slh_agent_event_run_once
+ * (with no wait) when it is readable or a handler asked for another turn.
+ */
+int slh_agent_event_wait_time(const struct slh_agent_event_loop* const loop,
+		int max_wait);
+
+/*!
+ * Update the time and call the handlers of expired timers, without
+ * looking at any file descriptors.
+ */
+void slh_agent_event_run_timers(struct slh_agent_event_loop* const loop);
+
+/*!
+ * Run one turn of the loop: wait for events (at most `max_wait`
+ * milliseconds), then call their handlers and those of expired timers.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_event_run_once(struct slh_agent_event_loop* const loop,
+		int max_wait);
+
+#endif
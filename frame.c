@@ -1,24 +1,150 @@
 /* SPDX-License-Identifier: GPL-2.0+ */
 /* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
 
+/* For memfd_create */
+#define _GNU_SOURCE
+
 #include "frame.h"
+#include "codec.h"
 
-#include <sys/select.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
-#ifndef SLH_WRITE_BUF_SZ
-#define SLH_WRITE_BUF_SZ	(256)
-#endif
+/*! Bytes taken by the length of each frame queued in packet mode */
+#define SLH_FRAME_PACKET_LEN_SZ	(2)
+/*! Largest number of datagrams handed to the kernel at once */
+#define SLH_FRAME_PACKET_BATCH	(64)
 
 /*!
  * Return the number of bytes waiting to be read.
  */
-static int slh_agent_frame_buf_waiting(
+static inline uint32_t slh_agent_frame_buf_waiting(
+		const struct slh_agent_frame_ctx* const ctx) {
+	return ctx->write_ptr - ctx->read_ptr;
+}
+
+/*!
+ * Return a view of the bytes waiting to be read.  Thanks to the mirrored
+ * mapping, these are always contiguous.
+ *
+ * @param[in]		ctx	Frame reader context
+ * @param[out]		len	Number of bytes waiting
+ */
+static inline const uint8_t* slh_agent_frame_buf_data(
+		const struct slh_agent_frame_ctx* const ctx,
+		uint32_t* len) {
+	*len = slh_agent_frame_buf_waiting(ctx);
+	return &(ctx->buffer[ctx->read_ptr & (ctx->buffer_sz - 1)]);
+}
+
+/*!
+ * Return a view of the free space in the buffer, which again is always
+ * contiguous.
+ *
+ * @param[in]		ctx	Frame reader context
+ * @param[out]		len	Number of bytes free
+ */
+static inline uint8_t* slh_agent_frame_buf_space(
+		const struct slh_agent_frame_ctx* const ctx,
+		uint32_t* len) {
+	*len = ctx->buffer_sz - slh_agent_frame_buf_waiting(ctx);
+	return &(ctx->buffer[ctx->write_ptr & (ctx->buffer_sz - 1)]);
+}
+
+/*!
+ * Map a ring buffer: `size` bytes of shared memory, mapped twice back to
+ * back so that a span running off the end of the first mapping carries on
+ * into the second.  `size` is rounded up to a power of two of at least one
+ * page first.
+ *
+ * @param[out]		buffer	Mapped buffer
+ * @param[inout]	size	Smallest size wanted; actual size
+ * @param[in]		name	Name of the buffer, for debugging
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+static int slh_agent_frame_buf_map(uint8_t** const buffer,
+		uint32_t* const size, const char* name);
+
+/*!
+ * Map `size` bytes of `fd` from `offset` twice, back to back.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+static int slh_agent_frame_buf_mirror(uint8_t** const buffer,
+		int fd, off_t offset, uint32_t size);
+
+/*!
+ * Decode a COBS-framed frame from the receive buffer.
+ */
+static int slh_agent_frame_cobs_read(struct slh_agent_frame_ctx* const ctx,
+		struct slh_agent_frame* const frame,
+		uint16_t max_sz);
+
+/*!
+ * Discard waiting bytes up to and including the next zero byte, which
+ * ends a COBS-framed frame.  If one is found, the decoder goes back to
+ * waiting for a new frame.
+ *
+ * @returns	Number of bytes discarded.
+ */
+static uint32_t slh_agent_frame_cobs_skip(
+		struct slh_agent_frame_ctx* const ctx);
+
+/*!
+ * Receive a frame from a SOCK_SEQPACKET socket.
+ */
+static int slh_agent_frame_packet_read(
+		struct slh_agent_frame_ctx* const ctx,
+		struct slh_agent_frame* const frame,
+		uint16_t max_sz);
+
+/*!
+ * Queue a frame to be sent as a datagram.
+ */
+static int slh_agent_frame_packet_write(
+		struct slh_agent_frame_ctx* const ctx,
+		const struct slh_agent_frame* const frame,
+		uint16_t frame_sz);
+
+/*!
+ * Send the queued frames, one datagram each.
+ */
+static int slh_agent_frame_packet_flush(
 		struct slh_agent_frame_ctx* const ctx);
 
+/*!
+ * Read a frame from the shared memory ring.
+ */
+static int slh_agent_frame_shm_read(struct slh_agent_frame_ctx* const ctx,
+		struct slh_agent_frame* const frame,
+		uint16_t max_sz);
+
+/*!
+ * Copy a frame into the shared memory ring.
+ */
+static int slh_agent_frame_shm_write(struct slh_agent_frame_ctx* const ctx,
+		const struct slh_agent_frame* const frame,
+		uint16_t frame_sz);
+
+/*!
+ * Publish the frames written to the shared memory ring.
+ */
+static int slh_agent_frame_shm_flush(struct slh_agent_frame_ctx* const ctx);
+
+/*!
+ * Signal an eventfd.
+ */
+static void slh_agent_frame_shm_kick(int fd);
+
 /*!
  * Read data into the buffer from the file descriptor.
  * Stop when we run out of data to read or space in the buffer.
@@ -30,19 +156,38 @@ static int slh_agent_frame_buf_fetch(
 		struct slh_agent_frame_ctx* const ctx);
 
 /*!
- * Seek `offset` bytes into the buffer and return the byte
- * at that offset.
+ * Return the byte a DLE escape sequence ending in `byte` stands for, or 0
+ * if the sequence is invalid.
  */
-static uint8_t slh_agent_frame_buf_readbyte(
-		struct slh_agent_frame_ctx* const ctx,
-		uint16_t offset);
+static inline uint8_t slh_agent_frame_unescape(uint8_t byte) {
+	switch (byte) {
+	case E_STX:
+		return STX;
+	case E_ETX:
+		return ETX;
+	case E_DLE:
+		return DLE;
+	default:
+		return 0;
+	}
+}
+
+/*!
+ * Discard waiting bytes up to and including the next ETX, or up to the
+ * next STX, whichever comes first.  If either is found, the decoder goes
+ * back to waiting for a new frame.
+ *
+ * @returns	Number of bytes discarded.
+ */
+static uint32_t slh_agent_frame_skip(
+		struct slh_agent_frame_ctx* const ctx);
 
 /*!
  * Dequeue `len` bytes from the buffer.
  */
 static void slh_agent_frame_buf_dequeue(
 		struct slh_agent_frame_ctx* const ctx,
-		uint16_t len);
+		uint32_t len);
 
 /*!
  * Initialise a frame reader/writer context.
@@ -50,314 +195,1027 @@ static void slh_agent_frame_buf_dequeue(
  * @param[inout]	ctx	Frame reader/writer context
  * @param[in]		rx_fd	Receive file descriptor
  * @param[in]		tx_fd	Transmit file descriptor
- * @param[in]		buf	Buffer pointer (or NULL to `malloc`)
- * @param[in]		buf_sz	Buffer size to initialise.
+ * @param[in]		buf_sz	Smallest receive buffer size
  *
  * @retval	0	Success
  * @retval	-EINVAL	Invalid parameters
  * @retval	-ENOMEM	Unable to allocate buffer
  */
 int slh_agent_frame_init(struct slh_agent_frame_ctx* const ctx,
-		int rx_fd, int tx_fd, uint8_t* buf, uint16_t buf_sz) {
-	if (!buf) {
-		buf = malloc(buf_sz);
-		if (!buf)
-			return -ENOMEM;
-	}
-	ctx->buffer = buf;
+		int rx_fd, int tx_fd, uint32_t buf_sz, uint32_t tx_sz) {
+	int res;
+
+	if ((!buf_sz) || (buf_sz > SLH_FRAME_BUF_MAX)
+			|| (!tx_sz) || (tx_sz > SLH_FRAME_BUF_MAX))
+		return -EINVAL;
+
 	ctx->buffer_sz = buf_sz;
+	res = slh_agent_frame_buf_map(&ctx->buffer, &ctx->buffer_sz,
+			"6lhagent-rx");
+	if (res < 0)
+		return res;
+
+	ctx->tx_buffer_sz = tx_sz;
+	res = slh_agent_frame_buf_map(&ctx->tx_buffer, &ctx->tx_buffer_sz,
+			"6lhagent-tx");
+	if (res < 0) {
+		munmap(ctx->buffer, 2 * (size_t)ctx->buffer_sz);
+		ctx->buffer = NULL;
+		return res;
+	}
+
 	ctx->read_ptr = 0;
 	ctx->write_ptr = 0;
+	ctx->tx_read_ptr = 0;
+	ctx->tx_write_ptr = 0;
 	ctx->rx_fd = rx_fd;
 	ctx->tx_fd = tx_fd;
+	ctx->rx_ready = true;
+	ctx->eof = false;
+	ctx->tx_async = false;
+	ctx->rx_state = SLH_FRAME_RX_IDLE;
+	ctx->rx_len = 0;
+	ctx->rx_run = 0;
+	ctx->rx_zero = false;
+	ctx->framing = SLH_FRAMING_STUFFED;
+	ctx->shm = NULL;
+	ctx->rx_ring = NULL;
+	ctx->tx_ring = NULL;
+	ctx->peer_rx_fd = -1;
+	ctx->peer_tx_fd = -1;
+
+	return 0;
+}
+
+int slh_agent_frame_init_packet(struct slh_agent_frame_ctx* const ctx,
+		int fd, uint32_t tx_sz) {
+	socklen_t type_sz;
+	int type;
+	int res;
+
+	if ((!tx_sz) || (tx_sz > SLH_FRAME_BUF_MAX))
+		return -EINVAL;
+
+	/* Frame boundaries are only kept by SOCK_SEQPACKET */
+	type_sz = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_sz) < 0)
+		return -errno;
+	if (type != SOCK_SEQPACKET)
+		return -EPROTOTYPE;
+
+	/* Datagrams are received straight into the caller's buffer */
+	ctx->buffer = NULL;
+	ctx->buffer_sz = 0;
+
+	ctx->tx_buffer_sz = tx_sz;
+	res = slh_agent_frame_buf_map(&ctx->tx_buffer, &ctx->tx_buffer_sz,
+			"6lhagent-tx");
+	if (res < 0)
+		return res;
+
+	ctx->read_ptr = 0;
+	ctx->write_ptr = 0;
+	ctx->tx_read_ptr = 0;
+	ctx->tx_write_ptr = 0;
+	ctx->rx_fd = fd;
+	ctx->tx_fd = fd;
+	ctx->rx_ready = true;
+	ctx->eof = false;
+	ctx->tx_async = false;
+	ctx->rx_state = SLH_FRAME_RX_IDLE;
+	ctx->rx_len = 0;
+	ctx->rx_run = 0;
+	ctx->rx_zero = false;
+	ctx->framing = SLH_FRAMING_PACKET;
+	ctx->shm = NULL;
+	ctx->rx_ring = NULL;
+	ctx->tx_ring = NULL;
+	ctx->peer_rx_fd = -1;
+	ctx->peer_tx_fd = -1;
+
+	return 0;
+}
+
+int slh_agent_frame_init_shm(struct slh_agent_frame_ctx* const ctx,
+		const struct slh_agent_shm_fds* const fds, _Bool parent) {
+	long page_sz = sysconf(_SC_PAGESIZE);
+	struct slh_agent_shm_header* hdr;
+	uint32_t ring_sz;
+	struct stat st;
+	int res;
+
+	if (page_sz <= 0)
+		return -EINVAL;
+
+	if (fstat(fds->mem_fd, &st) < 0)
+		return -errno;
+
+	if (st.st_size < page_sz)
+		return -EINVAL;
+
+	hdr = mmap(NULL, page_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fds->mem_fd, 0);
+	if (hdr == MAP_FAILED)
+		return -errno;
+
+	/* Check the header before trusting the ring size */
+	ring_sz = hdr->ring_sz;
+	if ((hdr->magic != SLH_AGENT_SHM_MAGIC)
+			|| (hdr->version != SLH_AGENT_SHM_VERSION)
+			|| (ring_sz < page_sz)
+			|| (ring_sz > SLH_FRAME_BUF_MAX)
+			|| (ring_sz & (ring_sz - 1))
+			|| (st.st_size < (3 * (off_t)ring_sz))) {
+		res = -EINVAL;
+		goto unmaphdr;
+	}
+
+	ctx->buffer_sz = ring_sz;
+	res = slh_agent_frame_buf_mirror(&ctx->buffer, fds->mem_fd,
+			(parent ? 2 : 1) * (off_t)ring_sz, ring_sz);
+	if (res < 0)
+		goto unmaphdr;
+
+	ctx->tx_buffer_sz = ring_sz;
+	res = slh_agent_frame_buf_mirror(&ctx->tx_buffer, fds->mem_fd,
+			(parent ? 1 : 2) * (off_t)ring_sz, ring_sz);
+	if (res < 0)
+		goto unmaprx;
+
+	ctx->shm = hdr;
+	if (parent) {
+		ctx->rx_ring = &hdr->to_parent;
+		ctx->tx_ring = &hdr->to_agent;
+		ctx->rx_fd = fds->parent_rx_fd;
+		ctx->tx_fd = fds->parent_tx_fd;
+		ctx->peer_rx_fd = fds->agent_rx_fd;
+		ctx->peer_tx_fd = fds->agent_tx_fd;
+	} else {
+		ctx->rx_ring = &hdr->to_agent;
+		ctx->tx_ring = &hdr->to_parent;
+		ctx->rx_fd = fds->agent_rx_fd;
+		ctx->tx_fd = fds->agent_tx_fd;
+		ctx->peer_rx_fd = fds->parent_rx_fd;
+		ctx->peer_tx_fd = fds->parent_tx_fd;
+	}
+
+	ctx->read_ptr = atomic_load(&ctx->rx_ring->tail);
+	ctx->write_ptr = ctx->read_ptr;
+	ctx->tx_write_ptr = atomic_load(&ctx->tx_ring->head);
+	ctx->tx_read_ptr = ctx->tx_write_ptr;
+	ctx->rx_ready = true;
+	ctx->eof = false;
+	ctx->tx_async = false;
+	ctx->rx_state = SLH_FRAME_RX_IDLE;
+	ctx->rx_len = 0;
+	ctx->rx_run = 0;
+	ctx->rx_zero = false;
+	ctx->framing = SLH_FRAMING_SHM;
 
 	return 0;
+
+unmaprx:
+	munmap(ctx->buffer, 2 * (size_t)ctx->buffer_sz);
+	ctx->buffer = NULL;
+unmaphdr:
+	munmap(hdr, page_sz);
+	return res;
+}
+
+void slh_agent_frame_free(struct slh_agent_frame_ctx* const ctx) {
+	if (ctx->shm) {
+		/* Hand over the last frames and say there are no more */
+		atomic_store(&ctx->tx_ring->head, ctx->tx_write_ptr);
+		atomic_store(&ctx->tx_ring->closed, true);
+		slh_agent_frame_shm_kick(ctx->peer_rx_fd);
+		munmap(ctx->shm, sysconf(_SC_PAGESIZE));
+		ctx->shm = NULL;
+	}
+	if (ctx->buffer)
+		munmap(ctx->buffer, 2 * (size_t)ctx->buffer_sz);
+	if (ctx->tx_buffer)
+		munmap(ctx->tx_buffer, 2 * (size_t)ctx->tx_buffer_sz);
+	ctx->buffer = NULL;
+	ctx->tx_buffer = NULL;
 }
 
 int slh_agent_read_frame(struct slh_agent_frame_ctx* const ctx,
 		struct slh_agent_frame* const frame,
 		uint16_t max_sz) {
-	uint16_t frame_sz = 0;
-	uint8_t offset = 0;
-	uint8_t* ptr = (uint8_t*)frame;
+	uint8_t* const out = (uint8_t*)frame;
+	struct slh_agent_codec_scan scan = SLH_AGENT_CODEC_SCAN_INIT;
+	uint32_t skipped = 0;
+
+	if (ctx->framing == SLH_FRAMING_COBS)
+		return slh_agent_frame_cobs_read(ctx, frame, max_sz);
+	if (ctx->framing == SLH_FRAMING_PACKET)
+		return slh_agent_frame_packet_read(ctx, frame, max_sz);
+	if (ctx->framing == SLH_FRAMING_SHM)
+		return slh_agent_frame_shm_read(ctx, frame, max_sz);
 
-	/* See if anything is waiting */
-	uint16_t rem = slh_agent_frame_buf_fetch(ctx);
+	while (1) {
+		const uint8_t* data;
+		const uint8_t* stx;
+		uint32_t rem;
+		uint32_t off;
+		size_t run;
+		uint8_t byte;
 
-	/* Read until we see STX */
-	while (rem) {
-		uint8_t byte = slh_agent_frame_buf_readbyte(ctx, offset);
-		if (byte == STX)
+		data = slh_agent_frame_buf_data(ctx, &rem);
+		if (!rem) {
+			/* All decoded so far, see if there's more */
+			int res = slh_agent_frame_buf_fetch(ctx);
+			if (res < 0)
+				return res;
+			if (!res)
+				break;
+			continue;
+		}
+
+		switch (ctx->rx_state) {
+		case SLH_FRAME_RX_IDLE:
+			/* Read until we see STX, discarding the rest */
+			stx = memchr(data, STX, rem);
+			if (!stx) {
+				slh_agent_frame_buf_dequeue(ctx, rem);
+				skipped += rem;
+				break;
+			}
+
+			slh_agent_frame_buf_dequeue(ctx, (stx - data) + 1);
+			ctx->rx_state = SLH_FRAME_RX_DATA;
+			ctx->rx_len = 0;
 			break;
 
-		offset++;
-		rem--;
-	}
+		case SLH_FRAME_RX_DATA:
+			/* Decode as much as is waiting in one go */
+			off = 0;
+			while (1) {
+				/* Copy up to the next special byte */
+				run = slh_agent_codec_span_next(&scan,
+						data + off, rem - off);
+				if (run > (uint32_t)(max_sz - ctx->rx_len)) {
+					/* No more space for these bytes */
+					slh_agent_frame_buf_dequeue(ctx,
+							off + run);
+					goto toobig;
+				}
 
-	/* Discard these initial bytes */
-	slh_agent_frame_buf_dequeue(ctx, offset);
+				memcpy(out + ctx->rx_len, data + off, run);
+				ctx->rx_len += run;
+				off += run;
 
-	/* If nothing left, bail */
-	if (!rem) {
-		if (offset)
-			return -EBADMSG;
-		else
-			return 0;
-	}
+				/* Carry on if a whole escape is here */
+				if ((off == rem) || ((off + 1) == rem)
+						|| (data[off] != DLE))
+					break;
 
-	/* Count the STX */
-	offset = 1;
-	rem--;
+				byte = slh_agent_frame_unescape(
+						data[off + 1]);
+				if (!byte)
+					/* Invalid, dealt with below */
+					break;
 
-	/* Following this should be our frame */
-	while (rem) {
-		uint8_t byte = slh_agent_frame_buf_readbyte(ctx, offset);
-		if (byte == ETX) {
-			/* This is the end of the frame */
-			offset++;
-
-			/* Dequeue the now complete frame and exit */
-			slh_agent_frame_buf_dequeue(ctx, offset);
-			return frame_sz;
-		} else if (byte == STX) {
-			/* This is the start of another frame! */
-			slh_agent_frame_buf_dequeue(ctx, offset);
-			return -EBADMSG;
-		} else if (byte == DLE) {
-			/* This is a two-byte escape sequence */
-			if (rem < 2)
-				/* Only the DLE present, wait for the rest */
-				return 0;
-
-			byte = slh_agent_frame_buf_readbyte(ctx, offset+1);
-			switch (byte) {
-			case E_STX:
-				byte = STX;
-				break;
-			case E_ETX:
-				byte = ETX;
+				if (ctx->rx_len == max_sz) {
+					/* No more space for this byte */
+					slh_agent_frame_buf_dequeue(ctx,
+							off + 2);
+					goto toobig;
+				}
+
+				out[ctx->rx_len] = byte;
+				ctx->rx_len++;
+				off += 2;
+			}
+
+			slh_agent_frame_buf_dequeue(ctx, off);
+			if (off == rem)
+				/* End of waiting data */
 				break;
-			case E_DLE:
-				byte = DLE;
+
+			byte = data[off];
+			if (byte == STX) {
+				/*
+				 * This is the start of another frame!  Leave
+				 * it for the next call.
+				 */
+				ctx->rx_state = SLH_FRAME_RX_IDLE;
+				return -EBADMSG;
+			}
+
+			slh_agent_frame_buf_dequeue(ctx, 1);
+			if (byte == DLE) {
+				/* This is a two-byte escape sequence */
+				ctx->rx_state = SLH_FRAME_RX_ESCAPE;
 				break;
-			default:
+			}
+
+			/* This is the end of the frame */
+			ctx->rx_state = SLH_FRAME_RX_IDLE;
+			if (!ctx->rx_len)
+				/* Not even a frame type */
+				return -EBADMSG;
+			return ctx->rx_len;
+
+		case SLH_FRAME_RX_ESCAPE:
+			byte = slh_agent_frame_unescape(data[0]);
+			if (data[0] == STX) {
+				/* Start of another frame, as above */
+				ctx->rx_state = SLH_FRAME_RX_IDLE;
+				return -EBADMSG;
+			} else if (!byte) {
 				/* Invalid sequence */
-				slh_agent_frame_buf_dequeue(ctx, offset+2);
+				slh_agent_frame_buf_dequeue(ctx, 1);
+				ctx->rx_state = SLH_FRAME_RX_DISCARD;
 				return -EBADMSG;
 			}
-			offset += 2;
-			rem -= 2;
-		} else {
-			/* This is a valid byte in the frame */
-			offset++;
-		}
 
-		/* No more space for this byte */
-		if (!max_sz)
-			return -EMSGSIZE;
+			slh_agent_frame_buf_dequeue(ctx, 1);
+			if (ctx->rx_len == max_sz)
+				/* No more space for this byte */
+				goto toobig;
+
+			out[ctx->rx_len] = byte;
+			ctx->rx_len++;
+			ctx->rx_state = SLH_FRAME_RX_DATA;
+			break;
 
-		*ptr = byte;
-		ptr++;
-		frame_sz++;
-		max_sz--;
+		default:
+			/* Still discarding a bad frame */
+			slh_agent_frame_skip(ctx);
+			break;
+		}
 	}
 
 	/* If we're here, then no ETX was seen. */
-	return 0;
+	if (skipped && (ctx->rx_state == SLH_FRAME_RX_IDLE))
+		/* Only garbage was waiting */
+		return -EBADMSG;
+	return ctx->eof ? -EPIPE : 0;
+
+toobig:
+	/* The rest of this frame is discarded as it arrives */
+	ctx->rx_state = SLH_FRAME_RX_DISCARD;
+	return -EMSGSIZE;
 }
 
 int slh_agent_drop_frame(struct slh_agent_frame_ctx* const ctx) {
-	uint16_t rem = slh_agent_frame_buf_waiting(ctx);
-	uint16_t num = 0;
-
-	while (rem) {
-		uint8_t byte = slh_agent_frame_buf_readbyte(ctx, num);
-		num++;
-		rem--;
-
-		switch (byte) {
-		case ETX:
-			/* Drop everything up to the ETX */
-			slh_agent_frame_buf_dequeue(ctx, num);
-			return num;
-		case STX:
-			/* Drop everything up to just before STX */
-			slh_agent_frame_buf_dequeue(ctx, num - 1);
-			return num - 1;
-		}
-	}
+	if (ctx->rx_state == SLH_FRAME_RX_IDLE)
+		/* Not part way through a frame */
+		return 0;
 
-	/* No data or all garbage. */
-	ctx->read_ptr = 0;
-	ctx->write_ptr = 0;
-	return num;
+	ctx->rx_state = SLH_FRAME_RX_DISCARD;
+	if (ctx->framing == SLH_FRAMING_COBS)
+		return slh_agent_frame_cobs_skip(ctx);
+	return slh_agent_frame_skip(ctx);
 }
 
 int slh_agent_write_frame(struct slh_agent_frame_ctx* const ctx,
 		const struct slh_agent_frame* const frame,
 		uint16_t frame_sz) {
-	const uint8_t* rptr = (const uint8_t*)frame;
-	uint8_t buf[SLH_WRITE_BUF_SZ];
-	uint8_t* wptr;
-	uint16_t buf_sz = 0;
-	_Bool stx_sent = false;
-	_Bool etx_sent = false;
-
-	/* Start with an STX byte */
-	while (frame_sz) {
-		wptr = buf;
-		buf_sz = 0;
-
-		if (!stx_sent) {
-			*wptr = STX;
-			wptr++;
-			buf_sz++;
-		}
+	uint32_t space_sz = slh_agent_frame_tx_space(ctx);
+	uint8_t* space;
+	size_t consumed;
+	size_t len;
 
-		/* Fill up the write buffer */
-		while (frame_sz) {
-			if ((*rptr == STX)
-					|| (*rptr == ETX)
-					|| (*rptr == DLE)) {
-				/* Escape sequence needed */
-				if ((buf_sz + 1) >= sizeof(buf))
-					break;
+	if (ctx->framing == SLH_FRAMING_PACKET)
+		return slh_agent_frame_packet_write(ctx, frame, frame_sz);
+	if (ctx->framing == SLH_FRAMING_SHM)
+		return slh_agent_frame_shm_write(ctx, frame, frame_sz);
 
-				wptr[0] = DLE;
-				switch (*rptr) {
-				case STX:
-					wptr[1] = E_STX;
-					break;
-				case ETX:
-					wptr[1] = E_ETX;
-					break;
-				case DLE:
-					wptr[1] = E_DLE;
-					break;
-				}
+	if (ctx->framing == SLH_FRAMING_COBS)
+		len = slh_agent_codec_cobs_max(frame_sz) + 1;
+	else
+		len = slh_agent_frame_encoded_max(frame_sz);
 
-				wptr += 2;
-				buf_sz += 2;
-			} else {
-				/* Ordinary byte */
-				if (buf_sz >= sizeof(buf))
-					break;
-				*wptr = *rptr;
-				wptr++;
-				buf_sz++;
-			}
-			frame_sz--;
-			rptr++;
-		}
+	if (space_sz < len) {
+		/* Make some room, if the peer is keeping up */
+		int res = slh_agent_frame_flush(ctx);
+		if ((res < 0) && (res != -EAGAIN))
+			return res;
+		space_sz = slh_agent_frame_tx_space(ctx);
+	}
 
-		if (!frame_sz && (buf_sz < sizeof(buf))) {
-			*wptr = ETX;
-			buf_sz++;
-			etx_sent = true;
-		}
+	/* Encode straight into the free space, which never wraps */
+	space = &(ctx->tx_buffer[ctx->tx_write_ptr
+			& (ctx->tx_buffer_sz - 1)]);
 
-		/* Write out the buffer */
-		if (write(ctx->tx_fd, buf, buf_sz) < buf_sz)
-			return -errno;
+	if (ctx->framing == SLH_FRAMING_COBS) {
+		/* Always fits if there's room for the worst case */
+		if (space_sz < len)
+			return -EAGAIN;
+
+		len = slh_agent_codec_cobs_encode(space,
+				(const uint8_t*)frame, frame_sz);
+		space[len] = 0;
+		ctx->tx_write_ptr += len + 1;
+		return 0;
 	}
 
-	if (!etx_sent) {
-		/* Didn't squeeze the ETX in, send it now */
-		buf[0] = ETX;
-		if (write(ctx->tx_fd, buf, 1) < 1)
+	/* Room for the STX and ETX at least? */
+	if (space_sz < 2)
+		return -EAGAIN;
+
+	space[0] = STX;
+	len = 1 + slh_agent_codec_escape(&space[1], space_sz - 2,
+			(const uint8_t*)frame, frame_sz, &consumed);
+	if (consumed < frame_sz)
+		/* Didn't fit, leave it out altogether */
+		return -EAGAIN;
+
+	space[len] = ETX;
+	len++;
+
+	ctx->tx_write_ptr += len;
+	return 0;
+}
+
+int slh_agent_frame_flush(struct slh_agent_frame_ctx* const ctx) {
+	if (ctx->tx_async)
+		/* Sent as and when the I/O engine gets to it */
+		return slh_agent_frame_tx_pending(ctx) ? -EAGAIN : 0;
+	if (ctx->framing == SLH_FRAMING_PACKET)
+		return slh_agent_frame_packet_flush(ctx);
+	if (ctx->framing == SLH_FRAMING_SHM)
+		return slh_agent_frame_shm_flush(ctx);
+
+	while (slh_agent_frame_tx_pending(ctx)) {
+		/* Waiting data never wraps either */
+		const uint8_t* data = &(ctx->tx_buffer[ctx->tx_read_ptr
+				& (ctx->tx_buffer_sz - 1)]);
+		ssize_t sz = write(ctx->tx_fd, data,
+				slh_agent_frame_tx_pending(ctx));
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
 			return -errno;
+		}
+		ctx->tx_read_ptr += sz;
 	}
+	return 0;
+}
+
+int slh_agent_frame_set_framing(struct slh_agent_frame_ctx* const ctx,
+		uint8_t framing) {
+	if (((ctx->framing != SLH_FRAMING_STUFFED)
+				&& (ctx->framing != SLH_FRAMING_COBS))
+			|| ((framing != SLH_FRAMING_STUFFED)
+				&& (framing != SLH_FRAMING_COBS)))
+		return -EINVAL;
+
+	if (framing == ctx->framing)
+		return 0;
+
+	if ((framing == SLH_FRAMING_COBS) && slh_agent_frame_tx_space(ctx))
+		/* End whatever the peer might still be decoding */
+		ctx->tx_buffer[ctx->tx_write_ptr++
+			& (ctx->tx_buffer_sz - 1)] = 0;
 
+	/* Whatever follows is a new frame */
+	ctx->framing = framing;
+	ctx->rx_state = SLH_FRAME_RX_IDLE;
+	ctx->rx_len = 0;
 	return 0;
 }
 
-static int slh_agent_frame_buf_fetch(
-		struct slh_agent_frame_ctx* const ctx) {
-	fd_set rfds;
-	struct timeval tv;
+const uint8_t* slh_agent_find_option(const uint8_t* opts, uint16_t opts_sz,
+		uint8_t type, uint8_t* len) {
+	while (opts_sz >= 2) {
+		uint8_t opt_len = opts[1];
+		if ((opt_len + 2) > opts_sz)
+			/* Truncated option */
+			break;
 
-	/* How many bytes are spare? */
-	uint16_t buf_rem;
-	if (ctx->write_ptr <= ctx->read_ptr) {
-		buf_rem = ctx->buffer_sz + ctx->read_ptr - ctx->write_ptr;
-	} else {
-		buf_rem = ctx->read_ptr - ctx->write_ptr;
+		if (opts[0] == type) {
+			*len = opt_len;
+			return &opts[2];
+		}
+
+		opts += opt_len + 2;
+		opts_sz -= opt_len + 2;
 	}
+	return NULL;
+}
 
-	/* Stop if there's no space */
-	if (!buf_rem)
-		return ctx->buffer_sz;
+static int slh_agent_frame_buf_map(uint8_t** const buffer,
+		uint32_t* const size, const char* name) {
+	long page_sz = sysconf(_SC_PAGESIZE);
+	uint32_t map_sz;
+	int res = 0;
+	int fd;
 
-	/* See if there's data waiting */
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-	FD_ZERO(&rfds);
-	FD_SET(ctx->rx_fd, &rfds);
-	int res = select(ctx->rx_fd + 1, &rfds, NULL, NULL, &tv);
-	if (res < 0) {
+	if (page_sz <= 0)
+		return -EINVAL;
+
+	/* Round up to a power of two, no smaller than a page */
+	map_sz = page_sz;
+	while (map_sz < *size)
+		map_sz <<= 1;
+
+	fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0)
 		return -errno;
-	} else if (!res) {
-		/* No new data */
-		return 0;
+
+	if (ftruncate(fd, map_sz) < 0) {
+		res = -errno;
+		goto closefd;
 	}
 
-	/* Allocate some buffer space and read */
-	uint8_t buf[buf_rem];
-	const uint8_t* ptr = buf;
-	ssize_t sz = read(ctx->rx_fd, buf, sizeof(buf));
-	/* EAGAIN and EWOULDBLOCK are fine */
-	if ((sz < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+	res = slh_agent_frame_buf_mirror(buffer, fd, 0, map_sz);
+	if (res == 0)
+		*size = map_sz;
+
+closefd:
+	/* The mappings keep the memory alive */
+	close(fd);
+	return res;
+}
+
+static int slh_agent_frame_buf_mirror(uint8_t** const buffer,
+		int fd, off_t offset, uint32_t size) {
+	/* Reserve address space for both mappings */
+	uint8_t* base = mmap(NULL, 2 * (size_t)size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
 		return -errno;
 
-	while (sz) {
-		uint16_t len;
-		if (ctx->read_ptr <= ctx->write_ptr) {
-			/* [  R        W-------] */
-			len = ctx->buffer_sz - ctx->write_ptr;
-		} else {
-			len = ctx->read_ptr - ctx->write_ptr;
-		}
+	/* Map the buffer into each half */
+	if ((mmap(base, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, offset)
+				== MAP_FAILED)
+			|| (mmap(base + size, size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, offset)
+				== MAP_FAILED)) {
+		int res = -errno;
+		munmap(base, 2 * (size_t)size);
+		return res;
+	}
+
+	*buffer = base;
+	return 0;
+}
+
+static int slh_agent_frame_buf_fetch(
+		struct slh_agent_frame_ctx* const ctx) {
+	/* How many bytes are spare? */
+	uint32_t buf_rem;
+	uint8_t* space = slh_agent_frame_buf_space(ctx, &buf_rem);
+	ssize_t sz;
 
-		if (len > sz)
-			len = sz;
+	/* Stop if there's no space or nothing to read */
+	if (!buf_rem || !ctx->rx_ready)
+		return slh_agent_frame_buf_waiting(ctx);
 
-		memcpy(&(ctx->buffer[ctx->write_ptr]),
-				ptr,
-				len);
-		ptr += len;
-		sz -= len;
-		ctx->write_ptr = (ctx->write_ptr + len)
-			% ctx->buffer_sz;
+	/* The free space never wraps, so read straight into it */
+	do {
+		sz = read(ctx->rx_fd, space, buf_rem);
+	} while ((sz < 0) && (errno == EINTR));
+
+	if (sz < 0) {
+		/* EAGAIN and EWOULDBLOCK are fine: no new data */
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			return -errno;
+		sz = 0;
+	} else if (!sz) {
+		/* End of file: the peer has closed the channel */
+		ctx->eof = true;
 	}
 
+	if (sz < (ssize_t)buf_rem)
+		/* A short read means we've drained the descriptor */
+		ctx->rx_ready = false;
+
+	ctx->write_ptr += sz;
 	return slh_agent_frame_buf_waiting(ctx);
 }
 
-static int slh_agent_frame_buf_waiting(
+static uint32_t slh_agent_frame_skip(
 		struct slh_agent_frame_ctx* const ctx) {
-	if (ctx->read_ptr <= ctx->write_ptr) {
-		return ctx->write_ptr - ctx->read_ptr;
-	} else {
-		return ctx->buffer_sz + ctx->write_ptr - ctx->read_ptr;
+	uint32_t rem;
+	const uint8_t* data = slh_agent_frame_buf_data(ctx, &rem);
+	uint32_t num = 0;
+
+	while (num < rem) {
+		/* Skip to the next special byte */
+		num += slh_agent_codec_span(data + num, rem - num);
+		if (num == rem)
+			break;
+
+		if (data[num] == STX) {
+			/* Stop just before the next frame */
+			ctx->rx_state = SLH_FRAME_RX_IDLE;
+			break;
+		}
+
+		num++;
+		if (data[num - 1] == ETX) {
+			/* Stop after the end of this one */
+			ctx->rx_state = SLH_FRAME_RX_IDLE;
+			break;
+		}
 	}
-}
 
-static uint8_t slh_agent_frame_buf_readbyte(
-		struct slh_agent_frame_ctx* const ctx,
-		uint16_t offset) {
-	return ctx->buffer[
-		(ctx->read_ptr + offset)
-			% ctx->buffer_sz];
+	slh_agent_frame_buf_dequeue(ctx, num);
+	return num;
 }
 
 static void slh_agent_frame_buf_dequeue(
 		struct slh_agent_frame_ctx* const ctx,
-		uint16_t len) {
+		uint32_t len) {
 	/* Clamp to amount remaining */
-	uint16_t rem = slh_agent_frame_buf_waiting(ctx);
+	uint32_t rem = slh_agent_frame_buf_waiting(ctx);
 	if (len > rem)
 		len = rem;
 
-	ctx->read_ptr = (ctx->read_ptr + len)
-		% ctx->buffer_sz;
+	ctx->read_ptr += len;
+}
+
+static int slh_agent_frame_cobs_read(struct slh_agent_frame_ctx* const ctx,
+		struct slh_agent_frame* const frame,
+		uint16_t max_sz) {
+	uint8_t* const out = (uint8_t*)frame;
+
+	while (1) {
+		const uint8_t* data;
+		const uint8_t* zero;
+		uint32_t rem;
+		uint32_t len;
+		uint32_t off;
+		uint32_t run;
+		uint32_t left;
+		uint8_t code;
+		_Bool pad;
+
+		data = slh_agent_frame_buf_data(ctx, &rem);
+		if (!rem) {
+			/* All decoded so far, see if there's more */
+			int res = slh_agent_frame_buf_fetch(ctx);
+			if (res < 0)
+				return res;
+			if (!res)
+				break;
+			continue;
+		}
+
+		switch (ctx->rx_state) {
+		case SLH_FRAME_RX_IDLE:
+			if (!data[0]) {
+				/* Zeros between frames are ignored */
+				slh_agent_frame_buf_dequeue(ctx, 1);
+				break;
+			}
+
+			ctx->rx_state = SLH_FRAME_RX_DATA;
+			ctx->rx_len = 0;
+			ctx->rx_run = 0;
+			ctx->rx_zero = false;
+			break;
+
+		case SLH_FRAME_RX_DATA:
+			/* Decode up to the zero ending the frame, if it's here */
+			zero = memchr(data, 0, rem);
+			if (zero)
+				rem = zero - data;
+
+			/* Work on copies: stores to `out` could alias `ctx` */
+			len = ctx->rx_len;
+			left = ctx->rx_run;
+			pad = ctx->rx_zero;
+			off = 0;
+			while (1) {
+				/* Copy as much of the block as is waiting */
+				run = left;
+				if (run > (rem - off))
+					run = rem - off;
+				if (run > (max_sz - len)) {
+					/* No more space for these bytes */
+					slh_agent_frame_buf_dequeue(ctx,
+							off + run);
+					goto toobig;
+				}
+
+				memcpy(out + len, data + off, run);
+				len += run;
+				left -= run;
+				off += run;
+				if (off == rem)
+					break;
+
+				/* On to the next block */
+				code = data[off];
+				off++;
+				if (pad) {
+					/* The previous one ended in a zero */
+					if (len == max_sz) {
+						slh_agent_frame_buf_dequeue(
+								ctx, off);
+						goto toobig;
+					}
+					out[len] = 0;
+					len++;
+				}
+				left = code - 1;
+				pad = (code != 0xff);
+			}
+
+			ctx->rx_len = len;
+			ctx->rx_run = left;
+			ctx->rx_zero = pad;
+			slh_agent_frame_buf_dequeue(ctx, off);
+			if (!zero)
+				/* End of waiting data */
+				break;
+
+			/* This is the end of the frame */
+			slh_agent_frame_buf_dequeue(ctx, 1);
+			ctx->rx_state = SLH_FRAME_RX_IDLE;
+			if (ctx->rx_run || !ctx->rx_len)
+				/* Cut short, or not even a frame type */
+				return -EBADMSG;
+			return ctx->rx_len;
+
+		default:
+			/* Still discarding a bad frame */
+			slh_agent_frame_cobs_skip(ctx);
+			break;
+		}
+	}
+
+	/* If we're here, then no zero was seen. */
+	return ctx->eof ? -EPIPE : 0;
+
+toobig:
+	/* The rest of this frame is discarded as it arrives */
+	ctx->rx_state = SLH_FRAME_RX_DISCARD;
+	return -EMSGSIZE;
+}
+
+static uint32_t slh_agent_frame_cobs_skip(
+		struct slh_agent_frame_ctx* const ctx) {
+	const uint8_t* zero;
+	const uint8_t* data;
+	uint32_t num;
+
+	data = slh_agent_frame_buf_data(ctx, &num);
+	zero = memchr(data, 0, num);
+	if (zero) {
+		num = (zero - data) + 1;
+		ctx->rx_state = SLH_FRAME_RX_IDLE;
+	}
+
+	slh_agent_frame_buf_dequeue(ctx, num);
+	return num;
+}
+
+static int slh_agent_frame_packet_read(
+		struct slh_agent_frame_ctx* const ctx,
+		struct slh_agent_frame* const frame,
+		uint16_t max_sz) {
+	ssize_t sz;
+
+	if (!ctx->rx_ready)
+		/* Drained on a previous call */
+		return ctx->eof ? -EPIPE : 0;
+
+	do {
+		/* MSG_TRUNC: tell us the real size of an oversized frame */
+		sz = recv(ctx->rx_fd, frame, max_sz, MSG_TRUNC);
+	} while ((sz < 0) && (errno == EINTR));
+
+	if (sz < 0) {
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			return -errno;
+		ctx->rx_ready = false;
+		return 0;
+	}
+
+	if (!sz) {
+		/* Either an empty datagram, or the peer has closed its end */
+		struct pollfd pfd = { .fd = ctx->rx_fd, .events = POLLRDHUP };
+		if ((poll(&pfd, 1, 0) <= 0) || !(pfd.revents & POLLRDHUP))
+			/* Not even a frame type */
+			return -EBADMSG;
+
+		ctx->rx_ready = false;
+		ctx->eof = true;
+		return -EPIPE;
+	}
+
+	if (sz > max_sz)
+		/* The rest went with the datagram */
+		return -EMSGSIZE;
+	return sz;
+}
+
+static int slh_agent_frame_packet_write(
+		struct slh_agent_frame_ctx* const ctx,
+		const struct slh_agent_frame* const frame,
+		uint16_t frame_sz) {
+	const uint32_t need = SLH_FRAME_PACKET_LEN_SZ + frame_sz;
+	uint8_t* space;
+
+	if (slh_agent_frame_tx_space(ctx) < need) {
+		/* Make some room, if the peer is keeping up */
+		int res = slh_agent_frame_packet_flush(ctx);
+		if ((res < 0) && (res != -EAGAIN))
+			return res;
+		if (slh_agent_frame_tx_space(ctx) < need)
+			return -EAGAIN;
+	}
+
+	/* The free space never wraps */
+	space = &(ctx->tx_buffer[ctx->tx_write_ptr
+			& (ctx->tx_buffer_sz - 1)]);
+	memcpy(space, &frame_sz, sizeof(frame_sz));
+	memcpy(space + SLH_FRAME_PACKET_LEN_SZ, frame, frame_sz);
+
+	ctx->tx_write_ptr += need;
+	return 0;
+}
+
+static int slh_agent_frame_packet_flush(
+		struct slh_agent_frame_ctx* const ctx) {
+	struct mmsghdr msgs[SLH_FRAME_PACKET_BATCH];
+	struct iovec iov[SLH_FRAME_PACKET_BATCH];
+
+	while (slh_agent_frame_tx_pending(ctx)) {
+		uint32_t ptr = ctx->tx_read_ptr;
+		unsigned int count = 0;
+		int sent;
+		int i;
+
+		/* Point a message at each waiting frame, none of which wrap */
+		while ((count < SLH_FRAME_PACKET_BATCH)
+				&& (ptr != ctx->tx_write_ptr)) {
+			uint8_t* rec = &(ctx->tx_buffer[ptr
+					& (ctx->tx_buffer_sz - 1)]);
+			uint16_t len;
+
+			memcpy(&len, rec, sizeof(len));
+			iov[count].iov_base = rec + SLH_FRAME_PACKET_LEN_SZ;
+			iov[count].iov_len = len;
+			memset(&msgs[count], 0, sizeof(msgs[count]));
+			msgs[count].msg_hdr.msg_iov = &iov[count];
+			msgs[count].msg_hdr.msg_iovlen = 1;
+
+			ptr += SLH_FRAME_PACKET_LEN_SZ + len;
+			count++;
+		}
+
+		sent = sendmmsg(ctx->tx_fd, msgs, count, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		for (i = 0; i < sent; i++)
+			ctx->tx_read_ptr += SLH_FRAME_PACKET_LEN_SZ
+				+ iov[i].iov_len;
+	}
+	return 0;
+}
+
+static int slh_agent_frame_shm_read(struct slh_agent_frame_ctx* const ctx,
+		struct slh_agent_frame* const frame,
+		uint16_t max_sz) {
+	struct slh_agent_shm_ring* const ring = ctx->rx_ring;
+	const uint8_t* data;
+	uint32_t rem;
+	uint16_t len;
+	int res;
+
+	data = slh_agent_frame_buf_data(ctx, &rem);
+	if (!rem) {
+		/* See if the peer has written any more */
+		ctx->write_ptr = atomic_load_explicit(&ring->head,
+				memory_order_acquire);
+		data = slh_agent_frame_buf_data(ctx, &rem);
+	}
+
+	if (!rem && ctx->rx_ready) {
+		/*
+		 * Announce we're going to sleep, then check nothing slipped
+		 * in before the peer could see the announcement.
+		 */
+		uint64_t count;
+		if (read(ctx->rx_fd, &count, sizeof(count)) < 0) {
+			/* Nothing to reset */
+		}
+
+		atomic_store(&ring->waiting, true);
+		ctx->write_ptr = atomic_load(&ring->head);
+		data = slh_agent_frame_buf_data(ctx, &rem);
+		if (rem)
+			atomic_store(&ring->waiting, false);
+		else
+			ctx->rx_ready = false;
+	}
+
+	if (!rem) {
+		if (!atomic_load(&ring->closed))
+			return 0;
+
+		/* The last frames may have gone in just before closing */
+		ctx->write_ptr = atomic_load(&ring->head);
+		data = slh_agent_frame_buf_data(ctx, &rem);
+		if (!rem) {
+			ctx->eof = true;
+			return -EPIPE;
+		}
+	}
+
+	/* The peer only ever publishes whole frames */
+	if (rem >= SLH_AGENT_SHM_LEN_SZ)
+		memcpy(&len, data, sizeof(len));
+	if ((rem < SLH_AGENT_SHM_LEN_SZ)
+			|| ((rem - SLH_AGENT_SHM_LEN_SZ) < len)) {
+		/* ...so this one is corrupt, throw away the lot */
+		slh_agent_frame_buf_dequeue(ctx, rem);
+		res = -EBADMSG;
+	} else {
+		if (!len) {
+			res = -EBADMSG;
+		} else if (len > max_sz) {
+			res = -EMSGSIZE;
+		} else {
+			memcpy(frame, data + SLH_AGENT_SHM_LEN_SZ, len);
+			res = len;
+		}
+		slh_agent_frame_buf_dequeue(ctx, SLH_AGENT_SHM_LEN_SZ + len);
+	}
+
+	/* Hand the space back, waking the peer if it's waiting for it */
+	atomic_store(&ring->tail, ctx->read_ptr);
+	if (atomic_load(&ring->blocked)
+			&& atomic_exchange(&ring->blocked, false))
+		slh_agent_frame_shm_kick(ctx->peer_tx_fd);
+
+	return res;
+}
+
+static int slh_agent_frame_shm_write(struct slh_agent_frame_ctx* const ctx,
+		const struct slh_agent_frame* const frame,
+		uint16_t frame_sz) {
+	const uint32_t need = SLH_AGENT_SHM_LEN_SZ + frame_sz;
+	uint8_t* space;
+
+	if (slh_agent_frame_tx_space(ctx) < need) {
+		/* See if the peer has made some room */
+		ctx->tx_read_ptr = atomic_load_explicit(&ctx->tx_ring->tail,
+				memory_order_acquire);
+		if (slh_agent_frame_tx_space(ctx) < need)
+			return -EAGAIN;
+	}
+
+	/* The free space never wraps */
+	space = &(ctx->tx_buffer[ctx->tx_write_ptr
+			& (ctx->tx_buffer_sz - 1)]);
+	memcpy(space, &frame_sz, sizeof(frame_sz));
+	memcpy(space + SLH_AGENT_SHM_LEN_SZ, frame, frame_sz);
+
+	ctx->tx_write_ptr += need;
+	return 0;
+}
+
+static int slh_agent_frame_shm_flush(struct slh_agent_frame_ctx* const ctx) {
+	struct slh_agent_shm_ring* const ring = ctx->tx_ring;
+
+	if (atomic_load_explicit(&ring->head, memory_order_relaxed)
+			!= ctx->tx_write_ptr) {
+		/* Publish the new frames, waking the peer if it's asleep */
+		atomic_store(&ring->head, ctx->tx_write_ptr);
+		if (atomic_load(&ring->waiting)
+				&& atomic_exchange(&ring->waiting, false))
+			slh_agent_frame_shm_kick(ctx->peer_rx_fd);
+	}
+
+	ctx->tx_read_ptr = atomic_load(&ring->tail);
+	if (slh_agent_frame_tx_space(ctx) >= (ctx->tx_buffer_sz / 2))
+		return 0;
+
+	/*
+	 * The peer is falling behind: ask it to wake us as it makes room,
+	 * then check it didn't make some before it could see the request.
+	 */
+	if (!atomic_load(&ring->blocked)) {
+		uint64_t count;
+		if (read(ctx->tx_fd, &count, sizeof(count)) < 0) {
+			/* Nothing to reset */
+		}
+		atomic_store(&ring->blocked, true);
+	}
+
+	ctx->tx_read_ptr = atomic_load(&ring->tail);
+	if (slh_agent_frame_tx_space(ctx) >= (ctx->tx_buffer_sz / 2))
+		return 0;
+	return -EAGAIN;
+}
+
+static void slh_agent_frame_shm_kick(int fd) {
+	const uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0) {
+		/* Counter can't overflow, so this can't fail */
+	}
 }
@@ -5,6 +5,7 @@
 #define _6LH_AGENT_FRAME_H
 
 #include "tap.h"
+#include "shm.h"
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
@@ -23,12 +24,21 @@
  * - The following frame types are defined:
  *	SOH (0x01):	Device detail
  *	EOT (0x04):	End of session, shut down and exit.
+ *	ENQ (0x05):	Request for the agent's counters, or the reply
+ *			carrying them (see stats.h)
  *	ACK (0x06):	Acknowledgement of last frame
  *	NAK (0x15):	Rejection of last frame
  *	SYN (0x16):	Keep-alive, no traffic to send
  *	FS (0x1c):	Ethernet frame
+ *	GS (0x1d):	Ethernet frame with compressed IPv6 headers (see
+ *			iphc.h), once IPHC has been negotiated
+ *	RS (0x1e):	Ethernet frame, possibly a TCP super-frame, behind an
+ *			offload header saying what checksum or segmentation
+ *			is left to do (see tap.h), once OFFLOAD has been
+ *			negotiated
  * - Only one frame may be sent at a time, an ACK or NAK must be
- *   received in reply before the next may be sent.
+ *   received in reply before the next may be sent, unless a larger window
+ *   has been negotiated (see window.h).
  * - SYN may be used to poll the other side to see if it's still alive.
  *   An ACK should be the immediate response.
  * - The very first frame sent by this program will be a `SOH` frame which
@@ -38,6 +48,26 @@
  *   - 4 bytes: interface index (big endian)
  *   - 1 byte: length of name field
  *   - N bytes: interface name
+ *   - remainder: options offered by the agent
+ * - The ACK sent in reply to `SOH` may carry the options accepted by the
+ *   parent.  Options are encoded as a type byte, a length byte and the
+ *   value.  Options not mentioned in the ACK are not used.  The following
+ *   options are defined:
+ *	WINDOW (0x01):	1 byte: largest number of frames in flight
+ *	FRAMING (0x02):	N bytes: framings the agent can switch to, the one
+ *			in use first.  The parent picks one in its ACK; the
+ *			agent switches once it has handled the ACK, the parent
+ *			right after sending it.
+ *	IPHC (0x03):	0 bytes: either side may send GS frames
+ *	OFFLOAD (0x04):	1 byte: offloads, SLH_TAP_OFFLOAD_ flags.  The
+ *			parent answers with those it will take on; either
+ *			side may then send RS frames needing them.
+ * - Over a SOCK_SEQPACKET socket, each datagram is one frame, type byte
+ *   first, without STX, ETX or escaping.
+ * - With COBS framing (see codec.h), each frame is COBS-encoded and
+ *   followed by a zero byte, with no STX, ETX or escaping.  The agent
+ *   sends a lone zero byte when it switches, to end anything left over
+ *   from before.
  */
 
 #define SOH	((uint8_t)(0x01))
@@ -46,12 +76,31 @@
 #define ETX	((uint8_t)(0x03))
 #define E_ETX	((uint8_t)('c'))
 #define EOT	((uint8_t)(0x04))
+#define ENQ	((uint8_t)(0x05))
 #define ACK	((uint8_t)(0x06))
 #define DLE	((uint8_t)(0x10))
 #define E_DLE	((uint8_t)('p'))
 #define NAK	((uint8_t)(0x15))
 #define SYN	((uint8_t)(0x16))
 #define FS	((uint8_t)(0x1c))
+#define GS	((uint8_t)(0x1d))
+#define RS	((uint8_t)(0x1e))
+
+/* Options negotiated in the SOH frame */
+#define SLH_OPT_WINDOW	((uint8_t)(0x01))
+#define SLH_OPT_FRAMING	((uint8_t)(0x02))
+#define SLH_OPT_IPHC	((uint8_t)(0x03))
+#define SLH_OPT_OFFLOAD	((uint8_t)(0x04))
+
+/* Control channel framing, as reported by SLH_OPT_FRAMING */
+/*! STX/ETX delimited frames with DLE escapes, over a byte stream */
+#define SLH_FRAMING_STUFFED	((uint8_t)(0x00))
+/*! One frame per datagram, over a SOCK_SEQPACKET socket */
+#define SLH_FRAMING_PACKET	((uint8_t)(0x01))
+/*! Length-prefixed frames in shared memory rings (see shm.h) */
+#define SLH_FRAMING_SHM		((uint8_t)(0x02))
+/*! COBS-encoded frames ending in a zero byte, over a byte stream */
+#define SLH_FRAMING_COBS	((uint8_t)(0x03))
 
 /*!
  * Frame to be transmitted or received
@@ -63,78 +112,325 @@ struct slh_agent_frame {
 	uint8_t		payload[];
 };
 
+/* Receive decoder states */
+/*! Waiting for the start of a frame */
+#define SLH_FRAME_RX_IDLE	(0)
+/*! Decoding the body of a frame */
+#define SLH_FRAME_RX_DATA	(1)
+/*! Decoding a frame, the last byte seen was a DLE */
+#define SLH_FRAME_RX_ESCAPE	(2)
+/*!
+ * Discarding the rest of a bad frame, up to its ETX or the next STX (or
+ * the next zero byte, with COBS framing)
+ */
+#define SLH_FRAME_RX_DISCARD	(3)
+
+#ifndef SLH_FRAME_BUF_MAX
+/*! Largest receive or transmit buffer size */
+#define SLH_FRAME_BUF_MAX	(16777216)
+#endif
+
 /*!
  * Reader/writer context
+ *
+ * Both buffers are rings whose memory is mapped twice, back to back, so
+ * the bytes waiting in them (and the free space) can always be handled as
+ * one contiguous span, however they straddle the end of the ring.
+ *
+ * Incoming bytes are decoded as soon as they arrive and then dropped from
+ * the receive buffer, with the decoder state kept here, so a frame split
+ * across many reads is still only scanned once.
+ *
+ * Frames written are encoded into the transmit buffer and only sent when
+ * slh_agent_frame_flush is called, so that everything sent in one go can
+ * be written with one system call.
+ *
+ * In packet mode, frames are received straight into the caller's buffer,
+ * and the transmit buffer holds each frame with a 2-byte length in front,
+ * to be sent one datagram apiece.  `rx_fd` and `tx_fd` are the same
+ * socket.
+ *
+ * In shared memory mode (see shm.h), the buffers are instead the rings
+ * shared with the peer.  Frames are copied in and out without escaping,
+ * the pointers are local copies of the ring indices, and `rx_fd` and
+ * `tx_fd` are the eventfds which wake us.
+ *
+ * With a byte stream framing, an I/O engine (see uring.h) may do the
+ * reading and writing instead: it clears `rx_ready` for good, so that
+ * slh_agent_read_frame only decodes what the engine put in the receive
+ * buffer, and sets `tx_async`, so that slh_agent_frame_flush leaves the
+ * sending to it.
  */
 struct slh_agent_frame_ctx {
-	/*! Receive buffer */
+	/*! Receive buffer, `buffer_sz` bytes mapped twice */
 	uint8_t* buffer;
+	/*! Transmit buffer, `tx_buffer_sz` bytes mapped twice */
+	uint8_t* tx_buffer;
 	/*! Incoming data file descriptor */
 	int rx_fd;
 	/*! Outgoing data file descriptor */
 	int tx_fd;
-	/*! Size of receive buffer */
-	uint16_t buffer_sz;
-	/*! Location of read pointer */
-	volatile uint16_t read_ptr;
-	/*! Location of write pointer */
-	volatile uint16_t write_ptr;
+	/*! Size of receive buffer, a power of two */
+	uint32_t buffer_sz;
+	/*! Total bytes consumed from the buffer, modulo 2^32 */
+	uint32_t read_ptr;
+	/*! Total bytes written into the buffer, modulo 2^32 */
+	uint32_t write_ptr;
+	/*! Size of transmit buffer, a power of two */
+	uint32_t tx_buffer_sz;
+	/*! Total bytes sent from the transmit buffer, modulo 2^32 */
+	uint32_t tx_read_ptr;
+	/*! Total bytes encoded into the transmit buffer, modulo 2^32 */
+	uint32_t tx_write_ptr;
+	/*!
+	 * Incoming data may be waiting.  Cleared once a read finds the
+	 * descriptor drained; the owner sets it again when the descriptor
+	 * is next reported readable.
+	 */
+	uint8_t rx_ready;
+	/*! The peer has closed the incoming channel */
+	uint8_t eof;
+	/*! Output is sent by an I/O engine, not by slh_agent_frame_flush */
+	uint8_t tx_async;
+	/*! Receive decoder state, one of the SLH_FRAME_RX_ values */
+	uint8_t rx_state;
+	/*! Bytes of the incoming frame decoded so far */
+	uint16_t rx_len;
+	/*! COBS: bytes left in the block being decoded */
+	uint16_t rx_run;
+	/*! COBS: a zero byte goes before the next block */
+	uint8_t rx_zero;
+	/*! How frames are carried, one of the SLH_FRAMING_ values */
+	uint8_t framing;
+	/*! Shared memory header, NULL if not in shared memory mode */
+	struct slh_agent_shm_header* shm;
+	/*! Shared memory ring read from */
+	struct slh_agent_shm_ring* rx_ring;
+	/*! Shared memory ring written to */
+	struct slh_agent_shm_ring* tx_ring;
+	/*! eventfd signalled when frames are written to `tx_ring` */
+	int peer_rx_fd;
+	/*! eventfd signalled when room is made in `rx_ring` */
+	int peer_tx_fd;
 };
 
 /*!
- * Initialise a frame reader/writer context.
+ * Return true if the context is in shared memory mode.
+ */
+static inline _Bool slh_agent_frame_is_shm(
+		const struct slh_agent_frame_ctx* const ctx) {
+	return ctx->framing == SLH_FRAMING_SHM;
+}
+
+/*!
+ * Return the largest number of bytes a frame of `frame_sz` bytes can take
+ * once encoded, that is, with every byte escaped.
+ */
+static inline uint32_t slh_agent_frame_encoded_max(uint16_t frame_sz) {
+	return (2 * (uint32_t)frame_sz) + 2;
+}
+
+/*!
+ * Return the number of bytes free in the transmit buffer.
+ */
+static inline uint32_t slh_agent_frame_tx_space(
+		const struct slh_agent_frame_ctx* const ctx) {
+	return ctx->tx_buffer_sz - (ctx->tx_write_ptr - ctx->tx_read_ptr);
+}
+
+/*!
+ * Return the number of bytes waiting to be sent.
+ */
+static inline uint32_t slh_agent_frame_tx_pending(
+		const struct slh_agent_frame_ctx* const ctx) {
+	return ctx->tx_write_ptr - ctx->tx_read_ptr;
+}
+
+/*!
+ * Return the free space in the receive buffer, for an I/O engine to read
+ * into.  Thanks to the mirrored mapping, it never wraps.
+ *
+ * @param[in]		ctx	Frame reader context
+ * @param[out]		sz	Number of bytes free
+ */
+static inline uint8_t* slh_agent_frame_rx_space(
+		const struct slh_agent_frame_ctx* const ctx,
+		uint32_t* const sz) {
+	*sz = ctx->buffer_sz - (ctx->write_ptr - ctx->read_ptr);
+	return &(ctx->buffer[ctx->write_ptr & (ctx->buffer_sz - 1)]);
+}
+
+/*!
+ * Hand over bytes an I/O engine has read into the free space, to be
+ * decoded by slh_agent_read_frame.  None at all means the peer has closed
+ * the channel.
+ */
+static inline void slh_agent_frame_rx_commit(
+		struct slh_agent_frame_ctx* const ctx, uint32_t sz) {
+	if (!sz)
+		ctx->eof = 1;
+	ctx->write_ptr += sz;
+}
+
+/*!
+ * Return the bytes waiting to be sent, for an I/O engine to write.  These
+ * never wrap either.
+ *
+ * @param[in]		ctx	Frame writer context
+ * @param[out]		sz	Number of bytes waiting
+ */
+static inline const uint8_t* slh_agent_frame_tx_data(
+		const struct slh_agent_frame_ctx* const ctx,
+		uint32_t* const sz) {
+	*sz = slh_agent_frame_tx_pending(ctx);
+	return &(ctx->tx_buffer[ctx->tx_read_ptr & (ctx->tx_buffer_sz - 1)]);
+}
+
+/*!
+ * Drop bytes an I/O engine has sent from the transmit buffer.
+ */
+static inline void slh_agent_frame_tx_commit(
+		struct slh_agent_frame_ctx* const ctx, uint32_t sz) {
+	ctx->tx_read_ptr += sz;
+}
+
+/*!
+ * Initialise a frame reader/writer context.  Buffer sizes are rounded up
+ * to a power of two, and to at least one page.
  *
  * @param[inout]	ctx	Frame reader/writer context
  * @param[in]		rx_fd	Receive file descriptor
  * @param[in]		tx_fd	Transmit file descriptor
- * @param[in]		buf	Buffer pointer (or NULL to `malloc`)
- * @param[in]		buf_sz	Buffer size to initialise.
+ * @param[in]		buf_sz	Smallest receive buffer size
+ * @param[in]		tx_sz	Smallest transmit buffer size
  *
  * @retval	0	Success
  * @retval	-EINVAL	Invalid parameters
  * @retval	-ENOMEM	Unable to allocate buffer
  */
 int slh_agent_frame_init(struct slh_agent_frame_ctx* const ctx,
-	int rx_fd, int tx_fd, uint8_t* buf, uint16_t buf_sz);
+	int rx_fd, int tx_fd, uint32_t buf_sz, uint32_t tx_sz);
+
+/*!
+ * Initialise a frame reader/writer context on a SOCK_SEQPACKET socket.
+ *
+ * @param[inout]	ctx	Frame reader/writer context
+ * @param[in]		fd	Socket, used in both directions
+ * @param[in]		tx_sz	Smallest transmit buffer size
+ *
+ * @retval	0		Success
+ * @retval	-EINVAL		Invalid parameters
+ * @retval	-ENOTSOCK	`fd` is not a socket
+ * @retval	-EPROTOTYPE	`fd` is not a SOCK_SEQPACKET socket
+ * @retval	-ENOMEM		Unable to allocate buffer
+ */
+int slh_agent_frame_init_packet(struct slh_agent_frame_ctx* const ctx,
+	int fd, uint32_t tx_sz);
+
+/*!
+ * Initialise a frame reader/writer context on a shared memory channel.
+ *
+ * @param[inout]	ctx	Frame reader/writer context
+ * @param[in]		fds	Shared memory channel descriptors
+ * @param[in]		parent	Whether we are the parent's side
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Not a valid shared memory channel
+ * @retval	<0	errno.h error
+ */
+int slh_agent_frame_init_shm(struct slh_agent_frame_ctx* const ctx,
+	const struct slh_agent_shm_fds* const fds, _Bool parent);
+
+/*!
+ * Switch a byte stream channel between byte-stuffed and COBS framing.
+ * Frames already in the transmit buffer go out as they were encoded.  On
+ * switching to COBS, a zero byte is sent first to end anything the peer
+ * was part way through.
+ *
+ * @param[inout]	ctx	Frame reader/writer context
+ * @param[in]		framing	SLH_FRAMING_STUFFED or SLH_FRAMING_COBS
+ *
+ * @retval	0		Success
+ * @retval	-EINVAL		Not a byte stream channel, or unknown framing
+ */
+int slh_agent_frame_set_framing(struct slh_agent_frame_ctx* const ctx,
+		uint8_t framing);
+
+/*!
+ * Release the buffers of a frame reader/writer context.  In shared memory
+ * mode, also tells the peer that no more frames will follow.
+ */
+void slh_agent_frame_free(struct slh_agent_frame_ctx* const ctx);
 
 /*!
  * Read a frame from the peer process.
  *
+ * A frame only partly received is decoded into `frame` as far as it goes,
+ * and picked up from there on the next call, so the same `frame` and
+ * `max_sz` must be passed each time until the call returns non-zero.
+ *
  * @param[inout]	ctx	Frame reader context
  * @param[out]		frame	The frame to read the data into.
  * @param[in]		max_sz	Maximum size of the frame
  *
  * @returns	Size of frame read
  *
+ * @retval	0		No (complete) frame waiting yet.
  * @retval	-EMSGSIZE	Message too big to fit into buffer.
  * @retval	-EBADMSG	Frame error occurred.
- * @retval	-EWOULDBLOCK	No (complete) frame waiting yet.
+ * @retval	-EPIPE		Peer closed the channel, no frame waiting.
  */
 int slh_agent_read_frame(struct slh_agent_frame_ctx* const ctx,
 		struct slh_agent_frame* const frame,
 		uint16_t max_sz);
 
 /*!
- * Flush the frame waiting in the buffer.
+ * Discard the rest of the frame being received.  Whatever of it has not
+ * arrived yet is discarded by slh_agent_read_frame as it comes in.
  *
  * @param[inout]	ctx	Frame reader context
  *
- * @returns		Size of frame discarded.
+ * @returns		Number of bytes discarded now.
  */
 int slh_agent_drop_frame(struct slh_agent_frame_ctx* const ctx);
 
 /*!
- * Write a frame to the peer process.
+ * Encode a frame into the transmit buffer.  If there isn't room, whatever
+ * is already waiting is flushed first.  The frame is only sent once
+ * slh_agent_frame_flush is called.
  *
  * @param[inout]	ctx	Frame writer context
  * @param[in]		frame	Frame to write.
  *
  * @retval		0	Success
+ * @retval		-EAGAIN	No room: the peer is not keeping up.  Nothing
+ *				was written.
  */
 int slh_agent_write_frame(struct slh_agent_frame_ctx* const ctx,
 		const struct slh_agent_frame* const frame,
 		uint16_t frame_sz);
 
+/*!
+ * Send as much of the transmit buffer as the peer will take.
+ *
+ * In shared memory mode, frames are handed over all at once; what matters
+ * is whether the peer is keeping up.  If more than half the ring is still
+ * waiting for it, the call returns -EAGAIN and `tx_fd` is signalled once
+ * the peer takes some.  Frames must therefore be no larger than half the
+ * ring.
+ *
+ * @param[inout]	ctx	Frame writer context
+ *
+ * If an I/O engine does the sending, this only says whether anything is
+ * still waiting for it.
+ *
+ * @retval		0	Everything has been sent
+ * @retval		-EAGAIN	Some data is still waiting; try again once the
+ *				descriptor is writable.
+ * @retval		<0	errno.h error
+ */
+int slh_agent_frame_flush(struct slh_agent_frame_ctx* const ctx);
+
 /*!
  * Send frame without payload.  (e.g. ACK, NAK or SYN)
  *
@@ -151,48 +447,81 @@ static inline int slh_agent_write_frame_nopayload(
 }
 
 /*!
- * Send the device detail frame
+ * Send an ACK or NAK in reply to a frame from the peer.
  *
  * @param[inout]	ctx	Frame writer context
+ * @param[in]		type	Reply type (ACK or NAK)
+ * @param[in]		use_seq	Whether sequence numbers are in use
+ * @param[in]		seq	Sequence number of the frame being answered
+ */
+static inline int slh_agent_write_reply(
+		struct slh_agent_frame_ctx* const ctx,
+		uint8_t type, _Bool use_seq, uint8_t seq) {
+	const uint8_t frame[] = { type, seq };
+	return slh_agent_write_frame(ctx,
+			(const struct slh_agent_frame*)frame,
+			use_seq ? 2 : 1);
+}
+
+/*!
+ * Build the device detail payload for a SOH frame.
+ *
+ * @param[out]		buf	Buffer to write the payload into
+ * @param[in]		buf_sz	Size of the buffer
  * @param[in]		tap	TAP interface context
+ * @param[in]		opts	Options offered to the parent
+ * @param[in]		opts_sz	Size of the options
  *
- * @retval		0	Success
+ * @returns		Size of the payload
+ * @retval		-EMSGSIZE	Buffer too small
  */
-static inline int slh_agent_write_device_detail_frame(
-		struct slh_agent_frame_ctx* const ctx,
-		const struct slh_agent_tap_ctx* const tap) {
+static inline int slh_agent_device_detail(
+		uint8_t* buf, uint16_t buf_sz,
+		const struct slh_agent_tap_ctx* const tap,
+		const uint8_t* opts, uint8_t opts_sz) {
 	uint32_t ifindex = htonl(tap->ifindex);
 	uint16_t mtu = htons(tap->mtu);
-	uint8_t name_len = strlen(tap->name);
-	uint8_t* ptr;
-	union {
-		struct slh_agent_frame header;
-		uint8_t raw[	1			/* Frame type */
-				+ SLH_TAP_MAC_SZ	/* MAC address */
-				+ sizeof(uint16_t)	/* MTU */
-				+ sizeof(uint32_t)	/* Index */
-				+ 1			/* Name length */
-				+ name_len		/* Name */
-		];
-	} frame;
-
-	frame.header.type = SOH;
-
-	ptr = frame.header.payload;
-	memcpy(ptr, tap->mac, sizeof(tap->mac));
-	ptr += sizeof(tap->mac);
-
-	memcpy(ptr, &mtu, sizeof(mtu));
-	ptr += sizeof(mtu);
-
-	memcpy(ptr, &ifindex, sizeof(ifindex));
-	ptr += sizeof(ifindex);
-
-	*ptr = name_len;
-	ptr++;
-
-	memcpy(ptr, tap->name, name_len);
-	return slh_agent_write_frame(ctx, &frame.header, sizeof(frame));
+	uint8_t name_len = strnlen(tap->name, SLH_TAP_NAME_SZ);
+	uint16_t len =	  SLH_TAP_MAC_SZ	/* MAC address */
+			+ sizeof(uint16_t)	/* MTU */
+			+ sizeof(uint32_t)	/* Index */
+			+ 1			/* Name length */
+			+ name_len		/* Name */
+			+ opts_sz;		/* Options */
+
+	if (len > buf_sz)
+		return -EMSGSIZE;
+
+	memcpy(buf, tap->mac, sizeof(tap->mac));
+	buf += sizeof(tap->mac);
+
+	memcpy(buf, &mtu, sizeof(mtu));
+	buf += sizeof(mtu);
+
+	memcpy(buf, &ifindex, sizeof(ifindex));
+	buf += sizeof(ifindex);
+
+	*buf = name_len;
+	buf++;
+
+	memcpy(buf, tap->name, name_len);
+	buf += name_len;
+
+	memcpy(buf, opts, opts_sz);
+	return len;
 }
 
+/*!
+ * Find an option in a list of negotiated options.
+ *
+ * @param[in]		opts	Option list
+ * @param[in]		opts_sz	Size of the option list
+ * @param[in]		type	Option type to look for
+ * @param[out]		len	Length of the option value
+ *
+ * @returns		Pointer to the option value, or NULL if not present.
+ */
+const uint8_t* slh_agent_find_option(const uint8_t* opts, uint16_t opts_sz,
+		uint8_t type, uint8_t* len);
+
 #endif
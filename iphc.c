@@ -0,0 +1,555 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "iphc.h"
+#include "tap.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*! EtherType of IPv6 */
+#define SLH_AGENT_IPHC_ETHERTYPE	(0x86dd)
+/*! IPv6 next header value for UDP */
+#define SLH_AGENT_IPHC_NH_UDP		(17)
+/*! IPv6 address size */
+#define SLH_AGENT_IPHC_ADDR_SZ		(16)
+
+/* IPHC header, first byte (RFC 6282 section 3.1.1) */
+#define SLH_AGENT_IPHC_DISPATCH		(0x60)
+#define SLH_AGENT_IPHC_DISPATCH_MASK	(0xe0)
+#define SLH_AGENT_IPHC_TF_SHIFT		(3)
+#define SLH_AGENT_IPHC_NH		(0x04)
+#define SLH_AGENT_IPHC_HLIM_MASK	(0x03)
+/* IPHC header, second byte */
+#define SLH_AGENT_IPHC_CID		(0x80)
+#define SLH_AGENT_IPHC_SAC		(0x40)
+#define SLH_AGENT_IPHC_SAM_SHIFT	(4)
+#define SLH_AGENT_IPHC_M		(0x08)
+#define SLH_AGENT_IPHC_DAC		(0x04)
+#define SLH_AGENT_IPHC_DAM_MASK		(0x03)
+
+/* UDP next header compression (RFC 6282 section 4.3.3) */
+#define SLH_AGENT_IPHC_NHC_UDP		(0xf0)
+#define SLH_AGENT_IPHC_NHC_UDP_MASK	(0xf8)
+#define SLH_AGENT_IPHC_NHC_UDP_C	(0x04)
+#define SLH_AGENT_IPHC_NHC_UDP_P_MASK	(0x03)
+
+/*! Longest compressed header: everything inline */
+#define SLH_AGENT_IPHC_HDR_MAX		(1 + (2 * SLH_TAP_MAC_SZ) + 2 + 4 \
+		+ 1 + 1 + (2 * SLH_AGENT_IPHC_ADDR_SZ) + 1 + 4 + 2)
+
+/*! Hop limits for each HLIM value, 0 being sent inline */
+static const uint8_t slh_agent_iphc_hlim[] = { 0, 1, 64, 255 };
+
+/*! Inline traffic class and flow label bytes for each TF value */
+static const uint8_t slh_agent_iphc_tf_sz[] = { 4, 3, 1, 0 };
+
+/*! Offset of the inline part of a unicast address for each SAM/DAM */
+static const uint8_t slh_agent_iphc_unicast_off[] = { 0, 8, 14, 16 };
+
+/*! Inline bytes of a multicast address for each DAM */
+static const uint8_t slh_agent_iphc_mcast_sz[] = { 16, 6, 4, 1 };
+
+/*! Inline port bytes for each UDP P value */
+static const uint8_t slh_agent_iphc_ports_sz[] = { 4, 3, 3, 1 };
+
+/*! Interface identifier left with a 16-bit SAM/DAM, bar its last 2 bytes */
+static const uint8_t slh_agent_iphc_short_iid[] = { 0, 0, 0, 0xff, 0xfe, 0 };
+
+/*!
+ * Return true if the `len` bytes at `buf` are all zero.
+ */
+static _Bool slh_agent_iphc_is_zero(const uint8_t* buf, uint8_t len) {
+	while (len--) {
+		if (*buf++)
+			return false;
+	}
+	return true;
+}
+
+/*!
+ * Write the link-local address formed from a MAC.
+ */
+static void slh_agent_iphc_ll_addr(uint8_t* addr, const uint8_t* mac) {
+	memset(addr, 0, 8);
+	addr[0] = 0xfe;
+	addr[1] = 0x80;
+	addr[8] = mac[0] ^ 0x02;
+	addr[9] = mac[1];
+	addr[10] = mac[2];
+	addr[11] = 0xff;
+	addr[12] = 0xfe;
+	addr[13] = mac[3];
+	addr[14] = mac[4];
+	addr[15] = mac[5];
+}
+
+/*!
+ * Return the SAM/DAM value to send a unicast address with, given the
+ * Ethernet address it would be formed from.
+ */
+static uint8_t slh_agent_iphc_unicast_mode(const uint8_t* addr,
+		const uint8_t* mac) {
+	uint8_t ll[SLH_AGENT_IPHC_ADDR_SZ];
+
+	slh_agent_iphc_ll_addr(ll, mac);
+	if (memcmp(addr, ll, 8))
+		/* Not link-local */
+		return 0;
+	if (!memcmp(addr + 8, ll + 8, 8))
+		return 3;
+	if (!memcmp(addr + 8, slh_agent_iphc_short_iid,
+				sizeof(slh_agent_iphc_short_iid)))
+		return 2;
+	return 1;
+}
+
+/*!
+ * Rebuild a unicast address sent with the given SAM/DAM value.
+ *
+ * @returns	The byte after the inline part
+ */
+static const uint8_t* slh_agent_iphc_unicast(uint8_t* addr, uint8_t mode,
+		const uint8_t* in, const uint8_t* mac) {
+	const uint8_t off = slh_agent_iphc_unicast_off[mode];
+
+	slh_agent_iphc_ll_addr(addr, mac);
+	if (mode == 2)
+		memcpy(addr + 8, slh_agent_iphc_short_iid,
+				sizeof(slh_agent_iphc_short_iid));
+	memcpy(addr + off, in, SLH_AGENT_IPHC_ADDR_SZ - off);
+	return in + SLH_AGENT_IPHC_ADDR_SZ - off;
+}
+
+/*!
+ * Return the DAM value to send a multicast address with.
+ */
+static uint8_t slh_agent_iphc_mcast_mode(const uint8_t* addr) {
+	if ((addr[1] == 0x02) && slh_agent_iphc_is_zero(addr + 2, 13))
+		/* ff02::00XX */
+		return 3;
+	if (slh_agent_iphc_is_zero(addr + 2, 11))
+		/* ffXX::00XX:XXXX */
+		return 2;
+	if (slh_agent_iphc_is_zero(addr + 2, 9))
+		/* ffXX::00XX:XXXX:XXXX */
+		return 1;
+	return 0;
+}
+
+/*!
+ * Write the inline part of a multicast address sent with the given DAM.
+ *
+ * @returns	The byte after the inline part
+ */
+static uint8_t* slh_agent_iphc_mcast_out(uint8_t* out, uint8_t mode,
+		const uint8_t* addr) {
+	switch (mode) {
+	case 0:
+		memcpy(out, addr, SLH_AGENT_IPHC_ADDR_SZ);
+		break;
+	case 1:
+		out[0] = addr[1];
+		memcpy(out + 1, addr + 11, 5);
+		break;
+	case 2:
+		out[0] = addr[1];
+		memcpy(out + 1, addr + 13, 3);
+		break;
+	default:
+		out[0] = addr[15];
+	}
+	return out + slh_agent_iphc_mcast_sz[mode];
+}
+
+/*!
+ * Rebuild a multicast address sent with the given DAM value.
+ *
+ * @returns	The byte after the inline part
+ */
+static const uint8_t* slh_agent_iphc_mcast(uint8_t* addr, uint8_t mode,
+		const uint8_t* in) {
+	memset(addr, 0, SLH_AGENT_IPHC_ADDR_SZ);
+	addr[0] = 0xff;
+	switch (mode) {
+	case 0:
+		memcpy(addr, in, SLH_AGENT_IPHC_ADDR_SZ);
+		break;
+	case 1:
+		addr[1] = in[0];
+		memcpy(addr + 11, in + 1, 5);
+		break;
+	case 2:
+		addr[1] = in[0];
+		memcpy(addr + 13, in + 1, 3);
+		break;
+	default:
+		addr[1] = 0x02;
+		addr[15] = in[0];
+	}
+	return in + slh_agent_iphc_mcast_sz[mode];
+}
+
+int slh_agent_iphc_compress(uint8_t* frame, uint16_t len,
+		const uint8_t* mac) {
+	const uint8_t* const ip = frame + SLH_AGENT_IPHC_ETH_SZ;
+	const uint8_t* const ip_src = ip + 8;
+	const uint8_t* const ip_dst = ip + 24;
+	const uint8_t* const udp = ip + SLH_AGENT_IPHC_IPV6_SZ;
+	uint16_t consumed = SLH_AGENT_IPHC_ETH_SZ + SLH_AGENT_IPHC_IPV6_SZ;
+	uint8_t hdr[SLH_AGENT_IPHC_HDR_MAX];
+	uint8_t* out = hdr;
+	uint8_t* iphc;
+	uint8_t dst_mode;
+	uint8_t src_mode;
+	uint8_t mode;
+	uint16_t plen;
+	uint16_t hdr_sz;
+	uint8_t tc;
+	uint32_t fl;
+
+	if ((len < consumed)
+			|| (((frame[12] << 8) | frame[13])
+				!= SLH_AGENT_IPHC_ETHERTYPE)
+			|| ((ip[0] >> 4) != 6))
+		return 0;
+
+	plen = (ip[4] << 8) | ip[5];
+	if (plen != (len - consumed))
+		/* Padded, or truncated */
+		return 0;
+
+	/* Ethernet addresses */
+	if (!memcmp(frame, mac, SLH_TAP_MAC_SZ))
+		dst_mode = SLH_AGENT_IPHC_MAC_LOCAL;
+	else if ((ip_dst[0] == 0xff) && (frame[0] == 0x33)
+			&& (frame[1] == 0x33)
+			&& !memcmp(frame + 2, ip_dst + 12, 4))
+		dst_mode = SLH_AGENT_IPHC_MAC_MCAST;
+	else
+		dst_mode = SLH_AGENT_IPHC_MAC_INLINE;
+
+	src_mode = memcmp(frame + SLH_TAP_MAC_SZ, mac, SLH_TAP_MAC_SZ)
+		? SLH_AGENT_IPHC_MAC_INLINE : SLH_AGENT_IPHC_MAC_LOCAL;
+
+	*out++ = dst_mode | (src_mode << 2);
+	if (dst_mode == SLH_AGENT_IPHC_MAC_INLINE) {
+		memcpy(out, frame, SLH_TAP_MAC_SZ);
+		out += SLH_TAP_MAC_SZ;
+	}
+	if (src_mode == SLH_AGENT_IPHC_MAC_INLINE) {
+		memcpy(out, frame + SLH_TAP_MAC_SZ, SLH_TAP_MAC_SZ);
+		out += SLH_TAP_MAC_SZ;
+	}
+
+	iphc = out;
+	iphc[0] = SLH_AGENT_IPHC_DISPATCH;
+	iphc[1] = 0;
+	out += 2;
+
+	/* Traffic class, sent with ECN ahead of DSCP, and flow label */
+	tc = (ip[0] << 4) | (ip[1] >> 4);
+	tc = (tc >> 2) | (tc << 6);
+	fl = ((uint32_t)(ip[1] & 0x0f) << 16) | (ip[2] << 8) | ip[3];
+	if (!fl && !tc) {
+		iphc[0] |= 3 << SLH_AGENT_IPHC_TF_SHIFT;
+	} else if (!fl) {
+		iphc[0] |= 2 << SLH_AGENT_IPHC_TF_SHIFT;
+		*out++ = tc;
+	} else if (!(tc & 0x3f)) {
+		/* ECN only */
+		iphc[0] |= 1 << SLH_AGENT_IPHC_TF_SHIFT;
+		*out++ = tc | (fl >> 16);
+		*out++ = fl >> 8;
+		*out++ = fl;
+	} else {
+		*out++ = tc;
+		*out++ = fl >> 16;
+		*out++ = fl >> 8;
+		*out++ = fl;
+	}
+
+	/* Next header: UDP is compressed if its length is consistent */
+	if ((ip[6] == SLH_AGENT_IPHC_NH_UDP)
+			&& (plen >= SLH_AGENT_IPHC_UDP_SZ)
+			&& (((udp[4] << 8) | udp[5]) == plen))
+		iphc[0] |= SLH_AGENT_IPHC_NH;
+	else
+		*out++ = ip[6];
+
+	/* Hop limit */
+	for (mode = 3; mode; mode--) {
+		if (ip[7] == slh_agent_iphc_hlim[mode])
+			break;
+	}
+	iphc[0] |= mode;
+	if (!mode)
+		*out++ = ip[7];
+
+	/* Source address */
+	if (slh_agent_iphc_is_zero(ip_src, SLH_AGENT_IPHC_ADDR_SZ)) {
+		iphc[1] |= SLH_AGENT_IPHC_SAC;
+	} else {
+		mode = slh_agent_iphc_unicast_mode(ip_src,
+				frame + SLH_TAP_MAC_SZ);
+		iphc[1] |= mode << SLH_AGENT_IPHC_SAM_SHIFT;
+		memcpy(out, ip_src + slh_agent_iphc_unicast_off[mode],
+				SLH_AGENT_IPHC_ADDR_SZ
+				- slh_agent_iphc_unicast_off[mode]);
+		out += SLH_AGENT_IPHC_ADDR_SZ
+			- slh_agent_iphc_unicast_off[mode];
+	}
+
+	/* Destination address */
+	if (ip_dst[0] == 0xff) {
+		mode = slh_agent_iphc_mcast_mode(ip_dst);
+		iphc[1] |= SLH_AGENT_IPHC_M | mode;
+		out = slh_agent_iphc_mcast_out(out, mode, ip_dst);
+	} else {
+		mode = slh_agent_iphc_unicast_mode(ip_dst, frame);
+		iphc[1] |= mode;
+		memcpy(out, ip_dst + slh_agent_iphc_unicast_off[mode],
+				SLH_AGENT_IPHC_ADDR_SZ
+				- slh_agent_iphc_unicast_off[mode]);
+		out += SLH_AGENT_IPHC_ADDR_SZ
+			- slh_agent_iphc_unicast_off[mode];
+	}
+
+	if (iphc[0] & SLH_AGENT_IPHC_NH) {
+		const uint16_t sport = (udp[0] << 8) | udp[1];
+		const uint16_t dport = (udp[2] << 8) | udp[3];
+		uint8_t* const nhc = out++;
+
+		if (((sport & 0xfff0) == 0xf0b0)
+				&& ((dport & 0xfff0) == 0xf0b0)) {
+			*nhc = SLH_AGENT_IPHC_NHC_UDP | 3;
+			*out++ = (udp[1] << 4) | (udp[3] & 0x0f);
+		} else if ((dport & 0xff00) == 0xf000) {
+			*nhc = SLH_AGENT_IPHC_NHC_UDP | 1;
+			*out++ = udp[0];
+			*out++ = udp[1];
+			*out++ = udp[3];
+		} else if ((sport & 0xff00) == 0xf000) {
+			*nhc = SLH_AGENT_IPHC_NHC_UDP | 2;
+			*out++ = udp[1];
+			*out++ = udp[2];
+			*out++ = udp[3];
+		} else {
+			*nhc = SLH_AGENT_IPHC_NHC_UDP;
+			memcpy(out, udp, 4);
+			out += 4;
+		}
+
+		/* Checksum */
+		*out++ = udp[6];
+		*out++ = udp[7];
+		consumed += SLH_AGENT_IPHC_UDP_SZ;
+	}
+
+	/* Always shorter than what it replaces, so the payload moves down */
+	hdr_sz = out - hdr;
+	memmove(frame + hdr_sz, frame + consumed, len - consumed);
+	memcpy(frame, hdr, hdr_sz);
+	return hdr_sz + len - consumed;
+}
+
+int slh_agent_iphc_decompress(uint8_t* dst, uint16_t dst_sz,
+		const uint8_t* src, uint16_t len, const uint8_t* mac) {
+	const uint8_t* const end = src + len;
+	uint8_t* const ip = dst + SLH_AGENT_IPHC_ETH_SZ;
+	uint8_t* const ip_src = ip + 8;
+	uint8_t* const ip_dst = ip + 24;
+	uint8_t* const udp = ip + SLH_AGENT_IPHC_IPV6_SZ;
+	uint16_t hdr_sz = SLH_AGENT_IPHC_ETH_SZ + SLH_AGENT_IPHC_IPV6_SZ;
+	const uint8_t* in = src;
+	uint8_t dst_mode;
+	uint8_t src_mode;
+	uint8_t iphc[2];
+	uint8_t tf;
+	uint8_t sam;
+	uint8_t dam;
+	uint8_t tc = 0;
+	uint32_t fl = 0;
+	uint32_t need;
+	uint32_t plen;
+
+	if (dst_sz < hdr_sz)
+		return -EMSGSIZE;
+	if (!len)
+		return -EBADMSG;
+
+	/* Ethernet addresses */
+	dst_mode = in[0] & 0x03;
+	src_mode = (in[0] >> 2) & 0x03;
+	if ((in[0] & 0xf0) || (dst_mode > SLH_AGENT_IPHC_MAC_MCAST)
+			|| (src_mode > SLH_AGENT_IPHC_MAC_LOCAL))
+		return -EBADMSG;
+	in++;
+
+	need = 2;
+	if (dst_mode == SLH_AGENT_IPHC_MAC_INLINE)
+		need += SLH_TAP_MAC_SZ;
+	if (src_mode == SLH_AGENT_IPHC_MAC_INLINE)
+		need += SLH_TAP_MAC_SZ;
+	if ((end - in) < need)
+		return -EBADMSG;
+
+	if (dst_mode == SLH_AGENT_IPHC_MAC_INLINE) {
+		memcpy(dst, in, SLH_TAP_MAC_SZ);
+		in += SLH_TAP_MAC_SZ;
+	} else if (dst_mode == SLH_AGENT_IPHC_MAC_LOCAL) {
+		memcpy(dst, mac, SLH_TAP_MAC_SZ);
+	}
+	if (src_mode == SLH_AGENT_IPHC_MAC_INLINE) {
+		memcpy(dst + SLH_TAP_MAC_SZ, in, SLH_TAP_MAC_SZ);
+		in += SLH_TAP_MAC_SZ;
+	} else {
+		memcpy(dst + SLH_TAP_MAC_SZ, mac, SLH_TAP_MAC_SZ);
+	}
+	dst[12] = SLH_AGENT_IPHC_ETHERTYPE >> 8;
+	dst[13] = SLH_AGENT_IPHC_ETHERTYPE & 0xff;
+
+	/* IPHC header: only the stateless forms are understood */
+	iphc[0] = *in++;
+	iphc[1] = *in++;
+	tf = (iphc[0] >> SLH_AGENT_IPHC_TF_SHIFT) & 0x03;
+	sam = (iphc[1] >> SLH_AGENT_IPHC_SAM_SHIFT) & 0x03;
+	dam = iphc[1] & SLH_AGENT_IPHC_DAM_MASK;
+	if (((iphc[0] & SLH_AGENT_IPHC_DISPATCH_MASK)
+				!= SLH_AGENT_IPHC_DISPATCH)
+			|| (iphc[1] & (SLH_AGENT_IPHC_CID
+					| SLH_AGENT_IPHC_DAC))
+			|| ((iphc[1] & SLH_AGENT_IPHC_SAC) && sam)
+			|| ((dst_mode == SLH_AGENT_IPHC_MAC_MCAST)
+				&& !(iphc[1] & SLH_AGENT_IPHC_M)))
+		return -EBADMSG;
+
+	need = slh_agent_iphc_tf_sz[tf];
+	if (!(iphc[0] & SLH_AGENT_IPHC_NH))
+		need++;
+	if (!(iphc[0] & SLH_AGENT_IPHC_HLIM_MASK))
+		need++;
+	if (!(iphc[1] & SLH_AGENT_IPHC_SAC))
+		need += SLH_AGENT_IPHC_ADDR_SZ
+			- slh_agent_iphc_unicast_off[sam];
+	if (iphc[1] & SLH_AGENT_IPHC_M)
+		need += slh_agent_iphc_mcast_sz[dam];
+	else
+		need += SLH_AGENT_IPHC_ADDR_SZ
+			- slh_agent_iphc_unicast_off[dam];
+	if ((end - in) < need)
+		return -EBADMSG;
+
+	/* Traffic class, sent with ECN ahead of DSCP, and flow label */
+	switch (tf) {
+	case 0:
+		tc = in[0];
+		fl = ((uint32_t)(in[1] & 0x0f) << 16) | (in[2] << 8) | in[3];
+		break;
+	case 1:
+		tc = in[0] & 0xc0;
+		fl = ((uint32_t)(in[0] & 0x0f) << 16) | (in[1] << 8) | in[2];
+		break;
+	case 2:
+		tc = in[0];
+		break;
+	}
+	in += slh_agent_iphc_tf_sz[tf];
+	tc = (tc << 2) | (tc >> 6);
+	ip[0] = 0x60 | (tc >> 4);
+	ip[1] = (tc << 4) | (fl >> 16);
+	ip[2] = fl >> 8;
+	ip[3] = fl;
+
+	if (iphc[0] & SLH_AGENT_IPHC_NH)
+		ip[6] = SLH_AGENT_IPHC_NH_UDP;
+	else
+		ip[6] = *in++;
+
+	ip[7] = slh_agent_iphc_hlim[iphc[0] & SLH_AGENT_IPHC_HLIM_MASK];
+	if (!ip[7])
+		ip[7] = *in++;
+
+	if (iphc[1] & SLH_AGENT_IPHC_SAC)
+		/* Unspecified address */
+		memset(ip_src, 0, SLH_AGENT_IPHC_ADDR_SZ);
+	else
+		in = slh_agent_iphc_unicast(ip_src, sam, in,
+				dst + SLH_TAP_MAC_SZ);
+
+	if (iphc[1] & SLH_AGENT_IPHC_M)
+		in = slh_agent_iphc_mcast(ip_dst, dam, in);
+	else
+		in = slh_agent_iphc_unicast(ip_dst, dam, in, dst);
+
+	if (dst_mode == SLH_AGENT_IPHC_MAC_MCAST) {
+		dst[0] = 0x33;
+		dst[1] = 0x33;
+		memcpy(dst + 2, ip_dst + 12, 4);
+	}
+
+	if (iphc[0] & SLH_AGENT_IPHC_NH) {
+		uint8_t nhc;
+		uint8_t ports;
+
+		if (in == end)
+			return -EBADMSG;
+		nhc = *in++;
+		ports = nhc & SLH_AGENT_IPHC_NHC_UDP_P_MASK;
+		if (((nhc & SLH_AGENT_IPHC_NHC_UDP_MASK)
+					!= SLH_AGENT_IPHC_NHC_UDP)
+				|| (nhc & SLH_AGENT_IPHC_NHC_UDP_C)
+				|| ((end - in)
+					< (slh_agent_iphc_ports_sz[ports] + 2)))
+			return -EBADMSG;
+
+		hdr_sz += SLH_AGENT_IPHC_UDP_SZ;
+		if (dst_sz < hdr_sz)
+			return -EMSGSIZE;
+
+		switch (ports) {
+		case 0:
+			memcpy(udp, in, 4);
+			break;
+		case 1:
+			udp[0] = in[0];
+			udp[1] = in[1];
+			udp[2] = 0xf0;
+			udp[3] = in[2];
+			break;
+		case 2:
+			udp[0] = 0xf0;
+			udp[1] = in[0];
+			udp[2] = in[1];
+			udp[3] = in[2];
+			break;
+		default:
+			udp[0] = 0xf0;
+			udp[1] = 0xb0 | (in[0] >> 4);
+			udp[2] = 0xf0;
+			udp[3] = 0xb0 | (in[0] & 0x0f);
+		}
+		in += slh_agent_iphc_ports_sz[ports];
+
+		/* Checksum */
+		udp[6] = in[0];
+		udp[7] = in[1];
+		in += 2;
+	}
+
+	/* The rest is payload */
+	if ((hdr_sz + (end - in)) > dst_sz)
+		return -EMSGSIZE;
+	memcpy(dst + hdr_sz, in, end - in);
+
+	plen = (hdr_sz - SLH_AGENT_IPHC_ETH_SZ - SLH_AGENT_IPHC_IPV6_SZ)
+		+ (end - in);
+	ip[4] = plen >> 8;
+	ip[5] = plen;
+	if (iphc[0] & SLH_AGENT_IPHC_NH) {
+		udp[4] = plen >> 8;
+		udp[5] = plen;
+	}
+	return hdr_sz + (end - in);
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_IPHC_H
+#define _6LH_AGENT_IPHC_H
+
+#include <stdint.h>
+
+/*
+ * IPv6 header compression.
+ *
+ * Once the parent has accepted the IPHC option, IPv6 frames may be sent
+ * either way as GS frames in place of FS, with the Ethernet, IPv6 and UDP
+ * headers compressed after RFC 6282.  The payload of a GS frame is:
+ *
+ * - 1 byte: how the Ethernet addresses are sent
+ *	bits 0-1:	destination: 0 inline, 1 the interface's MAC, 2 the
+ *			multicast MAC of the IPv6 destination (33:33:...)
+ *	bits 2-3:	source: 0 inline, 1 the interface's MAC
+ *	bits 4-7:	zero
+ * - the Ethernet addresses sent inline, destination first.  The EtherType
+ *   is always IPv6.
+ * - an IPHC header and its inline fields (RFC 6282 section 3.1), without
+ *   contexts: CID, SAC and DAC are zero, except that SAC=1 with SAM=00
+ *   stands for the unspecified address.  Addresses left out altogether
+ *   (SAM or DAM 11) are the link-local addresses formed from the Ethernet
+ *   source or destination, as in RFC 4291 appendix A.
+ * - if NH is set, a UDP header compressed as in RFC 6282 section 4.3.  The
+ *   checksum is always sent.
+ * - the rest of the IPv6 payload.
+ *
+ * The IPv6 payload length and the UDP length are worked out from the size
+ * of the frame.
+ */
+
+/*! Ethernet header size */
+#define SLH_AGENT_IPHC_ETH_SZ		(14)
+/*! IPv6 header size */
+#define SLH_AGENT_IPHC_IPV6_SZ		(40)
+/*! UDP header size */
+#define SLH_AGENT_IPHC_UDP_SZ		(8)
+
+/* Ethernet address modes, in the first byte of a GS frame */
+/*! Address sent inline */
+#define SLH_AGENT_IPHC_MAC_INLINE	(0)
+/*! The interface's own address */
+#define SLH_AGENT_IPHC_MAC_LOCAL	(1)
+/*! Multicast address of the IPv6 destination (destination only) */
+#define SLH_AGENT_IPHC_MAC_MCAST	(2)
+
+/*!
+ * Compress the headers of an IPv6 frame in place.  Frames which are not
+ * IPv6, or whose size does not match the IPv6 payload length (such as
+ * padded ones), are left alone.
+ *
+ * @param[inout]	frame	Ethernet frame
+ * @param[in]		len	Size of the frame
+ * @param[in]		mac	The interface's MAC
+ *
+ * @returns	Size of the compressed frame, never more than `len`
+ * @retval	0	Frame left alone, to be sent as it is
+ */
+int slh_agent_iphc_compress(uint8_t* frame, uint16_t len,
+		const uint8_t* mac);
+
+/*!
+ * Rebuild the Ethernet frame from the payload of a GS frame.
+ *
+ * @param[out]		dst	Output buffer
+ * @param[in]		dst_sz	Size of the output buffer
+ * @param[in]		src	Compressed frame
+ * @param[in]		len	Size of the compressed frame
+ * @param[in]		mac	The interface's MAC
+ *
+ * @returns	Size of the Ethernet frame
+ * @retval	-EBADMSG	Malformed or unsupported compressed frame
+ * @retval	-EMSGSIZE	Frame too big for the buffer
+ */
+int slh_agent_iphc_decompress(uint8_t* dst, uint16_t dst_sz,
+		const uint8_t* src, uint16_t len, const uint8_t* mac);
+
+#endif
@@ -1,5 +1,6 @@
 /* SPDX-License-Identifier: GPL-2.0+ */
 /* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+#include <linux/bpf.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <sys/socket.h>
@@ -9,6 +10,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netlink/netlink.h>
 #include <netlink/cache.h>
@@ -17,7 +20,88 @@
 #include "tap.h"
 #include "tapinternal.h"
 
-int slh_agent_tap_open(struct slh_agent_tap_ctx* const ctx) {
+/*! Build an eBPF instruction */
+#define SLH_AGENT_TAP_BPF_INSN(c, d, s, o, i)				\
+	((struct bpf_insn){						\
+		.code = (c), .dst_reg = (d), .src_reg = (s),		\
+		.off = (o), .imm = (i)					\
+	})
+
+/*!
+ * Have the kernel drop frames to destination MACs we did not ask for.
+ */
+static int slh_agent_tap_set_mac_filter(
+		const struct slh_agent_tap_ctx* const ctx) {
+	union {
+		struct tun_filter hdr;
+		uint8_t raw[sizeof(struct tun_filter)
+			+ (SLH_TAP_FILTER_MAX * ETH_ALEN)];
+	} filter;
+
+	memset(&filter, 0, sizeof(filter));
+	if (ctx->filter_flags & SLH_TAP_FILTER_ALLMULTI)
+		filter.hdr.flags |= TUN_FLT_ALLMULTI;
+	filter.hdr.count = ctx->filter_macs;
+	memcpy(filter.hdr.addr, ctx->filter_mac,
+			ctx->filter_macs * ETH_ALEN);
+
+	if (ioctl(ctx->fd, TUNSETTXFILTER, &filter) < 0)
+		return -errno;
+	return 0;
+}
+
+/*!
+ * Have the kernel drop frames with EtherTypes we did not ask for, using an
+ * eBPF socket filter which compares the EtherType with each in turn.
+ */
+static int slh_agent_tap_set_type_filter(
+		const struct slh_agent_tap_ctx* const ctx) {
+	struct bpf_insn prog[SLH_TAP_FILTER_MAX + 6];
+	union bpf_attr attr;
+	uint8_t len = 0;
+	uint8_t i;
+	int prog_fd;
+	int res = 0;
+
+	/* Loads from the frame take the socket buffer in r6 */
+	prog[len++] = SLH_AGENT_TAP_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X,
+			BPF_REG_6, BPF_REG_1, 0, 0);
+	/* r0 = EtherType */
+	prog[len++] = SLH_AGENT_TAP_BPF_INSN(BPF_LD | BPF_ABS | BPF_H,
+			0, 0, 0, 12);
+	/* Skip to the end if it is one we want */
+	for (i = 0; i < ctx->filter_types; i++)
+		prog[len++] = SLH_AGENT_TAP_BPF_INSN(
+				BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0,
+				ctx->filter_types - i + 1,
+				ctx->filter_type[i]);
+	/* Otherwise keep none of it */
+	prog[len++] = SLH_AGENT_TAP_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K,
+			BPF_REG_0, 0, 0, 0);
+	prog[len++] = SLH_AGENT_TAP_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	/* Keep all of it */
+	prog[len++] = SLH_AGENT_TAP_BPF_INSN(BPF_ALU | BPF_MOV | BPF_K,
+			BPF_REG_0, 0, 0, -1);
+	prog[len++] = SLH_AGENT_TAP_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = len;
+	attr.license = (uintptr_t)"GPL";
+
+	prog_fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+	if (prog_fd < 0)
+		return -errno;
+
+	/* The device keeps its own reference to the program */
+	if (ioctl(ctx->fd, TUNSETFILTEREBPF, &prog_fd) < 0)
+		res = -errno;
+	close(prog_fd);
+	return res;
+}
+
+static int slh_agent_linuxtap_open(struct slh_agent_tap_ctx* const ctx) {
 	int res = 0;
 	struct ifreq ifr;
 	struct nl_sock* sock;
@@ -28,14 +112,10 @@ int slh_agent_tap_open(struct slh_agent_tap_ctx* const ctx) {
 
 	slh_agent_tap_core_set_mtu(ctx);
 
-	res = slh_agent_tap_core_alloc_buf(ctx, sizeof(struct tun_pi));
-	if (res)
-		goto exit;
-
 	ctx->fd = open("/dev/net/tun", O_RDWR);
 	if (ctx->fd < 0) {
 		res = -errno;
-		goto freebuf;
+		goto exit;
 	}
 
 	memset(&ifr, 0, sizeof(ifr));
@@ -46,6 +126,10 @@ int slh_agent_tap_open(struct slh_agent_tap_ctx* const ctx) {
 	 *        IFF_NO_PI - Do not provide packet information  
 	 */
 	ifr.ifr_flags = IFF_TAP;
+	if (ctx->queues > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (ctx->offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 
 	/* Did we get a device name? */
 	if (ctx->name[0])
@@ -60,6 +144,33 @@ int slh_agent_tap_open(struct slh_agent_tap_ctx* const ctx) {
 	/* Set the device name */
 	strncpy(ctx->name, ifr.ifr_name, sizeof(ctx->name));
 
+	if (ctx->offload) {
+		/*
+		 * Our header size, which a device we attached to may have
+		 * had changed, and nothing left to us until we say so.
+		 */
+		int hdr_sz = SLH_TAP_OFFLOAD_HDR_SZ;
+
+		if ((ioctl(ctx->fd, TUNSETVNETHDRSZ, &hdr_sz) < 0)
+				|| (ioctl(ctx->fd, TUNSETOFFLOAD, 0) < 0)) {
+			res = -errno;
+			goto closetap;
+		}
+	}
+
+	/* Drop unwanted frames before they are copied to us */
+	if (ctx->filter_macs) {
+		res = slh_agent_tap_set_mac_filter(ctx);
+		if (res < 0)
+			goto closetap;
+	}
+
+	if (ctx->filter_types) {
+		res = slh_agent_tap_set_type_filter(ctx);
+		if (res < 0)
+			goto closetap;
+	}
+
 	sock = nl_socket_alloc();
 	if (!sock) {
 		res = -ENOMEM;
@@ -148,48 +259,196 @@ freenl:
 		goto exit;
 closetap:
 	close(ctx->fd);
-freebuf:
-	slh_agent_tap_core_free_buf(ctx);
 exit:
 	return res;
 }
 
+static int slh_agent_linuxtap_open_queue(
+		const struct slh_agent_tap_ctx* const primary,
+		struct slh_agent_tap_ctx* const ctx) {
+	int res = 0;
+	struct ifreq ifr;
+
+	memcpy(ctx->name, primary->name, sizeof(ctx->name));
+	memcpy(ctx->mac, primary->mac, sizeof(ctx->mac));
+	ctx->mtu = primary->mtu;
+	ctx->ifindex = primary->ifindex;
+	ctx->queues = primary->queues;
+	ctx->offload = primary->offload;
+
+	ctx->fd = open("/dev/net/tun", O_RDWR);
+	if (ctx->fd < 0) {
+		res = -errno;
+		goto exit;
+	}
+
+	/* Attach to the existing interface as another queue */
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_MULTI_QUEUE;
+	if (ctx->offload)
+		/* The device takes the flags of the last queue attached */
+		ifr.ifr_flags |= IFF_VNET_HDR;
+	strncpy(ifr.ifr_name, ctx->name, IFNAMSIZ);
+
+	res = ioctl(ctx->fd, TUNSETIFF, (void *) &ifr);
+	if (res < 0) {
+		res = -errno;
+		goto closetap;
+	}
+	goto exit;
+
+closetap:
+	close(ctx->fd);
+exit:
+	return res;
+}
+
+/*!
+ * Copy an offload header, swapping its 16-bit fields between network byte
+ * order and the host byte order the kernel uses.
+ */
+static void slh_agent_linuxtap_swap_hdr(uint8_t* const out,
+		const uint8_t* const in) {
+	uint8_t i;
+
+	/* Flags and segmentation type */
+	out[0] = in[0];
+	out[1] = in[1];
+
+	for (i = 2; i < SLH_TAP_OFFLOAD_HDR_SZ; i += sizeof(uint16_t)) {
+		uint16_t field;
+
+		memcpy(&field, &in[i], sizeof(field));
+		field = htons(field);
+		memcpy(&out[i], &field, sizeof(field));
+	}
+}
+
 /*!
- * Read an Ethernet frame from the TAP interface.
+ * Read an Ethernet frame and, if the interface has offloads, its offload
+ * header straight into the caller's buffers.
  *
  * @param[inout]	ctx	TAP interface context
+ * @param[out]		hdr	Output buffer to write offload header
  * @param[out]		buf	Output buffer to write frame
  * @param[in]		buf_sz	Size of buffer
  *
  * @returns	Size of frame written to buffer
+ * @retval	-EMSGSIZE	Frame did not fit in the buffer
  */
-int slh_agent_tap_read(struct slh_agent_tap_ctx* const ctx,
-		uint8_t* const buf, uint16_t buf_sz) {
+static int slh_agent_linuxtap_read_offload(
+		struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const hdr, uint8_t* const buf, uint16_t buf_sz) {
 	struct tun_pi info;
-	ssize_t len = read(ctx->fd, ctx->buffer,
-			ctx->mtu + sizeof(struct tun_pi));
-	if (len < sizeof(info))
+	const size_t hdr_sz = ctx->offload ? SLH_TAP_OFFLOAD_HDR_SZ : 0;
+	struct iovec iov[] = {
+		/* Packet information goes on the stack */
+		{
+			.iov_base = &info,
+			.iov_len = sizeof(info)
+		},
+		/* Offload header, if any, wherever the caller wants it */
+		{
+			.iov_base = hdr,
+			.iov_len = hdr_sz
+		},
+		/* The frame itself goes straight to the caller */
+		{
+			.iov_base = buf,
+			.iov_len = buf_sz
+		}
+	};
+	ssize_t len = readv(ctx->fd, iov, 3);
+	if (len < 0)
 		return -errno;
+	if (len < (ssize_t)(sizeof(info) + hdr_sz))
+		return -EBADMSG;
 
 	/* Inspect the packet info */
-	memcpy(&info, ctx->buffer, sizeof(info));
 	if (info.flags & TUN_PKT_STRIP) {
 		/* Ethernet frame got truncated */
 		return -EMSGSIZE;
 	}
-	len -= sizeof(info);
 
-	if (len > buf_sz)
-		/* It's too big for the buffer given */
+	if (hdr_sz)
+		slh_agent_linuxtap_swap_hdr(hdr, hdr);
+	return len - sizeof(info) - hdr_sz;
+}
+
+/*!
+ * Read an Ethernet frame from the TAP interface straight into the caller's
+ * buffer.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[out]		buf	Output buffer to write frame
+ * @param[in]		buf_sz	Size of buffer
+ *
+ * @returns	Size of frame written to buffer
+ * @retval	-EMSGSIZE	Frame did not fit in the buffer
+ */
+static int slh_agent_linuxtap_read(struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const buf, uint16_t buf_sz) {
+	/* Offload header, if any, is thrown away */
+	uint8_t hdr[SLH_TAP_OFFLOAD_HDR_SZ];
+
+	return slh_agent_linuxtap_read_offload(ctx, hdr, buf, buf_sz);
+}
+
+/*!
+ * Write an Ethernet frame to the TAP interface straight from the caller's
+ * buffer, with an offload header if the interface has offloads.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[in]		hdr	Offload header, in network byte order
+ * @param[in]		buf	Input buffer to read frame
+ * @param[in]		buf_sz	Size of buffer
+ *
+ * @retval	0	Success
+ */
+static int slh_agent_linuxtap_write_offload(
+		struct slh_agent_tap_ctx* const ctx,
+		const uint8_t* const hdr, const uint8_t* const buf,
+		uint16_t buf_sz) {
+	/* Zeroed packet info */
+	struct tun_pi info = {
+		.flags = 0,
+		.proto = 0
+	};
+	/* Offload header, in the kernel's byte order */
+	uint8_t host_hdr[SLH_TAP_OFFLOAD_HDR_SZ];
+	const size_t hdr_sz = ctx->offload ? SLH_TAP_OFFLOAD_HDR_SZ : 0;
+	const struct iovec iov[] = {
+		{
+			.iov_base = &info,
+			.iov_len = sizeof(info)
+		},
+		{
+			.iov_base = host_hdr,
+			.iov_len = hdr_sz
+		},
+		{
+			.iov_base = (void*)buf,
+			.iov_len = buf_sz
+		}
+	};
+
+	/* Only super-frames may be bigger than the MTU */
+	if (buf_sz > (((hdr[1] & ~SLH_TAP_GSO_ECN) != SLH_TAP_GSO_NONE)
+				? SLH_TAP_OFFLOAD_FRAME_MAX : ctx->mtu))
 		return -EMSGSIZE;
 
-	/* Copy it out */
-	memcpy(buf, &(ctx->buffer[sizeof(info)]), len);
-	return len;
+	slh_agent_linuxtap_swap_hdr(host_hdr, hdr);
+
+	/* Write, including the size of the headers */
+	if (writev(ctx->fd, iov, 3)
+			< (ssize_t)(sizeof(info) + hdr_sz + buf_sz))
+		return -errno;
+	return 0;
 }
 
 /*!
- * Write an Ethernet frame to the TAP interface.
+ * Write an Ethernet frame to the TAP interface straight from the caller's
+ * buffer.
  *
  * @param[inout]	ctx	TAP interface context
  * @param[in]		buf	Input buffer to read frame
@@ -197,27 +456,111 @@ int slh_agent_tap_read(struct slh_agent_tap_ctx* const ctx,
  *
  * @retval	0	Success
  */
-int slh_agent_tap_write(struct slh_agent_tap_ctx* const ctx,
+static int slh_agent_linuxtap_write(struct slh_agent_tap_ctx* const ctx,
 		const uint8_t* const buf, uint16_t buf_sz) {
-	if (buf_sz > ctx->mtu)
-		return -EMSGSIZE;
+	/* Offload header, if any, asks for nothing */
+	static const uint8_t hdr[SLH_TAP_OFFLOAD_HDR_SZ] = { 0 };
 
-	/* Zero out the packet info */
-	memset(ctx->buffer, 0, sizeof(struct tun_pi));
+	return slh_agent_linuxtap_write_offload(ctx, hdr, buf, buf_sz);
+}
 
-	/* Copy the destination buffer */
-	memcpy(&(ctx->buffer[sizeof(struct tun_pi)]),
-			buf, buf_sz);
+/*!
+ * Tell the kernel which offloads it may leave to us.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[in]		offload	SLH_TAP_OFFLOAD_ flags
+ *
+ * @retval	0	Success
+ */
+static int slh_agent_linuxtap_set_offload(
+		struct slh_agent_tap_ctx* const ctx, uint8_t offload) {
+	unsigned int flags = 0;
 
-	/* Include the size of the packet info header */
-	buf_sz += sizeof(struct tun_pi);
+	if (offload & SLH_TAP_OFFLOAD_CSUM)
+		flags |= TUN_F_CSUM;
+	if (offload & SLH_TAP_OFFLOAD_TSO4)
+		flags |= TUN_F_TSO4;
+	if (offload & SLH_TAP_OFFLOAD_TSO6)
+		flags |= TUN_F_TSO6;
+	if (offload & SLH_TAP_OFFLOAD_TSO_ECN)
+		flags |= TUN_F_TSO_ECN;
 
-	/* Write */
-	if (write(ctx->fd, ctx->buffer, buf_sz) < buf_sz)
+	if (ioctl(ctx->fd, TUNSETOFFLOAD, flags) < 0)
 		return -errno;
 	return 0;
 }
 
+/*!
+ * Check a frame read from the TAP interface by an I/O engine, and put its
+ * offload header, if any, into network byte order.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[inout]	raw	Packet information, offload header and frame
+ * @param[in]		raw_sz	Number of bytes read
+ *
+ * @returns	Size of the offload header and frame
+ * @retval	-EMSGSIZE	Frame did not fit in the buffer
+ */
+static int slh_agent_linuxtap_raw_unwrap(
+		struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const raw, uint32_t raw_sz) {
+	const size_t hdr_sz = ctx->offload ? SLH_TAP_OFFLOAD_HDR_SZ : 0;
+	struct tun_pi info;
+
+	if (raw_sz < (sizeof(info) + hdr_sz))
+		return -EBADMSG;
+
+	memcpy(&info, raw, sizeof(info));
+	if (info.flags & TUN_PKT_STRIP)
+		/* Ethernet frame got truncated */
+		return -EMSGSIZE;
+
+	if (hdr_sz)
+		slh_agent_linuxtap_swap_hdr(&raw[sizeof(info)],
+				&raw[sizeof(info)]);
+	return raw_sz - sizeof(info);
+}
+
+/*!
+ * Prepare a frame for an I/O engine to write to the TAP interface: fill in
+ * the packet information, and put the offload header, if any, into the
+ * kernel's byte order.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[inout]	raw	Room for packet information, then the offload
+ *				header and frame
+ * @param[in]		len	Size of the offload header and frame
+ *
+ * @returns	Number of bytes to write
+ */
+static int slh_agent_linuxtap_raw_wrap(
+		struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const raw, uint32_t len) {
+	const struct tun_pi info = {
+		.flags = 0,
+		.proto = 0
+	};
+	uint8_t* const hdr = &raw[sizeof(info)];
+	uint32_t max_sz = ctx->mtu;
+
+	if (ctx->offload) {
+		if (len < SLH_TAP_OFFLOAD_HDR_SZ)
+			return -EINVAL;
+
+		/* Only super-frames may be bigger than the MTU */
+		if ((hdr[1] & ~SLH_TAP_GSO_ECN) != SLH_TAP_GSO_NONE)
+			max_sz = SLH_TAP_OFFLOAD_FRAME_MAX;
+		max_sz += SLH_TAP_OFFLOAD_HDR_SZ;
+	}
+	if (len > max_sz)
+		return -EMSGSIZE;
+
+	if (ctx->offload)
+		slh_agent_linuxtap_swap_hdr(hdr, hdr);
+	memcpy(raw, &info, sizeof(info));
+	return sizeof(info) + len;
+}
+
 /*!
  * Close the TAP interface.
  *
@@ -225,8 +568,22 @@ int slh_agent_tap_write(struct slh_agent_tap_ctx* const ctx,
  *
  * @retval	0	Success
  */
-int slh_agent_tap_close(struct slh_agent_tap_ctx* const ctx) {
+static int slh_agent_linuxtap_close(struct slh_agent_tap_ctx* const ctx) {
 	close(ctx->fd);
-	slh_agent_tap_core_free_buf(ctx);
 	return 0;
 }
+
+const struct slh_agent_tap_ops slh_agent_linuxtap_ops = {
+	.name = "tap",
+	.open = slh_agent_linuxtap_open,
+	.open_queue = slh_agent_linuxtap_open_queue,
+	.read = slh_agent_linuxtap_read,
+	.write = slh_agent_linuxtap_write,
+	.close = slh_agent_linuxtap_close,
+	.read_offload = slh_agent_linuxtap_read_offload,
+	.write_offload = slh_agent_linuxtap_write_offload,
+	.set_offload = slh_agent_linuxtap_set_offload,
+	.raw_hdr_sz = sizeof(struct tun_pi),
+	.raw_unwrap = slh_agent_linuxtap_raw_unwrap,
+	.raw_wrap = slh_agent_linuxtap_raw_wrap,
+};
@@ -1,9 +1,7 @@
-#include "tap.h"
-#include "frame.h"
+#include "agent.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
@@ -11,20 +9,110 @@
 #include <arpa/inet.h>
 #include <linux/if_ether.h>
 
+#ifndef SLH_AGENT_RX_BUF_SZ
+/*! Default control channel input buffer size */
+#define SLH_AGENT_RX_BUF_SZ	(65536)
+#endif
+
+#ifndef SLH_AGENT_TX_BUF_SZ
+/*! Smallest control channel output buffer */
+#define SLH_AGENT_TX_BUF_SZ	(65536)
+#endif
+
 /*!
  * Standard options
  */
-const char* cmdline_opts = "a:m:n:";
+const char* cmdline_opts = "a:b:c:e:f:j:m:n:op:q:Q:r:R:s:t:T:uw:";
+
+/*!
+ * TAP backends, the first being the default: the Linux TAP interface where
+ * that is built, otherwise a socket.
+ */
+static const struct slh_agent_tap_ops* const tap_backends[] = {
+#ifdef SLH_AGENT_HAVE_LINUXTAP
+	&slh_agent_linuxtap_ops,
+#endif
+	&slh_agent_socktap_ops,
+	&slh_agent_mocktap_ops,
+};
+
+/*!
+ * Choose a TAP backend given as NAME[:ARG].
+ *
+ * @retval	0	Success
+ * @retval	-ENOENT	No such backend
+ */
+static int parse_backend(struct slh_agent_tap_ctx* const tap, char* str) {
+	char* arg = strchr(str, ':');
+	unsigned int i;
+
+	if (arg)
+		*(arg++) = 0;
+
+	for (i = 0; i < (sizeof(tap_backends) / sizeof(tap_backends[0]));
+			i++) {
+		if (!strcmp(str, tap_backends[i]->name)) {
+			tap->ops = tap_backends[i];
+			tap->arg = arg;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/*!
+ * Parse a colon-separated MAC address.
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Malformed address
+ */
+static int parse_mac(uint8_t* mac, const char* str) {
+	unsigned int i;
+
+	for (i = 0; i < SLH_TAP_MAC_SZ; i++) {
+		char* endptr = NULL;
+		unsigned long val = strtoul(str, &endptr, 16);
+
+		if ((endptr == str) || (val > UINT8_MAX))
+			return -EINVAL;
+		mac[i] = val;
+
+		if (i == (SLH_TAP_MAC_SZ - 1))
+			/* Last one, must be the end */
+			return *endptr ? -EINVAL : 0;
+		if (*endptr != ':')
+			return -EINVAL;
+		str = endptr + 1;
+	}
+
+	return -EINVAL;
+}
 
 int main(int argc, char* argv[]) {
-	fd_set rfds;
-	struct timeval tv;
-	struct slh_agent_tap_ctx tap;
+	struct slh_agent agent;
+	uint32_t window = 1;
+	uint32_t timeout = SLH_AGENT_WINDOW_DEFAULT_TIMEOUT;
+	uint32_t depth = SLH_AGENT_QUEUE_DEFAULT_DEPTH;
+	uint8_t policy = SLH_AGENT_QUEUE_DROP_TAIL;
+	uint32_t batch = SLH_AGENT_DEFAULT_BATCH;
+	uint32_t rx_sz = SLH_AGENT_RX_BUF_SZ;
+	uint32_t tx_sz;
+	struct slh_agent_shm_fds shm_fds;
+	struct slh_agent_capture capture;
+	const char* capture_path = NULL;
+	_Bool use_shm = false;
+	int ctl_fd = -1;
 	int res;
-	_Bool pending;
 
 	/* Prepare TAP context */
-	memset(&tap, 0, sizeof(tap));
+	memset(&agent, 0, sizeof(agent));
+	agent.tap.ops = tap_backends[0];
+	if (slh_agent_rules_init(&agent.rules) < 0) {
+		fprintf(stderr, "Failed to allocate rules\n");
+		return 1;
+	}
+
 	res = getopt(argc, argv, cmdline_opts);
 	while (res != -1) {
 		switch (res) {
@@ -50,12 +138,103 @@ int main(int argc, char* argv[]) {
 								optarg);
 						return 1;
 					}
-					tap.mac[idx] = val;
+					agent.tap.mac[idx] = val;
 					ptr = strtok_r(NULL, ":", &saveptr);
 					idx++;
 				}
 			}
 			break;
+		case 'b':
+			/* Set the most TAP frames read per wakeup */
+			{
+				char* endptr = NULL;
+				batch = strtoul(optarg, &endptr, 0);
+				if ((endptr == optarg) || (batch > UINT16_MAX)) {
+					fprintf(stderr, "Invalid batch size: %s\n",
+							optarg);
+					return 1;
+				}
+			}
+			break;
+		case 'c':
+			/* Talk to the parent over a SOCK_SEQPACKET socket */
+			{
+				char* endptr = NULL;
+				long fd = strtol(optarg, &endptr, 0);
+				if ((endptr == optarg) || *endptr || (fd < 0)
+						|| (fd > INT32_MAX)) {
+					fprintf(stderr, "Invalid socket: %s\n",
+							optarg);
+					return 1;
+				}
+				ctl_fd = fd;
+			}
+			break;
+		case 'e':
+			/* Only pass frames with these EtherTypes */
+			{
+				char* saveptr;
+				char* ptr = strtok_r(optarg, ",", &saveptr);
+
+				while (ptr) {
+					char* endptr = NULL;
+					unsigned long type = ETH_P_IPV6;
+
+					if (strcmp(ptr, "ipv6"))
+						type = strtoul(ptr, &endptr, 16);
+					if ((endptr && ((endptr == ptr) || *endptr))
+							|| (type > UINT16_MAX)
+							|| (agent.tap.filter_types
+								>= SLH_TAP_FILTER_MAX)) {
+						fprintf(stderr, "Invalid EtherType "
+								"filter: %s\n", ptr);
+						return 1;
+					}
+					agent.tap.filter_type[agent.tap.filter_types++]
+						= type;
+					ptr = strtok_r(NULL, ",", &saveptr);
+				}
+			}
+			break;
+		case 'f':
+			/* Only pass frames to these destination MACs */
+			{
+				char* saveptr;
+				char* ptr = strtok_r(optarg, ",", &saveptr);
+
+				while (ptr) {
+					if (!strcmp(ptr, "multicast")) {
+						agent.tap.filter_flags
+							|= SLH_TAP_FILTER_ALLMULTI;
+					} else if ((agent.tap.filter_macs
+								>= SLH_TAP_FILTER_MAX)
+							|| (parse_mac(agent.tap.filter_mac[
+									agent.tap.filter_macs],
+								ptr) < 0)) {
+						fprintf(stderr, "Invalid MAC "
+								"filter: %s\n", ptr);
+						return 1;
+					} else {
+						agent.tap.filter_macs++;
+					}
+					ptr = strtok_r(NULL, ",", &saveptr);
+				}
+			}
+			break;
+		case 'j':
+			/* Set the number of TAP queues */
+			{
+				char* endptr = NULL;
+				uint32_t queues = strtoul(optarg, &endptr, 0);
+				if ((endptr == optarg) || !queues
+						|| (queues > UINT16_MAX)) {
+					fprintf(stderr, "Invalid queue count: %s\n",
+							optarg);
+					return 1;
+				}
+				agent.tap.queues = queues;
+			}
+			break;
 		case 'm':
 			/* Set the MTU */
 			{
@@ -70,33 +249,159 @@ int main(int argc, char* argv[]) {
 					fprintf(stderr, "MTU too large: %u\n", mtu);
 					return 1;
 				}
-				tap.mtu = mtu;
+				agent.tap.mtu = mtu;
 			}
 			break;
 		case 'n':
 			/* Set the device name */
-			strncpy(tap.name, optarg, SLH_TAP_NAME_SZ);
+			strncpy(agent.tap.name, optarg, SLH_TAP_NAME_SZ);
+			break;
+		case 'o':
+			/* Offer the parent checksum and segmentation work */
+			agent.tap.offload = SLH_TAP_OFFLOAD_ALL;
+			break;
+		case 'p':
+			/* Capture the frames crossing the interface */
+			capture_path = optarg;
+			break;
+		case 'q':
+			/* Set the transmit queue depth */
+			{
+				char* endptr = NULL;
+				depth = strtoul(optarg, &endptr, 0);
+				if ((endptr == optarg) || (depth >= UINT16_MAX)) {
+					fprintf(stderr, "Invalid queue depth: %s\n",
+							optarg);
+					return 1;
+				}
+			}
+			break;
+		case 'Q':
+			/* Set the transmit queue overflow policy */
+			if (!strcmp(optarg, "head")) {
+				policy = SLH_AGENT_QUEUE_DROP_HEAD;
+			} else if (!strcmp(optarg, "tail")) {
+				policy = SLH_AGENT_QUEUE_DROP_TAIL;
+			} else {
+				fprintf(stderr, "Invalid queue policy: %s\n",
+						optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			/* Set the control channel input buffer size */
+			{
+				char* endptr = NULL;
+				rx_sz = strtoul(optarg, &endptr, 0);
+				if ((endptr == optarg) || !rx_sz
+						|| (rx_sz > SLH_FRAME_BUF_MAX)) {
+					fprintf(stderr, "Invalid buffer size: %s\n",
+							optarg);
+					return 1;
+				}
+			}
+			break;
+		case 'R':
+			/* Add frame rules, given inline or as @FILE */
+			{
+				unsigned int line = 0;
+
+				if (optarg[0] == '@')
+					res = slh_agent_rules_load(
+							&agent.rules,
+							optarg + 1, &line);
+				else
+					res = slh_agent_rules_parse(
+							&agent.rules,
+							optarg, &line);
+				if (res == -EINVAL) {
+					fprintf(stderr, "Invalid rule at line "
+							"%u: %s\n", line,
+							optarg);
+					return 1;
+				} else if (res < 0) {
+					fprintf(stderr, "Failed to add rules "
+							"%s: %s\n", optarg,
+							strerror(-res));
+					return 1;
+				}
+			}
+			break;
+		case 's':
+			/* Talk to the parent through shared memory */
+			if (slh_agent_shm_parse(&shm_fds, optarg) < 0) {
+				fprintf(stderr, "Invalid shared memory "
+						"descriptors: %s\n", optarg);
+				return 1;
+			}
+			use_shm = true;
+			break;
+		case 't':
+			/* Set the retransmission timeout */
+			{
+				char* endptr = NULL;
+				timeout = strtoul(optarg, &endptr, 0);
+				if ((endptr == optarg) || !timeout) {
+					fprintf(stderr, "Invalid timeout: %s\n",
+							optarg);
+					return 1;
+				}
+			}
+			break;
+		case 'T':
+			/* Choose what provides the interface */
+			if (parse_backend(&agent.tap, optarg) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n",
+						optarg);
+				return 1;
+			}
+			break;
+		case 'u':
+			/* TAP and control channel I/O through io_uring */
+			agent.uring = true;
+			break;
+		case 'w':
+			/* Set the largest window offered to the parent */
+			{
+				char* endptr = NULL;
+				window = strtoul(optarg, &endptr, 0);
+				if ((endptr == optarg) || !window
+						|| (window > SLH_AGENT_WINDOW_MAX)) {
+					fprintf(stderr, "Invalid window: %s\n",
+							optarg);
+					return 1;
+				}
+			}
 			break;
 		default:
-			fprintf(stderr, "Usage: %s [-m MTU] [-n NAME] [-a MAC]\n",
+			fprintf(stderr, "Usage: %s [-m MTU] [-n NAME] [-a MAC] "
+					"[-w WINDOW] [-t TIMEOUT] "
+					"[-q DEPTH] [-Q head|tail] [-j QUEUES] "
+					"[-b BATCH] [-r BUFSZ] [-c FD] "
+					"[-s MEM,ARX,ATX,PRX,PTX] "
+					"[-f MAC,...] [-e TYPE,...] "
+					"[-R RULES|@FILE] [-o] [-p FILE] [-u] "
+					"[-T tap|socket:PATH|socket:FD|mock]\n",
 					argv[0]);
 			return 1;
 		}
 		res = getopt(argc, argv, cmdline_opts);
 	}
 
-	/* Prepare control channel context */
-	struct slh_agent_frame_ctx ctl;
-	res = slh_agent_frame_init(&ctl, STDIN_FILENO,
-			STDOUT_FILENO, NULL, 4096);
-	if (res < 0) {
-		fprintf(stderr, "Failed to initialise control channel: %s\n",
-				strerror(-res));
+	if (use_shm && (ctl_fd >= 0)) {
+		fprintf(stderr, "Choose either -c or -s, not both\n");
+		return 1;
+	}
+
+	if ((agent.tap.filter_flags & SLH_TAP_FILTER_ALLMULTI)
+			&& !agent.tap.filter_macs) {
+		/* The kernel ignores a filter with no addresses */
+		fprintf(stderr, "-f multicast needs at least one MAC\n");
 		return 1;
 	}
 
 	/* Open a TAP device */
-	res = slh_agent_tap_open(&tap);
+	res = slh_agent_tap_open(&agent.tap);
 	if (res < 0) {
 		fprintf(stderr, "Failed to open device: %s\n",
 				strerror(-res));
@@ -113,98 +418,76 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
-	/* Send the frame info */
-	res = slh_agent_write_device_detail_frame(&ctl, &tap);
+	/*
+	 * Prepare control channel context: the output buffer takes at least
+	 * a few full-size frames, all escaped.
+	 */
+	tx_sz = 4 * slh_agent_frame_encoded_max(
+			slh_agent_tap_buf_sz(&agent.tap) + 2);
+	if (tx_sz < SLH_AGENT_TX_BUF_SZ)
+		tx_sz = SLH_AGENT_TX_BUF_SZ;
+
+	if (use_shm)
+		res = slh_agent_frame_init_shm(&agent.ctl, &shm_fds, false);
+	else if (ctl_fd >= 0)
+		res = slh_agent_frame_init_packet(&agent.ctl, ctl_fd, tx_sz);
+	else
+		res = slh_agent_frame_init(&agent.ctl, STDIN_FILENO,
+				STDOUT_FILENO, rx_sz, tx_sz);
 	if (res < 0) {
-		fprintf(stderr, "Failed to send SOH frame: %s\n",
+		fprintf(stderr, "Failed to initialise control channel: %s\n",
 				strerror(-res));
 		goto exit;
 	}
 
-	while (1) {
-		union {
-			uint8_t raw[tap.mtu + sizeof(struct slh_agent_frame)];
-			struct slh_agent_frame header;
-		} frame;
-
-		/* Wait for the next frame (up to 5 seconds) */
-		FD_ZERO(&rfds);
-		FD_SET(ctl.rx_fd, &rfds);
-		FD_SET(tap.fd, &rfds);
+	if ((agent.ctl.tx_buffer_sz / 2)
+			< slh_agent_frame_encoded_max(
+				slh_agent_tap_buf_sz(&agent.tap) + 2)) {
+		/* Not sure to have room for a full-size frame */
+		fprintf(stderr, "Shared memory rings too small\n");
+		res = -EMSGSIZE;
+		goto exit;
+	}
 
-		tv.tv_sec = 5;
-		tv.tv_usec = 0;
-		res = select(tap.fd + 1, &rfds, NULL, NULL, &tv);
+	/* Start capturing, as ourselves if we were setuid */
+	if (capture_path) {
+		res = slh_agent_capture_open(&capture, capture_path,
+				&agent.tap);
 		if (res < 0) {
-			break;
-		} else if (res > 0) {
-			if (FD_ISSET(tap.fd, &rfds)) {
-				/* We have an Ethernet frame */
-
-				int len = slh_agent_tap_read(&tap,
-						frame.header.payload,
-						sizeof(frame.raw)
-						- sizeof(struct slh_agent_frame));
-				if (len < 0) {
-					if (len == -EMSGSIZE)
-						continue;
-					else
-						break;
-				}
-
-				if (pending) {
-					continue;
-				}
-
-				/* Put the frame type in */
-				frame.header.type = FS;
-				res = slh_agent_write_frame(&ctl, &frame.header,
-						len + sizeof(struct slh_agent_frame));
-				if (!res) {
-					pending = true;
-				}
-			} else if (FD_ISSET(ctl.rx_fd, &rfds)) {
-				int len = slh_agent_read_frame(&ctl, &frame.header,
-					sizeof(frame));
-				if (len == -EBADMSG) {
-					slh_agent_drop_frame(&ctl);
-				} else if (len > 0) {
-					if (frame.header.type == EOT)
-						break;
-					switch (frame.header.type) {
-					case FS:
-						/* Payload is an Ethernet frame */
-						res = slh_agent_tap_write(
-								&tap,
-								frame.header.payload,
-								len - sizeof(struct slh_agent_frame));
-						if (res < 0) {
-							slh_agent_write_frame_nopayload(&ctl, NAK);
-						} else {
-							slh_agent_write_frame_nopayload(&ctl, ACK);
-						}
-						break;
-					case SYN:
-						slh_agent_write_frame_nopayload(&ctl, ACK);
-						break;
-					case ACK:
-					case NAK:
-						pending = false;
-						break;
-					default:
-						slh_agent_write_frame_nopayload(&ctl, NAK);
-					}
-				}
-			}
+			fprintf(stderr, "Failed to open capture %s: %s\n",
+					capture_path, strerror(-res));
+			goto exit;
 		}
+		agent.capture = &capture;
 	}
 
+	/* Prepare the agent */
+	agent.window = window;
+	agent.timeout = timeout;
+	agent.depth = depth;
+	agent.policy = policy;
+	agent.batch = batch;
+	res = slh_agent_init(&agent);
+	if (res < 0) {
+		fprintf(stderr, "Failed to initialise agent: %s\n",
+				strerror(-res));
+		goto exit;
+	}
+
+	res = slh_agent_run(&agent);
+	if (res < 0)
+		fprintf(stderr, "Agent stopped: %s\n", strerror(-res));
+	slh_agent_free(&agent);
+
 exit:
+	if (agent.capture && (slh_agent_capture_close(agent.capture) < 0))
+		fprintf(stderr, "Capture to %s incomplete\n", capture_path);
+	slh_agent_frame_free(&agent.ctl);
+	slh_agent_rules_free(&agent.rules);
+
 	/* Close the TAP device */
-	res = slh_agent_tap_close(&tap);
-	if (res < 0) {
+	if (slh_agent_tap_close(&agent.tap) < 0)
 		return 1;
-	}
 
-	return 0;
+	return (res < 0) ? 1 : 0;
 }
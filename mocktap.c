@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Mock backend: an interface in memory, fed and drained by the same
+ * process.  Frames each way wait in a ring of SLH_AGENT_MOCKTAP_SLOTS
+ * slots of the MTU in size; an eventfd stands in for the interface's
+ * descriptor, readable while frames are waiting for the agent.
+ */
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tap.h"
+#include "tapinternal.h"
+
+/*!
+ * Frames waiting one way.
+ */
+struct slh_agent_mocktap_ring {
+	/*! SLH_AGENT_MOCKTAP_SLOTS slots, each the MTU in size */
+	uint8_t* buffer;
+	/*! Size of the frame in each slot */
+	uint16_t len[SLH_AGENT_MOCKTAP_SLOTS];
+	/*! Slot the oldest frame is in */
+	uint16_t head;
+	/*! Number of frames waiting */
+	uint16_t count;
+};
+
+/*!
+ * Mock interface state.
+ */
+struct slh_agent_mocktap {
+	/*! Held by whichever thread is using the rings */
+	pthread_mutex_t lock;
+	/*! Frames for the agent to read */
+	struct slh_agent_mocktap_ring rx;
+	/*! Frames the agent wrote */
+	struct slh_agent_mocktap_ring tx;
+	/*! Frames written with no room for them */
+	uint64_t dropped;
+};
+
+/*!
+ * Add a frame to the back of a ring.
+ *
+ * @retval	0		Success
+ * @retval	-ENOBUFS	Ring full
+ */
+static int slh_agent_mocktap_put(struct slh_agent_mocktap_ring* const ring,
+		uint16_t slot_sz, const uint8_t* const buf, uint16_t buf_sz) {
+	uint16_t slot;
+
+	if (ring->count == SLH_AGENT_MOCKTAP_SLOTS)
+		return -ENOBUFS;
+
+	slot = (ring->head + ring->count) % SLH_AGENT_MOCKTAP_SLOTS;
+	memcpy(&ring->buffer[(size_t)slot * slot_sz], buf, buf_sz);
+	ring->len[slot] = buf_sz;
+	ring->count++;
+	return 0;
+}
+
+/*!
+ * Take the frame from the front of a ring.
+ *
+ * @returns	Size of the frame
+ * @retval	-EAGAIN		Ring empty
+ * @retval	-EMSGSIZE	Frame did not fit in the buffer; it is dropped
+ */
+static int slh_agent_mocktap_get(struct slh_agent_mocktap_ring* const ring,
+		uint16_t slot_sz, uint8_t* const buf, uint16_t buf_sz) {
+	const uint16_t slot = ring->head;
+	const uint16_t len = ring->len[slot];
+
+	if (!ring->count)
+		return -EAGAIN;
+
+	ring->head = (slot + 1) % SLH_AGENT_MOCKTAP_SLOTS;
+	ring->count--;
+
+	if (len > buf_sz)
+		return -EMSGSIZE;
+	memcpy(buf, &ring->buffer[(size_t)slot * slot_sz], len);
+	return len;
+}
+
+static int slh_agent_mocktap_open(struct slh_agent_tap_ctx* const ctx) {
+	struct slh_agent_mocktap* mock;
+	size_t ring_sz;
+	int res;
+
+	if (ctx->filter_macs || ctx->filter_types || ctx->offload
+			|| (ctx->queues > 1))
+		return -EOPNOTSUPP;
+
+	slh_agent_tap_core_set_mtu(ctx);
+	slh_agent_tap_core_set_ident(ctx, "mock0");
+	ctx->ifindex = 0;
+
+	mock = calloc(1, sizeof(*mock));
+	if (!mock)
+		return -ENOMEM;
+
+	ring_sz = (size_t)SLH_AGENT_MOCKTAP_SLOTS * ctx->mtu;
+	mock->rx.buffer = malloc(ring_sz);
+	if (!mock->rx.buffer) {
+		res = -ENOMEM;
+		goto freemock;
+	}
+
+	mock->tx.buffer = malloc(ring_sz);
+	if (!mock->tx.buffer) {
+		res = -ENOMEM;
+		goto freerx;
+	}
+
+	res = -pthread_mutex_init(&mock->lock, NULL);
+	if (res < 0)
+		goto freetx;
+
+	ctx->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctx->fd < 0) {
+		res = -errno;
+		goto destroylock;
+	}
+
+	ctx->priv = mock;
+	return 0;
+
+destroylock:
+	pthread_mutex_destroy(&mock->lock);
+freetx:
+	free(mock->tx.buffer);
+freerx:
+	free(mock->rx.buffer);
+freemock:
+	free(mock);
+	return res;
+}
+
+static int slh_agent_mocktap_open_queue(
+		const struct slh_agent_tap_ctx* const primary,
+		struct slh_agent_tap_ctx* const ctx) {
+	(void)primary;
+	(void)ctx;
+	return -EOPNOTSUPP;
+}
+
+static int slh_agent_mocktap_read(struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const buf, uint16_t buf_sz) {
+	struct slh_agent_mocktap* const mock = ctx->priv;
+	int len;
+
+	pthread_mutex_lock(&mock->lock);
+	len = slh_agent_mocktap_get(&mock->rx, ctx->mtu, buf, buf_sz);
+	if (!mock->rx.count) {
+		/* Drained: no longer readable */
+		uint64_t count;
+		if (read(ctx->fd, &count, sizeof(count)) < 0) {
+			/* Nothing to reset */
+		}
+	}
+	pthread_mutex_unlock(&mock->lock);
+	return len;
+}
+
+static int slh_agent_mocktap_write(struct slh_agent_tap_ctx* const ctx,
+		const uint8_t* const buf, uint16_t buf_sz) {
+	struct slh_agent_mocktap* const mock = ctx->priv;
+
+	if (buf_sz > ctx->mtu)
+		return -EMSGSIZE;
+
+	pthread_mutex_lock(&mock->lock);
+	if (slh_agent_mocktap_put(&mock->tx, ctx->mtu, buf, buf_sz) < 0)
+		/* As a busy link would, lose it */
+		mock->dropped++;
+	pthread_mutex_unlock(&mock->lock);
+	return 0;
+}
+
+static int slh_agent_mocktap_close(struct slh_agent_tap_ctx* const ctx) {
+	struct slh_agent_mocktap* const mock = ctx->priv;
+
+	close(ctx->fd);
+	pthread_mutex_destroy(&mock->lock);
+	free(mock->tx.buffer);
+	free(mock->rx.buffer);
+	free(mock);
+	ctx->priv = NULL;
+	return 0;
+}
+
+int slh_agent_mocktap_inject(struct slh_agent_tap_ctx* const ctx,
+		const uint8_t* const buf, uint16_t buf_sz) {
+	struct slh_agent_mocktap* const mock = ctx->priv;
+	int res;
+
+	if (buf_sz > ctx->mtu)
+		return -EMSGSIZE;
+
+	pthread_mutex_lock(&mock->lock);
+	res = slh_agent_mocktap_put(&mock->rx, ctx->mtu, buf, buf_sz);
+	if (!res && (mock->rx.count == 1)) {
+		/* Was empty: wake the agent */
+		const uint64_t one = 1;
+		if (write(ctx->fd, &one, sizeof(one)) < 0)
+			res = -errno;
+	}
+	pthread_mutex_unlock(&mock->lock);
+	return res;
+}
+
+int slh_agent_mocktap_take(struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const buf, uint16_t buf_sz) {
+	struct slh_agent_mocktap* const mock = ctx->priv;
+	int len;
+
+	pthread_mutex_lock(&mock->lock);
+	len = slh_agent_mocktap_get(&mock->tx, ctx->mtu, buf, buf_sz);
+	pthread_mutex_unlock(&mock->lock);
+	return len;
+}
+
+uint64_t slh_agent_mocktap_dropped(
+		const struct slh_agent_tap_ctx* const ctx) {
+	struct slh_agent_mocktap* const mock = ctx->priv;
+	uint64_t dropped;
+
+	pthread_mutex_lock(&mock->lock);
+	dropped = mock->dropped;
+	pthread_mutex_unlock(&mock->lock);
+	return dropped;
+}
+
+const struct slh_agent_tap_ops slh_agent_mocktap_ops = {
+	.name = "mock",
+	.open = slh_agent_mocktap_open,
+	.open_queue = slh_agent_mocktap_open_queue,
+	.read = slh_agent_mocktap_read,
+	.write = slh_agent_mocktap_write,
+	.close = slh_agent_mocktap_close,
+};
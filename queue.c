@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*!
+ * Return the position in the ring of slot numbers `offset` places after
+ * the head of the queue.
+ */
+static inline uint16_t slh_agent_queue_slot_idx(
+		const struct slh_agent_queue* const q,
+		uint16_t offset) {
+	return (q->head + offset) % (q->depth + 1);
+}
+
+/*!
+ * Return the slot `offset` places after the head of the queue.
+ */
+static inline uint16_t slh_agent_queue_slot(
+		const struct slh_agent_queue* const q,
+		uint16_t offset) {
+	return q->order[slh_agent_queue_slot_idx(q, offset)];
+}
+
+/*!
+ * Discard the queued frame `offset` places after the head, keeping the
+ * spare slot where it is.
+ */
+static void slh_agent_queue_remove(struct slh_agent_queue* const q,
+		uint16_t offset) {
+	const uint16_t spare = slh_agent_queue_slot(q, q->count);
+	const uint16_t victim = slh_agent_queue_slot(q, offset);
+
+	if (!offset) {
+		slh_agent_queue_pop(q);
+		return;
+	}
+
+	for (; offset < (q->count - 1); offset++)
+		q->order[slh_agent_queue_slot_idx(q, offset)] =
+			slh_agent_queue_slot(q, offset + 1);
+	q->order[slh_agent_queue_slot_idx(q, q->count - 1)] = spare;
+	q->order[slh_agent_queue_slot_idx(q, q->count)] = victim;
+	q->count--;
+}
+
+int slh_agent_queue_init(struct slh_agent_queue* const q,
+		uint16_t depth, uint16_t slot_sz, uint8_t policy) {
+	size_t slots = (size_t)depth + 1;
+	size_t i;
+
+	memset(q, 0, sizeof(*q));
+
+	q->buffer = malloc(slots * slot_sz);
+	q->len = calloc(slots, sizeof(uint16_t));
+	q->prio = calloc(slots, sizeof(uint8_t));
+	q->order = calloc(slots, sizeof(uint16_t));
+	if (!q->buffer || !q->len || !q->prio || !q->order) {
+		slh_agent_queue_free(q);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < slots; i++)
+		q->order[i] = i;
+
+	q->slot_sz = slot_sz;
+	q->depth = depth;
+	q->policy = policy;
+	return 0;
+}
+
+void slh_agent_queue_free(struct slh_agent_queue* const q) {
+	free(q->buffer);
+	free(q->len);
+	free(q->prio);
+	free(q->order);
+	q->buffer = NULL;
+	q->len = NULL;
+	q->prio = NULL;
+	q->order = NULL;
+}
+
+uint8_t* slh_agent_queue_tail(struct slh_agent_queue* const q,
+		uint16_t* max_sz) {
+	uint16_t slot = slh_agent_queue_slot(q, q->count);
+
+	*max_sz = q->slot_sz;
+	return &(q->buffer[(size_t)slot * q->slot_sz]);
+}
+
+int slh_agent_queue_push(struct slh_agent_queue* const q, uint16_t len,
+		uint8_t prio) {
+	const uint16_t slot = slh_agent_queue_slot(q, q->count);
+	uint16_t pos;
+	int res = 0;
+
+	if (q->count == q->depth) {
+		/* Sorted by priority, so the lowest are at the back */
+		uint8_t lowest;
+
+		if (!q->depth) {
+			q->dropped_tail++;
+			return -ENOBUFS;
+		}
+
+		lowest = q->prio[slh_agent_queue_slot(q, q->count - 1)];
+		if ((prio < lowest) || ((prio == lowest)
+				&& (q->policy == SLH_AGENT_QUEUE_DROP_TAIL))) {
+			q->dropped_tail++;
+			return -ENOBUFS;
+		}
+
+		if (q->policy == SLH_AGENT_QUEUE_DROP_TAIL) {
+			/* Outranked by the incoming frame */
+			slh_agent_queue_remove(q, q->count - 1);
+			q->dropped_tail++;
+		} else {
+			/* Make room by discarding the oldest of the lowest */
+			pos = 0;
+			if (q->prio[slh_agent_queue_slot(q, 0)] != lowest) {
+				pos = q->count - 1;
+				while (q->prio[slh_agent_queue_slot(q, pos - 1)]
+						== lowest)
+					pos--;
+			}
+			slh_agent_queue_remove(q, pos);
+			q->dropped_head++;
+		}
+		res = -ENOBUFS;
+	}
+
+	/* Behind every frame of the same or a higher priority */
+	for (pos = q->count; pos && (q->prio[slh_agent_queue_slot(q, pos - 1)]
+				< prio); pos--)
+		q->order[slh_agent_queue_slot_idx(q, pos)] =
+			slh_agent_queue_slot(q, pos - 1);
+	q->order[slh_agent_queue_slot_idx(q, pos)] = slot;
+
+	q->len[slot] = len;
+	q->prio[slot] = prio;
+	q->count++;
+	if (q->count > q->peak)
+		q->peak = q->count;
+	return res;
+}
+
+const uint8_t* slh_agent_queue_head(const struct slh_agent_queue* const q,
+		uint16_t* len) {
+	uint16_t slot;
+
+	if (!q->count)
+		return NULL;
+
+	slot = slh_agent_queue_slot(q, 0);
+	*len = q->len[slot];
+	return &(q->buffer[(size_t)slot * q->slot_sz]);
+}
+
+void slh_agent_queue_pop(struct slh_agent_queue* const q) {
+	if (!q->count)
+		return;
+
+	q->head = slh_agent_queue_slot_idx(q, 1);
+	q->count--;
+}
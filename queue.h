@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_QUEUE_H
+#define _6LH_AGENT_QUEUE_H
+
+#include <errno.h>
+#include <stdint.h>
+
+/*
+ * Bounded queue of Ethernet frames received from the TAP device while the
+ * transmit window is full.  All storage is allocated up front: `depth` slots
+ * for queued frames, plus one spare slot which incoming frames are read
+ * into.
+ *
+ * Each frame has a priority (see rules.h).  Frames leave the queue highest
+ * priority first, and in the order they came within a priority.  Once the
+ * queue is full, a frame of the lowest priority present is discarded: the
+ * overflow policy decides whether it is the oldest of them or the incoming
+ * frame (or, if that outranks them, the newest of them).  With every frame
+ * at the same priority, this is a plain FIFO.
+ *
+ * The queue keeps the order of its slots in a ring of slot numbers, so
+ * frames never move; one jumping the queue only moves slot numbers.
+ */
+
+#ifndef SLH_AGENT_QUEUE_DEFAULT_DEPTH
+/*! Default number of frames queued */
+#define SLH_AGENT_QUEUE_DEFAULT_DEPTH	(32)
+#endif
+
+/*! Overflow policy: discard the oldest queued frame */
+#define SLH_AGENT_QUEUE_DROP_HEAD	(0)
+/*! Overflow policy: discard the incoming frame */
+#define SLH_AGENT_QUEUE_DROP_TAIL	(1)
+
+/*!
+ * Frame queue context
+ */
+struct slh_agent_queue {
+	/*! Frame storage, `depth + 1` slots of `slot_sz` bytes each */
+	uint8_t* buffer;
+	/*! Length of the frame in each slot */
+	uint16_t* len;
+	/*! Priority of the frame in each slot */
+	uint8_t* prio;
+	/*!
+	 * Ring of `depth + 1` slot numbers: those queued in the order they
+	 * leave, starting at `head`, followed by the free ones, starting
+	 * with the spare slot.
+	 */
+	uint16_t* order;
+	/*! Size of each slot */
+	uint16_t slot_sz;
+	/*! Largest number of frames queued */
+	uint16_t depth;
+	/*! Position in `order` of the next frame to leave */
+	uint16_t head;
+	/*! Number of frames queued */
+	uint16_t count;
+	/*! Most frames ever queued */
+	uint16_t peak;
+	/*! Overflow policy */
+	uint8_t policy;
+	/*! Oldest frames discarded to make room */
+	uint32_t dropped_head;
+	/*! Incoming (or newest) frames discarded as the queue was full */
+	uint32_t dropped_tail;
+};
+
+/*!
+ * Initialise a frame queue.
+ *
+ * @param[inout]	q	Frame queue
+ * @param[in]		depth	Largest number of frames queued (may be 0)
+ * @param[in]		slot_sz	Largest frame stored
+ * @param[in]		policy	Overflow policy
+ *
+ * @retval	0	Success
+ * @retval	-ENOMEM	Unable to allocate buffers
+ */
+int slh_agent_queue_init(struct slh_agent_queue* const q,
+		uint16_t depth, uint16_t slot_sz, uint8_t policy);
+
+/*!
+ * Release the buffers held by a frame queue.
+ */
+void slh_agent_queue_free(struct slh_agent_queue* const q);
+
+/*!
+ * Return the slot the next incoming frame should be written into.  There is
+ * always one, even if the queue is full.
+ *
+ * @param[inout]	q	Frame queue
+ * @param[out]		max_sz	Size of the slot
+ */
+uint8_t* slh_agent_queue_tail(struct slh_agent_queue* const q,
+		uint16_t* max_sz);
+
+/*!
+ * Enqueue the frame written into the tail slot, applying the overflow
+ * policy if the queue is full.
+ *
+ * @param[inout]	q	Frame queue
+ * @param[in]		len	Length of the frame
+ * @param[in]		prio	Priority of the frame
+ *
+ * @retval	0		Frame queued
+ * @retval	-ENOBUFS	Queue full, a frame was discarded
+ */
+int slh_agent_queue_push(struct slh_agent_queue* const q, uint16_t len,
+		uint8_t prio);
+
+/*!
+ * Return the next frame to leave the queue, or NULL if empty.
+ *
+ * @param[inout]	q	Frame queue
+ * @param[out]		len	Length of the frame
+ */
+const uint8_t* slh_agent_queue_head(const struct slh_agent_queue* const q,
+		uint16_t* len);
+
+/*!
+ * Remove the next frame to leave from the queue.
+ */
+void slh_agent_queue_pop(struct slh_agent_queue* const q);
+
+#endif
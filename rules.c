@@ -0,0 +1,474 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "rules.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Layout of the key */
+/*! Destination MAC, 6 bytes */
+#define SLH_AGENT_RULES_KEY_DST		(0)
+/*! EtherType, 2 bytes, big-endian */
+#define SLH_AGENT_RULES_KEY_TYPE	(6)
+/*! SLH_AGENT_RULES_HAS_ flags */
+#define SLH_AGENT_RULES_KEY_FLAGS	(8)
+/*! IPv6 next header */
+#define SLH_AGENT_RULES_KEY_NH		(9)
+/*! IPv6 traffic class */
+#define SLH_AGENT_RULES_KEY_TC		(10)
+/*! UDP or TCP source port, 2 bytes, big-endian */
+#define SLH_AGENT_RULES_KEY_SPORT	(12)
+/*! UDP or TCP destination port, 2 bytes, big-endian */
+#define SLH_AGENT_RULES_KEY_DPORT	(14)
+
+/* Flags in the key, so that fields a frame lacks match nothing */
+/*! The frame is IPv6 */
+#define SLH_AGENT_RULES_HAS_IPV6	(1 << 0)
+/*! The frame is UDP or TCP over IPv6 */
+#define SLH_AGENT_RULES_HAS_PORTS	(1 << 1)
+
+/* Matches seen in a rule, to catch any given twice */
+#define SLH_AGENT_RULES_M_TYPE		(1 << 0)
+#define SLH_AGENT_RULES_M_DST		(1 << 1)
+#define SLH_AGENT_RULES_M_NH		(1 << 2)
+#define SLH_AGENT_RULES_M_TC		(1 << 3)
+#define SLH_AGENT_RULES_M_SPORT		(1 << 4)
+#define SLH_AGENT_RULES_M_DPORT		(1 << 5)
+#define SLH_AGENT_RULES_M_PORT		(1 << 6)
+
+/*! Largest rules file read */
+#define SLH_AGENT_RULES_FILE_MAX	(1048576)
+
+/*!
+ * A rule being compiled.
+ */
+struct slh_agent_rules_match {
+	uint8_t mask[SLH_AGENT_RULES_KEY_SZ];
+	uint8_t value[SLH_AGENT_RULES_KEY_SZ];
+	/*! SLH_AGENT_RULES_M_ flags */
+	uint8_t seen;
+	uint8_t action;
+};
+
+/*!
+ * Gather the fields of a frame into its key.
+ */
+static void slh_agent_rules_key(uint64_t* key, const uint8_t* frame,
+		uint16_t len) {
+	uint8_t k[SLH_AGENT_RULES_KEY_SZ];
+
+	memset(k, 0, sizeof(k));
+	if (len >= 14) {
+		memcpy(k + SLH_AGENT_RULES_KEY_DST, frame, 6);
+		k[SLH_AGENT_RULES_KEY_TYPE] = frame[12];
+		k[SLH_AGENT_RULES_KEY_TYPE + 1] = frame[13];
+	}
+
+	if ((len >= (14 + 40)) && (frame[12] == 0x86)
+			&& (frame[13] == 0xdd)) {
+		const uint8_t* const ip = frame + 14;
+
+		k[SLH_AGENT_RULES_KEY_FLAGS] = SLH_AGENT_RULES_HAS_IPV6;
+		k[SLH_AGENT_RULES_KEY_NH] = ip[6];
+		k[SLH_AGENT_RULES_KEY_TC] = (ip[0] << 4) | (ip[1] >> 4);
+
+		/* UDP and TCP both start with the two ports */
+		if ((len >= (14 + 40 + 4))
+				&& ((ip[6] == 17) || (ip[6] == 6))) {
+			k[SLH_AGENT_RULES_KEY_FLAGS] |=
+				SLH_AGENT_RULES_HAS_PORTS;
+			memcpy(k + SLH_AGENT_RULES_KEY_SPORT, ip + 40, 4);
+		}
+	}
+
+	memcpy(key, k, sizeof(k));
+}
+
+/*!
+ * Add a match on `len` bytes of the key at `off`.
+ */
+static void slh_agent_rules_set(struct slh_agent_rules_match* const m,
+		uint8_t off, const uint8_t* value, const uint8_t* mask,
+		uint8_t len) {
+	uint8_t i;
+
+	for (i = 0; i < len; i++) {
+		m->mask[off + i] |= mask[i];
+		m->value[off + i] |= value[i] & mask[i];
+	}
+}
+
+/*!
+ * Parse a number no greater than `max`.
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Malformed or out of range
+ */
+static int slh_agent_rules_number(const char* str, unsigned long max,
+		unsigned long* val) {
+	char* endptr = NULL;
+
+	if (!str)
+		return -EINVAL;
+	*val = strtoul(str, &endptr, 0);
+	if ((endptr == str) || *endptr || (*val > max))
+		return -EINVAL;
+	return 0;
+}
+
+/*!
+ * Parse a colon-separated MAC address.
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Malformed address
+ */
+static int slh_agent_rules_mac(const char* str, uint8_t* mac) {
+	int end = 0;
+
+	if (sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%n",
+				&mac[0], &mac[1], &mac[2], &mac[3], &mac[4],
+				&mac[5], &end) < 6)
+		return -EINVAL;
+	return str[end] ? -EINVAL : 0;
+}
+
+/*!
+ * Compile one rule, split into words.
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Malformed rule
+ */
+static int slh_agent_rules_compile(struct slh_agent_rules_match* const m,
+		char* rule) {
+	static const uint8_t ones[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	const uint8_t ipv6 = SLH_AGENT_RULES_HAS_IPV6;
+	const uint8_t ports = SLH_AGENT_RULES_HAS_PORTS;
+	char* saveptr;
+	char* word = strtok_r(rule, " \t\r", &saveptr);
+	unsigned long val;
+
+	memset(m, 0, sizeof(*m));
+
+	if (!strcmp(word, "accept")) {
+		m->action = 0;
+	} else if (!strcmp(word, "drop")) {
+		m->action = SLH_AGENT_RULES_DROP;
+	} else if (!strcmp(word, "prio")) {
+		if (slh_agent_rules_number(strtok_r(NULL, " \t\r", &saveptr),
+					SLH_AGENT_RULES_PRIO_MAX, &val) < 0)
+			return -EINVAL;
+		m->action = val;
+	} else {
+		return -EINVAL;
+	}
+
+	while ((word = strtok_r(NULL, " \t\r", &saveptr))) {
+		char* arg = strtok_r(NULL, " \t\r", &saveptr);
+		char* slash;
+		uint8_t flag;
+		uint8_t bytes[6];
+		uint8_t mask[6];
+
+		if (!arg)
+			return -EINVAL;
+
+		/* Masks, where allowed, follow a slash */
+		slash = strchr(arg, '/');
+		if (slash)
+			*slash++ = 0;
+
+		if (!strcmp(word, "type")) {
+			flag = SLH_AGENT_RULES_M_TYPE;
+			if (!strcmp(arg, "ipv6"))
+				val = 0x86dd;
+			else if (slh_agent_rules_number(arg, UINT16_MAX,
+						&val) < 0)
+				return -EINVAL;
+			bytes[0] = val >> 8;
+			bytes[1] = val;
+			slh_agent_rules_set(m, SLH_AGENT_RULES_KEY_TYPE,
+					bytes, ones, 2);
+		} else if (!strcmp(word, "dst")) {
+			flag = SLH_AGENT_RULES_M_DST;
+			if ((slh_agent_rules_mac(arg, bytes) < 0)
+					|| (slash && (slh_agent_rules_mac(
+							slash, mask) < 0)))
+				return -EINVAL;
+			slh_agent_rules_set(m, SLH_AGENT_RULES_KEY_DST,
+					bytes, slash ? mask : ones, 6);
+			slash = NULL;
+		} else if (!strcmp(word, "nh")) {
+			flag = SLH_AGENT_RULES_M_NH;
+			if (slh_agent_rules_number(arg, UINT8_MAX, &val) < 0)
+				return -EINVAL;
+			bytes[0] = val;
+			slh_agent_rules_set(m, SLH_AGENT_RULES_KEY_NH,
+					bytes, ones, 1);
+			slh_agent_rules_set(m, SLH_AGENT_RULES_KEY_FLAGS,
+					&ipv6, &ipv6, 1);
+		} else if (!strcmp(word, "tc")) {
+			flag = SLH_AGENT_RULES_M_TC;
+			if (slh_agent_rules_number(arg, UINT8_MAX, &val) < 0)
+				return -EINVAL;
+			bytes[0] = val;
+			mask[0] = 0xff;
+			if (slash) {
+				if (slh_agent_rules_number(slash, UINT8_MAX,
+							&val) < 0)
+					return -EINVAL;
+				mask[0] = val;
+				slash = NULL;
+			}
+			slh_agent_rules_set(m, SLH_AGENT_RULES_KEY_TC,
+					bytes, mask, 1);
+			slh_agent_rules_set(m, SLH_AGENT_RULES_KEY_FLAGS,
+					&ipv6, &ipv6, 1);
+		} else if (!strcmp(word, "sport") || !strcmp(word, "dport")
+				|| !strcmp(word, "port")) {
+			if (slh_agent_rules_number(arg, UINT16_MAX, &val) < 0)
+				return -EINVAL;
+			bytes[0] = val >> 8;
+			bytes[1] = val;
+			if (word[0] == 'p') {
+				/* Filled in per row, see slh_agent_rules_add */
+				flag = SLH_AGENT_RULES_M_PORT;
+				slh_agent_rules_set(m,
+						SLH_AGENT_RULES_KEY_SPORT,
+						bytes, ones, 2);
+			} else if (word[0] == 's') {
+				flag = SLH_AGENT_RULES_M_SPORT;
+				slh_agent_rules_set(m,
+						SLH_AGENT_RULES_KEY_SPORT,
+						bytes, ones, 2);
+			} else {
+				flag = SLH_AGENT_RULES_M_DPORT;
+				slh_agent_rules_set(m,
+						SLH_AGENT_RULES_KEY_DPORT,
+						bytes, ones, 2);
+			}
+			slh_agent_rules_set(m, SLH_AGENT_RULES_KEY_FLAGS,
+					&ports, &ports, 1);
+		} else {
+			return -EINVAL;
+		}
+
+		/* Each match once only, and no mask where none is taken */
+		if (slash || (m->seen & flag))
+			return -EINVAL;
+		m->seen |= flag;
+	}
+
+	if ((m->seen & SLH_AGENT_RULES_M_PORT)
+			&& (m->seen & (SLH_AGENT_RULES_M_SPORT
+					| SLH_AGENT_RULES_M_DPORT)))
+		return -EINVAL;
+	return 0;
+}
+
+/*!
+ * Write a row of the table.
+ */
+static void slh_agent_rules_row(struct slh_agent_rules* const rules,
+		uint16_t idx, const uint8_t* mask, const uint8_t* value,
+		uint8_t action) {
+	memcpy(rules->row[idx].mask, mask, SLH_AGENT_RULES_KEY_SZ);
+	memcpy(rules->row[idx].value, value, SLH_AGENT_RULES_KEY_SZ);
+	rules->action[idx] = action;
+}
+
+/*!
+ * Add the rows for a compiled rule ahead of the last row.
+ *
+ * @retval	0	Success
+ * @retval	-E2BIG	Too many rows
+ * @retval	-ENOMEM	Unable to grow the table
+ */
+static int slh_agent_rules_add(struct slh_agent_rules* const rules,
+		const struct slh_agent_rules_match* const m) {
+	const uint16_t add = (m->seen & SLH_AGENT_RULES_M_PORT) ? 2 : 1;
+	const uint8_t none[SLH_AGENT_RULES_KEY_SZ] = { 0 };
+	struct slh_agent_rule_row* row;
+	uint8_t* action;
+
+	if ((rules->rows + add) > UINT16_MAX)
+		return -E2BIG;
+
+	row = realloc(rules->row, (rules->rows + add) * sizeof(*row));
+	if (!row)
+		return -ENOMEM;
+	rules->row = row;
+
+	action = realloc(rules->action, rules->rows + add);
+	if (!action)
+		return -ENOMEM;
+	rules->action = action;
+
+	slh_agent_rules_row(rules, rules->rows - 1, m->mask, m->value,
+			m->action);
+	if (add > 1) {
+		/* The same again, with the port moved to the destination */
+		uint8_t mask[SLH_AGENT_RULES_KEY_SZ];
+		uint8_t value[SLH_AGENT_RULES_KEY_SZ];
+
+		memcpy(mask, m->mask, sizeof(mask));
+		memcpy(value, m->value, sizeof(value));
+		memcpy(mask + SLH_AGENT_RULES_KEY_DPORT,
+				mask + SLH_AGENT_RULES_KEY_SPORT, 2);
+		memcpy(value + SLH_AGENT_RULES_KEY_DPORT,
+				value + SLH_AGENT_RULES_KEY_SPORT, 2);
+		memset(mask + SLH_AGENT_RULES_KEY_SPORT, 0, 2);
+		memset(value + SLH_AGENT_RULES_KEY_SPORT, 0, 2);
+		slh_agent_rules_row(rules, rules->rows, mask, value,
+				m->action);
+	}
+
+	rules->rows += add;
+	rules->count++;
+	slh_agent_rules_row(rules, rules->rows - 1, none, none, 0);
+	return 0;
+}
+
+int slh_agent_rules_init(struct slh_agent_rules* const rules) {
+	const uint8_t none[SLH_AGENT_RULES_KEY_SZ] = { 0 };
+
+	rules->row = malloc(sizeof(*rules->row));
+	rules->action = malloc(1);
+	if (!rules->row || !rules->action) {
+		slh_agent_rules_free(rules);
+		return -ENOMEM;
+	}
+
+	rules->rows = 1;
+	rules->count = 0;
+	slh_agent_rules_row(rules, 0, none, none, 0);
+	return 0;
+}
+
+int slh_agent_rules_parse(struct slh_agent_rules* const rules,
+		const char* text, unsigned int* line) {
+	const uint8_t none[SLH_AGENT_RULES_KEY_SZ] = { 0 };
+	const uint16_t rows = rules->rows;
+	const uint16_t count = rules->count;
+	char* copy = strdup(text);
+	char* next = copy;
+	int res = 0;
+
+	if (!copy)
+		return -ENOMEM;
+
+	*line = 0;
+	while (next && !res) {
+		char* cur = next;
+		char* saveptr;
+		char* rule;
+
+		/* One line at a time, comments cut off */
+		(*line)++;
+		next = strchr(cur, '\n');
+		if (next)
+			*next++ = 0;
+		cur[strcspn(cur, "#")] = 0;
+
+		for (rule = strtok_r(cur, ";", &saveptr); rule && !res;
+				rule = strtok_r(NULL, ";", &saveptr)) {
+			struct slh_agent_rules_match m;
+
+			if (!rule[strspn(rule, " \t\r")])
+				/* Nothing but space */
+				continue;
+
+			res = slh_agent_rules_compile(&m, rule);
+			if (!res)
+				res = slh_agent_rules_add(rules, &m);
+		}
+	}
+
+	if (res < 0) {
+		/* Put the table back as it was */
+		rules->rows = rows;
+		rules->count = count;
+		slh_agent_rules_row(rules, rows - 1, none, none, 0);
+	}
+
+	free(copy);
+	return res;
+}
+
+int slh_agent_rules_load(struct slh_agent_rules* const rules,
+		const char* path, unsigned int* line) {
+	struct stat st;
+	char* text;
+	ssize_t len;
+	int fd;
+	int res;
+
+	*line = 0;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		res = -errno;
+		goto closefd;
+	}
+	if (st.st_size > SLH_AGENT_RULES_FILE_MAX) {
+		res = -EFBIG;
+		goto closefd;
+	}
+
+	text = malloc(st.st_size + 1);
+	if (!text) {
+		res = -ENOMEM;
+		goto closefd;
+	}
+
+	len = read(fd, text, st.st_size);
+	if (len < 0) {
+		res = -errno;
+		goto freetext;
+	}
+	text[len] = 0;
+
+	res = slh_agent_rules_parse(rules, text, line);
+
+freetext:
+	free(text);
+closefd:
+	close(fd);
+	return res;
+}
+
+void slh_agent_rules_free(struct slh_agent_rules* const rules) {
+	free(rules->row);
+	free(rules->action);
+	rules->row = NULL;
+	rules->action = NULL;
+	rules->rows = 0;
+	rules->count = 0;
+}
+
+uint8_t slh_agent_rules_eval(const struct slh_agent_rules* const rules,
+		const uint8_t* frame, uint16_t len) {
+	const struct slh_agent_rule_row* row = rules->row;
+	uint64_t key[SLH_AGENT_RULES_KEY_SZ / sizeof(uint64_t)];
+
+	if (rules->rows == 1) {
+		/* No rules, no need to look at the frame */
+		return rules->action[0];
+	}
+
+	slh_agent_rules_key(key, frame, len);
+
+	/* The last row matches everything, so this always stops */
+	while (((key[0] & row->mask[0]) ^ row->value[0])
+			| ((key[1] & row->mask[1]) ^ row->value[1]))
+		row++;
+
+	return rules->action[row - rules->row];
+}
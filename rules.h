@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_RULES_H
+#define _6LH_AGENT_RULES_H
+
+#include <errno.h>
+#include <stdint.h>
+
+/*
+ * Frame rules.
+ *
+ * Each rule gives an action and the fields a frame must match for it to
+ * apply.  The first rule an Ethernet frame matches decides what becomes of
+ * it, whichever way it is going; a frame matching none is accepted.
+ *
+ * Rules are written one to a line, or separated by semicolons, as an
+ * action followed by any number of matches.  `#` starts a comment.
+ *
+ *	accept			pass the frame on
+ *	drop			discard it
+ *	prio N			pass it on ahead of queued frames of a lower
+ *				priority (0 to SLH_AGENT_RULES_PRIO_MAX,
+ *				accept being 0)
+ *
+ *	type N			EtherType (or `ipv6`)
+ *	dst MAC[/MASK]		destination MAC
+ *	nh N			IPv6 next header
+ *	tc N[/MASK]		IPv6 traffic class
+ *	sport N, dport N	UDP or TCP source or destination port
+ *	port N			either port
+ *
+ * For example: `drop type 0x0806; prio 3 nh 17 port 5683; drop dst
+ * 33:33:00:00:00:00/ff:ff:00:00:00:00`.
+ *
+ * Rules are compiled into a flat table.  The fields of a frame are
+ * gathered into a key of SLH_AGENT_RULES_KEY_SZ bytes, and each row of the
+ * table holds a mask and the value the key must have under it, so checking
+ * a row takes a few ANDs and compares whatever it tests.  A rule matching
+ * either port takes two rows.  The table ends with a row matching
+ * everything, which accepts.
+ */
+
+/*! Action: discard the frame */
+#define SLH_AGENT_RULES_DROP		(0xff)
+/*! Highest priority a frame can be given */
+#define SLH_AGENT_RULES_PRIO_MAX	(7)
+
+/*! Size of the key a frame is checked by */
+#define SLH_AGENT_RULES_KEY_SZ		(16)
+
+/*!
+ * One row of the table: the frame's key, masked with `mask`, must equal
+ * `value`.
+ */
+struct slh_agent_rule_row {
+	uint64_t mask[SLH_AGENT_RULES_KEY_SZ / sizeof(uint64_t)];
+	uint64_t value[SLH_AGENT_RULES_KEY_SZ / sizeof(uint64_t)];
+};
+
+/*!
+ * Compiled rules.
+ */
+struct slh_agent_rules {
+	/*! Table rows, the last matching everything */
+	struct slh_agent_rule_row* row;
+	/*! Action of each row, SLH_AGENT_RULES_DROP or a priority */
+	uint8_t* action;
+	/*! Number of rows, including the last */
+	uint16_t rows;
+	/*! Number of rules compiled */
+	uint16_t count;
+};
+
+/*!
+ * Initialise an empty set of rules, accepting everything.
+ *
+ * @retval	0	Success
+ * @retval	-ENOMEM	Unable to allocate the table
+ */
+int slh_agent_rules_init(struct slh_agent_rules* const rules);
+
+/*!
+ * Compile rules, adding them after those already there.
+ *
+ * @param[inout]	rules	Compiled rules
+ * @param[in]		text	Rules to compile
+ * @param[out]		line	Line of the first bad rule
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Malformed rule; none of `text` is added
+ * @retval	-E2BIG	Too many rules
+ * @retval	-ENOMEM	Unable to grow the table
+ */
+int slh_agent_rules_parse(struct slh_agent_rules* const rules,
+		const char* text, unsigned int* line);
+
+/*!
+ * Compile the rules in a file, adding them after those already there.
+ *
+ * @retval	0	Success
+ * @retval	<0	As slh_agent_rules_parse, or errno.h error reading
+ *			the file
+ */
+int slh_agent_rules_load(struct slh_agent_rules* const rules,
+		const char* path, unsigned int* line);
+
+/*!
+ * Release the table.
+ */
+void slh_agent_rules_free(struct slh_agent_rules* const rules);
+
+/*!
+ * Find what to do with an Ethernet frame.
+ *
+ * @param[in]		rules	Compiled rules
+ * @param[in]		frame	Ethernet frame
+ * @param[in]		len	Size of the frame
+ *
+ * @returns	SLH_AGENT_RULES_DROP, or the priority to pass it on with
+ */
+uint8_t slh_agent_rules_eval(const struct slh_agent_rules* const rules,
+		const uint8_t* frame, uint16_t len);
+
+#endif
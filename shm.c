@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/* For memfd_create */
+#define _GNU_SOURCE
+
+#include "shm.h"
+#include "frame.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+int slh_agent_shm_create(struct slh_agent_shm_fds* const fds,
+		uint32_t ring_sz) {
+	long page_sz = sysconf(_SC_PAGESIZE);
+	struct slh_agent_shm_header* hdr;
+	int* const efds[] = {
+		&fds->agent_rx_fd, &fds->agent_tx_fd,
+		&fds->parent_rx_fd, &fds->parent_tx_fd
+	};
+	uint32_t map_sz;
+	unsigned int i;
+	int res;
+
+	if ((page_sz <= 0) || !ring_sz || (ring_sz > SLH_FRAME_BUF_MAX))
+		return -EINVAL;
+
+	/* Round up to a power of two, no smaller than a page */
+	map_sz = page_sz;
+	while (map_sz < ring_sz)
+		map_sz <<= 1;
+
+	fds->mem_fd = memfd_create("6lhagent-shm", MFD_CLOEXEC);
+	if (fds->mem_fd < 0)
+		return -errno;
+
+	/* The rings start out empty: the memfd is zero-filled */
+	if (ftruncate(fds->mem_fd, 3 * (off_t)map_sz) < 0) {
+		res = -errno;
+		goto closemem;
+	}
+
+	hdr = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fds->mem_fd, 0);
+	if (hdr == MAP_FAILED) {
+		res = -errno;
+		goto closemem;
+	}
+
+	hdr->magic = SLH_AGENT_SHM_MAGIC;
+	hdr->version = SLH_AGENT_SHM_VERSION;
+	hdr->ring_sz = map_sz;
+	/* Neither side has looked yet, so the first frames must wake them */
+	atomic_init(&hdr->to_agent.waiting, true);
+	atomic_init(&hdr->to_parent.waiting, true);
+	munmap(hdr, map_sz);
+
+	for (i = 0; i < (sizeof(efds) / sizeof(efds[0])); i++) {
+		*efds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (*efds[i] < 0) {
+			res = -errno;
+			goto closeefds;
+		}
+	}
+
+	return 0;
+
+closeefds:
+	while (i--)
+		close(*efds[i]);
+closemem:
+	close(fds->mem_fd);
+	return res;
+}
+
+void slh_agent_shm_close(struct slh_agent_shm_fds* const fds) {
+	close(fds->parent_tx_fd);
+	close(fds->parent_rx_fd);
+	close(fds->agent_tx_fd);
+	close(fds->agent_rx_fd);
+	close(fds->mem_fd);
+}
+
+int slh_agent_shm_parse(struct slh_agent_shm_fds* const fds,
+		const char* str) {
+	int* const fd[] = {
+		&fds->mem_fd, &fds->agent_rx_fd, &fds->agent_tx_fd,
+		&fds->parent_rx_fd, &fds->parent_tx_fd
+	};
+	unsigned int i;
+
+	for (i = 0; i < (sizeof(fd) / sizeof(fd[0])); i++) {
+		char* endptr = NULL;
+		long val = strtol(str, &endptr, 0);
+
+		if ((endptr == str) || (val < 0) || (val > INT32_MAX))
+			return -EINVAL;
+		*fd[i] = val;
+
+		if (i == ((sizeof(fd) / sizeof(fd[0])) - 1))
+			/* Last one, must be the end */
+			return *endptr ? -EINVAL : 0;
+		if (*endptr != ',')
+			return -EINVAL;
+		str = endptr + 1;
+	}
+
+	return -EINVAL;
+}
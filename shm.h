@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_SHM_H
+#define _6LH_AGENT_SHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Shared memory control channel.
+ *
+ * Instead of byte-stuffed frames over stdin/stdout, the parent may hand the
+ * agent a memfd holding two single-producer, single-consumer rings, one for
+ * each direction, and four eventfds to wake either side with.  The memfd is
+ * laid out in three blocks of `ring_sz` bytes:
+ *
+ * - block 0: struct slh_agent_shm_header
+ * - block 1: frames from the parent to the agent
+ * - block 2: frames from the agent to the parent
+ *
+ * Each frame is stored as a 2-byte length (host byte order) followed by the
+ * frame itself, type byte first, with no escaping.  Frames wrap around the
+ * end of the ring.  The producer only moves `head` past whole frames.
+ *
+ * A consumer that finds its ring empty sets `waiting` and checks again
+ * before sleeping on its eventfd; a producer that moves `head` and finds
+ * `waiting` set clears it and signals that eventfd.  The same goes for a
+ * producer short of space, with `blocked`, `tail` and the producer's own
+ * eventfd.  A producer which has finished sets `closed`.  Both consumers
+ * start out with `waiting` set.
+ */
+
+/*! "6LHS" */
+#define SLH_AGENT_SHM_MAGIC	(0x53484c36)
+#define SLH_AGENT_SHM_VERSION	(1)
+
+/*! Bytes taken by the length of each frame in a ring */
+#define SLH_AGENT_SHM_LEN_SZ	(2)
+
+/*!
+ * Ring indices and flags.  The producer's and the consumer's halves sit in
+ * separate cache lines.
+ */
+struct slh_agent_shm_ring {
+	/*! Bytes written by the producer, modulo 2^32 */
+	_Atomic uint32_t head;
+	/*! The producer has finished */
+	_Atomic uint32_t closed;
+	/*! The producer is waiting for room */
+	_Atomic uint32_t blocked;
+	uint8_t _pad0[52];
+	/*! Bytes read by the consumer, modulo 2^32 */
+	_Atomic uint32_t tail;
+	/*! The consumer is waiting for data */
+	_Atomic uint32_t waiting;
+	uint8_t _pad1[56];
+};
+
+/*!
+ * Shared memory header, at the start of the memfd.
+ */
+struct slh_agent_shm_header {
+	/*! SLH_AGENT_SHM_MAGIC */
+	uint32_t magic;
+	/*! SLH_AGENT_SHM_VERSION */
+	uint32_t version;
+	/*! Size of each ring, a power of two of at least one page */
+	uint32_t ring_sz;
+	uint8_t _pad[52];
+	/*! Frames from the parent to the agent */
+	struct slh_agent_shm_ring to_agent;
+	/*! Frames from the agent to the parent */
+	struct slh_agent_shm_ring to_parent;
+};
+
+/*!
+ * File descriptors making up a shared memory channel.  Each side waits on
+ * its own two eventfds and signals the other side's.
+ */
+struct slh_agent_shm_fds {
+	/*! memfd holding the header and rings */
+	int mem_fd;
+	/*! Signalled when there are frames for the agent */
+	int agent_rx_fd;
+	/*! Signalled when there is room for frames from the agent */
+	int agent_tx_fd;
+	/*! Signalled when there are frames for the parent */
+	int parent_rx_fd;
+	/*! Signalled when there is room for frames from the parent */
+	int parent_tx_fd;
+};
+
+/*!
+ * Create a shared memory channel, for the parent's side.  All descriptors
+ * are close-on-exec and the eventfds non-blocking.
+ *
+ * @param[out]		fds	Descriptors of the new channel
+ * @param[in]		ring_sz	Smallest size of each ring
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Invalid ring size
+ * @retval	<0	errno.h error
+ */
+int slh_agent_shm_create(struct slh_agent_shm_fds* const fds,
+		uint32_t ring_sz);
+
+/*!
+ * Close the descriptors of a shared memory channel.
+ */
+void slh_agent_shm_close(struct slh_agent_shm_fds* const fds);
+
+/*!
+ * Parse the descriptors of a shared memory channel given as a list of five
+ * comma-separated numbers, in the order of struct slh_agent_shm_fds.
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Malformed list
+ */
+int slh_agent_shm_parse(struct slh_agent_shm_fds* const fds,
+		const char* str);
+
+#endif
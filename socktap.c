@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+/*
+ * Socket backend: the interface is one end of an AF_UNIX SOCK_SEQPACKET
+ * socket, each datagram carrying one Ethernet frame with no packet
+ * information header.  Whatever holds the other end plays the network.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tap.h"
+#include "tapinternal.h"
+
+/*!
+ * Connect to the listening socket at `path`.
+ *
+ * @returns	Connected socket
+ * @retval	-ENAMETOOLONG	Path too long for a socket address
+ */
+static int slh_agent_socktap_connect(const char* path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+	return fd;
+}
+
+/*!
+ * Descriptor number given as the argument, or -1 if it is a path.
+ */
+static int slh_agent_socktap_arg_fd(const char* arg) {
+	char* endptr = NULL;
+	long fd = strtol(arg, &endptr, 10);
+
+	if ((endptr == arg) || *endptr || (fd < 0) || (fd > INT32_MAX))
+		return -1;
+	return fd;
+}
+
+static int slh_agent_socktap_open(struct slh_agent_tap_ctx* const ctx) {
+	socklen_t type_sz;
+	int type;
+
+	if (!ctx->arg || !ctx->arg[0])
+		return -EINVAL;
+
+	/* Nothing in the kernel to filter for us, or offload to us */
+	if (ctx->filter_macs || ctx->filter_types || ctx->offload)
+		return -EOPNOTSUPP;
+
+	slh_agent_tap_core_set_mtu(ctx);
+	slh_agent_tap_core_set_ident(ctx, "sock0");
+	ctx->ifindex = 0;
+
+	ctx->fd = slh_agent_socktap_arg_fd(ctx->arg);
+	if (ctx->fd < 0) {
+		ctx->fd = slh_agent_socktap_connect(ctx->arg);
+		return (ctx->fd < 0) ? ctx->fd : 0;
+	}
+
+	/* A descriptor can't be opened again for the other queues */
+	if (ctx->queues > 1)
+		return -EOPNOTSUPP;
+
+	/* Frame boundaries are only kept by SOCK_SEQPACKET */
+	type_sz = sizeof(type);
+	if (getsockopt(ctx->fd, SOL_SOCKET, SO_TYPE, &type, &type_sz) < 0)
+		return -errno;
+	if (type != SOCK_SEQPACKET)
+		return -EPROTOTYPE;
+	return 0;
+}
+
+static int slh_agent_socktap_open_queue(
+		const struct slh_agent_tap_ctx* const primary,
+		struct slh_agent_tap_ctx* const ctx) {
+	memcpy(ctx->name, primary->name, sizeof(ctx->name));
+	memcpy(ctx->mac, primary->mac, sizeof(ctx->mac));
+	ctx->mtu = primary->mtu;
+	ctx->ifindex = primary->ifindex;
+	ctx->queues = primary->queues;
+
+	/* Each queue is a connection of its own */
+	ctx->fd = slh_agent_socktap_connect(ctx->arg);
+	return (ctx->fd < 0) ? ctx->fd : 0;
+}
+
+static int slh_agent_socktap_read(struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const buf, uint16_t buf_sz) {
+	/* MSG_TRUNC: learn the real size of a frame too big for us */
+	ssize_t len = recv(ctx->fd, buf, buf_sz, MSG_TRUNC);
+
+	if (len < 0)
+		return -errno;
+	if (!len)
+		/* The other end has gone */
+		return -EPIPE;
+	if (len > buf_sz)
+		return -EMSGSIZE;
+	return len;
+}
+
+static int slh_agent_socktap_write(struct slh_agent_tap_ctx* const ctx,
+		const uint8_t* const buf, uint16_t buf_sz) {
+	if (buf_sz > ctx->mtu)
+		return -EMSGSIZE;
+
+	if (send(ctx->fd, buf, buf_sz, MSG_NOSIGNAL) < 0)
+		return -errno;
+	return 0;
+}
+
+static int slh_agent_socktap_close(struct slh_agent_tap_ctx* const ctx) {
+	close(ctx->fd);
+	return 0;
+}
+
+const struct slh_agent_tap_ops slh_agent_socktap_ops = {
+	.name = "socket",
+	.open = slh_agent_socktap_open,
+	.open_queue = slh_agent_socktap_open_queue,
+	.read = slh_agent_socktap_read,
+	.write = slh_agent_socktap_write,
+	.close = slh_agent_socktap_close,
+};
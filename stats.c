@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "stats.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+const char* const slh_agent_stats_names[SLH_AGENT_STATS_COUNT] = {
+	"up_frames",
+	"up_bytes",
+	"up_truncated",
+	"up_filtered",
+	"up_queue_drop_head",
+	"up_queue_drop_tail",
+	"up_queue_depth",
+	"up_queue_peak",
+	"up_sent",
+	"up_compressed",
+	"up_sent_bytes",
+	"up_wire_bytes",
+	"up_retransmits",
+	"up_naks",
+	"down_frames",
+	"down_bytes",
+	"down_bad",
+	"down_oversize",
+	"down_duplicates",
+	"down_undecodable",
+	"down_filtered",
+	"down_written",
+	"down_write_errors",
+	"down_naks",
+	"capture_dropped",
+	"up_offloaded",
+	"down_offloaded",
+};
+
+/*!
+ * Return the counter at `idx`, in struct order.
+ */
+static uint64_t slh_agent_stats_get(const struct slh_agent_stats* const stats,
+		uint16_t idx) {
+	uint64_t value;
+
+	memcpy(&value, (const uint8_t*)stats + (idx * sizeof(uint64_t)),
+			sizeof(value));
+	return value;
+}
+
+int slh_agent_stats_encode(uint8_t* buf, uint16_t buf_sz,
+		const struct slh_agent_stats* const stats) {
+	uint16_t i;
+
+	if (buf_sz < SLH_AGENT_STATS_SZ)
+		return -EMSGSIZE;
+
+	for (i = 0; i < SLH_AGENT_STATS_COUNT; i++) {
+		uint64_t value = slh_agent_stats_get(stats, i);
+		uint8_t b;
+
+		for (b = 0; b < sizeof(uint64_t); b++)
+			*(buf++) = value >> (56 - (8 * b));
+	}
+	return SLH_AGENT_STATS_SZ;
+}
+
+void slh_agent_stats_dump(FILE* out, const char* name,
+		const struct slh_agent_stats* const stats) {
+	uint16_t i;
+
+	for (i = 0; i < SLH_AGENT_STATS_COUNT; i++)
+		fprintf(out, "%s: %s %" PRIu64 "\n", name,
+				slh_agent_stats_names[i],
+				slh_agent_stats_get(stats, i));
+	fflush(out);
+}
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_STATS_H
+#define _6LH_AGENT_STATS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Runtime counters.
+ *
+ * The agent keeps one block of counters for its interface: `up` counters
+ * follow Ethernet frames from the interface to the parent, `down` counters
+ * those from the parent to the interface.  The main thread alone updates
+ * them, with plain increments.
+ *
+ * The parent may ask for them by sending an ENQ frame, with no payload.
+ * The agent replies at once with an ENQ frame (not sequenced, and not to be
+ * ACKed) carrying each counter as 8 bytes, big endian, in the order of
+ * struct slh_agent_stats.  Counters are only ever added at the end, so a
+ * parent should ignore any beyond those it knows.
+ */
+
+/*!
+ * Counter block.  Every field is a uint64_t; see slh_agent_stats_names
+ * for the order they are reported in.
+ */
+struct slh_agent_stats {
+	/*! Frames read from the interface */
+	uint64_t up_frames;
+	/*! Bytes read from the interface */
+	uint64_t up_bytes;
+	/*! Frames bigger than the MTU, discarded (-EMSGSIZE) */
+	uint64_t up_truncated;
+	/*! Frames dropped by the rules */
+	uint64_t up_filtered;
+	/*! Oldest queued frames discarded to make room */
+	uint64_t up_queue_drop_head;
+	/*! Incoming (or newest) frames discarded, the queue being full */
+	uint64_t up_queue_drop_tail;
+	/*! Frames waiting in the transmit queue now */
+	uint64_t up_queue_depth;
+	/*! Most frames ever waiting in the transmit queue */
+	uint64_t up_queue_peak;
+	/*! FS, GS and RS frames sent to the parent, not counting resends */
+	uint64_t up_sent;
+	/*! Of those, GS frames */
+	uint64_t up_compressed;
+	/*! Size of those frames, type and sequence number included */
+	uint64_t up_sent_bytes;
+	/*! Size of those frames once encoded for the control channel */
+	uint64_t up_wire_bytes;
+	/*! Frames resent for want of an ACK */
+	uint64_t up_retransmits;
+	/*! NAKs received from the parent */
+	uint64_t up_naks;
+
+	/*! FS, GS and RS frames received from the parent */
+	uint64_t down_frames;
+	/*! Size of those frames, type and sequence number included */
+	uint64_t down_bytes;
+	/*! Malformed frames discarded, the decoder resynchronising */
+	uint64_t down_bad;
+	/*! Frames discarded as too big for the receive buffer */
+	uint64_t down_oversize;
+	/*! Frames received again, our ACK having been lost */
+	uint64_t down_duplicates;
+	/*! GS or RS frames which could not be decoded */
+	uint64_t down_undecodable;
+	/*! Frames dropped by the rules */
+	uint64_t down_filtered;
+	/*! Frames written to the interface */
+	uint64_t down_written;
+	/*! Frames the interface would not take */
+	uint64_t down_write_errors;
+	/*! NAKs sent to the parent, for any reason */
+	uint64_t down_naks;
+
+	/*! Frames left out of the capture, the writer falling behind */
+	uint64_t capture_dropped;
+
+	/*! Of up_sent, RS frames */
+	uint64_t up_offloaded;
+	/*! Of down_frames, RS frames */
+	uint64_t down_offloaded;
+};
+
+/*! Number of counters */
+#define SLH_AGENT_STATS_COUNT	\
+	(sizeof(struct slh_agent_stats) / sizeof(uint64_t))
+
+/*! Size of the payload of an ENQ reply */
+#define SLH_AGENT_STATS_SZ	(SLH_AGENT_STATS_COUNT * sizeof(uint64_t))
+
+/*!
+ * Names of the counters, in the order they are reported.
+ */
+extern const char* const slh_agent_stats_names[SLH_AGENT_STATS_COUNT];
+
+/*!
+ * Encode the counters as the payload of an ENQ reply.
+ *
+ * @param[out]		buf	Output buffer
+ * @param[in]		buf_sz	Size of the output buffer
+ * @param[in]		stats	Counters
+ *
+ * @returns	Size of the payload, SLH_AGENT_STATS_SZ
+ * @retval	-EMSGSIZE	Buffer too small
+ */
+int slh_agent_stats_encode(uint8_t* buf, uint16_t buf_sz,
+		const struct slh_agent_stats* const stats);
+
+/*!
+ * Write the counters out, one per line, prefixed with the interface
+ * name.
+ *
+ * @param[in]		out	Where to write them
+ * @param[in]		name	Interface name
+ * @param[in]		stats	Counters
+ */
+void slh_agent_stats_dump(FILE* out, const char* name,
+		const struct slh_agent_stats* const stats);
+
+#endif
@@ -13,19 +13,76 @@
 /*! Size of a MAC address */
 #define SLH_TAP_MAC_SZ	(6)
 
+/*! Most destination MACs or EtherTypes the kernel can be told to pass */
+#define SLH_TAP_FILTER_MAX	(16)
+
+/* Kernel filter flags */
+/*! Also pass frames to any multicast MAC */
+#define SLH_TAP_FILTER_ALLMULTI	(1 << 0)
+
+/*
+ * Offloads.
+ *
+ * With offloads, the kernel may leave checksums and TCP segmentation to
+ * whoever is on the far side of the interface: frames read come with an
+ * offload header saying what is left to do, which may be a checksum over
+ * part of the frame or cutting a "super-frame" of up to
+ * SLH_TAP_OFFLOAD_FRAME_MAX bytes into segments.  Frames written may be
+ * given one too, and the kernel does the rest if it has to.
+ *
+ * The header is that of virtio-net (struct virtio_net_hdr), with its
+ * fields big-endian:
+ * - 1 byte: flags, SLH_TAP_OFFLOAD_F_ values
+ * - 1 byte: segmentation, one of the SLH_TAP_GSO_ values
+ * - 2 bytes: size of the Ethernet, IP and TCP headers
+ * - 2 bytes: size of the TCP payload of each segment
+ * - 2 bytes: where in the frame to start checksumming
+ * - 2 bytes: where from there to store the checksum
+ */
+
+/*! Size of an offload header */
+#define SLH_TAP_OFFLOAD_HDR_SZ		(10)
+
+/*!
+ * Largest frame read or written with an offload header: what fits in 16
+ * bits with the header, frame type and sequence number.
+ */
+#define SLH_TAP_OFFLOAD_FRAME_MAX	(65520)
+
+/* Offloads, as for TUNSETOFFLOAD */
+/*! Checksums */
+#define SLH_TAP_OFFLOAD_CSUM		(1 << 0)
+/*! TCP segmentation over IPv4; needs SLH_TAP_OFFLOAD_CSUM */
+#define SLH_TAP_OFFLOAD_TSO4		(1 << 1)
+/*! TCP segmentation over IPv6; needs SLH_TAP_OFFLOAD_CSUM */
+#define SLH_TAP_OFFLOAD_TSO6		(1 << 2)
+/*! TCP segmentation of frames with ECN set */
+#define SLH_TAP_OFFLOAD_TSO_ECN		(1 << 3)
+/*! All of the above */
+#define SLH_TAP_OFFLOAD_ALL		(0x0f)
+
+/* Offload header flags */
+/*! The checksum still has to be filled in */
+#define SLH_TAP_OFFLOAD_F_NEEDS_CSUM	(1 << 0)
+/*! The checksum has already been checked */
+#define SLH_TAP_OFFLOAD_F_DATA_VALID	(1 << 1)
+
+/* Offload header segmentation types */
+/*! Not a super-frame */
+#define SLH_TAP_GSO_NONE		(0x00)
+/*! TCP over IPv4 */
+#define SLH_TAP_GSO_TCPV4		(0x01)
+/*! TCP over IPv6 */
+#define SLH_TAP_GSO_TCPV6		(0x04)
+/*! Flag: ECN is set */
+#define SLH_TAP_GSO_ECN			(0x80)
+
+struct slh_agent_tap_ops;
+
 /*!
  * TAP interface context
  */
 struct slh_agent_tap_ctx {
-	/*!
-	 * Receive buffer, must be mtu + 4 bytes in size.
-	 *
-	 * If this is NULL when slh_agent_tap_open is called, a new one
-	 * will be `malloc`'d.  Otherwise the pointer given is assumed
-	 * to point to a big-enough one.
-	 */
-	uint8_t* buffer;
-
 	/*!
 	 * Interface name.  If the first byte is non-zero, it is assumed
 	 * that a `tap` interface with this name already exists and we should
@@ -45,12 +102,19 @@ struct slh_agent_tap_ctx {
 	uint8_t mac[SLH_TAP_MAC_SZ];
 
 	/*!
-	 * Interface MTU.  This decides the size of the buffer needed and
+	 * Interface MTU.  This decides the largest frame passed and
 	 * determines the MTU of the interface itself.  If left at 0, an MTU
 	 * of 1280 is assumed.
 	 */
 	uint16_t mtu;
 
+	/*!
+	 * Number of queues.  If greater than 1, the interface is created
+	 * in multi-queue mode and the remaining queues may be opened with
+	 * slh_agent_tap_open_queue.
+	 */
+	uint16_t queues;
+
 	/*!
 	 * File descriptor.  This will receive the file descriptor of the
 	 * `tap` interface when it is opened.
@@ -65,31 +129,206 @@ struct slh_agent_tap_ctx {
 
 	/*! Flags: For internal use only */
 	uint32_t flags;
+
+	/*!
+	 * Destination MACs of the frames the kernel should pass us, the
+	 * first `filter_macs` of them.  Frames sent to other MACs are
+	 * dropped before they reach us, unless SLH_TAP_FILTER_ALLMULTI is
+	 * set in `filter_flags` and they are multicast.  If `filter_macs` is
+	 * 0, all frames are passed.
+	 */
+	uint8_t filter_mac[SLH_TAP_FILTER_MAX][SLH_TAP_MAC_SZ];
+	/*! Number of destination MACs in `filter_mac` */
+	uint8_t filter_macs;
+	/*! Kernel filter flags, SLH_TAP_FILTER_ values */
+	uint8_t filter_flags;
+
+	/*!
+	 * EtherTypes of the frames the kernel should pass us, the first
+	 * `filter_types` of them.  If `filter_types` is 0, all frames are
+	 * passed.
+	 */
+	uint16_t filter_type[SLH_TAP_FILTER_MAX];
+	/*! Number of EtherTypes in `filter_type` */
+	uint8_t filter_types;
+
+	/*!
+	 * Offloads we are prepared to take on, SLH_TAP_OFFLOAD_ flags.  If
+	 * non-zero, every frame read or written goes with an offload
+	 * header, but the kernel leaves nothing to us until told to with
+	 * slh_agent_tap_set_offload.
+	 */
+	uint8_t offload;
+
+	/*!
+	 * Backend providing the interface.  Must be set before opening;
+	 * queues opened with slh_agent_tap_open_queue take the primary's.
+	 */
+	const struct slh_agent_tap_ops* ops;
+
+	/*! Backend argument, if the backend takes one */
+	const char* arg;
+
+	/*! Backend state: for internal use only */
+	void* priv;
 };
 
 /*!
- * Open the TAP interface.
+ * TAP backend.  Each operation behaves as the slh_agent_tap_ function of
+ * the same name.  `fd` must be something epoll can watch, readable while
+ * frames are waiting to be read.  Backends without offloads leave the
+ * three offload operations NULL, and fail to open if any are asked for.
+ *
+ * Backends whose `fd` carries one frame per read or write may also let an
+ * I/O engine (see uring.h) do the reading and writing: each frame on the
+ * descriptor then comes `raw_hdr_sz` bytes after the start of the buffer,
+ * behind its offload header if the interface has offloads, and the last
+ * two operations check and fill in what goes ahead of it.  Others leave
+ * them NULL.
+ */
+struct slh_agent_tap_ops {
+	/*! Name the backend is chosen by */
+	const char* name;
+	int (*open)(struct slh_agent_tap_ctx* const ctx);
+	int (*open_queue)(const struct slh_agent_tap_ctx* const primary,
+			struct slh_agent_tap_ctx* const ctx);
+	int (*read)(struct slh_agent_tap_ctx* const ctx,
+			uint8_t* const buf, uint16_t buf_sz);
+	int (*write)(struct slh_agent_tap_ctx* const ctx,
+			const uint8_t* const buf, uint16_t buf_sz);
+	int (*close)(struct slh_agent_tap_ctx* const ctx);
+	int (*read_offload)(struct slh_agent_tap_ctx* const ctx,
+			uint8_t* const hdr, uint8_t* const buf,
+			uint16_t buf_sz);
+	int (*write_offload)(struct slh_agent_tap_ctx* const ctx,
+			const uint8_t* const hdr, const uint8_t* const buf,
+			uint16_t buf_sz);
+	int (*set_offload)(struct slh_agent_tap_ctx* const ctx,
+			uint8_t offload);
+	uint8_t raw_hdr_sz;
+	int (*raw_unwrap)(struct slh_agent_tap_ctx* const ctx,
+			uint8_t* const raw, uint32_t raw_sz);
+	int (*raw_wrap)(struct slh_agent_tap_ctx* const ctx,
+			uint8_t* const raw, uint32_t len);
+};
+
+/*!
+ * Linux TAP interface, created or attached to through `/dev/net/tun`.
+ * Needs CAP_NET_ADMIN.  Supports offloads.
+ */
+extern const struct slh_agent_tap_ops slh_agent_linuxtap_ops;
+
+/*!
+ * One end of an AF_UNIX SOCK_SEQPACKET socket, each datagram an Ethernet
+ * frame.  `arg` is the path of a listening socket to connect to, once for
+ * each queue, or the number of a descriptor already connected.  Kernel
+ * filters and offloads are not supported.  Needs no privileges.
+ */
+extern const struct slh_agent_tap_ops slh_agent_socktap_ops;
+
+/*!
+ * Interface in memory only, fed and drained from the same process with
+ * slh_agent_mocktap_inject and slh_agent_mocktap_take.  Frames written
+ * when SLH_AGENT_MOCKTAP_SLOTS are already waiting to be taken are
+ * dropped.  Takes no argument, and supports neither kernel filters,
+ * offloads, nor more than one queue.
+ */
+extern const struct slh_agent_tap_ops slh_agent_mocktap_ops;
+
+/*! Frames held each way by the mock backend */
+#define SLH_AGENT_MOCKTAP_SLOTS	(256)
+
+/*!
+ * Queue an Ethernet frame for the agent to read from a mock interface.
+ * May be called from any thread.
+ *
+ * @retval	0		Success
+ * @retval	-EMSGSIZE	Frame larger than the MTU
+ * @retval	-ENOBUFS	SLH_AGENT_MOCKTAP_SLOTS frames already waiting
+ */
+int slh_agent_mocktap_inject(struct slh_agent_tap_ctx* const ctx,
+		const uint8_t* const buf, uint16_t buf_sz);
+
+/*!
+ * Take the oldest Ethernet frame the agent wrote to a mock interface.
+ * May be called from any thread.
+ *
+ * @returns	Size of the frame
+ * @retval	-EAGAIN		No frame waiting
+ * @retval	-EMSGSIZE	Frame did not fit in the buffer; it is dropped
+ */
+int slh_agent_mocktap_take(struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const buf, uint16_t buf_sz);
+
+/*!
+ * Count the frames a mock interface has dropped for want of room.
+ */
+uint64_t slh_agent_mocktap_dropped(
+		const struct slh_agent_tap_ctx* const ctx);
+
+/*!
+ * Open the TAP interface with the backend in `ctx->ops`, and install the
+ * kernel filters asked for.
  *
  * @param[inout]	ctx	TAP interface context
  *
+ * @retval	0		Success
+ * @retval	-EOPNOTSUPP	Backend cannot do what was asked of it
+ */
+static inline int slh_agent_tap_open(struct slh_agent_tap_ctx* const ctx) {
+	return ctx->ops->open(ctx);
+}
+
+/*!
+ * Open another queue on a multi-queue TAP interface.  The name, MAC, MTU
+ * and interface index are copied from the primary context; `ctx` gets its
+ * own file descriptor.
+ *
+ * @param[in]		primary	TAP interface context, already open
+ * @param[inout]	ctx	TAP interface context for the new queue
+ *
  * @retval	0	Success
  */
-int slh_agent_tap_open(struct slh_agent_tap_ctx* const ctx);
+static inline int slh_agent_tap_open_queue(
+		const struct slh_agent_tap_ctx* const primary,
+		struct slh_agent_tap_ctx* const ctx) {
+	ctx->ops = primary->ops;
+	ctx->arg = primary->arg;
+	return primary->ops->open_queue(primary, ctx);
+}
+
+/*!
+ * Return the room needed for a frame read from the TAP interface: the MTU,
+ * or with offloads, an offload header and the largest super-frame.
+ */
+static inline uint16_t slh_agent_tap_buf_sz(
+		const struct slh_agent_tap_ctx* const ctx) {
+	return ctx->offload
+		? (SLH_TAP_OFFLOAD_HDR_SZ + SLH_TAP_OFFLOAD_FRAME_MAX)
+		: ctx->mtu;
+}
 
 /*!
- * Read an Ethernet frame from the TAP interface.
+ * Read an Ethernet frame from the TAP interface straight into the caller's
+ * buffer.  With offloads, the offload header is discarded, so this is only
+ * safe until slh_agent_tap_set_offload is called.
  *
  * @param[inout]	ctx	TAP interface context
  * @param[out]		buf	Output buffer to write frame
  * @param[in]		buf_sz	Size of buffer
  *
  * @returns	Size of frame written to buffer
+ * @retval	-EMSGSIZE	Frame did not fit in the buffer
  */
-int slh_agent_tap_read(struct slh_agent_tap_ctx* const ctx,
-		uint8_t* const buf, uint16_t buf_sz);
+static inline int slh_agent_tap_read(struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const buf, uint16_t buf_sz) {
+	return ctx->ops->read(ctx, buf, buf_sz);
+}
 
 /*!
- * Write an Ethernet frame to the TAP interface.
+ * Write an Ethernet frame to the TAP interface straight from the caller's
+ * buffer.  With offloads, it goes with an offload header asking for
+ * nothing.
  *
  * @param[inout]	ctx	TAP interface context
  * @param[in]		buf	Input buffer to read frame
@@ -97,8 +336,10 @@ int slh_agent_tap_read(struct slh_agent_tap_ctx* const ctx,
  *
  * @retval	0	Success
  */
-int slh_agent_tap_write(struct slh_agent_tap_ctx* const ctx,
-		const uint8_t* const buf, uint16_t buf_sz);
+static inline int slh_agent_tap_write(struct slh_agent_tap_ctx* const ctx,
+		const uint8_t* const buf, uint16_t buf_sz) {
+	return ctx->ops->write(ctx, buf, buf_sz);
+}
 
 /*!
  * Close the TAP interface.
@@ -107,6 +348,113 @@ int slh_agent_tap_write(struct slh_agent_tap_ctx* const ctx,
  *
  * @retval	0	Success
  */
-int slh_agent_tap_close(struct slh_agent_tap_ctx* const ctx);
+static inline int slh_agent_tap_close(struct slh_agent_tap_ctx* const ctx) {
+	return ctx->ops->close(ctx);
+}
+
+/*!
+ * Read an Ethernet frame and its offload header from a TAP interface
+ * opened with offloads.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[out]		hdr	SLH_TAP_OFFLOAD_HDR_SZ bytes for the header
+ * @param[out]		buf	Output buffer to write frame
+ * @param[in]		buf_sz	Size of buffer
+ *
+ * @returns	Size of frame written to buffer, not counting the header
+ * @retval	-EMSGSIZE	Frame did not fit in the buffer
+ */
+static inline int slh_agent_tap_read_offload(
+		struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const hdr, uint8_t* const buf, uint16_t buf_sz) {
+	return ctx->ops->read_offload(ctx, hdr, buf, buf_sz);
+}
+
+/*!
+ * Write an Ethernet frame with an offload header to a TAP interface opened
+ * with offloads.  The kernel checks the header, and finishes the checksum
+ * or cuts up the frame if the frame's destination needs it.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[in]		hdr	Offload header
+ * @param[in]		buf	Input buffer to read frame
+ * @param[in]		buf_sz	Size of buffer
+ *
+ * @retval	0		Success
+ * @retval	-EINVAL		Header does not fit the frame
+ */
+static inline int slh_agent_tap_write_offload(
+		struct slh_agent_tap_ctx* const ctx,
+		const uint8_t* const hdr, const uint8_t* const buf,
+		uint16_t buf_sz) {
+	return ctx->ops->write_offload(ctx, hdr, buf, buf_sz);
+}
+
+/*!
+ * Have the kernel leave some of the offloads asked for at open time to us.
+ * Frames already waiting to be read are unaffected.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[in]		offload	SLH_TAP_OFFLOAD_ flags, a subset of
+ *				`ctx->offload`
+ *
+ * @retval	0		Success
+ * @retval	-EINVAL		Offloads not asked for at open time
+ */
+static inline int slh_agent_tap_set_offload(
+		struct slh_agent_tap_ctx* const ctx, uint8_t offload) {
+	if (offload & ~ctx->offload)
+		return -EINVAL;
+	return ctx->ops->set_offload(ctx, offload);
+}
+
+/*!
+ * Return true if an I/O engine may read and write the TAP interface's
+ * descriptor itself.
+ */
+static inline _Bool slh_agent_tap_has_raw(
+		const struct slh_agent_tap_ctx* const ctx) {
+	return ctx->ops->raw_unwrap && ctx->ops->raw_wrap;
+}
+
+/*!
+ * Check a frame read from the descriptor in one go, and turn what is left
+ * of the `raw_hdr_sz` bytes ahead of it into the offload header the rest
+ * of the agent expects, in place.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[inout]	raw	What was read
+ * @param[in]		raw_sz	Number of bytes read
+ *
+ * @returns	Size of the frame, with its offload header if any, starting
+ *		`raw_hdr_sz` bytes into `raw`
+ * @retval	-EMSGSIZE	Frame did not fit in the buffer
+ * @retval	-EBADMSG	Too short to be a frame
+ */
+static inline int slh_agent_tap_raw_unwrap(
+		struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const raw, uint32_t raw_sz) {
+	return ctx->ops->raw_unwrap(ctx, raw, raw_sz);
+}
+
+/*!
+ * Fill in the `raw_hdr_sz` bytes ahead of a frame to be written to the
+ * descriptor in one go, in place.
+ *
+ * @param[inout]	ctx	TAP interface context
+ * @param[inout]	raw	Buffer holding the frame, with its offload
+ *				header if the interface has offloads,
+ *				`raw_hdr_sz` bytes in
+ * @param[in]		len	Size of the frame and offload header
+ *
+ * @returns	Number of bytes to write, from the start of `raw`
+ * @retval	-EMSGSIZE	Frame too big
+ * @retval	-EINVAL		No room for the offload header
+ */
+static inline int slh_agent_tap_raw_wrap(
+		struct slh_agent_tap_ctx* const ctx,
+		uint8_t* const raw, uint32_t len) {
+	return ctx->ops->raw_wrap(ctx, raw, len);
+}
 
 #endif
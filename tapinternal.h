@@ -7,17 +7,12 @@
 #include "tap.h"
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #ifndef SLH_AGENT_TAP_DEFAULT_MTU
 #define SLH_AGENT_TAP_DEFAULT_MTU	(1280)
 #endif
 
-/*!
- * Free the buffer on close.  This indicates it was us that malloc'd the
- * buffer in the first place.
- */
-#define SLH_AGENT_TAP_FLAG_FREEBUF	(1 << 0)
-
 /*!
  * Set the MTU if not already set.
  */
@@ -27,36 +22,6 @@ static inline void slh_agent_tap_core_set_mtu(
 		ctx->mtu = SLH_AGENT_TAP_DEFAULT_MTU;
 }
 
-/*!
- * Allocate a buffer, if one not already provided.
- *
- * @param	ctx	TAP device context.
- * @param	extra	Number of extra bytes on top of MTU.
- */
-static inline int slh_agent_tap_core_alloc_buf(
-		struct slh_agent_tap_ctx* const ctx,
-		size_t extra) {
-	if (!(ctx->buffer)) {
-		ctx->buffer = malloc(ctx->mtu + extra);
-		if (!ctx->buffer)
-			return -ENOMEM;
-
-		ctx->flags = SLH_AGENT_TAP_FLAG_FREEBUF;
-	}
-	return 0;
-}
-
-/*!
- * Free the buffer, if we allocated it.
- */
-static inline void slh_agent_tap_core_free_buf(
-		struct slh_agent_tap_ctx* const ctx) {
-	if (ctx->flags & SLH_AGENT_TAP_FLAG_FREEBUF) {
-		free(ctx->buffer);
-		ctx->buffer = NULL;
-	}
-}
-
 /*!
  * Return true if the MAC address is set
  */
@@ -70,4 +35,19 @@ static inline _Bool slh_agent_tap_core_has_macaddr(
 	return false;
 }
 
+/*!
+ * Name and address an interface which has none of its own, if not given
+ * them: a locally administered MAC, and the name given here.
+ */
+static inline void slh_agent_tap_core_set_ident(
+		struct slh_agent_tap_ctx* const ctx, const char* name) {
+	if (!slh_agent_tap_core_has_macaddr(ctx)) {
+		memset(ctx->mac, 0, sizeof(ctx->mac));
+		ctx->mac[0] = 0x02;
+		ctx->mac[sizeof(ctx->mac) - 1] = 0x01;
+	}
+	if (!ctx->name[0])
+		strncpy(ctx->name, name, sizeof(ctx->name) - 1);
+}
+
 #endif
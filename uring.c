@@ -0,0 +1,419 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "uring.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/*! Request user data: what it is for and which buffer it uses */
+#define SLH_AGENT_URING_DATA(op, buf)	(((uint64_t)(op) << 16) | (buf))
+
+/*! Request cancelling another, whose completion is of no interest */
+#define SLH_AGENT_URING_CANCEL		(0xff)
+
+/*!
+ * Offset for reads and writes: the current position, if there is one.
+ */
+#define SLH_AGENT_URING_POS		((uint64_t)-1)
+
+/*!
+ * Set or clear O_NONBLOCK on a descriptor.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+static int slh_agent_uring_nonblock(int fd, _Bool nonblock) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -errno;
+
+	flags = nonblock ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	if (fcntl(fd, F_SETFL, flags) < 0)
+		return -errno;
+	return 0;
+}
+
+/*!
+ * Return a free submission queue entry, submitting what is queued to make
+ * room if need be, or NULL if that fails.
+ */
+static struct io_uring_sqe* slh_agent_uring_sqe(
+		struct slh_agent_uring* const uring) {
+	struct io_uring_sqe* sqe = io_uring_get_sqe(&uring->ring);
+
+	if (!sqe) {
+		/* Full: hand over what's there without waiting */
+		io_uring_submit(&uring->ring);
+		sqe = io_uring_get_sqe(&uring->ring);
+	}
+	return sqe;
+}
+
+/*!
+ * Prepare a TAP read or write of a pool buffer.
+ */
+static void slh_agent_uring_prep(struct slh_agent_uring* const uring,
+		struct io_uring_sqe* const sqe, uint8_t op, uint16_t buf,
+		uint32_t len) {
+	uint8_t* const data = slh_agent_uring_buf_data(uring, buf);
+	const int fd = uring->tap->fd;
+
+	if (op == SLH_AGENT_URING_TAP_READ) {
+		if (uring->fixed)
+			io_uring_prep_read_fixed(sqe, fd, data, len,
+					SLH_AGENT_URING_POS, 0);
+		else
+			io_uring_prep_read(sqe, fd, data, len,
+					SLH_AGENT_URING_POS);
+	} else {
+		if (uring->fixed)
+			io_uring_prep_write_fixed(sqe, fd, data, len,
+					SLH_AGENT_URING_POS, 0);
+		else
+			io_uring_prep_write(sqe, fd, data, len,
+					SLH_AGENT_URING_POS);
+	}
+	io_uring_sqe_set_data64(sqe, SLH_AGENT_URING_DATA(op, buf));
+}
+
+/*!
+ * Put a buffer back in the pool.
+ */
+static inline void slh_agent_uring_put_buf(
+		struct slh_agent_uring* const uring, uint16_t buf) {
+	uring->free[uring->free_count++] = buf;
+}
+
+/*!
+ * Post TAP reads up to SLH_AGENT_URING_READS, a control channel read if
+ * there is room for one, the output waiting, and the poll.
+ *
+ * @retval	0	Success
+ * @retval	-EBUSY	Submission queue full
+ */
+static int slh_agent_uring_arm(struct slh_agent_uring* const uring) {
+	struct slh_agent_frame_ctx* const ctl = uring->ctl;
+	struct io_uring_sqe* sqe;
+	uint32_t sz;
+
+	while ((uring->reads < SLH_AGENT_URING_READS) && uring->free_count) {
+		sqe = slh_agent_uring_sqe(uring);
+		if (!sqe)
+			return -EBUSY;
+
+		slh_agent_uring_prep(uring, sqe, SLH_AGENT_URING_TAP_READ,
+				uring->free[--uring->free_count],
+				uring->buf_sz);
+		uring->reads++;
+	}
+
+	if (ctl && !uring->ctl_reading && !ctl->eof) {
+		uint8_t* const space = slh_agent_frame_rx_space(ctl, &sz);
+
+		if (sz) {
+			sqe = slh_agent_uring_sqe(uring);
+			if (!sqe)
+				return -EBUSY;
+
+			io_uring_prep_read(sqe, ctl->rx_fd, space, sz,
+					SLH_AGENT_URING_POS);
+			io_uring_sqe_set_data64(sqe, SLH_AGENT_URING_DATA(
+					SLH_AGENT_URING_CTL_READ, 0));
+			uring->ctl_reading = true;
+		}
+	}
+
+	if (ctl && !uring->ctl_writing) {
+		/* One write at a time, so the output stays in order */
+		const uint8_t* const data = slh_agent_frame_tx_data(ctl, &sz);
+
+		if (sz) {
+			sqe = slh_agent_uring_sqe(uring);
+			if (!sqe)
+				return -EBUSY;
+
+			io_uring_prep_write(sqe, ctl->tx_fd, data, sz,
+					SLH_AGENT_URING_POS);
+			io_uring_sqe_set_data64(sqe, SLH_AGENT_URING_DATA(
+					SLH_AGENT_URING_CTL_WRITE, 0));
+			uring->ctl_writing = true;
+		}
+	}
+
+	if ((uring->poll_fd >= 0) && !uring->polling) {
+		sqe = slh_agent_uring_sqe(uring);
+		if (!sqe)
+			return -EBUSY;
+
+		io_uring_prep_poll_add(sqe, uring->poll_fd, POLLIN);
+		io_uring_sqe_set_data64(sqe, SLH_AGENT_URING_DATA(
+					SLH_AGENT_URING_POLL, 0));
+		uring->polling = true;
+	}
+	return 0;
+}
+
+/*!
+ * Handle one completion.
+ */
+static void slh_agent_uring_handle(struct slh_agent_uring* const uring,
+		uint64_t data, int res) {
+	const uint8_t op = data >> 16;
+	uint16_t buf = data & UINT16_MAX;
+
+	switch (op) {
+	case SLH_AGENT_URING_TAP_READ:
+		uring->reads--;
+		if ((res != -EINTR) && (res != -EAGAIN)) {
+			uring->buf[buf].len = (res > 0) ? res : 0;
+			uring->cb(uring, op, buf, res);
+		}
+		slh_agent_uring_put_buf(uring, buf);
+		break;
+	case SLH_AGENT_URING_TAP_WRITE:
+		uring->buf[buf].res = res;
+		uring->buf[buf].done = true;
+
+		/* Report it, and any after it, once those before are done */
+		while (uring->writes_count) {
+			buf = uring->writes[uring->writes_head];
+			if (!uring->buf[buf].done)
+				break;
+
+			uring->writes_head = (uring->writes_head + 1)
+				% SLH_AGENT_URING_BUFS;
+			uring->writes_count--;
+			uring->buf[buf].done = false;
+			uring->cb(uring, op, buf, uring->buf[buf].res);
+			slh_agent_uring_put_buf(uring, buf);
+		}
+		break;
+	case SLH_AGENT_URING_CTL_READ:
+		uring->ctl_reading = false;
+		if ((res == -EINTR) || (res == -EAGAIN))
+			/* Posted again on the next turn */
+			break;
+		if (res >= 0)
+			slh_agent_frame_rx_commit(uring->ctl, res);
+		uring->cb(uring, op, 0, res);
+		break;
+	case SLH_AGENT_URING_CTL_WRITE:
+		uring->ctl_writing = false;
+		if ((res == -EINTR) || (res == -EAGAIN))
+			break;
+		if (res > 0)
+			/* The rest, if any, goes on the next turn */
+			slh_agent_frame_tx_commit(uring->ctl, res);
+		uring->cb(uring, op, 0, res);
+		break;
+	case SLH_AGENT_URING_POLL:
+		uring->polling = false;
+		uring->cb(uring, op, 0, res);
+		break;
+	}
+}
+
+int slh_agent_uring_init(struct slh_agent_uring* const uring,
+		struct slh_agent_tap_ctx* const tap,
+		struct slh_agent_frame_ctx* const ctl, int poll_fd) {
+	struct iovec pool;
+	uint16_t i;
+	int res;
+
+	if (!slh_agent_tap_has_raw(tap))
+		return -EOPNOTSUPP;
+
+	uring->tap = tap;
+	uring->ctl = ctl;
+	uring->poll_fd = poll_fd;
+	uring->writes_head = 0;
+	uring->writes_count = 0;
+	uring->reads = 0;
+	uring->ctl_reading = false;
+	uring->ctl_writing = false;
+	uring->polling = false;
+
+	/* Room for a frame as the backend reads and writes it */
+	uring->buf_sz = tap->ops->raw_hdr_sz + slh_agent_tap_buf_sz(tap);
+	pool.iov_len = (size_t)SLH_AGENT_URING_BUFS * uring->buf_sz;
+	pool.iov_base = mmap(NULL, pool.iov_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pool.iov_base == MAP_FAILED)
+		return -errno;
+	uring->pool = pool.iov_base;
+
+	for (i = 0; i < SLH_AGENT_URING_BUFS; i++) {
+		uring->free[i] = SLH_AGENT_URING_BUFS - 1 - i;
+		uring->buf[i].done = false;
+	}
+	uring->free_count = SLH_AGENT_URING_BUFS;
+
+	res = io_uring_queue_init(SLH_AGENT_URING_DEPTH, &uring->ring, 0);
+	if (res < 0)
+		goto unmap;
+
+	/*
+	 * Registered, the pool needn't be looked up and pinned on every
+	 * read and write.  Within RLIMIT_MEMLOCK only, on older kernels;
+	 * without, it still works, just not as well.
+	 */
+	uring->fixed = !io_uring_register_buffers(&uring->ring, &pool, 1);
+
+	/* Reads are to wait in the kernel, not fail with EAGAIN */
+	res = slh_agent_uring_nonblock(tap->fd, false);
+	if (res < 0)
+		goto exit;
+
+	if (ctl) {
+		res = slh_agent_uring_nonblock(ctl->rx_fd, false);
+		if (res < 0)
+			goto exit;
+
+		if (ctl->tx_fd != ctl->rx_fd) {
+			res = slh_agent_uring_nonblock(ctl->tx_fd, false);
+			if (res < 0)
+				goto exit;
+		}
+
+		/* Leave slh_agent_read_frame to decode what we read */
+		ctl->rx_ready = false;
+		ctl->tx_async = true;
+	}
+	return 0;
+
+exit:
+	io_uring_queue_exit(&uring->ring);
+unmap:
+	munmap(uring->pool, pool.iov_len);
+	uring->pool = NULL;
+	return res;
+}
+
+int slh_agent_uring_get_buf(struct slh_agent_uring* const uring) {
+	if (!slh_agent_uring_can_write(uring))
+		return -ENOBUFS;
+	return uring->free[--uring->free_count];
+}
+
+int slh_agent_uring_tap_write(struct slh_agent_uring* const uring,
+		uint16_t buf, uint32_t len) {
+	struct io_uring_sqe* sqe;
+	int res;
+
+	res = slh_agent_tap_raw_wrap(uring->tap,
+			slh_agent_uring_buf_data(uring, buf), len);
+	if (res < 0)
+		goto putbuf;
+	uring->buf[buf].len = res;
+
+	sqe = slh_agent_uring_sqe(uring);
+	if (!sqe) {
+		res = -EBUSY;
+		goto putbuf;
+	}
+
+	slh_agent_uring_prep(uring, sqe, SLH_AGENT_URING_TAP_WRITE, buf,
+			uring->buf[buf].len);
+	uring->writes[(uring->writes_head + uring->writes_count)
+		% SLH_AGENT_URING_BUFS] = buf;
+	uring->writes_count++;
+	return 0;
+
+putbuf:
+	slh_agent_uring_put_buf(uring, buf);
+	return res;
+}
+
+int slh_agent_uring_submit(struct slh_agent_uring* const uring,
+		int max_wait) {
+	struct io_uring_cqe* cqe;
+	int res;
+
+	res = slh_agent_uring_arm(uring);
+	if (res < 0)
+		return res;
+
+	if (max_wait < 0) {
+		res = io_uring_submit_and_wait(&uring->ring, 1);
+	} else {
+		struct __kernel_timespec ts = {
+			.tv_sec = max_wait / 1000,
+			.tv_nsec = (max_wait % 1000) * 1000000
+		};
+
+		res = io_uring_submit_and_wait_timeout(&uring->ring, &cqe, 1,
+				&ts, NULL);
+	}
+
+	/* Timed out or interrupted: nothing to do this turn */
+	if ((res < 0) && (res != -ETIME) && (res != -EINTR))
+		return res;
+	return 0;
+}
+
+void slh_agent_uring_complete(struct slh_agent_uring* const uring) {
+	struct io_uring_cqe* cqe;
+
+	while (!io_uring_peek_cqe(&uring->ring, &cqe)) {
+		const uint64_t data = io_uring_cqe_get_data64(cqe);
+		const int res = cqe->res;
+
+		/* Seen first: the handler may queue more */
+		io_uring_cqe_seen(&uring->ring, cqe);
+		if ((data >> 16) != SLH_AGENT_URING_CANCEL)
+			slh_agent_uring_handle(uring, data, res);
+	}
+}
+
+void slh_agent_uring_stop(struct slh_agent_uring* const uring) {
+	struct slh_agent_frame_ctx* const ctl = uring->ctl;
+	struct io_uring_sqe* sqe;
+	struct io_uring_cqe* cqe;
+
+	if (!ctl)
+		return;
+
+	if (uring->ctl_writing) {
+		sqe = slh_agent_uring_sqe(uring);
+		if (sqe) {
+			io_uring_prep_cancel64(sqe, SLH_AGENT_URING_DATA(
+						SLH_AGENT_URING_CTL_WRITE, 0),
+					0);
+			io_uring_sqe_set_data64(sqe, SLH_AGENT_URING_DATA(
+						SLH_AGENT_URING_CANCEL, 0));
+			io_uring_submit(&uring->ring);
+		}
+
+		/* Only the write matters now */
+		while (uring->ctl_writing
+				&& !io_uring_wait_cqe(&uring->ring, &cqe)) {
+			if (io_uring_cqe_get_data64(cqe)
+					== SLH_AGENT_URING_DATA(
+						SLH_AGENT_URING_CTL_WRITE,
+						0)) {
+				uring->ctl_writing = false;
+				if (cqe->res > 0)
+					slh_agent_frame_tx_commit(ctl,
+							cqe->res);
+			}
+			io_uring_cqe_seen(&uring->ring, cqe);
+		}
+	}
+
+	slh_agent_uring_nonblock(ctl->rx_fd, true);
+	if (ctl->tx_fd != ctl->rx_fd)
+		slh_agent_uring_nonblock(ctl->tx_fd, true);
+	ctl->tx_async = false;
+	uring->ctl = NULL;
+}
+
+void slh_agent_uring_free(struct slh_agent_uring* const uring) {
+	io_uring_queue_exit(&uring->ring);
+	munmap(uring->pool, (size_t)SLH_AGENT_URING_BUFS * uring->buf_sz);
+	uring->pool = NULL;
+}
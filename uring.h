@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_URING_H
+#define _6LH_AGENT_URING_H
+
+#include "tap.h"
+#include "frame.h"
+#include <liburing.h>
+
+/*
+ * io_uring I/O engine, built only when liburing is available.
+ *
+ * Rather than a system call for each frame read or written, reads are kept
+ * posted on the TAP interface, SLH_AGENT_URING_READS of them, and one on
+ * the control channel.  Everything queued during a turn of the loop (TAP
+ * writes, control channel output, reads replacing those which completed)
+ * goes to the kernel in one go, with the same call that waits for the
+ * next completions.  At high packet rates, each call carries many frames.
+ *
+ * TAP frames are read into and written from a pool of SLH_AGENT_URING_BUFS
+ * buffers registered with the kernel, if it lets us; otherwise the pool is
+ * used all the same, unregistered.  Writes may not take the buffers the
+ * posted reads need.  The control channel is read straight into, and
+ * written straight from, its frame context's buffers.
+ *
+ * The engine needs a TAP backend supporting raw I/O (see tap.h), and only
+ * takes on the control channel if it is a byte stream; otherwise, that is
+ * left to the event loop.  The loop's epoll instance is polled through the
+ * ring, so whatever it watches still gets looked at.  The descriptors the
+ * engine reads and writes are made blocking, so that reads wait in the
+ * kernel for data rather than failing.
+ */
+
+#ifndef SLH_AGENT_URING_DEPTH
+/*! Size of the submission queue */
+#define SLH_AGENT_URING_DEPTH	(256)
+#endif
+
+#ifndef SLH_AGENT_URING_BUFS
+/*! Buffers in the pool, for TAP reads and writes */
+#define SLH_AGENT_URING_BUFS	(128)
+#endif
+
+#ifndef SLH_AGENT_URING_READS
+/*! TAP reads kept posted */
+#define SLH_AGENT_URING_READS	(32)
+#endif
+
+/* Completions, as passed to the handler */
+/*! TAP read into buffer `buf`; its `len` is the number of bytes read */
+#define SLH_AGENT_URING_TAP_READ	(0)
+/*! TAP write from buffer `buf`, reported in the order they were queued */
+#define SLH_AGENT_URING_TAP_WRITE	(1)
+/*! Control channel read, already added to its receive buffer */
+#define SLH_AGENT_URING_CTL_READ	(2)
+/*! Control channel write, already dropped from its transmit buffer */
+#define SLH_AGENT_URING_CTL_WRITE	(3)
+/*! The polled descriptor is readable */
+#define SLH_AGENT_URING_POLL		(4)
+
+struct slh_agent_uring;
+
+/*!
+ * Completion handler.  The buffer of a TAP read or write goes back to the
+ * pool once the handler returns.
+ *
+ * @param[inout]	uring	I/O engine
+ * @param[in]		op	What completed, an SLH_AGENT_URING_ value
+ * @param[in]		buf	Buffer of a TAP read or write
+ * @param[in]		res	Bytes read or written, or <0 errno.h error
+ */
+typedef void (*slh_agent_uring_cb)(struct slh_agent_uring* const uring,
+		uint8_t op, uint16_t buf, int res);
+
+/*!
+ * Pool buffer
+ */
+struct slh_agent_uring_buf {
+	/*! Bytes read, or to be written, from the start of the buffer */
+	uint32_t len;
+	/*! Left to the caller, e.g. to say which frame a write carries */
+	uint32_t tag;
+	/*! Result of a write, once complete */
+	int res;
+	/*! Write complete, waiting for those queued before it */
+	uint8_t done;
+};
+
+/*!
+ * I/O engine context
+ */
+struct slh_agent_uring {
+	/*! The ring */
+	struct io_uring ring;
+	/*! Completion handler */
+	slh_agent_uring_cb cb;
+	/*! Handler data */
+	void* data;
+	/*! TAP interface */
+	struct slh_agent_tap_ctx* tap;
+	/*! Control channel, or NULL if left to the event loop */
+	struct slh_agent_frame_ctx* ctl;
+	/*! Descriptor polled for readability, or -1 */
+	int poll_fd;
+	/*! SLH_AGENT_URING_BUFS buffers of `buf_sz` bytes */
+	uint8_t* pool;
+	/*! Size of each buffer */
+	uint32_t buf_sz;
+	/*! State of each buffer */
+	struct slh_agent_uring_buf buf[SLH_AGENT_URING_BUFS];
+	/*! Buffers not in use, `free_count` of them */
+	uint16_t free[SLH_AGENT_URING_BUFS];
+	/*! Number of buffers not in use */
+	uint16_t free_count;
+	/*! Buffers being written, oldest first from `writes_head` */
+	uint16_t writes[SLH_AGENT_URING_BUFS];
+	/*! Oldest write */
+	uint16_t writes_head;
+	/*! Number of writes in flight */
+	uint16_t writes_count;
+	/*! TAP reads posted */
+	uint16_t reads;
+	/*! The pool is registered with the kernel */
+	uint8_t fixed;
+	/*! A control channel read is posted */
+	uint8_t ctl_reading;
+	/*! A control channel write is posted */
+	uint8_t ctl_writing;
+	/*! `poll_fd` is being polled */
+	uint8_t polling;
+};
+
+/*!
+ * Return a buffer from the pool.
+ */
+static inline uint8_t* slh_agent_uring_buf_data(
+		const struct slh_agent_uring* const uring, uint16_t buf) {
+	return &(uring->pool[(size_t)buf * uring->buf_sz]);
+}
+
+/*!
+ * Return true if a buffer can be had for a TAP write.
+ */
+static inline _Bool slh_agent_uring_can_write(
+		const struct slh_agent_uring* const uring) {
+	return uring->free_count > (SLH_AGENT_URING_READS - uring->reads);
+}
+
+/*!
+ * Set up the ring and the buffer pool.  `uring->cb` and `uring->data` must
+ * be set by the caller.  Nothing is posted until the first turn.
+ *
+ * @param[out]		uring	I/O engine
+ * @param[in]		tap	TAP interface, supporting raw I/O
+ * @param[in]		ctl	Control channel on a byte stream, to be read
+ *				and written by the engine, or NULL
+ * @param[in]		poll_fd	Descriptor to poll, or -1
+ *
+ * @retval	0		Success
+ * @retval	-EOPNOTSUPP	TAP backend does not support raw I/O
+ * @retval	<0		errno.h error
+ */
+int slh_agent_uring_init(struct slh_agent_uring* const uring,
+		struct slh_agent_tap_ctx* const tap,
+		struct slh_agent_frame_ctx* const ctl, int poll_fd);
+
+/*!
+ * Take a buffer from the pool for a TAP write.  The frame, with its
+ * offload header if the interface has offloads, goes `raw_hdr_sz` bytes
+ * in.
+ *
+ * @returns	Buffer number
+ * @retval	-ENOBUFS	None to spare
+ */
+int slh_agent_uring_get_buf(struct slh_agent_uring* const uring);
+
+/*!
+ * Queue a TAP write, to be submitted on the next turn.  The handler hears
+ * of it once it and all writes queued before it are complete.
+ *
+ * @param[inout]	uring	I/O engine
+ * @param[in]		buf	Buffer from slh_agent_uring_get_buf
+ * @param[in]		len	Size of the frame and offload header
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error; the buffer goes back to the pool
+ */
+int slh_agent_uring_tap_write(struct slh_agent_uring* const uring,
+		uint16_t buf, uint32_t len);
+
+/*!
+ * Post reads and control channel output, submit everything queued, and
+ * wait for a completion: at most `max_wait` milliseconds, -1 for no limit.
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_uring_submit(struct slh_agent_uring* const uring,
+		int max_wait);
+
+/*!
+ * Call the handler for each completion waiting.  What the handler queues
+ * is submitted on the next turn.
+ */
+void slh_agent_uring_complete(struct slh_agent_uring* const uring);
+
+/*!
+ * Stop sending control channel output, and hand the channel back to
+ * slh_agent_frame_flush, its descriptors non-blocking again.  A write
+ * still in flight is cancelled; whatever of it was written is dropped
+ * from the transmit buffer.  Nothing but slh_agent_uring_free may follow.
+ */
+void slh_agent_uring_stop(struct slh_agent_uring* const uring);
+
+/*!
+ * Tear down the ring, cancelling anything still in flight, and release
+ * the buffer pool.
+ */
+void slh_agent_uring_free(struct slh_agent_uring* const uring);
+
+#endif
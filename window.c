@@ -0,0 +1,269 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "window.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*!
+ * Return the slot index holding the frame `offset` places after the
+ * oldest unacknowledged frame.
+ */
+static inline uint8_t slh_agent_window_slot_idx(
+		const struct slh_agent_window* const win,
+		uint8_t offset) {
+	return (win->base_slot + offset) % win->max;
+}
+
+/*!
+ * Return the frame stored in the given slot.
+ */
+static inline uint8_t* slh_agent_window_slot_buf(
+		const struct slh_agent_window* const win,
+		uint8_t idx) {
+	return &(win->buffer[(size_t)idx * win->slot_sz]);
+}
+
+/*!
+ * Release the frame with sequence number `seq` if it is in flight.
+ *
+ * @returns	1 if the frame was released, 0 otherwise.
+ */
+static int slh_agent_window_release(struct slh_agent_window* const win,
+		uint8_t seq);
+
+/*!
+ * Move the base of the window past all released frames.
+ */
+static void slh_agent_window_advance(struct slh_agent_window* const win);
+
+int slh_agent_window_init(struct slh_agent_window* const win,
+		uint8_t max, uint16_t mtu, uint32_t timeout) {
+	if ((!max) || (max > SLH_AGENT_WINDOW_MAX))
+		return -EINVAL;
+
+	memset(win, 0, sizeof(*win));
+
+	/* Frame type, sequence number and payload */
+	win->slot_sz = mtu + 2;
+	win->buffer = malloc((size_t)max * win->slot_sz);
+	if (!win->buffer)
+		return -ENOMEM;
+
+	win->slots = calloc(max, sizeof(struct slh_agent_window_slot));
+	if (!win->slots) {
+		free(win->buffer);
+		win->buffer = NULL;
+		return -ENOMEM;
+	}
+
+	win->max = max;
+	win->size = 1;
+	win->timeout = timeout;
+	return 0;
+}
+
+void slh_agent_window_free(struct slh_agent_window* const win) {
+	free(win->buffer);
+	free(win->slots);
+	win->buffer = NULL;
+	win->slots = NULL;
+}
+
+void slh_agent_window_set_size(struct slh_agent_window* const win,
+		uint8_t size) {
+	if (!size)
+		size = 1;
+	if (size > win->max)
+		size = win->max;
+
+	win->size = size;
+	win->seq = (size > 1);
+}
+
+uint8_t* slh_agent_window_payload(struct slh_agent_window* const win,
+		uint16_t* max_sz) {
+	uint8_t idx = slh_agent_window_slot_idx(win,
+			slh_agent_window_inflight(win));
+
+	/* Leave room for the frame type and sequence number */
+	*max_sz = win->slot_sz - 1 - win->seq;
+	return slh_agent_window_slot_buf(win, idx) + 1 + win->seq;
+}
+
+const struct slh_agent_frame* slh_agent_window_commit(
+		struct slh_agent_window* const win,
+		uint8_t type, uint16_t len, uint64_t now,
+		uint16_t* frame_sz) {
+	uint8_t idx = slh_agent_window_slot_idx(win,
+			slh_agent_window_inflight(win));
+	struct slh_agent_window_slot* const slot = &(win->slots[idx]);
+	uint8_t* buf = slh_agent_window_slot_buf(win, idx);
+
+	buf[0] = type;
+	if (win->seq)
+		buf[1] = win->next;
+
+	slot->len = 1 + win->seq + len;
+	slot->deadline = now + win->timeout;
+	slot->retries = 0;
+	slot->busy = true;
+	win->next++;
+
+	*frame_sz = slot->len;
+	return (const struct slh_agent_frame*)buf;
+}
+
+int slh_agent_window_ack(struct slh_agent_window* const win,
+		const uint8_t* payload, uint16_t len) {
+	int released = 0;
+
+	if (!slh_agent_window_inflight(win))
+		return 0;
+
+	if (!(win->seq && len)) {
+		/* Unsequenced: acknowledges the oldest frame */
+		released = slh_agent_window_release(win, win->base);
+	} else {
+		/* Cumulative acknowledgement up to the first sequence number */
+		uint8_t count = payload[0] - win->base;
+		if (count < slh_agent_window_inflight(win)) {
+			uint8_t seq = win->base;
+			while (count--) {
+				released += slh_agent_window_release(win, seq);
+				seq++;
+			}
+			released += slh_agent_window_release(win, seq);
+		}
+
+		/* Selective acknowledgement of the remainder */
+		for (payload++, len--; len; payload++, len--)
+			released += slh_agent_window_release(win, *payload);
+	}
+
+	slh_agent_window_advance(win);
+	return released;
+}
+
+int slh_agent_window_nak(struct slh_agent_window* const win,
+		const uint8_t* payload, uint16_t len) {
+	int released = 0;
+
+	if (!slh_agent_window_inflight(win))
+		return 0;
+
+	if (!(win->seq && len)) {
+		/* Unsequenced: rejects the oldest frame */
+		released = slh_agent_window_release(win, win->base);
+	} else {
+		for (; len; payload++, len--)
+			released += slh_agent_window_release(win, *payload);
+	}
+
+	slh_agent_window_advance(win);
+	return released;
+}
+
+const struct slh_agent_frame* slh_agent_window_due(
+		struct slh_agent_window* const win,
+		uint64_t now, uint16_t* frame_sz) {
+	uint8_t inflight = slh_agent_window_inflight(win);
+	uint8_t offset;
+
+	for (offset = 0; offset < inflight; offset++) {
+		uint8_t idx = slh_agent_window_slot_idx(win, offset);
+		struct slh_agent_window_slot* const slot = &(win->slots[idx]);
+
+		if (!slot->busy || (slot->deadline > now))
+			continue;
+
+		if (slot->retries >= SLH_AGENT_WINDOW_RETRIES) {
+			/* Give up on this frame */
+			slot->busy = false;
+			continue;
+		}
+
+		slot->retries++;
+		slot->deadline = now + win->timeout;
+		win->due_slot = idx;
+		*frame_sz = slot->len;
+		return (const struct slh_agent_frame*)
+			slh_agent_window_slot_buf(win, idx);
+	}
+
+	slh_agent_window_advance(win);
+	return NULL;
+}
+
+void slh_agent_window_undue(struct slh_agent_window* const win,
+		uint64_t now) {
+	struct slh_agent_window_slot* const slot
+		= &(win->slots[win->due_slot]);
+
+	slot->retries--;
+	slot->deadline = now;
+}
+
+int slh_agent_window_next_timeout(
+		const struct slh_agent_window* const win, uint64_t now) {
+	uint8_t inflight = slh_agent_window_inflight(win);
+	uint8_t offset;
+	int timeout = -1;
+
+	for (offset = 0; offset < inflight; offset++) {
+		uint8_t idx = slh_agent_window_slot_idx(win, offset);
+		const struct slh_agent_window_slot* const slot
+			= &(win->slots[idx]);
+		int remain;
+
+		if (!slot->busy)
+			continue;
+
+		remain = (slot->deadline > now) ? (slot->deadline - now) : 0;
+		if ((timeout < 0) || (remain < timeout))
+			timeout = remain;
+	}
+
+	return timeout;
+}
+
+_Bool slh_agent_window_rx_dup(struct slh_agent_window* const win,
+		uint8_t seq) {
+	/* Forget the sequence number half the space away */
+	const uint8_t old = seq + 128;
+
+	win->rx_seen[old >> 3] &= ~(1 << (old & 7));
+	return (win->rx_seen[seq >> 3] & (1 << (seq & 7))) != 0;
+}
+
+void slh_agent_window_rx_done(struct slh_agent_window* const win,
+		uint8_t seq) {
+	win->rx_seen[seq >> 3] |= 1 << (seq & 7);
+}
+
+static int slh_agent_window_release(struct slh_agent_window* const win,
+		uint8_t seq) {
+	uint8_t offset = seq - win->base;
+	struct slh_agent_window_slot* slot;
+
+	if (offset >= slh_agent_window_inflight(win))
+		/* Not in flight, stale or bogus acknowledgement */
+		return 0;
+
+	slot = &(win->slots[slh_agent_window_slot_idx(win, offset)]);
+	if (!slot->busy)
+		return 0;
+
+	slot->busy = false;
+	return 1;
+}
+
+static void slh_agent_window_advance(struct slh_agent_window* const win) {
+	while (slh_agent_window_inflight(win)
+			&& !(win->slots[win->base_slot].busy)) {
+		win->base++;
+		win->base_slot = (win->base_slot + 1) % win->max;
+	}
+}
@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_WINDOW_H
+#define _6LH_AGENT_WINDOW_H
+
+#include "frame.h"
+#include <stdint.h>
+
+/*
+ * Transmit window.
+ *
+ * Frames sent to the parent are held in a window slot until the parent
+ * acknowledges them.  In the legacy stop-and-wait mode, the window is one
+ * frame wide and no sequence numbers are used.  Once the parent agrees to a
+ * larger window in reply to the SOH frame, FS, GS, RS, ACK and NAK frames
+ * carry a sequence number as the first payload byte and several frames may
+ * be in flight at once.
+ *
+ * - An ACK carrying a sequence number acknowledges that frame and every frame
+ *   sent before it (cumulative acknowledgement).  Any further sequence
+ *   numbers in the same ACK are acknowledged individually (selective
+ *   acknowledgement).
+ * - A NAK carrying a sequence number rejects that frame only.
+ * - Frames not acknowledged within the timeout are retransmitted, up to
+ *   SLH_AGENT_WINDOW_RETRIES times, after which they are discarded.
+ */
+
+/*! Largest window supported: half the 8-bit sequence space */
+#define SLH_AGENT_WINDOW_MAX		(127)
+
+#ifndef SLH_AGENT_WINDOW_RETRIES
+/*! Number of retransmissions before a frame is discarded */
+#define SLH_AGENT_WINDOW_RETRIES	(3)
+#endif
+
+#ifndef SLH_AGENT_WINDOW_DEFAULT_TIMEOUT
+/*! Default retransmission timeout in milliseconds */
+#define SLH_AGENT_WINDOW_DEFAULT_TIMEOUT	(1000)
+#endif
+
+/*!
+ * State of a transmit window slot
+ */
+struct slh_agent_window_slot {
+	/*! Time at which this frame is retransmitted (milliseconds) */
+	uint64_t deadline;
+	/*! Size of the frame stored, including type and sequence number */
+	uint16_t len;
+	/*! Number of times this frame has been retransmitted */
+	uint8_t retries;
+	/*! Slot is awaiting acknowledgement */
+	uint8_t busy;
+};
+
+/*!
+ * Transmit window context
+ */
+struct slh_agent_window {
+	/*! Frame storage, `max` slots of `slot_sz` bytes each */
+	uint8_t* buffer;
+	/*! Slot states */
+	struct slh_agent_window_slot* slots;
+	/*! Size of each frame slot */
+	uint16_t slot_sz;
+	/*! Number of slots allocated */
+	uint8_t max;
+	/*! Negotiated window size */
+	uint8_t size;
+	/*! Sequence number of oldest unacknowledged frame */
+	uint8_t base;
+	/*! Sequence number of next frame to be sent */
+	uint8_t next;
+	/*! Slot holding the oldest unacknowledged frame */
+	uint8_t base_slot;
+	/*! Whether sequence numbers are in use */
+	uint8_t seq;
+	/*! Retransmission timeout in milliseconds */
+	uint32_t timeout;
+	/*! Sequence numbers recently received from the parent */
+	uint8_t rx_seen[32];
+	/*! Slot last returned by slh_agent_window_due */
+	uint8_t due_slot;
+};
+
+/*!
+ * Initialise a transmit window.  The window starts in stop-and-wait mode.
+ *
+ * @param[inout]	win	Transmit window
+ * @param[in]		max	Largest window that may be negotiated
+ * @param[in]		mtu	Largest payload carried in a frame
+ * @param[in]		timeout	Retransmission timeout in milliseconds
+ *
+ * @retval	0	Success
+ * @retval	-EINVAL	Invalid parameters
+ * @retval	-ENOMEM	Unable to allocate buffers
+ */
+int slh_agent_window_init(struct slh_agent_window* const win,
+		uint8_t max, uint16_t mtu, uint32_t timeout);
+
+/*!
+ * Release the buffers held by a transmit window.
+ */
+void slh_agent_window_free(struct slh_agent_window* const win);
+
+/*!
+ * Switch the window to the negotiated size.  A size greater than 1 turns
+ * on sequence numbering.  Must be called with no frames in flight.
+ *
+ * @param[inout]	win	Transmit window
+ * @param[in]		size	Window size agreed with the parent
+ */
+void slh_agent_window_set_size(struct slh_agent_window* const win,
+		uint8_t size);
+
+/*!
+ * Return the number of frames awaiting acknowledgement.
+ */
+static inline uint8_t slh_agent_window_inflight(
+		const struct slh_agent_window* const win) {
+	return (uint8_t)(win->next - win->base);
+}
+
+/*!
+ * Return true if another frame may be sent.
+ */
+static inline _Bool slh_agent_window_has_space(
+		const struct slh_agent_window* const win) {
+	return slh_agent_window_inflight(win) < win->size;
+}
+
+/*!
+ * Return the payload area of the next free slot, so the caller may fill it
+ * in place.  Only valid if slh_agent_window_has_space returns true.
+ *
+ * @param[inout]	win	Transmit window
+ * @param[out]		max_sz	Space available for the payload
+ */
+uint8_t* slh_agent_window_payload(struct slh_agent_window* const win,
+		uint16_t* max_sz);
+
+/*!
+ * Claim the next free slot for a frame whose payload was written via
+ * slh_agent_window_payload.
+ *
+ * @param[inout]	win	Transmit window
+ * @param[in]		type	Frame type
+ * @param[in]		len	Payload length
+ * @param[in]		now	Current time (milliseconds)
+ * @param[out]		frame_sz	Size of the frame to transmit
+ *
+ * @returns	The frame to be transmitted.
+ */
+const struct slh_agent_frame* slh_agent_window_commit(
+		struct slh_agent_window* const win,
+		uint8_t type, uint16_t len, uint64_t now,
+		uint16_t* frame_sz);
+
+/*!
+ * Process an ACK from the parent.
+ *
+ * @param[inout]	win	Transmit window
+ * @param[in]		payload	ACK payload (sequence numbers)
+ * @param[in]		len	Length of payload
+ *
+ * @returns	Number of frames released from the window.
+ */
+int slh_agent_window_ack(struct slh_agent_window* const win,
+		const uint8_t* payload, uint16_t len);
+
+/*!
+ * Process a NAK from the parent.  Unlike an ACK, a sequence number in a NAK
+ * rejects only that frame.
+ *
+ * @param[inout]	win	Transmit window
+ * @param[in]		payload	NAK payload (sequence numbers)
+ * @param[in]		len	Length of payload
+ *
+ * @returns	Number of frames released from the window.
+ */
+int slh_agent_window_nak(struct slh_agent_window* const win,
+		const uint8_t* payload, uint16_t len);
+
+/*!
+ * Return the next frame due for retransmission, or NULL if none are due.
+ * Frames that have exhausted their retries are discarded.
+ *
+ * @param[inout]	win	Transmit window
+ * @param[in]		now	Current time (milliseconds)
+ * @param[out]		frame_sz	Size of the frame to transmit
+ */
+const struct slh_agent_frame* slh_agent_window_due(
+		struct slh_agent_window* const win,
+		uint64_t now, uint16_t* frame_sz);
+
+/*!
+ * Put back the frame last returned by slh_agent_window_due, which could not
+ * be sent: it stays due, and the attempt does not count towards its
+ * retries.
+ *
+ * @param[inout]	win	Transmit window
+ * @param[in]		now	Current time (milliseconds)
+ */
+void slh_agent_window_undue(struct slh_agent_window* const win,
+		uint64_t now);
+
+/*!
+ * Return the number of milliseconds until the next retransmission
+ * is due, or -1 if nothing is in flight.
+ */
+int slh_agent_window_next_timeout(
+		const struct slh_agent_window* const win, uint64_t now);
+
+/*!
+ * Check a sequenced frame from the parent against those handled, and
+ * forget the sequence number half the space away.
+ *
+ * @returns	true if this sequence number was written out recently, that
+ *		is, the frame is a retransmission of one already handled.
+ */
+_Bool slh_agent_window_rx_dup(struct slh_agent_window* const win,
+		uint8_t seq);
+
+/*!
+ * Record a sequenced frame from the parent as handled, once written out
+ * and acknowledged.  A frame that was rejected is not recorded, so that
+ * its retransmission is handled afresh.
+ */
+void slh_agent_window_rx_done(struct slh_agent_window* const win,
+		uint8_t seq);
+
+#endif
@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#include "worker.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/*!
+ * Worker thread: read frames from the TAP queue into the ring.
+ */
+static void* slh_agent_worker_main(void* arg);
+
+/*!
+ * Record the error the worker thread stopped on, and wake the main thread
+ * to hear of it.
+ */
+static void slh_agent_worker_fail(struct slh_agent_worker* const worker,
+		int res);
+
+/*!
+ * Return the frame storage of the given slot.
+ */
+static inline uint8_t* slh_agent_worker_slot_buf(
+		const struct slh_agent_worker* const worker,
+		uint32_t idx) {
+	return &(worker->buffer[(size_t)(idx % SLH_AGENT_WORKER_SLOTS)
+			* worker->slot_sz]);
+}
+
+int slh_agent_worker_start(struct slh_agent_worker* const worker,
+		const struct slh_agent_tap_ctx* const primary) {
+	int res;
+
+	worker->slot_sz = slh_agent_tap_buf_sz(primary);
+	atomic_init(&worker->head, 0);
+	atomic_init(&worker->tail, 0);
+	atomic_init(&worker->waiting, true);
+	atomic_init(&worker->blocked, false);
+	atomic_init(&worker->truncated, 0);
+	atomic_init(&worker->res, 0);
+
+	worker->buffer = malloc((size_t)SLH_AGENT_WORKER_SLOTS
+			* worker->slot_sz);
+	if (!worker->buffer)
+		return -ENOMEM;
+
+	worker->len = calloc(SLH_AGENT_WORKER_SLOTS, sizeof(uint16_t));
+	if (!worker->len) {
+		res = -ENOMEM;
+		goto freebuf;
+	}
+
+	worker->ev.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->ev.fd < 0) {
+		res = -errno;
+		goto freelen;
+	}
+
+	/* The worker blocks on this one */
+	worker->space_fd = eventfd(0, EFD_CLOEXEC);
+	if (worker->space_fd < 0) {
+		res = -errno;
+		goto closeev;
+	}
+
+	memset(&worker->tap, 0, sizeof(worker->tap));
+	res = slh_agent_tap_open_queue(primary, &worker->tap);
+	if (res < 0)
+		goto closespace;
+
+	res = -pthread_create(&worker->thread, NULL,
+			slh_agent_worker_main, worker);
+	if (res < 0)
+		goto closetap;
+
+	return 0;
+
+closetap:
+	slh_agent_tap_close(&worker->tap);
+closespace:
+	close(worker->space_fd);
+closeev:
+	close(worker->ev.fd);
+freelen:
+	free(worker->len);
+freebuf:
+	free(worker->buffer);
+	return res;
+}
+
+void slh_agent_worker_stop(struct slh_agent_worker* const worker) {
+	/* The worker spends its life blocked in read(), a cancellation point */
+	pthread_cancel(worker->thread);
+	pthread_join(worker->thread, NULL);
+
+	slh_agent_tap_close(&worker->tap);
+	close(worker->space_fd);
+	close(worker->ev.fd);
+	free(worker->len);
+	free(worker->buffer);
+}
+
+const uint8_t* slh_agent_worker_head(struct slh_agent_worker* const worker,
+		uint16_t* len) {
+	uint32_t tail = atomic_load_explicit(&worker->tail,
+			memory_order_relaxed);
+
+	if (tail == atomic_load_explicit(&worker->head, memory_order_acquire))
+		return NULL;
+
+	*len = worker->len[tail % SLH_AGENT_WORKER_SLOTS];
+	return slh_agent_worker_slot_buf(worker, tail);
+}
+
+void slh_agent_worker_pop(struct slh_agent_worker* const worker) {
+	atomic_fetch_add(&worker->tail, 1);
+
+	/* Wake the worker if it's waiting for room */
+	if (atomic_exchange(&worker->blocked, false)) {
+		const uint64_t one = 1;
+		if (write(worker->space_fd, &one, sizeof(one)) < 0) {
+			/* Counter can't overflow, so this can't fail */
+		}
+	}
+}
+
+_Bool slh_agent_worker_sleep(struct slh_agent_worker* const worker) {
+	uint64_t count;
+
+	/* Reset the eventfd, it's non-blocking so this never stalls */
+	if (read(worker->ev.fd, &count, sizeof(count)) < 0) {
+		/* Nothing to reset */
+	}
+
+	/*
+	 * Announce we're going to sleep, then check nothing slipped in
+	 * before the worker could see the announcement.  Both sides use
+	 * sequentially-consistent accesses so one of them always notices.
+	 */
+	atomic_store(&worker->waiting, true);
+	if (atomic_load(&worker->head) != atomic_load(&worker->tail)) {
+		atomic_store(&worker->waiting, false);
+		return false;
+	}
+	return true;
+}
+
+static void* slh_agent_worker_main(void* arg) {
+	struct slh_agent_worker* const worker = arg;
+
+	while (1) {
+		uint32_t head = atomic_load_explicit(&worker->head,
+				memory_order_relaxed);
+		uint8_t* const slot = slh_agent_worker_slot_buf(worker, head);
+		int len;
+
+		if ((head - atomic_load(&worker->tail))
+				>= SLH_AGENT_WORKER_SLOTS) {
+			/*
+			 * Ring is full: announce we're waiting, then check
+			 * the main thread didn't make room in the meantime.
+			 */
+			uint64_t count;
+
+			atomic_store(&worker->blocked, true);
+			if ((head - atomic_load(&worker->tail))
+					< SLH_AGENT_WORKER_SLOTS) {
+				atomic_store(&worker->blocked, false);
+				continue;
+			}
+
+			if (read(worker->space_fd, &count, sizeof(count))
+					< 0) {
+				slh_agent_worker_fail(worker, -errno);
+				break;
+			}
+			continue;
+		}
+
+		if (worker->tap.offload) {
+			/* Offload header goes in front, as the agent reads */
+			len = slh_agent_tap_read_offload(&worker->tap, slot,
+					slot + SLH_TAP_OFFLOAD_HDR_SZ,
+					worker->slot_sz
+						- SLH_TAP_OFFLOAD_HDR_SZ);
+			if (len >= 0)
+				len += SLH_TAP_OFFLOAD_HDR_SZ;
+		} else {
+			len = slh_agent_tap_read(&worker->tap, slot,
+					worker->slot_sz);
+		}
+		if (len == -EMSGSIZE) {
+			/* Sole writer, so no need for a locked increment */
+			atomic_store_explicit(&worker->truncated,
+					atomic_load_explicit(
+						&worker->truncated,
+						memory_order_relaxed) + 1,
+					memory_order_relaxed);
+			continue;
+		} else if (len < 0) {
+			/* Queue has gone away */
+			slh_agent_worker_fail(worker, len);
+			break;
+		}
+
+		worker->len[head % SLH_AGENT_WORKER_SLOTS] = len;
+		atomic_store(&worker->head, head + 1);
+
+		/* Wake the main thread if it's asleep */
+		if (atomic_exchange(&worker->waiting, false)) {
+			const uint64_t one = 1;
+			if (write(worker->ev.fd, &one, sizeof(one)) < 0) {
+				slh_agent_worker_fail(worker, -errno);
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void slh_agent_worker_fail(struct slh_agent_worker* const worker,
+		int res) {
+	const uint64_t one = 1;
+
+	atomic_store(&worker->res, res);
+	if (write(worker->ev.fd, &one, sizeof(one)) < 0) {
+		/* Nothing more we can do; the main thread will miss us */
+	}
+}
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/* vim: set tw=78 ts=8 sts=8 noet fileencoding=utf-8: */
+
+#ifndef _6LH_AGENT_WORKER_H
+#define _6LH_AGENT_WORKER_H
+
+#include "tap.h"
+#include "event.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * TAP queue worker.
+ *
+ * In multi-queue mode, each extra TAP queue is read by its own thread.  The
+ * worker hands frames to the main thread through a single-producer,
+ * single-consumer ring, so no lock is shared between workers or with the
+ * main thread.  The main thread sleeps in its event loop; a worker only
+ * signals its eventfd when the main thread has said it is about to sleep.
+ * Likewise, a worker that finds the ring full stops reading (leaving frames
+ * queued in the kernel) until the main thread signals that it has made room.
+ */
+
+#ifndef SLH_AGENT_WORKER_SLOTS
+/*! Number of frames buffered between a worker and the main thread */
+#define SLH_AGENT_WORKER_SLOTS	(64)
+#endif
+
+/*!
+ * TAP queue worker context
+ */
+struct slh_agent_worker {
+	/*! TAP queue served by this worker */
+	struct slh_agent_tap_ctx tap;
+	/*! Worker thread */
+	pthread_t thread;
+	/*! Event used to wake the main thread */
+	struct slh_agent_event ev;
+	/*! eventfd used to wake the worker when the ring has room */
+	int space_fd;
+	/*! Frame storage, SLH_AGENT_WORKER_SLOTS slots of `slot_sz` bytes */
+	uint8_t* buffer;
+	/*! Length of the frame in each slot */
+	uint16_t* len;
+	/*! Size of each slot */
+	uint16_t slot_sz;
+	/*! Next slot to be filled, written by the worker */
+	_Atomic uint32_t head;
+	/*! Next slot to be consumed, written by the main thread */
+	_Atomic uint32_t tail;
+	/*! Main thread is waiting to be woken */
+	_Atomic uint8_t waiting;
+	/*! Worker is waiting for room in the ring */
+	_Atomic uint8_t blocked;
+	/*! Frames bigger than the slots, discarded; written by the worker */
+	_Atomic uint32_t truncated;
+	/*! Error the worker stopped on, or 0; written by the worker */
+	_Atomic int res;
+};
+
+/*!
+ * Open another queue on the TAP interface and start a thread serving it.
+ * `ev.cb` and `ev.data` must be set; `ev.fd` is set to an eventfd that
+ * becomes readable when frames are waiting, or when the worker has stopped
+ * on an error, left in `res`.
+ *
+ * @param[inout]	worker	Worker context
+ * @param[in]		primary	TAP interface, opened in multi-queue mode
+ *
+ * @retval	0	Success
+ * @retval	<0	errno.h error
+ */
+int slh_agent_worker_start(struct slh_agent_worker* const worker,
+		const struct slh_agent_tap_ctx* const primary);
+
+/*!
+ * Stop the worker thread and close its TAP queue.
+ */
+void slh_agent_worker_stop(struct slh_agent_worker* const worker);
+
+/*!
+ * Return the oldest frame handed over by the worker, or NULL if none are
+ * waiting.  With offloads, the frame has its offload header in front.
+ * Called from the main thread only.
+ *
+ * @param[inout]	worker	Worker context
+ * @param[out]		len	Length of the frame
+ */
+const uint8_t* slh_agent_worker_head(struct slh_agent_worker* const worker,
+		uint16_t* len);
+
+/*!
+ * Release the oldest frame back to the worker, waking it if it was
+ * waiting for room.
+ */
+void slh_agent_worker_pop(struct slh_agent_worker* const worker);
+
+/*!
+ * Tell the worker the main thread is going back to sleep.  Resets the
+ * eventfd and returns false if frames arrived in the meantime, in which
+ * case the caller should keep draining.
+ */
+_Bool slh_agent_worker_sleep(struct slh_agent_worker* const worker);
+
+#endif